@@ -0,0 +1,187 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * The database cache: lookups, and "database get" answered from it.
+ *
+ * agi_astdb_cache_get() is timed on hits and on misses, from one thread and
+ * from several reading the same shards at once, which readers of a seqlock
+ * do without writing to it. agi_command_databaseget() is then timed over a
+ * socket pair to a fake Asterisk, before the cache exists, so that every
+ * get is a round trip, and once it does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "agi_astdb.h"
+#include "agi_commands.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+#include "bench.h"
+
+#define AGI_BENCH_KEYS      256
+#define AGI_BENCH_LOOKUPS   (4 * 1024 * 1024)
+#define AGI_BENCH_THREADS   4
+#define AGI_BENCH_GETS      20000
+
+static char         keys[AGI_BENCH_KEYS][16];
+
+typedef struct {
+    pthread_t       tid;
+    const char     *family;
+    size_t          nhits;
+} bench_reader_t;
+
+static void *
+reader(void *arg)
+{
+    char                buf[AGI_ASTDB_VALUE_LEN];
+    size_t              i;
+    bench_reader_t     *r = arg;
+
+    r->nhits = 0;
+
+    for (i = 0; i < AGI_BENCH_LOOKUPS; i++) {
+        if (agi_astdb_cache_get(r->family, keys[i % AGI_BENCH_KEYS], buf,
+                                sizeof buf) != AGI_AGAIN)
+        {
+            r->nhits++;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+lookups(const char *name, const char *family, unsigned nthreads)
+{
+    size_t                  n, nhits;
+    unsigned                i;
+    double                  t;
+    bench_reader_t          r[AGI_BENCH_THREADS];
+
+    t = bench_now();
+
+    for (i = 0; i < nthreads; i++) {
+        r[i].family = family;
+        (void)pthread_create(&r[i].tid, NULL, reader, &r[i]);
+    }
+
+    for (nhits = 0, i = 0; i < nthreads; i++) {
+        (void)pthread_join(r[i].tid, NULL);
+        nhits += r[i].nhits;
+    }
+
+    t = bench_now() - t;
+    n = (size_t)nthreads * AGI_BENCH_LOOKUPS;
+
+    /* keys sharing a slot evict each other: not every lookup hits */
+    printf("cache get, %-5s %u threads %8.1f ns %6.1f%% hits\n", name,
+           nthreads, t / (double)n, (double)nhits * 100 / (double)n);
+}
+
+/* Asterisk's side: every key holds the same value */
+static void *
+asterisk(void *arg)
+{
+    int         fd;
+    char        buf[4096];
+    ssize_t     n, i;
+    uintptr_t   nlines;
+
+    fd = (int)(intptr_t)arg;
+    nlines = 0;
+
+    while ((n = read(fd, buf, sizeof buf)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (buf[i] != '\n')
+                continue;
+
+            nlines++;
+
+            if (write(fd, "200 result=1 (blocked)\n", 23) == -1)
+                return (void *)nlines;
+        }
+    }
+
+    (void)close(fd);
+
+    return (void *)nlines;
+}
+
+static void
+gets(const char *name)
+{
+    int             sv[2];
+    char            buf[AGI_ASTDB_VALUE_LEN];
+    size_t          i;
+    double          t;
+    void           *nlines;
+    pthread_t       tid;
+    agi_session_t  *s;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        exit(1);
+
+    (void)pthread_create(&tid, NULL, asterisk, (void *)(intptr_t)sv[1]);
+
+    s = agi_session_open(NULL, &agi_transport_unix, sv[0], sv[0]);
+    if (s == NULL)
+        exit(1);
+
+    t = bench_now();
+
+    for (i = 0; i < AGI_BENCH_GETS; i++) {
+        if (agi_command_databaseget(s, buf, sizeof buf, "blacklist",
+                                    keys[i % AGI_BENCH_KEYS]) != 1)
+        {
+            exit(1);
+        }
+    }
+
+    t = bench_now() - t;
+
+    agi_session_free(s);
+
+    (void)pthread_join(tid, &nlines);
+
+    printf("database get, %-9s %13.1f us %6.1f%% round trips\n", name,
+           t / AGI_BENCH_GETS / 1e3,
+           (double)(uintptr_t)nlines * 100 / AGI_BENCH_GETS);
+}
+
+int
+main(void)
+{
+    unsigned    i;
+
+    openlog("astdb_bench", LOG_PERROR, LOG_USER);
+
+    for (i = 0; i < AGI_BENCH_KEYS; i++)
+        (void)snprintf(keys[i], sizeof keys[i], "1555%07u", i);
+
+    gets("uncached");
+
+    if (agi_astdb_cache_init(3600) == -1)
+        return 1;
+
+    /* the first get of each key fills the cache */
+    gets("cached");
+
+    for (i = 0; i < AGI_BENCH_KEYS; i++)
+        agi_astdb_cache_put("known", keys[i], 1, "blocked", 7);
+
+    lookups("hit", "known", 1);
+    lookups("miss", "unknown", 1);
+    lookups("hit", "known", AGI_BENCH_THREADS);
+    lookups("miss", "unknown", AGI_BENCH_THREADS);
+
+    return 0;
+}
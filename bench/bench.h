@@ -0,0 +1,55 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * What the benchmarks share. Each is a program of its own, run with no
+ * arguments, or a count as the first one: of iterations for most of them.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdlib.h>
+#include <time.h>
+
+/* monotonic time in nanoseconds */
+static inline double
+bench_now(void)
+{
+    struct timespec     ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static inline long
+bench_count(int argc, char **argv, long n)
+{
+    if (argc > 1 && atol(argv[1]) > 0)
+        return atol(argv[1]);
+
+    return n;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+    double  x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* the p-th percentile of n samples, sorted on the way */
+static inline double
+bench_percentile(double *v, size_t n, double p)
+{
+    size_t  i;
+
+    qsort(v, n, sizeof *v, bench_cmp);
+
+    i = (size_t)(p / 100 * (double)(n - 1) + 0.5);
+
+    return v[i];
+}
+
+#endif /* BENCH_H */
@@ -0,0 +1,177 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Round trips of a call flow, with and without deferred writes.
+ *
+ * The flow is what a routing script typically does before it dials: read
+ * the caller, look them up in the database, tag the channel with a dozen
+ * variables, record the call, dial. The fake Asterisk on the other end of
+ * a socket pair answers at once, so the time is mostly that of the bench
+ * itself; a real one adds its own latency to every round trip saved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "agi_commands.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+#include "bench.h"
+
+#define AGI_BENCH_PLAIN     0
+#define AGI_BENCH_VARS      1       /* agi_setvariable_defer() */
+#define AGI_BENCH_DB        2       /* and agi_database_defer() */
+
+static const char  *vars[][2] = {
+    { "CDR(accountcode)",       "acme" },
+    { "CDR(userfield)",         "inbound,ivr" },
+    { "__CALLTYPE",             "inbound" },
+    { "__CUSTOMER_ID",          "1048576" },
+    { "__ROUTE",                "sales-eu" },
+    { "__TRUNK",                "trunk-a" },
+    { "__DID",                  "18005550100" },
+    { "__QUEUE",                "sales" },
+    { "LANGUAGE()",             "en" },
+    { "CHANNEL(musicclass)",    "default" },
+    { "TIMEOUT(absolute)",      "3600" },
+    { "CALLERID(name)",         "ACME Sales" },
+};
+
+/* Asterisk's side: every line is a round trip */
+static void *
+asterisk(void *arg)
+{
+    int             fd;
+    char            buf[4096];
+    size_t          len;
+    ssize_t         n, i, line;
+    const char     *r;
+    uintptr_t       nlines;
+
+    fd = (int)(intptr_t)arg;
+    nlines = 0;
+
+    while ((n = read(fd, buf, sizeof buf)) > 0) {
+        for (line = 0, i = 0; i < n; i++) {
+            if (buf[i] != '\n')
+                continue;
+
+            nlines++;
+
+            /* exec and missing keys alike answer 0 */
+            if (strncmp(buf + line, "get variable", 12) == 0) {
+                r = "200 result=1 (15551234567)\n";
+            }
+            else if (strncmp(buf + line, "exec", 4) == 0
+                     || strncmp(buf + line, "database get", 12) == 0)
+            {
+                r = "200 result=0\n";
+            }
+            else {
+                r = "200 result=1\n";
+            }
+
+            len = strlen(r);
+            line = i + 1;
+
+            if (write(fd, r, len) != (ssize_t)len)
+                return (void *)nlines;
+        }
+    }
+
+    (void)close(fd);
+
+    return (void *)nlines;
+}
+
+static void
+flow(agi_session_t *s, int mode)
+{
+    char        num[64], buf[64];
+    size_t      i;
+
+    if (mode != AGI_BENCH_PLAIN)
+        (void)agi_setvariable_defer(s);
+
+    if (mode == AGI_BENCH_DB)
+        (void)agi_database_defer(s);
+
+    (void)agi_command_answer(s);
+    (void)agi_command_getvariable(s, num, sizeof num, "CALLERID(num)");
+    (void)agi_command_databaseget(s, buf, sizeof buf, "blacklist", num);
+
+    for (i = 0; i < sizeof vars / sizeof vars[0]; i++)
+        (void)agi_command_setvariable(s, vars[i][0], vars[i][1]);
+
+    (void)agi_command_databaseput(s, "lastcall", num, "1697612345");
+    (void)agi_command_exec(s, "Dial", "PJSIP/sales-1,30,tT");
+    (void)agi_command_hangup(s, NULL);
+}
+
+static void
+bench(const char *name, int mode, size_t ncalls)
+{
+    int             sv[2];
+    size_t          i;
+    double          t, ns;
+    void           *nlines;
+    uintptr_t       total;
+    pthread_t       tid;
+    agi_session_t  *s;
+
+    ns = 0;
+    total = 0;
+
+    for (i = 0; i < ncalls; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+            exit(1);
+
+        (void)pthread_create(&tid, NULL, asterisk, (void *)(intptr_t)sv[1]);
+
+        s = agi_session_open(NULL, &agi_transport_unix, sv[0], sv[0]);
+        if (s == NULL)
+            exit(1);
+
+        t = bench_now();
+
+        flow(s, mode);
+
+        ns += bench_now() - t;
+
+        agi_session_free(s);
+
+        (void)pthread_join(tid, &nlines);
+
+        total += (uintptr_t)nlines;
+    }
+
+    printf("%-16s %6.1f %10.1f\n", name, (double)total / (double)ncalls,
+           ns / (double)ncalls / 1e3);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t  ncalls;
+
+    openlog("defer_bench", LOG_PERROR, LOG_USER);
+
+    ncalls = (size_t)bench_count(argc, argv, 2000);
+
+    printf("%zu calls, %zu variables set per call\n", ncalls,
+           sizeof vars / sizeof vars[0]);
+    printf("                 RTTs/call   us/call\n");
+
+    bench("plain", AGI_BENCH_PLAIN, ncalls);
+    bench("deferred vars", AGI_BENCH_VARS, ncalls);
+    bench("deferred vars+db", AGI_BENCH_DB, ncalls);
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Memory a session spends on its parsed AGI environment, and the rate at
+ * which environments are parsed.
+ *
+ * agi_env_old_t is the layout agi_env_t replaced: a pointer per variable,
+ * 128 of them for the arguments, and the pointers the parser kept. The
+ * environment text itself is left out of both counts: each keeps one copy.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "agi_env.h"
+#include "agi_parse.h"
+#include "agi_pool.h"
+#include "bench.h"
+
+typedef struct {
+    char   *type, *dnid, *rdnis, *argv[128], *network, *request, *channel,
+           *version, *context, *uniqueid, *callerid, *threadid, *language,
+           *priority, *enhanced, *extension, *callington, *callingtns,
+           *callingpres, *callingani2, *accountcode, *calleridname,
+           *network_script;
+    int     network_n, priority_n, enhanced_n;
+    long    threadid_n;
+    char   *variable_start, *variable_end, *value_start, *value_end;
+} agi_env_old_t;
+
+/* as Asterisk 18 sends it to agi://10.0.0.1/ivr/main with three arguments */
+static const char   env_text[] =
+    "agi_network: yes\n"
+    "agi_network_script: ivr/main?lang=en\n"
+    "agi_request: agi://10.0.0.1/ivr/main?lang=en\n"
+    "agi_channel: PJSIP/trunk-0000a1b2\n"
+    "agi_language: en\n"
+    "agi_type: PJSIP\n"
+    "agi_uniqueid: 1697612345.4711\n"
+    "agi_version: 18.19.0\n"
+    "agi_callerid: 15551234567\n"
+    "agi_calleridname: John Smith\n"
+    "agi_callingpres: 0\n"
+    "agi_callingani2: 0\n"
+    "agi_callington: 0\n"
+    "agi_callingtns: 0\n"
+    "agi_dnid: 18005550100\n"
+    "agi_rdnis: unknown\n"
+    "agi_context: from-trunk\n"
+    "agi_extension: 18005550100\n"
+    "agi_priority: 3\n"
+    "agi_enhanced: 0.0\n"
+    "agi_accountcode: \n"
+    "agi_threadid: 140234567890176\n"
+    "agi_arg_1: main\n"
+    "agi_arg_2: 42\n"
+    "agi_arg_3: retry=3\n"
+    "\n";
+
+int
+main(int argc, char **argv)
+{
+    int                 rv;
+    long                i, n;
+    char                buf[sizeof env_text], mem[4096];
+    size_t              len, used;
+    double              t;
+    agi_env_t           env;
+    agi_arena_t         arena;
+    agi_env_parser_t    ep;
+
+    n = bench_count(argc, argv, 1000000);
+    len = sizeof env_text - 1;
+
+    agi_arena_init(&arena, mem, sizeof mem);
+
+    t = bench_now();
+
+    for (i = 0; i < n; i++) {
+        /* the parser writes null bytes into the text */
+        (void)memcpy(buf, env_text, len);
+
+        agi_env_parser_init(&ep);
+        agi_env_init(&env);
+
+        rv = agi_process_environment(&ep, &env, &arena, buf, len);
+        if (rv != AGI_DONE) {
+            fprintf(stderr, "environment not parsed: %d\n", rv);
+            return 1;
+        }
+
+        agi_arena_reset(&arena);
+    }
+
+    t = bench_now() - t;
+
+    /* once more, to count what it allocated */
+    (void)memcpy(buf, env_text, len);
+
+    agi_env_parser_init(&ep);
+    agi_env_init(&env);
+
+    (void)agi_process_environment(&ep, &env, &arena, buf, len);
+
+    used = sizeof env + env.nalloc * sizeof *env.argv
+           + (env.extra ? sizeof *env.extra : 0);
+
+    printf("environment: %zu bytes, %u arguments\n", len, env.argc);
+    printf("bytes per session: %zu before, %zu after\n",
+           sizeof(agi_env_old_t), used);
+    printf("parse: %.0f ns per environment, %.0f MB/s\n",
+           t / (double)n, (double)len * (double)n / t * 1e3);
+
+    agi_arena_reset(&arena);
+
+    return 0;
+}
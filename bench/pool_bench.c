@@ -0,0 +1,156 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Session setup and teardown rate, sessions from the heap against sessions
+ * from a pool, with 1 to N threads each running its own event loop.
+ *
+ * Every thread keeps AGI_BENCH_LIVE sessions open, replacing the oldest with
+ * a new one, which also allocates what a handler would. A session watches an
+ * eventfd, the descriptor costs being the same either way.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+#include <syslog.h>
+
+#include "agi_event.h"
+#include "agi_pool.h"
+#include "agi_session.h"
+#include "bench.h"
+
+#define AGI_BENCH_LIVE      64
+
+typedef struct {
+    pthread_t           tid;
+    int                 pool;
+    long                n;
+    double              ns;
+    agi_pool_stats_t    stats;
+} bench_thread_t;
+
+static void
+handler(agi_session_t *s)
+{
+    (void)s;
+}
+
+static void *
+run(void *arg)
+{
+    int                 fd;
+    long                i;
+    double              t;
+    agi_session_t      *live[AGI_BENCH_LIVE];
+    bench_thread_t     *bt = arg;
+    agi_event_loop_t   *loop;
+
+    loop = agi_event_loop_create(64, handler, NULL, 0);
+    if (loop == NULL)
+        exit(1);
+
+    if (bt->pool)
+        loop->pool = agi_session_pool_create(AGI_BENCH_LIVE, 0);
+
+    (void)memset(live, 0, sizeof live);
+
+    t = bench_now();
+
+    for (i = 0; i < bt->n; i++) {
+        if (live[i % AGI_BENCH_LIVE])
+            agi_session_free(live[i % AGI_BENCH_LIVE]);
+
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        live[i % AGI_BENCH_LIVE] = agi_session_open(loop, &agi_transport_tcp,
+                                                    fd, fd);
+        if (live[i % AGI_BENCH_LIVE] == NULL)
+            exit(1);
+
+        /* the environment arguments, a route and the handler's own data */
+        (void)agi_arena_alloc(&live[i % AGI_BENCH_LIVE]->arena, 64);
+        (void)agi_arena_alloc(&live[i % AGI_BENCH_LIVE]->arena, 160);
+        (void)agi_arena_alloc(&live[i % AGI_BENCH_LIVE]->arena, 512);
+    }
+
+    for (i = 0; i < AGI_BENCH_LIVE; i++) {
+        if (live[i])
+            agi_session_free(live[i]);
+    }
+
+    bt->ns = bench_now() - t;
+
+    if (loop->pool) {
+        bt->stats = loop->pool->stats;
+        agi_pool_destroy(loop->pool);
+        loop->pool = NULL;
+    }
+
+    agi_event_loop_destroy(loop);
+
+    return NULL;
+}
+
+static double
+bench(int nthreads, int pool, long n, agi_pool_stats_t *stats)
+{
+    int                 i;
+    double              ns;
+    bench_thread_t      bt[256];
+
+    ns = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        (void)memset(&bt[i], 0, sizeof bt[i]);
+
+        bt[i].pool = pool;
+        bt[i].n = n;
+
+        (void)pthread_create(&bt[i].tid, NULL, run, &bt[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        (void)pthread_join(bt[i].tid, NULL);
+
+        if (bt[i].ns > ns)
+            ns = bt[i].ns;
+    }
+
+    *stats = bt[0].stats;
+
+    /* sessions per second, over all the threads */
+    return (double)n * nthreads / ns * 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+    int                 n, ncpu, nmax;
+    long                count;
+    double              heap, pool;
+    agi_pool_stats_t    stats;
+
+    openlog("pool_bench", LOG_PERROR, LOG_USER);
+
+    count = bench_count(argc, argv, 200000);
+
+    /* more threads than CPUs still contend on the heap */
+    ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    nmax = ncpu < 4 ? 4 : ncpu > 256 ? 256 : ncpu;
+
+    printf("%d CPUs\n", ncpu);
+    printf("threads     heap/s      pool/s   pool peak  exhausted\n");
+
+    for (n = 1; n <= nmax; n *= 2) {
+        heap = bench(n, 0, count, &stats);
+        pool = bench(n, 1, count, &stats);
+
+        printf("%7d %10.0f  %10.0f  %10zu %10lu\n", n, heap, pool,
+               stats.peak, stats.nexhausted);
+    }
+
+    return 0;
+}
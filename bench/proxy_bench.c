@@ -0,0 +1,343 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Latency the proxy adds to a command, and the throughput of its relay.
+ *
+ * Latency: a backend event loop sends NOOP after NOOP, and the client,
+ * playing Asterisk, times from its answer to the next command, connected
+ * to the backend directly and then through agi_proxy_handler(). The
+ * difference is what two more hops through the kernel and the proxy loop
+ * cost.
+ *
+ * Throughput: once past the environment, a plain echo backend sends back
+ * whatever the client streams, directly and then through the proxy, which
+ * splices both ways. All of it on loopback, and on the CPUs the client and
+ * the backends share with the proxy.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "agi_event.h"
+#include "agi_proxy.h"
+#include "agi_session.h"
+#include "bench.h"
+
+#define AGI_BENCH_PROXY_PORT    46500
+#define AGI_BENCH_AGI_PORT      46501
+#define AGI_BENCH_ECHO_PORT     46502
+
+#define AGI_BENCH_COMMANDS      20000
+#define AGI_BENCH_BYTES         (256 * 1024 * 1024)
+#define AGI_BENCH_CHUNK         (64 * 1024)
+
+static const char   agi_env[] =
+    "agi_network: yes\n"
+    "agi_network_script: ivr/main\n"
+    "agi_channel: PJSIP/trunk-0000a1b2\n"
+    "agi_uniqueid: 1697612345.4711\n"
+    "agi_callerid: 15551234567\n"
+    "\n";
+
+static const char   echo_env[] =
+    "agi_network: yes\n"
+    "agi_network_script: bulk/echo\n"
+    "\n";
+
+static double       rtt[AGI_BENCH_COMMANDS];
+
+static void
+reply(agi_session_t *s, void *ctx, int rc, agi_result_t *r)
+{
+    size_t  i = (size_t)ctx + 1;
+
+    (void)r;
+
+    if (rc != AGI_OK || i == AGI_BENCH_COMMANDS
+        || agi_session_command(s, "NOOP\n", 5, reply, (void *)i) != AGI_OK)
+    {
+        agi_session_close(s);
+    }
+}
+
+static void
+handler(agi_session_t *s)
+{
+    reply(s, (void *)-1, AGI_OK, NULL);
+}
+
+static void *
+run(void *arg)
+{
+    (void)agi_event_loop_run(arg);
+
+    return NULL;
+}
+
+static int
+listen_on(int port)
+{
+    int                 fd, one;
+    struct sockaddr_in  sa;
+
+    (void)memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    one = 1;
+    (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+    if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1
+        || listen(fd, 16) == -1)
+    {
+        exit(1);
+    }
+
+    return fd;
+}
+
+static int
+connect_to(int port)
+{
+    int                 fd, one;
+    struct sockaddr_in  sa;
+
+    (void)memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    one = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1)
+        exit(1);
+
+    return fd;
+}
+
+/* the echo backend: answers the environment, then sends everything back */
+static void *
+echo(void *arg)
+{
+    int         lfd, fd;
+    char        buf[AGI_BENCH_CHUNK];
+    size_t      env;
+    ssize_t     n, i, w;
+
+    lfd = (int)(intptr_t)arg;
+
+    for ( ;; ) {
+        fd = accept(lfd, NULL, NULL);
+        if (fd == -1)
+            continue;
+
+        /* the client streams nothing before the answer */
+        for (env = 0; env < sizeof echo_env - 1; env += (size_t)n) {
+            n = read(fd, buf, sizeof buf);
+            if (n <= 0)
+                break;
+        }
+
+        if (write(fd, "200 result=1\n", 13) == -1) {
+            (void)close(fd);
+            continue;
+        }
+
+        while ((n = read(fd, buf, sizeof buf)) > 0) {
+            for (i = 0; i < n; i += w) {
+                w = write(fd, buf + i, (size_t)(n - i));
+                if (w <= 0)
+                    break;
+            }
+        }
+
+        (void)close(fd);
+    }
+
+    return NULL;
+}
+
+static void
+latency(const char *name, int port)
+{
+    int         fd;
+    char        buf[4096];
+    size_t      n;
+    ssize_t     len, i;
+    double      t, p50, p99;
+
+    fd = connect_to(port);
+
+    if (write(fd, agi_env, sizeof agi_env - 1) == -1)
+        exit(1);
+
+    n = 0;
+    t = 0;
+
+    while ((len = read(fd, buf, sizeof buf)) > 0) {
+        for (i = 0; i < len; i++) {
+            if (buf[i] != '\n')
+                continue;
+
+            if (t != 0)
+                rtt[n++] = bench_now() - t;
+
+            t = bench_now();
+
+            if (write(fd, "200 result=0\n", 13) == -1)
+                exit(1);
+        }
+    }
+
+    (void)close(fd);
+
+    if (n == 0)
+        exit(1);
+
+    /* sorts rtt */
+    p50 = bench_percentile(rtt, n, 50);
+    p99 = bench_percentile(rtt, n, 99);
+
+    printf("%-8s %8zu commands   p50 %6.1f us   p99 %6.1f us\n", name, n,
+           p50 / 1e3, p99 / 1e3);
+}
+
+static void *
+drain(void *arg)
+{
+    int         fd;
+    char        buf[AGI_BENCH_CHUNK];
+    size_t      got;
+    ssize_t     n;
+
+    fd = (int)(intptr_t)arg;
+
+    for (got = 0; got < AGI_BENCH_BYTES; got += (size_t)n) {
+        n = read(fd, buf, sizeof buf);
+        if (n <= 0)
+            exit(1);
+    }
+
+    return NULL;
+}
+
+static void
+throughput(const char *name, int port)
+{
+    int                 fd;
+    char               *buf;
+    size_t              sent;
+    ssize_t             n;
+    double              t;
+    pthread_t           tid;
+
+    buf = calloc(1, AGI_BENCH_CHUNK);
+    if (buf == NULL)
+        exit(1);
+
+    fd = connect_to(port);
+
+    if (write(fd, echo_env, sizeof echo_env - 1) == -1
+        || read(fd, buf, 13) != 13)
+    {
+        exit(1);
+    }
+
+    t = bench_now();
+
+    (void)pthread_create(&tid, NULL, drain, (void *)(intptr_t)fd);
+
+    for (sent = 0; sent < AGI_BENCH_BYTES; sent += (size_t)n) {
+        n = write(fd, buf, AGI_BENCH_CHUNK);
+        if (n <= 0)
+            exit(1);
+    }
+
+    (void)pthread_join(tid, NULL);
+
+    t = bench_now() - t;
+
+    (void)close(fd);
+    free(buf);
+
+    printf("%-8s %8d MB         %8.0f MB/s each way\n", name,
+           AGI_BENCH_BYTES >> 20, (double)AGI_BENCH_BYTES / t * 1e3);
+}
+
+int
+main(void)
+{
+    char                    port[16], agi_port[16], echo_port[16];
+    pthread_t               tid;
+    agi_proxy_t             p;
+    agi_event_loop_t       *proxy, *backend;
+    agi_proxy_pool_t        pools[2];
+    agi_proxy_backend_t     backends[2];
+
+    openlog("proxy_bench", LOG_PERROR, LOG_USER);
+
+    (void)snprintf(port, sizeof port, "%d", AGI_BENCH_PROXY_PORT);
+    (void)snprintf(agi_port, sizeof agi_port, "%d", AGI_BENCH_AGI_PORT);
+    (void)snprintf(echo_port, sizeof echo_port, "%d", AGI_BENCH_ECHO_PORT);
+
+    (void)memset(backends, 0, sizeof backends);
+    backends[0].host = "127.0.0.1";
+    backends[0].port = agi_port;
+    backends[1].host = "127.0.0.1";
+    backends[1].port = echo_port;
+
+    pools[0].prefix = "";
+    pools[0].backends = &backends[0];
+    pools[0].nbackends = 1;
+    pools[1].prefix = "bulk/";
+    pools[1].backends = &backends[1];
+    pools[1].nbackends = 1;
+
+    p.pools = pools;
+    p.npools = 2;
+
+    if (agi_proxy_init(&p) == -1)
+        return 1;
+
+    backend = agi_event_loop_create(0, handler, NULL, 0);
+    proxy = agi_event_loop_create(0, agi_proxy_handler, &p,
+                                  AGI_EVENT_LOOP_RAW_ENV);
+
+    if (backend == NULL || proxy == NULL
+        || agi_event_listen(backend, "127.0.0.1", agi_port, 0, 0) == -1
+        || agi_event_listen(proxy, "127.0.0.1", port, 0, 0) == -1)
+    {
+        return 1;
+    }
+
+    (void)pthread_create(&tid, NULL, run, backend);
+    (void)pthread_create(&tid, NULL, run, proxy);
+    (void)pthread_create(&tid, NULL, echo,
+                         (void *)(intptr_t)listen_on(AGI_BENCH_ECHO_PORT));
+
+    /* the loops and the echo backend run until the process exits */
+
+    latency("direct", AGI_BENCH_AGI_PORT);
+    latency("proxied", AGI_BENCH_PROXY_PORT);
+
+    throughput("direct", AGI_BENCH_ECHO_PORT);
+    throughput("proxied", AGI_BENCH_PROXY_PORT);
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Throughput of the environment line scanner, scalar against SSE2 and AVX2,
+ * on its own and inside the environment parser.
+ *
+ * agi_scan.c is compiled in rather than linked, for its versions to be
+ * called by name and the parser to be pinned to one of them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "agi_scan.c"
+
+#include "agi_env.h"
+#include "agi_parse.h"
+#include "agi_pool.h"
+#include "bench.h"
+
+/* the largest environment Asterisk sends: 127 arguments of 200 bytes */
+static size_t
+env_build(char *buf, size_t size)
+{
+    int     a;
+    size_t  n;
+
+    n = (size_t)snprintf(buf, size,
+                         "agi_network: yes\n"
+                         "agi_network_script: ivr/main\n"
+                         "agi_request: agi://10.0.0.1/ivr/main\n"
+                         "agi_channel: PJSIP/trunk-0000a1b2\n"
+                         "agi_language: en\n"
+                         "agi_type: PJSIP\n"
+                         "agi_uniqueid: 1697612345.4711\n"
+                         "agi_version: 18.19.0\n"
+                         "agi_callerid: 15551234567\n"
+                         "agi_calleridname: John Smith\n"
+                         "agi_context: from-trunk\n"
+                         "agi_extension: 18005550100\n"
+                         "agi_priority: 3\n"
+                         "agi_threadid: 140234567890176\n");
+
+    for (a = 1; a <= AGI_ENV_ARGS; a++) {
+        n += (size_t)snprintf(buf + n, size - n, "agi_arg_%d: ", a);
+
+        (void)memset(buf + n, 'a' + a % 26, 200);
+        n += 200;
+
+        buf[n++] = '\n';
+    }
+
+    buf[n++] = '\n';
+
+    return n;
+}
+
+static double
+scan(agi_scan_line_pt handler, const char *buf, size_t len, long n)
+{
+    long        i;
+    size_t      off, lf, colon, sum;
+    unsigned    nul;
+    double      t;
+
+    sum = 0;
+    t = bench_now();
+
+    for (i = 0; i < n; i++) {
+        for (off = 0; off < len; off += lf + 1) {
+            lf = handler(buf + off, len - off, &colon, &nul);
+            sum += colon;
+        }
+    }
+
+    t = bench_now() - t;
+
+    /* for the loop not to go */
+    if (sum == 0)
+        printf("?\n");
+
+    return (double)len * (double)n / t;
+}
+
+static double
+parse(agi_scan_line_pt handler, const char *text, size_t len, long n)
+{
+    long                i;
+    char                buf[AGI_ENV_MAX_LEN], mem[4096];
+    double              t;
+    agi_env_t           env;
+    agi_arena_t         arena;
+    agi_env_parser_t    ep;
+
+    agi_scan_line_handler = handler;
+
+    agi_arena_init(&arena, mem, sizeof mem);
+
+    t = bench_now();
+
+    for (i = 0; i < n; i++) {
+        (void)memcpy(buf, text, len);
+
+        agi_env_parser_init(&ep);
+        agi_env_init(&env);
+
+        if (agi_process_environment(&ep, &env, &arena, buf, len) != AGI_DONE) {
+            fprintf(stderr, "environment not parsed\n");
+            exit(1);
+        }
+
+        agi_arena_reset(&arena);
+    }
+
+    t = bench_now() - t;
+
+    return (double)len * (double)n / t;
+}
+
+static void
+run(const char *name, agi_scan_line_pt handler, const char *buf, size_t len,
+    long n)
+{
+    printf("%-8s scan %6.2f GB/s   parse %6.2f GB/s\n", name,
+           scan(handler, buf, len, n), parse(handler, buf, len, n / 4));
+}
+
+int
+main(int argc, char **argv)
+{
+    long            n;
+    size_t          len;
+    static char     buf[AGI_ENV_MAX_LEN];
+
+    n = bench_count(argc, argv, 20000);
+    len = env_build(buf, sizeof buf);
+
+    printf("environment: %zu bytes, %d arguments\n", len, AGI_ENV_ARGS);
+
+    run("scalar", agi_scan_line_scalar, buf, len, n);
+
+#if (AGI_SCAN_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2"))
+        run("sse2", agi_scan_line_sse2, buf, len, n);
+
+    if (__builtin_cpu_supports("avx2"))
+        run("avx2", agi_scan_line_avx2, buf, len, n);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Per-call cost of a classic AGI program against agi_shim.
+ *
+ * The bench plays Asterisk: for every call it forks, execs the script on a
+ * pair of pipes, writes the environment, answers three commands, and waits
+ * for the script to exit. The script is either this very program started
+ * as "classic", which runs the call itself on an event loop of its own, or
+ * build/agi_shim, which hands the call to the daemon this program runs on a
+ * thread. Both run the same handler.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "agi_event.h"
+#include "agi_handoff.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+#include "bench.h"
+
+#define AGI_BENCH_PATH      "/tmp/agi_shim_bench.sock"
+
+static const char  *commands[] = {
+    "ANSWER\n",
+    "GET VARIABLE CALLERID(num)\n",
+    "HANGUP\n",
+};
+
+static const char   env[] =
+    "agi_request: ivr/main\n"
+    "agi_channel: PJSIP/trunk-0000a1b2\n"
+    "agi_uniqueid: 1697612345.4711\n"
+    "agi_callerid: 15551234567\n"
+    "agi_context: from-trunk\n"
+    "agi_extension: 18005550100\n"
+    "agi_priority: 1\n"
+    "\n";
+
+static void
+reply(agi_session_t *s, void *ctx, int rc, agi_result_t *r)
+{
+    size_t  i = (size_t)ctx + 1;
+
+    (void)r;
+
+    if (rc != AGI_OK || i == sizeof commands / sizeof commands[0]) {
+        agi_session_close(s);
+        return;
+    }
+
+    if (agi_session_command(s, commands[i], strlen(commands[i]), reply,
+                            (void *)i) != AGI_OK)
+    {
+        agi_session_close(s);
+    }
+}
+
+static void
+handler(agi_session_t *s)
+{
+    if (agi_session_command(s, commands[0], strlen(commands[0]), reply,
+                            (void *)0) != AGI_OK)
+    {
+        agi_session_close(s);
+    }
+}
+
+/* the classic program stops once its only call is over */
+static void
+classic_reply(agi_session_t *s, void *ctx, int rc, agi_result_t *r)
+{
+    size_t  i = (size_t)ctx + 1;
+
+    (void)r;
+
+    if (rc != AGI_OK || i == sizeof commands / sizeof commands[0]
+        || agi_session_command(s, commands[i], strlen(commands[i]),
+                               classic_reply, (void *)i) != AGI_OK)
+    {
+        agi_session_close(s);
+        agi_event_loop_stop(s->loop);
+    }
+}
+
+static void
+classic_handler(agi_session_t *s)
+{
+    classic_reply(s, (void *)-1, AGI_OK, NULL);
+}
+
+static int
+classic(void)
+{
+    agi_event_loop_t   *loop;
+
+    loop = agi_event_loop_create(0, classic_handler, NULL, 0);
+    if (loop == NULL)
+        return 1;
+
+    if (fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK) == -1
+        || agi_session_open(loop, &agi_transport_stdio, STDIN_FILENO,
+                            STDOUT_FILENO) == NULL
+        || agi_event_loop_run(loop) == -1)
+    {
+        return 1;
+    }
+
+    agi_event_loop_destroy(loop);
+
+    return 0;
+}
+
+static void *
+daemon_run(void *arg)
+{
+    (void)agi_event_loop_run(arg);
+
+    return NULL;
+}
+
+/* Asterisk's side of one call, in ns */
+static double
+call(char *const argv[])
+{
+    int         in[2], out[2], status;
+    char        buf[4096];
+    pid_t       pid;
+    double      t;
+    ssize_t     n, i;
+
+    t = bench_now();
+
+    if (pipe(in) == -1 || pipe(out) == -1)
+        exit(1);
+
+    pid = fork();
+
+    if (pid == -1)
+        exit(1);
+
+    if (pid == 0) {
+        if (dup2(in[0], STDIN_FILENO) == -1
+            || dup2(out[1], STDOUT_FILENO) == -1)
+        {
+            _exit(1);
+        }
+
+        (void)close(in[0]);
+        (void)close(in[1]);
+        (void)close(out[0]);
+        (void)close(out[1]);
+
+        (void)execv(argv[0], argv);
+        _exit(1);
+    }
+
+    (void)close(in[0]);
+    (void)close(out[1]);
+
+    if (write(in[1], env, sizeof env - 1) == -1)
+        exit(1);
+
+    while ((n = read(out[0], buf, sizeof buf)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (buf[i] == '\n'
+                && write(in[1], "200 result=1\n", 13) == -1)
+            {
+                break;
+            }
+        }
+    }
+
+    (void)close(in[1]);
+    (void)close(out[0]);
+
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        /* void */
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        exit(1);
+
+    return bench_now() - t;
+}
+
+static void
+bench(const char *name, char *const argv[], double *v, size_t n)
+{
+    size_t  i;
+    double  mean, p50, p99;
+
+    for (mean = 0, i = 0; i < n; i++) {
+        v[i] = call(argv);
+        mean += v[i];
+    }
+
+    mean /= (double)n;
+
+    /* sorts v */
+    p50 = bench_percentile(v, n, 50);
+    p99 = bench_percentile(v, n, 99);
+
+    printf("%-8s %10.0f %10.0f %10.0f\n", name, mean / 1e3, p50 / 1e3,
+           p99 / 1e3);
+}
+
+int
+main(int argc, char **argv)
+{
+    char                self[PATH_MAX], shim[PATH_MAX + 16], *p;
+    size_t              n;
+    ssize_t             len;
+    double             *v;
+    pthread_t           tid;
+    agi_event_loop_t   *loop;
+
+    if (argc > 1 && strcmp(argv[1], "classic") == 0)
+        return classic();
+
+    openlog("shim_bench", LOG_PERROR, LOG_USER);
+
+    n = (size_t)bench_count(argc, argv, 500);
+
+    v = malloc(n * sizeof *v);
+    if (v == NULL)
+        return 1;
+
+    /* build/bench/shim_bench, and build/agi_shim */
+    len = readlink("/proc/self/exe", self, sizeof self - 1);
+    if (len == -1)
+        return 1;
+
+    self[len] = '\0';
+
+    (void)strcpy(shim, self);
+
+    p = strrchr(shim, '/');
+    if (p)
+        *p = '\0';
+
+    p = strrchr(shim, '/');
+    (void)strcpy(p ? p + 1 : shim, "agi_shim");
+
+    loop = agi_event_loop_create(0, handler, NULL, 0);
+    if (loop == NULL || agi_handoff_listen(loop, AGI_BENCH_PATH) == -1)
+        return 1;
+
+    (void)setenv(AGI_HANDOFF_PATH_ENV, AGI_BENCH_PATH, 1);
+
+    (void)pthread_create(&tid, NULL, daemon_run, loop);
+
+    printf("per call, us\n");
+    printf("               mean        p50        p99\n");
+
+    bench("classic", (char *const []) { self, "classic", NULL }, v, n);
+    bench("agi_shim", (char *const []) { shim, NULL }, v, n);
+
+    (void)unlink(AGI_BENCH_PATH);
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Call latency under skewed load, with and without work stealing.
+ *
+ * Each call computes between its two commands, posted with agi_sched_post():
+ * one call in AGI_BENCH_HEAVY_EVERY spends AGI_BENCH_HEAVY_US, the others
+ * AGI_BENCH_LIGHT_US. Whichever worker gets a heavy call holds up the light
+ * ones behind it unless another worker steals them. The latency is that of
+ * the whole call, as the client sees it. Stealing needs idle CPUs to run
+ * on: with fewer CPUs than workers the two modes come out alike.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "agi_env.h"
+#include "agi_sched.h"
+#include "agi_session.h"
+#include "agi_worker.h"
+#include "bench.h"
+
+#define AGI_BENCH_CLIENTS       16
+#define AGI_BENCH_CALLS         500     /* per client */
+#define AGI_BENCH_HEAVY_EVERY   10
+#define AGI_BENCH_HEAVY_US      2000
+#define AGI_BENCH_LIGHT_US      50
+
+static int      port;
+
+static void
+spin(double us)
+{
+    double  end;
+
+    end = bench_now() + us * 1e3;
+
+    while (bench_now() < end) {
+        /* void */
+    }
+}
+
+static void
+hangup(agi_session_t *s, void *ctx, int rc, agi_result_t *r)
+{
+    (void)ctx;
+    (void)rc;
+    (void)r;
+
+    agi_session_close(s);
+}
+
+static void
+compute(agi_task_t *t)
+{
+    spin((double)(uintptr_t)t->data);
+}
+
+static void
+computed(agi_task_t *t)
+{
+    if (agi_session_command(t->session, "HANGUP\n", 7, hangup, NULL)
+        != AGI_OK)
+    {
+        agi_session_close(t->session);
+    }
+}
+
+static void
+answered(agi_session_t *s, void *ctx, int rc, agi_result_t *r)
+{
+    const char  *arg;
+    agi_task_t  *t;
+
+    (void)ctx;
+    (void)r;
+
+    t = agi_arena_calloc(&s->arena, sizeof *t);
+
+    if (rc != AGI_OK || t == NULL) {
+        agi_session_close(s);
+        return;
+    }
+
+    arg = agi_env_arg(&s->env, s->env_buf, 1);
+
+    t->handler = compute;
+    t->done = computed;
+    t->data = (void *)(uintptr_t)(arg && arg[0] == 'h' ? AGI_BENCH_HEAVY_US
+                                                       : AGI_BENCH_LIGHT_US);
+
+    (void)agi_sched_post(s, t);
+}
+
+static void
+handler(agi_session_t *s)
+{
+    if (agi_session_command(s, "ANSWER\n", 7, answered, NULL) != AGI_OK)
+        agi_session_close(s);
+}
+
+typedef struct {
+    pthread_t           tid;
+    unsigned            id;
+    double              ns[AGI_BENCH_CALLS];
+    unsigned            n;
+} bench_client_t;
+
+static void *
+client(void *arg)
+{
+    int                 fd, one, i;
+    char                buf[4096], env[256];
+    size_t              len;
+    ssize_t             n, k;
+    double              t;
+    bench_client_t     *c = arg;
+    struct sockaddr_in  sa;
+
+    (void)memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    one = 1;
+
+    for (i = 0; i < AGI_BENCH_CALLS; i++) {
+        len = (size_t)snprintf(env, sizeof env,
+                               "agi_network: yes\n"
+                               "agi_network_script: ivr/main\n"
+                               "agi_arg_1: %s\n\n",
+                               (c->id * AGI_BENCH_CALLS + (unsigned)i)
+                               % AGI_BENCH_HEAVY_EVERY ? "light" : "heavy");
+
+        t = bench_now();
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+        if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1
+            || write(fd, env, len) == -1)
+        {
+            (void)close(fd);
+            continue;
+        }
+
+        while ((n = read(fd, buf, sizeof buf)) > 0) {
+            for (k = 0; k < n; k++) {
+                if (buf[k] == '\n'
+                    && write(fd, "200 result=1\n", 13) == -1)
+                {
+                    break;
+                }
+            }
+        }
+
+        (void)close(fd);
+
+        if (n == 0)
+            c->ns[c->n++] = bench_now() - t;
+    }
+
+    return NULL;
+}
+
+static void
+bench(unsigned nworkers, int steal)
+{
+    char                    p[16];
+    size_t                  i, j, n;
+    double                 *all, p50, p99;
+    agi_workers_t          *w;
+    agi_workers_conf_t      conf;
+    static bench_client_t   c[AGI_BENCH_CLIENTS];
+
+    port = 46200 + steal;
+    (void)snprintf(p, sizeof p, "%d", port);
+
+    (void)memset(&conf, 0, sizeof conf);
+    conf.nworkers = nworkers;
+    conf.host = "127.0.0.1";
+    conf.port = p;
+    conf.backlog = 1024;
+    conf.nevents = 256;
+    conf.pool_size = 256;
+    conf.sched = steal;
+    conf.handler = handler;
+
+    w = agi_workers_start(&conf);
+    if (w == NULL)
+        exit(1);
+
+    for (i = 0; i < AGI_BENCH_CLIENTS; i++) {
+        c[i].id = (unsigned)i;
+        c[i].n = 0;
+
+        (void)pthread_create(&c[i].tid, NULL, client, &c[i]);
+    }
+
+    n = 0;
+    all = malloc(sizeof *all * AGI_BENCH_CLIENTS * AGI_BENCH_CALLS);
+    if (all == NULL)
+        exit(1);
+
+    for (i = 0; i < AGI_BENCH_CLIENTS; i++) {
+        (void)pthread_join(c[i].tid, NULL);
+
+        for (j = 0; j < c[i].n; j++)
+            all[n++] = c[i].ns[j];
+    }
+
+    agi_workers_stop(w);
+    (void)agi_workers_wait(w);
+
+    if (n == 0)
+        exit(1);
+
+    /* sorts all */
+    p50 = bench_percentile(all, n, 50);
+    p99 = bench_percentile(all, n, 99);
+
+    printf("%-8s %6zu calls   p50 %8.0f us   p99 %8.0f us   max %8.0f us\n",
+           steal ? "steal" : "no steal", n, p50 / 1e3, p99 / 1e3,
+           all[n - 1] / 1e3);
+
+    free(all);
+}
+
+int
+main(int argc, char **argv)
+{
+    long    ncpu, nworkers;
+
+    openlog("steal_bench", LOG_PERROR, LOG_USER);
+
+    /* as many workers as CPUs, or as the first argument says */
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nworkers = bench_count(argc, argv, ncpu);
+
+    if (nworkers > AGI_WORKER_MAX)
+        nworkers = AGI_WORKER_MAX;
+
+    printf("%ld CPUs, %ld workers, %d clients\n", ncpu, nworkers,
+           AGI_BENCH_CLIENTS);
+
+    bench((unsigned)nworkers, 0);
+    bench((unsigned)nworkers, 1);
+
+    return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Command round trip over each transport.
+ *
+ * One session sends NOOP after NOOP, each once the previous one is
+ * answered, over TCP on loopback, a Unix domain socket, and the pair of
+ * pipes of a classic AGI script. The client plays Asterisk on a thread of
+ * its own and times from its answer to the next command: the latency the
+ * transport, the event loop and the parser add to every command.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "agi_event.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+#include "bench.h"
+
+#define AGI_BENCH_PORT      46400
+#define AGI_BENCH_PATH      "/tmp/agi_transport_bench.sock"
+
+static const char   env[] =
+    "agi_network: yes\n"
+    "agi_network_script: ivr/main\n"
+    "agi_channel: PJSIP/trunk-0000a1b2\n"
+    "agi_uniqueid: 1697612345.4711\n"
+    "agi_callerid: 15551234567\n"
+    "\n";
+
+static size_t       ncommands;
+static double      *rtt;
+
+static void
+reply(agi_session_t *s, void *ctx, int rc, agi_result_t *r)
+{
+    size_t  i = (size_t)ctx + 1;
+
+    (void)r;
+
+    if (rc != AGI_OK || i == ncommands
+        || agi_session_command(s, "NOOP\n", 5, reply, (void *)i) != AGI_OK)
+    {
+        agi_session_close(s);
+        agi_event_loop_stop(s->loop);
+    }
+}
+
+static void
+handler(agi_session_t *s)
+{
+    if (agi_session_command(s, "NOOP\n", 5, reply, (void *)0) != AGI_OK) {
+        agi_session_close(s);
+        agi_event_loop_stop(s->loop);
+    }
+}
+
+static void *
+run(void *arg)
+{
+    (void)agi_event_loop_run(arg);
+
+    return NULL;
+}
+
+/* Asterisk's side: reads from rfd, answers on wfd */
+static size_t
+client(int rfd, int wfd)
+{
+    char        buf[4096];
+    size_t      n;
+    ssize_t     len, i;
+    double      t;
+
+    if (write(wfd, env, sizeof env - 1) == -1)
+        return 0;
+
+    n = 0;
+    t = 0;
+
+    while ((len = read(rfd, buf, sizeof buf)) > 0) {
+        for (i = 0; i < len; i++) {
+            if (buf[i] != '\n')
+                continue;
+
+            /* the first command comes after the environment, not an answer */
+            if (t != 0)
+                rtt[n++] = bench_now() - t;
+
+            t = bench_now();
+
+            if (write(wfd, "200 result=0\n", 13) == -1)
+                return n;
+        }
+    }
+
+    return n;
+}
+
+static int
+connect_tcp(void)
+{
+    int                 fd, one;
+    struct sockaddr_in  sa;
+
+    (void)memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(AGI_BENCH_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    one = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1) {
+        (void)close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+connect_unix(void)
+{
+    int                 fd;
+    struct sockaddr_un  sun;
+
+    (void)memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    (void)strcpy(sun.sun_path, AGI_BENCH_PATH);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (connect(fd, (struct sockaddr *)&sun, sizeof sun) == -1) {
+        (void)close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void
+bench(const char *name)
+{
+    int                 fd, in[2], out[2];
+    char                port[16];
+    size_t              i, n;
+    double              p50, p99, mean;
+    pthread_t           tid;
+    agi_event_loop_t   *loop;
+
+    loop = agi_event_loop_create(0, handler, NULL, 0);
+    if (loop == NULL)
+        exit(1);
+
+    fd = -1;
+    in[0] = in[1] = out[0] = out[1] = -1;
+
+    if (strcmp(name, "tcp") == 0) {
+        (void)snprintf(port, sizeof port, "%d", AGI_BENCH_PORT);
+
+        if (agi_event_listen(loop, "127.0.0.1", port, 0, 0) == -1)
+            exit(1);
+    }
+    else if (strcmp(name, "unix") == 0) {
+        if (agi_event_listen_unix(loop, AGI_BENCH_PATH, 0) == -1)
+            exit(1);
+    }
+    else {
+        /* Asterisk writes to in[1] and reads from out[0] */
+        if (pipe(in) == -1 || pipe(out) == -1
+            || fcntl(in[0], F_SETFL, O_NONBLOCK) == -1
+            || agi_session_open(loop, &agi_transport_stdio, in[0], out[1])
+               == NULL)
+        {
+            exit(1);
+        }
+    }
+
+    (void)pthread_create(&tid, NULL, run, loop);
+
+    if (in[0] == -1) {
+        fd = strcmp(name, "tcp") == 0 ? connect_tcp() : connect_unix();
+        if (fd == -1)
+            exit(1);
+
+        n = client(fd, fd);
+
+        (void)close(fd);
+    }
+    else {
+        n = client(out[0], in[1]);
+
+        (void)close(out[0]);
+        (void)close(in[1]);
+    }
+
+    (void)pthread_join(tid, NULL);
+
+    agi_event_loop_destroy(loop);
+
+    if (n == 0)
+        exit(1);
+
+    for (mean = 0, i = 0; i < n; i++)
+        mean += rtt[i];
+
+    mean /= (double)n;
+
+    /* sorts rtt */
+    p50 = bench_percentile(rtt, n, 50);
+    p99 = bench_percentile(rtt, n, 99);
+
+    printf("%-6s %8zu %10.1f %10.1f %10.1f\n", name, n, mean / 1e3,
+           p50 / 1e3, p99 / 1e3);
+}
+
+int
+main(int argc, char **argv)
+{
+    openlog("transport_bench", LOG_PERROR, LOG_USER);
+
+    ncommands = (size_t)bench_count(argc, argv, 20000);
+
+    rtt = malloc(ncommands * sizeof *rtt);
+    if (rtt == NULL)
+        return 1;
+
+    printf("round trip of a command, us\n");
+    printf("       samples       mean        p50        p99\n");
+
+    bench("tcp");
+    bench("unix");
+    bench("stdio");
+
+    (void)unlink(AGI_BENCH_PATH);
+
+    return 0;
+}
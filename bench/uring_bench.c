@@ -0,0 +1,217 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Commands per second over epoll and over io_uring.
+ *
+ * Both backends replay the same call: the environment, then the commands
+ * of a short IVR, each sent once the previous one is answered. The client
+ * threads, playing Asterisk over loopback, share the CPUs with the worker:
+ * what differs between the two runs is the syscalls of the worker.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "agi_session.h"
+#include "agi_worker.h"
+#include "bench.h"
+
+#define AGI_BENCH_CLIENTS   16
+#define AGI_BENCH_SECONDS   2
+
+static const char  *commands[] = {
+    "ANSWER\n",
+    "GET VARIABLE CALLERID(num)\n",
+    "DATABASE GET blacklist 15551234567\n",
+    "SET VARIABLE LANGUAGE() \"en\"\n",
+    "STREAM FILE welcome \"\"\n",
+    "GET DATA ivr/menu 5000 1\n",
+    "SET VARIABLE CHOICE \"1\"\n",
+    "EXEC Playback \"ivr/thanks\"\n",
+    "HANGUP\n",
+};
+
+#define AGI_BENCH_COMMANDS  (sizeof commands / sizeof commands[0])
+
+static const char   env[] =
+    "agi_network: yes\n"
+    "agi_network_script: ivr/main\n"
+    "agi_channel: PJSIP/trunk-0000a1b2\n"
+    "agi_uniqueid: 1697612345.4711\n"
+    "agi_callerid: 15551234567\n"
+    "agi_context: from-trunk\n"
+    "agi_extension: 18005550100\n"
+    "agi_priority: 1\n"
+    "\n";
+
+static atomic_int       stop;
+static atomic_long      ncalls;
+static int              port;
+
+static void
+reply(agi_session_t *s, void *ctx, int rc, agi_result_t *r)
+{
+    size_t  i = (size_t)ctx + 1;
+
+    (void)r;
+
+    if (rc != AGI_OK || i == AGI_BENCH_COMMANDS) {
+        agi_session_close(s);
+        return;
+    }
+
+    if (agi_session_command(s, commands[i], strlen(commands[i]), reply,
+                            (void *)i) != AGI_OK)
+    {
+        agi_session_close(s);
+    }
+}
+
+static void
+handler(agi_session_t *s)
+{
+    if (agi_session_command(s, commands[0], strlen(commands[0]), reply,
+                            (void *)0) != AGI_OK)
+    {
+        agi_session_close(s);
+    }
+}
+
+/* Asterisk's side: answers every line with 200 result=1 until closed */
+static void *
+client(void *arg)
+{
+    int                 fd, one;
+    char                buf[4096];
+    ssize_t             n, i;
+    struct sockaddr_in  sa;
+
+    (void)arg;
+
+    (void)memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    one = 1;
+
+    while (!atomic_load(&stop)) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+        if (connect(fd, (struct sockaddr *)&sa, sizeof sa) == -1
+            || write(fd, env, sizeof env - 1) == -1)
+        {
+            (void)close(fd);
+            continue;
+        }
+
+        while ((n = read(fd, buf, sizeof buf)) > 0) {
+            for (i = 0; i < n; i++) {
+                if (buf[i] == '\n'
+                    && write(fd, "200 result=1\n", 13) == -1)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (n == 0)
+            atomic_fetch_add(&ncalls, 1);
+
+        (void)close(fd);
+    }
+
+    return NULL;
+}
+
+static void
+bench(unsigned nworkers, int uring)
+{
+    int                 i;
+    char                p[16];
+    double              t, calls;
+    pthread_t           tid[AGI_BENCH_CLIENTS];
+    agi_workers_t      *w;
+    agi_workers_conf_t  conf;
+
+    port = 46300 + uring;
+    (void)snprintf(p, sizeof p, "%d", port);
+
+    (void)memset(&conf, 0, sizeof conf);
+    conf.nworkers = nworkers;
+    conf.host = "127.0.0.1";
+    conf.port = p;
+    conf.backlog = 1024;
+    conf.nevents = 256;
+    conf.pool_size = 256;
+    conf.uring = uring;
+    conf.handler = handler;
+
+    w = agi_workers_start(&conf);
+    if (w == NULL)
+        exit(1);
+
+    /* the loop falls back to epoll when the kernel has no io_uring */
+    if (uring && w->worker[0].loop->uring == NULL)
+        printf("io_uring not available, ");
+
+    atomic_store(&stop, 0);
+    atomic_store(&ncalls, 0);
+
+    t = bench_now();
+
+    for (i = 0; i < AGI_BENCH_CLIENTS; i++)
+        (void)pthread_create(&tid[i], NULL, client, NULL);
+
+    (void)sleep(AGI_BENCH_SECONDS);
+
+    atomic_store(&stop, 1);
+
+    for (i = 0; i < AGI_BENCH_CLIENTS; i++)
+        (void)pthread_join(tid[i], NULL);
+
+    t = bench_now() - t;
+
+    agi_workers_stop(w);
+    (void)agi_workers_wait(w);
+
+    calls = (double)atomic_load(&ncalls) / t * 1e9;
+
+    printf("%-8s %10.0f calls/s %10.0f commands/s\n",
+           uring ? "io_uring" : "epoll", calls, calls * AGI_BENCH_COMMANDS);
+}
+
+int
+main(int argc, char **argv)
+{
+    long        nworkers;
+
+    openlog("uring_bench", LOG_PERROR, LOG_USER);
+
+    /* one worker, or as many as the first argument says */
+    nworkers = bench_count(argc, argv, 1);
+
+    if (nworkers > AGI_WORKER_MAX)
+        nworkers = AGI_WORKER_MAX;
+
+    printf("%ld workers, %d clients, %zu commands per call\n", nworkers,
+           AGI_BENCH_CLIENTS, AGI_BENCH_COMMANDS);
+
+    bench((unsigned)nworkers, 0);
+    bench((unsigned)nworkers, 1);
+
+    return 0;
+}
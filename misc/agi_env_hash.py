@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+#
+# Author: Romario Maxwell
+#
+# Generate the perfect hash of the AGI environment variable names found in
+# src/agi_env.c. Run it after adding a variable to FIELDS and its field to
+# the enum in src/agi_env.h, and paste its output over the generated block.
+#
+# The hash is agi_env_hash() from src/agi_env.h, fed one byte at a time by
+# the environment parser. A key lands in slot
+#
+#     ((hash >> AGI_ENV_HASH_SHIFT) + agi_env_disp[hash & mask]) % NFIELDS
+#
+# and the displacements are searched bucket by bucket, largest first, so
+# that every key gets a slot of its own.
+
+import sys
+
+# variable names, agi_ prefix left out; the field of each is AGI_ENV_<NAME>
+FIELDS = [
+    "type",
+    "dnid",
+    "rdnis",
+    "network",
+    "request",
+    "channel",
+    "version",
+    "context",
+    "uniqueid",
+    "callerid",
+    "threadid",
+    "language",
+    "priority",
+    "enhanced",
+    "extension",
+    "callington",
+    "callingtns",
+    "callingpres",
+    "callingani2",
+    "accountcode",
+    "calleridname",
+    "network_script",
+]
+
+MULTIPLIER = 31
+SHIFT = 8
+
+
+def agi_env_hash(name):
+    h = 0
+    for c in name.encode():
+        h = (h * MULTIPLIER + c) & 0xffffffff
+    return h
+
+
+def search(nbuckets):
+    n = len(FIELDS)
+    buckets = [[] for _ in range(nbuckets)]
+
+    for f in FIELDS:
+        h = agi_env_hash(f)
+        buckets[h & (nbuckets - 1)].append((h >> SHIFT, f))
+
+    disp = [0] * nbuckets
+    slots = [None] * n
+
+    for b in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+        for d in range(n):
+            taken = [(k + d) % n for k, _ in buckets[b]]
+
+            if len(set(taken)) == len(taken) \
+                    and all(slots[t] is None for t in taken):
+                break
+        else:
+            return None
+
+        disp[b] = d
+
+        for t, (_, f) in zip(taken, buckets[b]):
+            slots[t] = f
+
+    return disp, slots
+
+
+def main():
+    nbuckets = 1
+
+    while True:
+        found = search(nbuckets)
+        if found:
+            break
+        nbuckets *= 2
+
+    disp, slots = found
+
+    print("#define AGI_ENV_NBUCKETS    %d" % nbuckets)
+    print()
+    print("static const unsigned char agi_env_disp[AGI_ENV_NBUCKETS] = {")
+    for i in range(0, nbuckets, 8):
+        print("    " + ", ".join("%2d" % d for d in disp[i:i + 8]) + ",")
+    print("};")
+    print()
+    print("static const agi_env_field_t agi_env_fields[AGI_ENV_NFIELDS] = {")
+    for name in slots:
+        print("    { agi_string(\"%s\"), AGI_ENV_%s }," % (name, name.upper()))
+    print("};")
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -14,441 +14,412 @@
 #include <sys/types.h>
 #include <sys/msg.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <sys/un.h>
 
 #include <netdb.h>
+#include <poll.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
 #include "agi.h"
-#include "utils.h"
+#include "agi_buf.h"
+#include "agi_commands.h"
+#include "agi_coro.h"
+#include "agi_env.h"
+#include "agi_parse.h"
+#include "agi_session.h"
+#include "agi_varcache.h"
 #include "log.h"
-#include "string.h"     /* strlcpy */
 
-#define strcmp6id(s, c0, c1, c2, c3, c4, c5, c6, c7)                      \
-    s[0] == c0 && s[1] == c1 && s[2] == c2 && s[3] == c3 && s[4] == c4        \
-    && s[5] == c5
+#define LF '\n'
 
-#define strcmp2callingt(s, c0, c1, c2, c3, c4, c5, c6, c7, c8, c9)        \
-    s[8] == c8  && s[9] == c9
+/*
+ * Read and process the AGI environment. Returns as soon as the blank line
+ * ending it has been received; the timeout only guards against a peer that
+ * stops sending halfway through. env holds offsets into buf, of which no more
+ * than AGI_ENV_MAX_LEN bytes are used, and must be released with
+ * agi_env_free().
+ */
+int
+agi_getenvironment(int fd, agi_env_t *env, char *buf, size_t bufsz)
+{
+    int                 rv;
+    size_t              buflen = 0;
+    size_t              datalen = 0;    /* agi environment length */
+    ssize_t             bytes = 0;
+    struct pollfd       pfd;
+    agi_env_parser_t    ep;
 
-#define strcmp4calling(s, c0, c1, c2, c3, c4, c5, c6, c7, c8, c9, c10)    \
-    s[7] == c7 && s[8] == c8 && s[9] == c9 && s[10] == c10
+    /* poll() rather than select(): fd may well be above FD_SETSIZE */
+    pfd.fd = fd;
+    pfd.events = POLLIN;
 
+    agi_env_parser_init(&ep);
 
-static void struct_member_helper(agi_environment_t *e,
-    const char *variable, size_t variable_len,
-    const char *value, size_t value_len);
+    agi_env_init(env);
 
-static void
-struct_member_helper(agi_environment_t *e,
-    const char *variable, size_t variable_len
-    const char *value, size_t value_len)
-{
-    int         n;  /* argument number */
-    const char *c;
+    if (bufsz > AGI_ENV_MAX_LEN)
+        bufsz = AGI_ENV_MAX_LEN;
 
-    switch (variable_len) {
-    case 4:
-        if (strcmp4(variable, 't', 'y', 'p', 'e')) {
-            e->type = (char *)value;
-            break;
-        }
-        
-        if (strcmp4(variable, 'd', 'n', 'i', 'd')) {
-            e->dnid = (char *)value;
-            break;
-        }
+    /* to allow for the terminating null-character to be appended */
+    buflen = bufsz - 1;
 
-        break;
+    *buf = '\0';
 
-    case 5:
-        if (strcmp5(variable, 'r', 'd', 'n', 'i', 's')) {
-            e->rdnis = (char *)value;
-            break;
+    for (;;) {
+        if (buflen == datalen) {
+            log(LOG_ERR, "agi environment larger than %zu bytes", buflen);
+            return -1;
         }
 
-        if (strcmp4(variable, 'a', 'r', 'g', '_')) {
-            c = variable + (sizeof "arg_" - 1);     /* argument number */
+        pfd.revents = 0;
 
-            if (c[0] >= '1' && c[0] <= '9') {
-                n = c[0] - '1';     /* avoid extra n - 1 sub for index below */
-                e->argv[n] = (char *)value;
-            }
-            else
-                /* invalid argument number (valid: 1 - 9) */
+        rv = poll(&pfd, 1, 1500);
+
+        if (rv == -1) {
+            if (errno != EINTR) {
+                log(LOG_ERR, "poll() failed");
                 return -1;
+            }
 
-            break;
+            continue;
         }
 
-        break;
+        if (rv == 0) {
+            log(LOG_ERR, "read timeout occurred after 1.5 sec");
+            return -1;
+        }
 
-    case 6:
-        if (strcmp4(variable, 'a', 'r', 'g', '_')) {
-            c = variable + (sizeof "arg_" - 1);     /* argument number */
+        /* not recv(): fd is a pipe for classic AGI */
+        bytes = read(fd, buf + datalen, buflen - datalen);
 
-            if (c[0] >= '1' && c[0] <= '9' && c[1] >= '0' && c[1] <= '9') {
-                n = (c[0] - '0') * 10;
-                n += c[1] - '0';
+        if (bytes == (ssize_t)-1) {
+            if (errno == EINTR)
+                continue;
 
-                e->argv[n - 1] = (char *)value;
-            }
-            else
-                /* invalid argument number (valid: 10 - 99) */
-                return -1;
+            log(LOG_ERR, "read() failed");
+            return -1;
         }
 
-        break;
-
-    case 7:
-        if (strcmp7(variable, 'n', 'e', 't', 'w', 'o', 'r', 'k')) {
-            e->network = (char *)value;
-            e->network_n =
-                variable_len == 3 && strcmp3(e->network, 'y', 'e', 's');
-            break;
+        if (bytes == (ssize_t)0) {
+            log(LOG_ERR, "remote side closed their endpoint");
+            return -1;
         }
 
-        if (strcmp7(variable, 'r', 'e', 'q', 'u', 'e', 's', 't')) {
-            e->request = (char *)value;
-            break;
-        }
+        datalen += (size_t)bytes;
 
-        if (strcmp7(variable, 'c', 'h', 'a', 'n', 'n', 'e', 'l')) {
-            e->channel = (char *)value;
-            break;
-        }
+        rv = agi_process_environment(&ep, env, NULL, buf, datalen);
 
-        if (strcmp7(variable, 'v', 'e', 'r', 's', 'i', 'o', 'n')) {
-            e->version = (char *)value;
+        if (rv == AGI_DONE)
             break;
-        }
 
-        if (strcmp7(variable, 'c', 'o', 'n', 't', 'e', 'x', 't')) {
-            e->context = (char *)value;
-            break;
-        }
+        if (rv == AGI_ERROR)
+            return -1;
+    }
 
-        /* TODO: refactor and remove code duplication */
-        if (strcmp4(variable, 'a', 'r', 'g', '_')) {
-            c = variable + (sizeof "arg_" - 1);     /* argument number */
-
-            if (c[0] == '1') {
-                if ((c[1] == '0' || c[1] == '1')
-                    && c[2] >= '0' && c[2] <= '9') {
-
-                    n = (c[0] - '0') * 100;
-                    n += (c[1] - '0') * 10;
-                    n += c[2] - '0';
-
-                    e->argv[n - 1] = (char *)value;
-                }
-                else if (c[1] == '2' && c[2] >= '0' && c[2] <= '7') {
-                    n = (c[0] - '0') * 100;
-                    n += (c[1] - '0') * 10;
-                    n += c[2] - '0';
-
-                    e->argv[n - 1] = (char *)value;
-                }
-                else
-                    /* invalid argument number (valid: 100 - 127) */
-                    return -1;
-            }
-            else
-                /* invalid argument number (valid: 100 - 127) */
-                return -1;
+    buf[ep.pos] = '\0';
 
-            break;
-        }
+    return 0;
+}
 
-        break;
+/*
+ * With io_uring nothing tells a script when the socket is writable again:
+ * the rest of the command goes through the ring, from the session buffer,
+ * and the script waits for agi_session_sent() to resume it.
+ */
+int
+agi_send_pushed(agi_session_t *s, const char *buf, size_t len)
+{
+    char    *p;
+    size_t  off;
 
-    case 8:
-        if (variable[6] == 'i' && variable[7] == 'd') {
-            if (strcmp6id(variable,
-                    'u', 'n', 'i', 'q', 'u', 'e', 'i', 'd'))
-            {
-                e->uniqueid = (char *)value;
-                break;
-            }
+    while (s->sending) {
+        if (s->closing || agi_coro_wait(s) == -1)
+            return -1;
+    }
 
-            if (strcmp6id(variable,
-                    'c', 'a', 'l', 'l', 'e', 'r', 'i', 'd'))
-            {
-                e->callerid = value;
-                break;
-            }
+    if (s->out_len) {
+        log(LOG_ERR, "session %d: commands queued by its script", s->ev.fd);
+        return -1;
+    }
 
-            if (strcmp6id(variable,
-                    't', 'h', 'r', 'e', 'a', 'd', 'i', 'd'))
-            {
-                e->threadid = (char *)value;
-                e->threadid_n = strtol(e->threadid, (char **)NULL, 10);
-                break;
-            }
-        } else {
-            if (strcmp8(variable, 'l', 'a', 'n', 'g', 'u', 'a', 'g', 'e'))
-            {
-                e->language = (char *)value;
-                break;
-            }
+    if (buf >= s->out && buf < s->out + s->out_size) {
+        /* formatted in place after agi_session_reserve() */
+        off = (size_t)(buf - s->out);
+    }
+    else {
+        p = agi_session_reserve(s, len);
+        if (p == NULL)
+            return -1;
 
-            if (strcmp8(variable, 'p', 'r', 'i', 'o', 'r', 'i', 't', 'y'))
-            {
-                e->priority = (char *)value;
-                e->priority_n = atoi(e->priority);
-                break;
-            }
+        (void)memcpy(p, buf, len);
+        off = 0;
+    }
 
-            if (strcmp8(variable, 'e', 'n', 'h', 'a', 'n', 'c', 'e', 'd'))
-            {
-                e->enhanced = (char *)value;
-                e->enhanced_n = variable_len == 3
-                    && strcmp3(e->enhanced, '1', '.', '0');
-                break;
-            }
-        }
+    s->out_sent = off;
+    s->out_len = off + len;
 
-        break;
+    if (agi_session_flush(s) == AGI_ERROR)
+        return -1;
 
-    case 9:
-        if (strcmp9(variable, 'e', 'x', 't', 'e', 'n', 's', 'i', 'o', 'n'))
-            e->extension = (char *)value;
+    while (s->sending) {
+        if (s->closing || agi_coro_wait(s) == -1)
+            return -1;
+    }
 
-        break;
+    return s->closing ? -1 : 0;
+}
 
-    case 10:
-        if (strcmp8(variable, 'c', 'a', 'l', 'l', 'i', 'n', 'g', 't')) {
-            if (strcmp2callingt(variable,
-                    'c', 'a', 'l', 'l', 'i', 'n', 'g', 't', 'o', 'n'))
-            {
-                e->callington = (char *)value;
-                break;
-            }
+/*
+ * Send AGI command to Asterisk and wait for its reply. The result points
+ * into the session buffer; bytes received past the reply stay there for the
+ * next command.
+ */
+int
+agi_send_command(agi_session_t *s, const char *command, size_t len,
+    agi_result_t *r)
+{
+    /* whatever the command does, it sees the variables set before it */
+    if (agi_setvariable_flush(s) == -1)
+        return -1;
 
-            if (strcmp2callingt(variable,
-                    'c', 'a', 'l', 'l', 'i', 'n', 'g', 't', 'n', 's'))
-            {
-                e->callingtns = (char *)value;
-                break;
-            }
-        }
+    /* and cached variables may no longer hold */
+    agi_varcache_flush(s);
 
-        break;
+    return agi_exchange_command(s, command, len, r);
+}
 
-    case 11:
-        if (strcmp7(variable, 'c', 'a', 'l', 'l', 'i', 'n', 'g')) {
-            if (strcmp4calling(variable,
-                    'c', 'a', 'l', 'l', 'i', 'n', 'g', 'p', 'r', 'e', 's'))
-            {
-                e->callingpres = (char *)value;
-                break;
+/* agi_send_command() for callers keeping the variable cache themselves */
+int
+agi_exchange_command(agi_session_t *s, const char *command, size_t len,
+    agi_result_t *r)
+{
+    size_t  sent;
+    ssize_t bytes;
+
+    /* the channel is gone, no use waiting for Asterisk to say so again */
+    if (s->hangup)
+        return -1;
+
+    for (sent = 0; sent < len; sent += (size_t)bytes) {
+        bytes = s->transport->send(s, command + sent, len - sent);
+
+        if (bytes == (ssize_t)-1) {
+            if (errno == EINTR) {
+                bytes = 0;
+                continue;
             }
 
-            if (strcmp4calling(variable,
-                    'c', 'a', 'l', 'l', 'i', 'n', 'g', 'a', 'n', 'i', '2'))
-            {
-                e->callingani2 = (char *)value;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && s->pushed) {
+                if (agi_send_pushed(s, command + sent, len - sent) == -1)
+                    return -1;
+
                 break;
             }
-        } else {
-            if (strcmp11(variable,
-                    'a', 'c', 'c', 'o', 'u', 'n', 't', 'c', 'o', 'd', 'e'))
+
+            /* on a coroutine, until the event loop sees the socket writable */
+            if ((errno == EAGAIN || errno == EWOULDBLOCK)
+                && agi_coro_wait(s) == 0)
             {
-                e->accountcode = (char *)value;
-                break;
+                bytes = 0;
+                continue;
             }
-        }
 
-        break;
+            /* remote socket closed */
+            if (EPIPE == errno)
+                log(LOG_ERR,
+                        "send() failed: Asterisk closed"
+                        " its endpoint and may have died");
 
-    case 12:
-        if (strcmp12(variable,
-                'c', 'a', 'l', 'l', 'e', 'r', 'i', 'd', 'n', 'a', 'm', 'e'))
-        {
-            e->calleridname = (char *)value;
-        }
+            log(LOG_ERR, "send() failed");
 
-        break;
-
-    case 14:
-        if (strcmp14(variable,
-                'n', 'e', 't', 'w', 'o', 'r', 'k',
-                '_',
-                's', 'c', 'r', 'i', 'p', 't'))
-        {
-            e->network_script = (char *)value;
+            return -1;
         }
+    }
 
-        break;
+    if (agi_read_replies(s, r, 1) == -1)
+        return -1;
 
-    default:
-        break;
-    }
+    log_debug2("agi command parsed status: %d, result: %d",
+               r->status, r->code);
+    log_debug2("agi command parsed data: %.*s",
+               (int)r->data.len, r->data.data);
+
+    return r->status == 200 ? 0 : -1;
 }
 
+/*
+ * Wait for the replies to n commands already sent. All of them are received
+ * before any is parsed, since receiving may move the buffer the results
+ * point into. HANGUP in their place fails them and the session's commands
+ * from then on.
+ */
 int
-agi_getenvironment(int fd, char *buf, size_t bufsz)
+agi_read_replies(agi_session_t *s, agi_result_t *r, size_t n)
 {
-    int             rv;
-    size_t          buflen = 0;
-    size_t          datalen = 0;    /* agi environment length */
-    ssize_t         bytes = 0;
-    fd_set          master;
-    fd_set          readfds;    /* temp file descriptor list for select() */
-    struct timeval  tv = {1L, 500000L};
+    int     rv = 0;
+    char    *line;
+    size_t  i, len;
+    ssize_t bytes;
 
-    FD_ZERO(&master);
-    FD_ZERO(&readfds);
+    if (s->hangup)
+        return -1;
 
-    FD_SET(fd, &master);
+    while (agi_buffered_replies(&s->in, n) < n) {
+        /* with io_uring, agi_session_input() appends to s->in and resumes */
+        if (s->pushed) {
+            if (s->closing || agi_coro_wait(s) == -1) {
+                log(LOG_ERR, "session %d closed before the reply", s->ev.fd);
+                return -1;
+            }
 
-    /* to allow for the terminating null-character to be appended */
-    buflen = bufsz - 1;
+            continue;
+        }
 
-    *buf = '\0';
+        bytes = agi_buf_recv(&s->in, s);
 
-    while (buflen) {
-        /*
-         * select() on Linux modifies the struct to reflect the amount of
-         * time not slept as well as when it is interrupted by a signal handler
-         */
-        tv.tv_sec = 1L;
-        tv.tv_usec = 500000L;
+        if (bytes <= (ssize_t)0) {
+            if (bytes == (ssize_t)-1 && errno == EINTR)
+                continue;
 
-        /* select() modifies the set */
-        readfds = master;
+            if (bytes == (ssize_t)-1
+                && (errno == EAGAIN || errno == EWOULDBLOCK)
+                && agi_coro_wait(s) == 0)
+            {
+                continue;
+            }
 
-        rv = select(fd + 1, &readfds, (fd_set *)NULL, (fd_set *)NULL, &tv);
+            /* remote socket has been closed */
+            if ((ssize_t)0 == bytes)
+                log(LOG_ERR,
+                        "recv() failed: Asterisk closed"
+                        " its endpoint and may have died");
 
-        log_debug0("select() on socket ready");
+            log(LOG_ERR, "recv() failed");
 
-        if (rv == -1) {
-            if (errno != EINTR) {
-                log(LOG_ERR, "select() failed");
-                return -1;
-            }
-        }
-        else if (rv == 0) {
-            log(LOG_ERR, "read timeout occurred after 1.5 sec");
-            break;
+            return -1;
         }
-        else {
-            if (FD_ISSET(fd, &master)) {
-                bytes = recv(fd, buf + datalen, buflen, 0);
+    }
 
-                if (bytes == (ssize_t)-1) {
-                    log(LOG_ERR, "recv() failed");
-                    return -1;
-                }
+    for (i = 0; i < n; i++) {
+        line = agi_buf_line(&s->in, &len);
 
-                if (bytes == (ssize_t)0) {
-                    log(LOG_ERR, "remote side closed their endpoint");
-                    break;
-                }
+        if (agi_parse_hangup(line, len)) {
+            log_debug1("session %d: Asterisk sent HANGUP", s->ev.fd);
 
-                if (datalen > (size_t)1) {
-                    /* end of environment variables */
-                    if ((buf[datalen] == '\n') && (buf[datalen - 1] == '\n'))
-                        break;
-                }
+            s->hangup = 1;
 
-                buflen = bufsz - (size_t)bytes;
-                datalen += (size_t)bytes;
+            /* the replies left, if any, do not matter anymore */
+            for ( ; i < n; i++) {
+                (void)memset(&r[i], 0, sizeof(agi_result_t));
+                r[i].code = -1;
+                r[i].endpos = -1;
             }
-        }
-    }
 
-    buf[datalen + 1] = '\0';
+            return -1;
+        }
 
-    return 0;
-}
+        switch (agi_parse_command_response_line(line, len, &r[i])) {
 
-/* Send AGI command to Asterisk */
-int
-agi_send_command(int fd, const char *command, char *result, char *data)
-{
-    int     rv;
-    char    response_line[BUFSIZ];
-    size_t  len;
-    ssize_t bytes;
+        case AGI_OK:
+            break;
 
-    if (send(fd, command, strlen(command)) == -1) {
-        /* remote socket closed */
-        if (EPIPE == errno)
-            log(LOG_ERR,
-                    "send() failed: Asterisk closed"
-                    " its endpoint and may have died");
+        case AGI_AGAIN:
+            /* skip the usage text up to "520 End of proper usage." */
+            while ((line = agi_buf_line(&s->in, &len)) != NULL) {
+                if (len >= 4 && memcmp(line, "520 ", 4) == 0)
+                    break;
+            }
 
-        log(LOG_ERR, "send() failed");
+            break;
 
-        return -1;
+        default:
+            log(LOG_ERR, "invalid agi command reply: %.*s", (int)len, line);
+            rv = -1;
+            break;
+        }
     }
 
-    bytes = recv(fd, response_line, sizeof response_line, 0);
-    if (bytes <= (ssize_t)0) {
-        /* remote socket has been closed */
-        if ((ssize_t)0 == bytes)
-            log(LOG_ERR,
-                    "recv() failed: Asterisk closed"
-                    " its endpoint and may have died");
-
-        log(LOG_ERR, "recv() failed");
+    return rv;
+}
 
-        return -1;
-    }
+/*
+ * Count, up to n, the complete replies buffered. A reply is one line, except
+ * for "520-" whose usage text runs up to a line starting with "520 ". HANGUP
+ * ends the wait: n is returned.
+ */
+size_t
+agi_buffered_replies(agi_buf_t *b, size_t n)
+{
+    int     usage = 0;
+    char    *p, *lf;
+    size_t  count = 0;
 
-    response_line[bytes] = '\0';
+    for (p = b->pos; count < n && p < b->last; p = lf + 1) {
+        lf = memchr(p, LF, (size_t)(b->last - p));
+        if (lf == NULL)
+            break;
 
-    log_debug1("agi command response line: %s", response_line);
+        if (!usage && agi_parse_hangup(p, (size_t)(lf - p) + 1))
+            return n;
 
-    rv = agi_parse_command_response_line(response_line, result, data);
+        if (lf - p >= 4 && p[0] == '5' && p[1] == '2' && p[2] == '0') {
+            if (p[3] == '-') {
+                usage = 1;
+                continue;
+            }
 
-    if (rv == -1)
-        return -1;
+            if (p[3] == ' ')
+                usage = 0;
+        }
 
-    log_debug2("\n"
-                   "agi command parsed result: %s\n"
-                   "agi command parsed data: %s\n",
-                   strlen(result) ? result : "(null)",
-                   strlen(data) ? data : "(null)");
+        if (!usage)
+            count++;
+    }
 
-    return 0;
+    return count;
 }
 
-void
-agi_process_environment(agi_environment_t *e, char *buf)
+/*
+ * Feed the bytes received so far, buf[0 .. len), to the environment parser.
+ * Complete lines are null-terminated in place and stored in env as offsets;
+ * what env allocates comes from arena, or the heap when it is NULL. Returns
+ * AGI_AGAIN until the blank line ending the environment has been seen, then
+ * AGI_DONE with ep->pos just past it, or AGI_ERROR when out of memory.
+ * Variables the extra table has no room for are left out, and env->overflow
+ * set.
+ */
+int
+agi_process_environment(agi_env_parser_t *ep, agi_env_t *env,
+    agi_arena_t *arena, char *buf, size_t len)
 {
     int     rv;
     size_t  var_len, val_len;
     char    *variable, *value;
 
     for (;;) {
-        rv = agi_parse_environment_variable_line(e, buf);
+        rv = agi_parse_environment_variable_line(ep, buf, len);
 
-        /*
-         * to determine when we reach the blank line indicating the end of the
-         * AGI environment list
-         */
-        if (rv == 3)
-            break;
+        if (rv == AGI_ERROR) {
+            log(LOG_ERR, "invalid agi environment line skipped");
+            continue;
+        }
 
-        if (rv == 0) {
-            var_len = e->variable_end - e->variable_start;
-            variable = e->variable_start;
-            variable[var_len] = '\0';
+        if (rv != AGI_OK)
+            return rv;
 
-            val_len = e->value_end - e->value_start;
-            value = e->value_start;
-            value[val_len] = '\0';
+        var_len = ep->variable_end - ep->variable_start;
+        variable = buf + ep->variable_start;
+        variable[var_len] = '\0';
 
-            log_debug2("agi env line: %s: %s", variable, value);
+        val_len = ep->value_end - ep->value_start;
+        value = buf + ep->value_start;
+        value[val_len] = '\0';
 
-            struct_member_helper(e, variable, var_len, value, val_len);
-        }
+        log_debug2("agi env line: %s: %s", variable, value);
 
-        buf = e->value_end + 1;
+        if (agi_env_set(env, arena, ep, buf) == -1)
+            return AGI_ERROR;
     }
 }
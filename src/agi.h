@@ -0,0 +1,30 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Asterisk Gateway Interface (AGI) library: the headers a program includes
+ */
+
+#ifndef AGI_H
+#define AGI_H
+
+#include "agi_core.h"
+#include "agi_astdb.h"
+#include "agi_batch.h"
+#include "agi_commands.h"
+#include "agi_coro.h"
+#include "agi_env.h"
+#include "agi_event.h"
+#include "agi_handoff.h"
+#include "agi_module.h"
+#include "agi_parse.h"
+#include "agi_pool.h"
+#include "agi_proxy.h"
+#include "agi_route.h"
+#include "agi_sched.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+#include "agi_uring.h"
+#include "agi_varcache.h"
+#include "agi_worker.h"
+
+#endif /* AGI_H */
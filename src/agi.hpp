@@ -0,0 +1,409 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * C++20 interface to AGI sessions driven by the event loop
+ *
+ * Every command of agi_commands.h is an awaitable function of the same name
+ * in namespace agi, taking the session and the arguments it puts on the
+ * wire, less the output buffers of the C functions:
+ *
+ *     agi::task
+ *     script(agi::session s)
+ *     {
+ *         agi::result r = co_await agi::getvariable(s, "CALLERID(num)");
+ *
+ *         if (r.code() == 1 && r.value() == "100")
+ *             co_await agi::streamfile(s, "welcome", "", 0);
+ *
+ *         s.close();
+ *     }
+ *
+ * Commands are formatted straight into the session output buffer, results
+ * are views into its read buffer, and coroutine frames come from the session
+ * arena: nothing is allocated on the heap.
+ */
+
+#ifndef AGI_HPP
+#define AGI_HPP
+
+#include <charconv>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <string_view>
+
+extern "C" {
+#include "agi_commands.h"
+#include "agi_env.h"
+#include "agi_session.h"
+}
+
+namespace agi {
+
+constexpr std::string_view
+view(const agi_str_t &s) noexcept
+{
+    return { s.data, s.len };
+}
+
+/*
+ * The reply to a command. The views remain valid until the next co_await on
+ * the session.
+ */
+class result {
+public:
+    result() noexcept
+    {
+        std::memset(&r_, 0, sizeof r_);
+
+        r_.code = -1;
+        r_.endpos = -1;
+    }
+
+    explicit result(int rc) noexcept : result() { rc_ = rc; }
+    result(int rc, const agi_result_t *r) noexcept : rc_(rc), r_(*r) {}
+
+    /* a 200 reply that was received and parsed */
+    bool ok() const noexcept { return rc_ == AGI_OK && r_.status == 200; }
+    explicit operator bool() const noexcept { return ok(); }
+
+    int rc() const noexcept { return rc_; }
+    int status() const noexcept { return r_.status; }
+    int code() const noexcept { return r_.code; }
+    long endpos() const noexcept { return r_.endpos; }
+    bool timeout() const noexcept { return r_.timeout; }
+
+    std::string_view result_str() const noexcept { return view(r_.result); }
+    std::string_view data() const noexcept { return view(r_.data); }
+    std::string_view value() const noexcept { return view(r_.value); }
+
+    /* the digits of getdata, leading zeros included */
+    std::string_view digits() const noexcept { return view(r_.result); }
+
+private:
+    int             rc_ = AGI_ERROR;
+    agi_result_t    r_;
+};
+
+class session {
+public:
+    session(agi_session_t *s) noexcept : s_(s) {}
+
+    agi_session_t *get() const noexcept { return s_; }
+
+    std::string_view
+    env(unsigned field) const noexcept
+    {
+        const char *v = agi_env_get(&s_->env, s_->env_buf, field);
+
+        return v ? std::string_view(v) : std::string_view();
+    }
+
+    /* agi_arg_1 is arg(1) */
+    std::string_view
+    arg(unsigned n) const noexcept
+    {
+        const char *v = agi_env_arg(&s_->env, s_->env_buf, n);
+
+        return v ? std::string_view(v) : std::string_view();
+    }
+
+    /* a variable without a field of its own, by name without "agi_" */
+    std::string_view
+    extra(const char *name) const noexcept
+    {
+        const char *v = agi_env_extra_get(&s_->env, s_->env_buf, name);
+
+        return v ? std::string_view(v) : std::string_view();
+    }
+
+    unsigned argc() const noexcept { return s_->env.argc; }
+    long threadid() const noexcept { return s_->env.threadid_n; }
+    int priority() const noexcept { return s_->env.priority_n; }
+    bool network() const noexcept { return s_->env.network_n; }
+    bool enhanced() const noexcept { return s_->env.enhanced_n; }
+
+    /* released with the session */
+    void *
+    alloc(std::size_t n) const noexcept
+    {
+        return agi_session_alloc(s_, n);
+    }
+
+    void close() const noexcept { agi_session_close(s_); }
+
+private:
+    agi_session_t  *s_;
+};
+
+/*
+ * A script started by calling it: it runs up to its first co_await, and on
+ * from there as replies arrive. Its first parameter must be the session,
+ * whose arena the frame comes from. When the session fails, every command
+ * awaited completes with rc() AGI_ERROR so that the script can return; a
+ * script still waiting when the session is closed by other means is dropped
+ * without unwinding.
+ */
+class task {
+public:
+    struct promise_type {
+        template <typename... Args>
+        static void *
+        operator new(std::size_t n, session s, Args &&...) noexcept
+        {
+            return s.alloc(n);
+        }
+
+        template <typename... Args>
+        static void *
+        operator new(std::size_t n, agi_session_t *s, Args &&...) noexcept
+        {
+            return agi_session_alloc(s, n);
+        }
+
+        /* released with the arena */
+        static void operator delete(void *, std::size_t) noexcept {}
+
+        static task get_return_object_on_allocation_failure() noexcept
+        {
+            return {};
+        }
+
+        task get_return_object() noexcept { return {}; }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+namespace detail {
+
+/*
+ * The formatting rules of agi_commands.c: every argument is preceded by a
+ * space, none may hold a LF, and a NULL p is passed through
+ */
+
+constexpr char *
+put(char *p, char *end, std::string_view v) noexcept
+{
+    if (p == nullptr || static_cast<std::size_t>(end - p) < v.size() + 1)
+        return nullptr;
+
+    *p++ = ' ';
+
+    for (char c : v)
+        *p++ = c;
+
+    return p;
+}
+
+constexpr char *
+put_str(char *p, char *end, std::string_view v) noexcept
+{
+    if (v.empty())
+        return put(p, end, "\"\"");
+
+    if (v.find(AGI_LF) != std::string_view::npos)
+        return nullptr;
+
+    return put(p, end, v);
+}
+
+constexpr char *
+put_qstr(char *p, char *end, std::string_view v) noexcept
+{
+    if (p == nullptr || end - p < 3)
+        return nullptr;
+
+    *p++ = ' ';
+    *p++ = '"';
+
+    for (char c : v) {
+        if (c == AGI_LF || end - p < 2)
+            return nullptr;
+
+        if (c == '"' || c == '\\')
+            *p++ = '\\';
+
+        if (p == end)
+            return nullptr;
+
+        *p++ = c;
+    }
+
+    if (p == end)
+        return nullptr;
+
+    *p++ = '"';
+
+    return p;
+}
+
+/* an optional argument is omitted when its view is null */
+constexpr char *
+put_ostr(char *p, char *end, std::string_view v) noexcept
+{
+    return v.data() ? put_str(p, end, v) : p;
+}
+
+template <typename T>
+char *
+put_num(char *p, char *end, T v) noexcept
+{
+    if (p == nullptr || p == end)
+        return nullptr;
+
+    *p++ = ' ';
+
+    auto [last, ec] = std::to_chars(p, end, v);
+
+    return ec == std::errc() ? last : nullptr;
+}
+
+constexpr char *
+put_bool(char *p, char *end, bool v) noexcept
+{
+    return put(p, end, v ? "on" : "off");
+}
+
+}   /* namespace detail */
+
+/*
+ * An AGI command, queued on the session as soon as it is formatted, and
+ * awaited for its reply. It must be awaited where it was created: it can be
+ * neither copied nor moved, since the session refers to it. A command that
+ * was too long, held a LF, or was refused by the session completes at once
+ * with rc() AGI_ERROR or AGI_BUSY.
+ */
+class [[nodiscard]] command {
+public:
+    command(agi_session_t *s, char *p) noexcept
+    {
+        int rc = AGI_ERROR;
+
+        if (p) {
+            *p++ = AGI_LF;
+
+            char *start = s->out + s->out_len;
+
+            rc = agi_session_command(s, start,
+                                     static_cast<std::size_t>(p - start),
+                                     handler, this);
+        }
+
+        if (rc != AGI_OK) {
+            result_ = result(rc);
+            done_ = true;
+        }
+    }
+
+    command(const command &) = delete;
+    command &operator=(const command &) = delete;
+
+    bool await_ready() const noexcept { return done_; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { h_ = h; }
+    result await_resume() const noexcept { return result_; }
+
+private:
+    static void
+    handler(agi_session_t *, void *ctx, int rc, agi_result_t *r) noexcept
+    {
+        command *c = static_cast<command *>(ctx);
+
+        c->result_ = result(rc, r);
+        c->done_ = true;
+
+        /* r only lives for this call: the script runs on from within it */
+        if (c->h_)
+            c->h_.resume();
+    }
+
+    result                      result_;
+    std::coroutine_handle<>     h_;
+    bool                        done_ = false;
+};
+
+/* the verb and worst case length of every command, known at compile time */
+template <unsigned Id>
+struct command_traits;
+
+#define AGI_HPP_COMMAND_TRAITS(name, verb_, shape, cache, defer)              \
+template <>                                                                   \
+struct command_traits<AGI_CMD_##name> {                                       \
+    static constexpr std::string_view   verb = verb_;                         \
+    static constexpr std::size_t        len = AGI_COMMAND_LEN(name, verb_);   \
+};
+
+AGI_COMMANDS(AGI_HPP_COMMAND_TRAITS)
+
+#undef AGI_HPP_COMMAND_TRAITS
+
+#define AGI_HPP_ARG_TYPE_STR    std::string_view
+#define AGI_HPP_ARG_TYPE_QSTR   std::string_view
+#define AGI_HPP_ARG_TYPE_OSTR   std::string_view
+#define AGI_HPP_ARG_TYPE_INT    int
+#define AGI_HPP_ARG_TYPE_LONG   long
+#define AGI_HPP_ARG_TYPE_ULONG  unsigned long
+#define AGI_HPP_ARG_TYPE_OFF    off_t
+#define AGI_HPP_ARG_TYPE_BOOL   bool
+
+#define AGI_HPP_ARG_DECL_OUT(name)
+#define AGI_HPP_ARG_DECL_SIZE(name)
+#define AGI_HPP_ARG_DECL_STR(name)      , AGI_HPP_ARG_TYPE_STR name
+#define AGI_HPP_ARG_DECL_QSTR(name)     , AGI_HPP_ARG_TYPE_QSTR name
+#define AGI_HPP_ARG_DECL_OSTR(name)     , AGI_HPP_ARG_TYPE_OSTR name
+#define AGI_HPP_ARG_DECL_INT(name)      , AGI_HPP_ARG_TYPE_INT name
+#define AGI_HPP_ARG_DECL_LONG(name)     , AGI_HPP_ARG_TYPE_LONG name
+#define AGI_HPP_ARG_DECL_ULONG(name)    , AGI_HPP_ARG_TYPE_ULONG name
+#define AGI_HPP_ARG_DECL_OFF(name)      , AGI_HPP_ARG_TYPE_OFF name
+#define AGI_HPP_ARG_DECL_BOOL(name)     , AGI_HPP_ARG_TYPE_BOOL name
+
+#define AGI_HPP_ARG_DECL(type, name)    AGI_HPP_ARG_DECL_##type(name)
+
+#define AGI_HPP_ARG_PUT_STR(v)      p = detail::put_str(p, end, v);
+#define AGI_HPP_ARG_PUT_QSTR(v)     p = detail::put_qstr(p, end, v);
+#define AGI_HPP_ARG_PUT_OSTR(v)     p = detail::put_ostr(p, end, v);
+#define AGI_HPP_ARG_PUT_INT(v)      p = detail::put_num(p, end, v);
+#define AGI_HPP_ARG_PUT_LONG(v)     p = detail::put_num(p, end, v);
+#define AGI_HPP_ARG_PUT_ULONG(v)    p = detail::put_num(p, end, v);
+#define AGI_HPP_ARG_PUT_OFF(v)      p = detail::put_num(p, end, (long)v);
+#define AGI_HPP_ARG_PUT_BOOL(v)     p = detail::put_bool(p, end, v);
+#define AGI_HPP_ARG_PUT_OUT(v)
+#define AGI_HPP_ARG_PUT_SIZE(v)
+
+#define AGI_HPP_ARG_PUT(type, name) AGI_HPP_ARG_PUT_##type(name)
+
+/* end is left one byte short of the reservation for the LF */
+#define AGI_HPP_COMMAND(name, verb_, shape, cache, defer)                     \
+inline command                                                                \
+name(session s AGI_ARGS_##name(AGI_HPP_ARG_DECL)) noexcept                    \
+{                                                                             \
+    using traits = command_traits<AGI_CMD_##name>;                            \
+                                                                              \
+    char *p = agi_session_reserve(s.get(), traits::len);                      \
+    char *end = p ? p + traits::len - 1 : nullptr;                            \
+                                                                              \
+    if (p) {                                                                  \
+        std::memcpy(p, traits::verb.data(), traits::verb.size());             \
+        p += traits::verb.size();                                             \
+    }                                                                         \
+                                                                              \
+    AGI_ARGS_##name(AGI_HPP_ARG_PUT)                                          \
+                                                                              \
+    (void)end;                                                                \
+    return command(s.get(), p);                                               \
+}
+
+AGI_COMMANDS(AGI_HPP_COMMAND)
+
+#undef AGI_HPP_COMMAND
+#undef AGI_HPP_ARG_PUT
+#undef AGI_HPP_ARG_DECL
+
+}   /* namespace agi */
+
+#endif /* AGI_HPP */
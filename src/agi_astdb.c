@@ -0,0 +1,270 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Process-wide cache of the Asterisk database, read without locks
+ *
+ * agi_command_databaseget() answers from here what any session of the
+ * process read or wrote less than ttl seconds ago, missing keys included,
+ * and the other database commands keep it current: see the "variable cache"
+ * column of AGI_COMMANDS(). What Asterisk or other processes change is only
+ * seen once the entry expires.
+ *
+ * The cache is split in shards of direct-mapped slots, a new entry replacing
+ * whichever had the same slot. Each shard is a seqlock: readers never write
+ * to it nor wait for a lock, and writers, rare next to them, serialize on
+ * the shard mutex. agi_astdb_cache_deltree() invalidates every entry at
+ * once, whatever the family, by moving to a new generation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "agi_astdb.h"
+#include "log.h"
+
+static int agi_astdb_key(const char *family, const char *key, char *buf,
+    size_t *len, uint32_t *hash);
+static uint32_t agi_astdb_now(void);
+
+static agi_astdb_shard_t   *agi_astdb_shards;
+static unsigned             agi_astdb_ttl;
+static atomic_uint          agi_astdb_generation;
+
+#define agi_astdb_shard(hash)                                                 \
+    (&agi_astdb_shards[(hash) & (AGI_ASTDB_SHARDS - 1)])
+#define agi_astdb_slot(sh, hash)                                              \
+    (&(sh)->slots[((hash) >> 16) & (AGI_ASTDB_SLOTS - 1)])
+
+/* Once, before the sessions start; entries live ttl seconds */
+int
+agi_astdb_cache_init(unsigned ttl)
+{
+    unsigned    i;
+
+    agi_astdb_shards = calloc(AGI_ASTDB_SHARDS, sizeof(agi_astdb_shard_t));
+    if (agi_astdb_shards == NULL) {
+        log(LOG_ERR, "calloc() failed");
+        return -1;
+    }
+
+    for (i = 0; i < AGI_ASTDB_SHARDS; i++) {
+        atomic_init(&agi_astdb_shards[i].seq, 0);
+        (void)pthread_mutex_init(&agi_astdb_shards[i].lock, NULL);
+    }
+
+    atomic_init(&agi_astdb_generation, 1);
+
+    agi_astdb_ttl = ttl;
+
+    return 0;
+}
+
+/*
+ * The result code "database get" would return, and the value into buf of
+ * size bytes, or AGI_AGAIN when not cached or too long for buf
+ */
+int
+agi_astdb_cache_get(const char *family, const char *key, char *buf,
+    size_t size)
+{
+    int                     code;
+    char                    k[AGI_ASTDB_KEY_LEN];
+    size_t                  len, value_len;
+    uint32_t                hash, now, generation;
+    unsigned                seq;
+    agi_astdb_slot_t       *slot;
+    agi_astdb_shard_t      *sh;
+
+    if (agi_astdb_shards == NULL
+        || agi_astdb_key(family, key, k, &len, &hash) == -1)
+    {
+        return AGI_AGAIN;
+    }
+
+    sh = agi_astdb_shard(hash);
+    slot = agi_astdb_slot(sh, hash);
+
+    code = AGI_AGAIN;
+    now = agi_astdb_now();
+    generation = atomic_load_explicit(&agi_astdb_generation,
+                                      memory_order_acquire);
+
+    do {
+        seq = atomic_load_explicit(&sh->seq, memory_order_acquire);
+
+        if (seq & 1)
+            continue;
+
+        code = AGI_AGAIN;
+
+        if (slot->hash == hash && slot->key_len == len
+            && slot->generation == generation && slot->expires > now
+            && memcmp(slot->key, k, len) == 0)
+        {
+            /*
+             * Read once: a writer may change them under us, and the copy
+             * must stay within buf and the slot even then. What a torn
+             * read copies is thrown away by the seq check below.
+             */
+            code = *(volatile int16_t *)&slot->code;
+            value_len = *(volatile uint8_t *)&slot->value_len;
+
+            if (value_len >= AGI_ASTDB_VALUE_LEN)
+                value_len = AGI_ASTDB_VALUE_LEN - 1;
+
+            /* the command then fails as it would have */
+            if (code == 1 && value_len >= size)
+                code = AGI_AGAIN;
+
+            if (code == 1) {
+                (void)memcpy(buf, slot->value, value_len);
+                buf[value_len] = '\0';
+            }
+        }
+
+        /* what was read holds if no writer came by meanwhile */
+        atomic_thread_fence(memory_order_acquire);
+
+    } while ((seq & 1)
+             || atomic_load_explicit(&sh->seq, memory_order_relaxed) != seq);
+
+    return code;
+}
+
+void
+agi_astdb_cache_put(const char *family, const char *key, int code,
+    const char *value, size_t len)
+{
+    char                    k[AGI_ASTDB_KEY_LEN];
+    size_t                  klen;
+    uint32_t                hash;
+    unsigned                seq;
+    agi_astdb_slot_t       *slot;
+    agi_astdb_shard_t      *sh;
+
+    if (agi_astdb_shards == NULL
+        || agi_astdb_key(family, key, k, &klen, &hash) == -1)
+    {
+        return;
+    }
+
+    /* too long to cache, and the entry it replaces is stale */
+    if (code == 1 && len >= AGI_ASTDB_VALUE_LEN) {
+        agi_astdb_cache_forget(family, key);
+        return;
+    }
+
+    sh = agi_astdb_shard(hash);
+    slot = agi_astdb_slot(sh, hash);
+
+    (void)pthread_mutex_lock(&sh->lock);
+
+    seq = atomic_load_explicit(&sh->seq, memory_order_relaxed);
+    atomic_store_explicit(&sh->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->hash = hash;
+    slot->generation = atomic_load(&agi_astdb_generation);
+    slot->expires = agi_astdb_now() + agi_astdb_ttl;
+    slot->code = (int16_t)code;
+    slot->key_len = (uint8_t)klen;
+    slot->value_len = code == 1 ? (uint8_t)len : 0;
+
+    (void)memcpy(slot->key, k, klen);
+
+    if (code == 1)
+        (void)memcpy(slot->value, value, len);
+
+    atomic_store_explicit(&sh->seq, seq + 2, memory_order_release);
+
+    (void)pthread_mutex_unlock(&sh->lock);
+}
+
+/* When what the key holds is not known */
+void
+agi_astdb_cache_forget(const char *family, const char *key)
+{
+    char                    k[AGI_ASTDB_KEY_LEN];
+    size_t                  len;
+    uint32_t                hash;
+    unsigned                seq;
+    agi_astdb_slot_t       *slot;
+    agi_astdb_shard_t      *sh;
+
+    if (agi_astdb_shards == NULL
+        || agi_astdb_key(family, key, k, &len, &hash) == -1)
+    {
+        return;
+    }
+
+    sh = agi_astdb_shard(hash);
+    slot = agi_astdb_slot(sh, hash);
+
+    (void)pthread_mutex_lock(&sh->lock);
+
+    if (slot->hash == hash) {
+        seq = atomic_load_explicit(&sh->seq, memory_order_relaxed);
+        atomic_store_explicit(&sh->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        slot->key_len = 0;
+
+        atomic_store_explicit(&sh->seq, seq + 2, memory_order_release);
+    }
+
+    (void)pthread_mutex_unlock(&sh->lock);
+}
+
+/* The keys of a tree are not known: all the entries go */
+void
+agi_astdb_cache_deltree(const char *family)
+{
+    (void)family;
+
+    if (agi_astdb_shards)
+        atomic_fetch_add_explicit(&agi_astdb_generation, 1,
+                                  memory_order_release);
+}
+
+/* "family/key", as AstDB itself names it, and its FNV-1a hash */
+static int
+agi_astdb_key(const char *family, const char *key, char *buf, size_t *len,
+    uint32_t *hash)
+{
+    size_t      i, flen, klen;
+    uint32_t    h;
+
+    flen = strlen(family);
+    klen = strlen(key);
+
+    if (flen + 1 + klen >= AGI_ASTDB_KEY_LEN)
+        return -1;
+
+    (void)memcpy(buf, family, flen);
+    buf[flen] = '/';
+    (void)memcpy(buf + flen + 1, key, klen);
+
+    *len = flen + 1 + klen;
+
+    h = 2166136261u;
+
+    for (i = 0; i < *len; i++) {
+        h ^= (unsigned char)buf[i];
+        h *= 16777619u;
+    }
+
+    *hash = h;
+
+    return 0;
+}
+
+static uint32_t
+agi_astdb_now(void)
+{
+    struct timespec     ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return (uint32_t)ts.tv_sec;
+}
@@ -0,0 +1,57 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Process-wide cache of the Asterisk database, read without locks
+ */
+
+#ifndef AGI_ASTDB_H
+#define AGI_ASTDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "agi_core.h"
+
+#define AGI_ASTDB_SHARDS        16      /* must be powers of 2 */
+#define AGI_ASTDB_SLOTS         64
+
+/* "family/key" and values longer than that are not cached */
+#define AGI_ASTDB_KEY_LEN       96
+#define AGI_ASTDB_VALUE_LEN     160
+
+/* an entry, the only one of its hash in the shard */
+typedef struct {
+    uint32_t                hash;
+    uint32_t                generation; /* of agi_astdb_cache_deltree() */
+    uint32_t                expires;    /* seconds, CLOCK_MONOTONIC */
+    int16_t                 code;       /* 1 with value, 0 for no key */
+    uint8_t                 key_len;    /* 0 for a free slot */
+    uint8_t                 value_len;
+    char                    key[AGI_ASTDB_KEY_LEN];
+    char                    value[AGI_ASTDB_VALUE_LEN];
+} agi_astdb_slot_t;
+
+/*
+ * Readers copy a slot out and retry when seq changed meanwhile, or was odd:
+ * a writer, holding lock, bumps it before and after writing.
+ */
+typedef struct {
+    atomic_uint             seq;
+    pthread_mutex_t         lock;
+
+    agi_astdb_slot_t        slots[AGI_ASTDB_SLOTS];
+} agi_astdb_shard_t;
+
+int agi_astdb_cache_init(unsigned ttl);
+
+int agi_astdb_cache_get(const char *family, const char *key, char *buf,
+    size_t size);
+void agi_astdb_cache_put(const char *family, const char *key, int code,
+    const char *value, size_t len);
+void agi_astdb_cache_forget(const char *family, const char *key);
+void agi_astdb_cache_deltree(const char *family);
+
+#endif /* AGI_ASTDB_H */
@@ -0,0 +1,188 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Pipelined AGI commands: N commands in one write, N replies matched in order
+ *
+ * Asterisk answers the commands of a connection strictly in order, so
+ * independent commands (set variable, verbose, set callerid, ...) can all be
+ * written at once and cost a single round trip instead of one each.
+ */
+
+#include <stdio.h>          /* vsnprintf */
+#include <stdarg.h>
+#include <string.h>         /* memcpy */
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "agi_batch.h"
+#include "agi_commands.h"
+#include "agi_coro.h"
+#include "agi_parse.h"
+#include "agi_session.h"
+#include "agi_varcache.h"
+#include "log.h"
+
+static int agi_batch_write(agi_session_t *s, agi_batch_t *b);
+static int agi_batch_push(agi_session_t *s, struct iovec *iov,
+    size_t iovcnt);
+
+void
+agi_batch_init(agi_batch_t *b)
+{
+    b->n = 0;
+    b->len = 0;
+}
+
+/*
+ * Queue a command (terminated with LF) without copying it; it must stay
+ * valid until agi_batch_send() returns
+ */
+int
+agi_batch_add(agi_batch_t *b, const char *command, size_t len)
+{
+    if (b->n == AGI_BATCH_MAX)
+        return AGI_BUSY;
+
+    b->iov[b->n].iov_base = (void *)command;
+    b->iov[b->n].iov_len = len;
+    b->n++;
+
+    return AGI_OK;
+}
+
+/* Format a command (terminated with LF) into the batch */
+int
+agi_batch_addf(agi_batch_t *b, const char *fmt, ...)
+{
+    int     n;
+    size_t  avail;
+    va_list args;
+
+    if (b->n == AGI_BATCH_MAX)
+        return AGI_BUSY;
+
+    avail = AGI_BATCH_BUF_LEN - b->len;
+
+    va_start(args, fmt);
+    n = vsnprintf(b->buf + b->len, avail, fmt, args);
+    va_end(args);
+
+    if (n < 0)
+        return AGI_ERROR;
+
+    if ((size_t)n >= avail)
+        return AGI_BUSY;
+
+    (void)agi_batch_add(b, b->buf + b->len, (size_t)n);
+    b->len += (size_t)n;
+
+    return AGI_OK;
+}
+
+/*
+ * Write every queued command at once and wait for their replies, stored in
+ * order in results[0 .. n). The results point into the session buffer and
+ * remain valid until the next command. The batch is empty again on return.
+ */
+int
+agi_batch_send(agi_session_t *s, agi_batch_t *b, agi_result_t *results)
+{
+    size_t  n;
+
+    n = b->n;
+
+    if (n == 0)
+        return 0;
+
+    if (agi_setvariable_flush(s) == -1) {
+        agi_batch_init(b);
+        return -1;
+    }
+
+    agi_varcache_flush(s);
+
+    if (agi_batch_write(s, b) == -1) {
+        agi_batch_init(b);
+        return -1;
+    }
+
+    agi_batch_init(b);
+
+    return agi_read_replies(s, results, n);
+}
+
+static int
+agi_batch_write(agi_session_t *s, agi_batch_t *b)
+{
+    size_t          iovcnt;
+    ssize_t         bytes;
+    struct iovec   *iov;
+
+    iov = b->iov;
+    iovcnt = b->n;
+
+    while (iovcnt) {
+        bytes = s->transport->sendv(s, iov, (int)iovcnt);
+
+        if (bytes == (ssize_t)-1) {
+            if (errno == EINTR)
+                continue;
+
+            /* the rest goes as agi_exchange_command() sends its command */
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && s->pushed)
+                return agi_batch_push(s, iov, iovcnt);
+
+            if ((errno == EAGAIN || errno == EWOULDBLOCK)
+                && agi_coro_wait(s) == 0)
+            {
+                continue;
+            }
+
+            log(LOG_ERR, "%s write failed", s->transport->name);
+            return -1;
+        }
+
+        /* skip what the kernel took, usually everything */
+        while (iovcnt && (size_t)bytes >= iov->iov_len) {
+            bytes -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + bytes;
+            iov->iov_len -= (size_t)bytes;
+        }
+    }
+
+    return 0;
+}
+
+/* the commands not sent yet, gathered in the session buffer for the ring */
+static int
+agi_batch_push(agi_session_t *s, struct iovec *iov, size_t iovcnt)
+{
+    char    *p;
+    size_t  i, len;
+
+    len = 0;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    p = agi_session_reserve(s, len);
+    if (p == NULL) {
+        log(LOG_ERR, "%s write failed", s->transport->name);
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        (void)memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    return agi_send_pushed(s, p - len, len);
+}
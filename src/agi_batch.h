@@ -0,0 +1,39 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Pipelined AGI commands: N commands in one write, N replies matched in order
+ */
+
+#ifndef AGI_BATCH_H
+#define AGI_BATCH_H
+
+#include <stddef.h>
+
+#include <sys/uio.h>        /* struct iovec */
+
+#include "agi_core.h"
+#include "agi_parse.h"     /* agi_result_t */
+
+#define AGI_BATCH_MAX       32
+
+/* storage for the commands formatted with agi_batch_addf() */
+#define AGI_BATCH_BUF_LEN   4096
+
+typedef struct {
+    struct iovec    iov[AGI_BATCH_MAX];
+    size_t          n;
+
+    size_t          len;            /* used bytes of buf */
+    char            buf[AGI_BATCH_BUF_LEN];
+} agi_batch_t;
+
+void agi_batch_init(agi_batch_t *b);
+
+int agi_batch_add(agi_batch_t *b, const char *command, size_t len);
+int agi_batch_addf(agi_batch_t *b, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+int agi_batch_send(agi_session_t *s, agi_batch_t *b,
+    agi_result_t *results);
+
+#endif /* AGI_BATCH_H */
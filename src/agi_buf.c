@@ -0,0 +1,176 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Per-connection read buffer framing AGI reply lines on LF
+ */
+
+#include <stdlib.h>
+#include <string.h>         /* memchr, memcpy, memmove */
+#include <errno.h>
+
+#include <sys/types.h>
+
+#include "agi_buf.h"
+#include "agi_core.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+#include "log.h"
+
+int
+agi_buf_init(agi_buf_t *b, agi_arena_t *arena, size_t size)
+{
+    b->start = NULL;
+    b->arena = arena;
+
+    if (size) {
+        b->start = arena ? agi_arena_alloc(arena, size) : malloc(size);
+        if (b->start == NULL) {
+            log(LOG_ERR, "malloc() failed");
+            return -1;
+        }
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + size;
+    b->scanned = b->start;
+
+    return 0;
+}
+
+/* memory from an arena is left to agi_arena_reset() */
+void
+agi_buf_free(agi_buf_t *b)
+{
+    if (b->arena == NULL)
+        free(b->start);
+
+    b->start = NULL;
+    b->pos = NULL;
+    b->last = NULL;
+    b->end = NULL;
+    b->scanned = NULL;
+}
+
+/*
+ * Make room for at least n bytes after last. Lines previously returned by
+ * agi_buf_line() are invalidated.
+ */
+int
+agi_buf_reserve(agi_buf_t *b, size_t n)
+{
+    char   *p;
+    size_t  len, scanned, size;
+
+    if ((size_t)(b->end - b->last) >= n)
+        return 0;
+
+    len = agi_buf_len(b);
+    scanned = (size_t)(b->scanned - b->pos);
+
+    /* compact: usually only the tail of a reply is left */
+    if (b->pos != b->start) {
+        if (len)
+            (void)memmove(b->start, b->pos, len);
+
+        b->pos = b->start;
+        b->last = b->start + len;
+        b->scanned = b->start + scanned;
+
+        if ((size_t)(b->end - b->last) >= n)
+            return 0;
+    }
+
+    size = b->start ? (size_t)(b->end - b->start) : AGI_BUF_SIZE;
+
+    while (size - len < n)
+        size *= 2;
+
+    if (size > AGI_BUF_MAX_SIZE) {
+        log(LOG_ERR, "agi reply longer than %d bytes", AGI_BUF_MAX_SIZE);
+        return -1;
+    }
+
+    if (b->arena)
+        p = agi_arena_realloc(b->arena, b->start,
+                              (size_t)(b->end - b->start), size);
+    else
+        p = realloc(b->start, size);
+
+    if (p == NULL) {
+        log(LOG_ERR, "realloc() failed");
+        return -1;
+    }
+
+    b->start = p;
+    b->pos = p;
+    b->last = p + len;
+    b->end = p + size;
+    b->scanned = p + scanned;
+
+    return 0;
+}
+
+int
+agi_buf_append(agi_buf_t *b, const char *p, size_t n)
+{
+    if (agi_buf_reserve(b, n) == -1)
+        return -1;
+
+    (void)memcpy(b->last, p, n);
+    b->last += n;
+
+    return 0;
+}
+
+/*
+ * One read from the transport of s into the free space of the buffer.
+ * Returns what recv() would have returned, with errno set on failure.
+ */
+ssize_t
+agi_buf_recv(agi_buf_t *b, agi_session_t *s)
+{
+    ssize_t                 bytes;
+    const agi_transport_t  *t = s->transport;
+
+    if (agi_buf_reserve(b, t->recv_size) == -1) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    bytes = t->recv(s, b->last, (size_t)(b->end - b->last));
+
+    if (bytes > 0)
+        b->last += bytes;
+
+    return bytes;
+}
+
+/*
+ * Return the next complete line, LF included, and consume it. The line is
+ * left in place and may be parsed and modified there; it remains valid until
+ * the next agi_buf_reserve(), agi_buf_append() or agi_buf_recv().
+ */
+char *
+agi_buf_line(agi_buf_t *b, size_t *len)
+{
+    char   *line, *lf;
+
+    if (b->scanned == b->last)
+        return NULL;
+
+    lf = memchr(b->scanned, AGI_LF, (size_t)(b->last - b->scanned));
+
+    if (lf == NULL) {
+        b->scanned = b->last;
+        return NULL;
+    }
+
+    line = b->pos;
+    *len = (size_t)(lf - line) + 1;
+
+    b->pos = lf + 1;
+    b->scanned = b->pos;
+
+    return line;
+}
@@ -0,0 +1,54 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Per-connection read buffer framing AGI reply lines on LF
+ */
+
+#ifndef AGI_BUF_H
+#define AGI_BUF_H
+
+#include <stddef.h>
+
+#include <sys/types.h>      /* ssize_t */
+
+#include "agi_core.h"
+#include "agi_pool.h"       /* agi_arena_t */
+
+#define AGI_BUF_SIZE        1024        /* initial size */
+#define AGI_BUF_MAX_SIZE    (1024 * 1024)
+
+/* free space asked for before every read */
+#define AGI_BUF_RECV_SIZE   512
+
+/*
+ *     start        pos               last             end
+ *       |  consumed |  unconsumed     |      free      |
+ *
+ * Bytes between pos and last outlive the command they arrived with, so a
+ * reply split over several reads or merged with the next one is framed
+ * correctly. The buffer is compacted, and only grown when compaction does
+ * not free enough space, right before a read.
+ */
+typedef struct {
+    char           *start;
+    char           *pos;
+    char           *last;
+    char           *end;
+
+    char           *scanned;    /* bytes before it are known to hold no LF */
+
+    agi_arena_t    *arena;      /* memory comes from the heap when NULL */
+} agi_buf_t;
+
+#define agi_buf_len(b)      ((size_t)((b)->last - (b)->pos))
+
+int agi_buf_init(agi_buf_t *b, agi_arena_t *arena, size_t size);
+void agi_buf_free(agi_buf_t *b);
+
+int agi_buf_reserve(agi_buf_t *b, size_t n);
+int agi_buf_append(agi_buf_t *b, const char *p, size_t n);
+ssize_t agi_buf_recv(agi_buf_t *b, agi_session_t *s);
+
+char *agi_buf_line(agi_buf_t *b, size_t *len);
+
+#endif /* AGI_BUF_H */
@@ -2,599 +2,1149 @@
  * Author: Romario Maxwell
  */
 
-#include <stdio.h>          /* BUFSIZ, snprintf */
-#include <stdlib.h>
-#include <string.h>         /* memcpy, strlen */
+#include <stdint.h>         /* uintptr_t */
+#include <string.h>         /* memcpy */
+
+#include "agi_commands.h"
+#include "agi_astdb.h"
+#include "agi_parse.h"      /* agi_result_t */
+#include "agi_session.h"
+#include "agi_varcache.h"
+#include "log.h"
+
+static char *agi_command_start(agi_session_t *s, const agi_command_desc_t *d,
+    char **end);
+static int agi_command_send(agi_session_t *s, const agi_command_desc_t *d,
+    char *p, agi_result_t *r);
+static int agi_command_value(char *buf, size_t size, agi_result_t *r);
+static size_t agi_base64_decode(char *dst, const char *src, size_t len);
+static int agi_setvariable_add(agi_session_t *s, const char *name,
+    const char *value);
+static int agi_database_put(agi_session_t *s, const char *family,
+    const char *key, const char *value);
+static char *agi_database_name(char *buf, const char *family,
+    const char *key);
+static char *agi_command_scratch(agi_session_t *s);
+static size_t agi_setvariable_next(agi_defer_t *d, size_t *off, char *buf);
+static void agi_setvariable_reply(agi_session_t *s, void *ctx, int rc,
+    agi_result_t *r);
+static void agi_setvariable_drop(agi_session_t *s, agi_defer_t *d, int rv);
+static int agi_defer_grow(agi_session_t *s, char **buf, size_t *size,
+    size_t need);
+static unsigned agi_database_pair(const char *name);
+static size_t agi_database_sent(agi_session_t *s, agi_defer_t *d,
+    const char *p, const char *end);
+static void agi_database_publish(const char *p, const char *end, int ok);
+static size_t agi_mset_len(const char *name, const char *value,
+    size_t *wire);
+static char *agi_mset_put(char *p, const char *name, const char *value);
+
+static char *agi_put(char *p, char *end, const char *v, size_t len);
+static char *agi_put_str(char *p, char *end, const char *v);
+static char *agi_put_qstr(char *p, char *end, const char *v);
+static char *agi_put_ostr(char *p, char *end, const char *v);
+static char *agi_put_long(char *p, char *end, long v);
+static char *agi_put_ulong(char *p, char *end, unsigned long v);
+static char *agi_put_bool(char *p, char *end, int v);
+
+#define AGI_COMMAND_DESC(name, verb, shape, cache, defer)                     \
+    { verb, sizeof verb - 1, AGI_COMMAND_LEN(name, verb),                     \
+      AGI_RESULT_##shape },
+
+const agi_command_desc_t agi_commands[AGI_CMD_MAX] = {
+    AGI_COMMANDS(AGI_COMMAND_DESC)
+};
+
+#define AGI_ARG_PUT_STR(v)      p = agi_put_str(p, end, v);
+#define AGI_ARG_PUT_QSTR(v)     p = agi_put_qstr(p, end, v);
+#define AGI_ARG_PUT_OSTR(v)     p = agi_put_ostr(p, end, v);
+#define AGI_ARG_PUT_INT(v)      p = agi_put_long(p, end, v);
+#define AGI_ARG_PUT_LONG(v)     p = agi_put_long(p, end, v);
+#define AGI_ARG_PUT_ULONG(v)    p = agi_put_ulong(p, end, v);
+#define AGI_ARG_PUT_OFF(v)      p = agi_put_long(p, end, (long)v);
+#define AGI_ARG_PUT_BOOL(v)     p = agi_put_bool(p, end, v);
+#define AGI_ARG_PUT_OUT(v)
+#define AGI_ARG_PUT_SIZE(v)
+
+#define AGI_ARG_PUT(type, name) AGI_ARG_PUT_##type(name)
+
+/* the variable cache key of the GET commands, NULL when not cached */
+#define AGI_CACHE_KEY_getvariable       variablename
+#define AGI_CACHE_KEY_getfullvariable   (chan ? NULL : name)
+
+/* before the command is formatted, see agi_varcache.c */
+#define AGI_CACHE_BEFORE_KEEP(cmd)
+#define AGI_CACHE_BEFORE_SET(cmd)                                             \
+    if (s->defer && s->defer->vars) {                                         \
+        rv = agi_setvariable_add(s, name, value);                             \
+        agi_varcache_set(s, name, value, rv);                                 \
+        return rv;                                                            \
+    }
+#define AGI_CACHE_BEFORE_FLUSH(cmd)                                           \
+    agi_varcache_flush(s);
+#define AGI_CACHE_BEFORE_GET(cmd)                                             \
+    rv = agi_varcache_get(s, AGI_CMD_##cmd, AGI_CACHE_KEY_##cmd, buf, size);  \
+    if (rv != AGI_AGAIN)                                                      \
+        return rv;
+#define AGI_CACHE_BEFORE_DBGET(cmd)                                           \
+    if (s->defer && s->defer->ndb && agi_setvariable_flush(s) == -1)          \
+        return -1;                                                            \
+    rv = agi_astdb_cache_get(family, key, buf, size);                         \
+    if (rv != AGI_AGAIN)                                                      \
+        return rv;
+#define AGI_CACHE_BEFORE_DBPUT(cmd)                                           \
+    rv = agi_database_put(s, family, key, value);                             \
+    if (rv != AGI_AGAIN)                                                      \
+        return rv;
+#define AGI_CACHE_BEFORE_DBDEL(cmd)
+#define AGI_CACHE_BEFORE_DBDELTREE(cmd)
+
+/* once replied, rv being -1 if it failed */
+#define AGI_CACHE_AFTER_KEEP(cmd)
+#define AGI_CACHE_AFTER_FLUSH(cmd)
+#define AGI_CACHE_AFTER_GET(cmd)                                              \
+    if (rv == 0)                                                              \
+        agi_varcache_put(s, AGI_CMD_##cmd, AGI_CACHE_KEY_##cmd, &r);
+#define AGI_CACHE_AFTER_SET(cmd)                                              \
+    agi_varcache_set(s, name, value, rv == 0 ? r.code : -1);
+#define AGI_CACHE_AFTER_DBGET(cmd)                                            \
+    if (rv == 0 && r.status == 200 && (r.code == 0 || r.code == 1))           \
+        agi_astdb_cache_put(family, key, r.code, r.value.data, r.value.len);
+#define AGI_CACHE_AFTER_DBPUT(cmd)                                            \
+    if (rv == 0 && r.code == 1) {                                             \
+        agi_astdb_cache_put(family, key, 1, value, strlen(value));            \
+    }                                                                         \
+    else {                                                                    \
+        agi_astdb_cache_forget(family, key);                                  \
+    }                                                                         \
+    agi_varcache_flush(s);
+#define AGI_CACHE_AFTER_DBDEL(cmd)                                            \
+    if (rv == 0 && r.code == 1) {                                             \
+        agi_astdb_cache_put(family, key, 0, NULL, 0);                         \
+    }                                                                         \
+    else {                                                                    \
+        agi_astdb_cache_forget(family, key);                                  \
+    }                                                                         \
+    agi_varcache_flush(s);
+#define AGI_CACHE_AFTER_DBDELTREE(cmd)                                        \
+    agi_astdb_cache_deltree(family);                                          \
+    agi_varcache_flush(s);
+
+/* then, the deferred writes the command may observe */
+#define AGI_DEFER_BEFORE_SYNC                                                 \
+    if (agi_setvariable_flush(s) == -1)                                       \
+        return -1;
+#define AGI_DEFER_BEFORE_NONE
+
+#define AGI_COMMAND_RESULT_CODE                                               \
+    return r.code;
+
+#define AGI_COMMAND_RESULT_VALUE                                              \
+    if (agi_command_value(buf, size, &r) == -1)                               \
+        return -1;                                                            \
+    return r.code;
 
-#include <sys/types.h>      /* off_t */
+/*
+ * The command is formatted straight into the session output buffer, one
+ * argument after the other, and sent from there
+ */
+#define AGI_COMMAND_DEFINE_CODE(name, shape, cache, defer)                    \
+int                                                                           \
+agi_command_##name(agi_session_t *s AGI_ARGS_##name(AGI_ARG_DECL))            \
+{                                                                             \
+    int              rv;                                                      \
+    char            *p, *end;                                                 \
+    agi_result_t     r;                                                       \
+                                                                              \
+    AGI_CACHE_BEFORE_##cache(name)                                            \
+    AGI_DEFER_BEFORE_##defer                                                  \
+                                                                              \
+    p = agi_command_start(s, &agi_commands[AGI_CMD_##name], &end);            \
+                                                                              \
+    AGI_ARGS_##name(AGI_ARG_PUT)                                              \
+                                                                              \
+    rv = agi_command_send(s, &agi_commands[AGI_CMD_##name], p, &r);           \
+                                                                              \
+    AGI_CACHE_AFTER_##cache(name)                                             \
+                                                                              \
+    if (rv == -1)                                                             \
+        return -1;                                                            \
+                                                                              \
+    AGI_COMMAND_RESULT_##shape                                                \
+}
 
-#include <linux/limits.h>   /* PATH_MAX */
+#define AGI_COMMAND_DEFINE_VALUE(name, shape, cache, defer)                   \
+    AGI_COMMAND_DEFINE_CODE(name, shape, cache, defer)
+#define AGI_COMMAND_DEFINE_CUSTOM(name, shape, cache, defer)
 
-#include "agi.h"
-#include "string.h"     /* strlcpy */
-#include "utils.h"      /* AST_XXX */
+#define AGI_COMMAND_DEFINE(name, verb, shape, cache, defer)                   \
+    AGI_COMMAND_DEFINE_##shape(name, shape, cache, defer)
 
-#define LF '\n'
+AGI_COMMANDS(AGI_COMMAND_DEFINE)
 
 /*
- * Reference the line "#define AGI_BUF_LEN 2048" in res/res_agi.c in the
- * Asterisk project
+ * The digits are the result itself rather than a value. digits must hold
+ * maxlen + 1 bytes: up to maxlen digits are stored, null-terminated, and
+ * those past them are dropped. Nothing is stored with maxlen below 0.
  */
-#define AGI_BUF_LEN 2048
+int
+agi_command_getdata(agi_session_t *s, const char *prompt, char *digits,
+    int maxlen, int timeout)
+{
+    char            *p, *end;
+    size_t           len;
+    agi_result_t     r;
 
-#define CMD_GET_DATA_LEN (sizeof "get data" - 1) + 1 + PATH_MAX + 1           \
-    + INT32_LEN + 1 + INT32_LEN
+    /* the prompt may well be read out of a variable */
+    if (agi_setvariable_flush(s) == -1)
+        return -1;
 
-#define CMD_HANGUP_LEN (sizeof "hangup" - 1) + 1 + AST_CHANNEL_NAME
+    p = agi_command_start(s, &agi_commands[AGI_CMD_getdata], &end);
 
-#define CMD_CHANNEL_STATUS_LEN (sizeof "channel status" - 1) + 1              \
-    + AST_CHANNEL_NAME
+    AGI_ARGS_getdata(AGI_ARG_PUT)
 
-#define CMD_SET_CONTEXT_LEN (sizeof "set context" - 1) + 1 + AST_MAX_CONTEXT
+    if (agi_command_send(s, &agi_commands[AGI_CMD_getdata], p, &r) == -1)
+        return -1;
 
-#define CMD_SET_EXTENSION_LEN (sizeof "set extension" - 1) + 1                \
-    + AST_MAX_EXTENSION
+    if (r.code != -1 && maxlen >= 0) {
+        /* the digits as sent: leading zeros are significant */
+        len = r.result.len < (size_t)maxlen ? r.result.len : (size_t)maxlen;
 
+        (void)memcpy(digits, r.result.data, len);
+        digits[len] = '\0';
+    }
+
+    return r.code;
+}
+
+/*
+ * Values of n variables in one round trip: "get full variable" of
+ *
+ *     ${BASE64_ENCODE(${name1})},${BASE64_ENCODE(${name2})},...
+ *
+ * the ',' never being part of a value once encoded. The values are decoded
+ * into buf, of size bytes, and values[i] views the value of names[i], empty
+ * for an unset variable. Returns 0, or -1 when a name cannot be sent, the
+ * command fails, or the encoded values do not fit in buf.
+ */
 int
-agi_command_exec(int fd, const char *application, const char *options)
+agi_command_getvariables(agi_session_t *s, char *buf, size_t size,
+    const char **names, unsigned n, agi_str_t *values)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
-
-    (void)snprintf(command, sizeof command,
-                   "exec %s %s" LF, application, options);
+    int          rc;
+    char         *expr, *p, *end, *field, *comma, *out;
+    size_t       len;
+    unsigned     i;
+
+    static const char   head[] = "${BASE64_ENCODE(${";
+    static const char   tail[] = "})}";
+
+    /*
+     * The expression shares the scratch buffer with the deferred writes:
+     * they are sent first, leaving nothing for the command to flush.
+     */
+    if (agi_setvariable_flush(s) == -1)
+        return -1;
+
+    expr = agi_command_scratch(s);
+    if (expr == NULL)
+        return -1;
+
+    p = expr;
+    end = expr + AGI_BUF_LEN;
+
+    for (i = 0; i < n; i++) {
+        len = strlen(names[i]);
+
+        /* a '}' would end the reference early */
+        if (memchr(names[i], '}', len) != NULL
+            || (size_t)(end - p) <= len + sizeof head + sizeof tail)
+        {
+            log(LOG_ERR, "agi variable \"%s\" cannot be fetched", names[i]);
+            return -1;
+        }
+
+        if (i)
+            *p++ = ',';
+
+        p = (char *)memcpy(p, head, sizeof head - 1) + sizeof head - 1;
+        p = (char *)memcpy(p, names[i], len) + len;
+        p = (char *)memcpy(p, tail, sizeof tail - 1) + sizeof tail - 1;
+    }
 
-    (void)agi_send_command(fd, command, result, data);
+    *p = '\0';
 
-    result_n = atoi(result);
+    rc = agi_command_getfullvariable(s, buf, size, expr, NULL);
+    if (rc == -1)
+        return -1;
 
-    return result_n;
-}
+    /* all of them empty, and the expression with them */
+    if (rc != 1)
+        buf[0] = '\0';
 
-int
-agi_command_getdata(int fd, const char *prompt, char *s, int maxlen,
-    int timeout)
-{
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[CMD_GET_DATA_LEN + 1];
+    /* decoding shrinks: each value lands behind what is still to be read */
+    field = buf;
+    out = buf;
 
-    (void)snprintf(command, sizeof command,
-                   "get data %s %d %d" LF, prompt, timeout, maxlen);
+    for (i = 0; i < n; i++) {
+        comma = strchr(field, ',');
+        len = comma ? (size_t)(comma - field) : strlen(field);
 
-    (void)agi_send_command(fd, command, result, data);
+        values[i].data = out;
+        values[i].len = agi_base64_decode(out, field, len);
 
-    result_n = atoi(result);
-    if (result_n != -1)
-        (void)strlcpy(s, result, 256); /* TODO: Remove magic number! */
+        out += values[i].len;
+        field = comma ? comma + 1 : field + len;
+    }
 
-    return result_n;
+    return 0;
 }
 
+/*
+ * From now on agi_command_setvariable() only records the variable, and
+ * returns 1 as Asterisk would. The writes go at once, in as few "exec MSet"
+ * as the line length and AGI_MSET_PAIRS allow, before the next command that
+ * may observe them (all but those marked NONE in AGI_COMMANDS()), any
+ * command sent as text or queued by agi_session_command(), and when a
+ * script spawned by agi_coro_spawn() returns. A script without one calls
+ * agi_setvariable_flush() before it is done.
+ */
 int
-agi_command_getfullvariable(int fd, char *buf, const char *name,
-    const char *chan)
+agi_setvariable_defer(agi_session_t *s)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    if (s->defer == NULL) {
+        s->defer = agi_arena_calloc(&s->arena, sizeof(agi_defer_t));
+        if (s->defer == NULL)
+            return -1;
+    }
 
-    (void)snprintf(command, sizeof command,
-                   "get full variable %s %s" LF, name, chan);
+    s->defer->vars = 1;
 
-    (void)agi_send_command(fd, command, result, data);
+    return 0;
+}
 
-    result_n = atoi(result);
+/*
+ * From now on, agi_command_databaseput() is held back as a DB() variable
+ * among the deferred writes and returns 1 at once: agi_database_flush()
+ * sends them. The database cache, which other sessions read, only gets the
+ * value once the MSet carrying it succeeded, and agi_command_databaseget()
+ * sends the pending puts before reading it.
+ */
+int
+agi_database_defer(agi_session_t *s)
+{
+    if (s->defer == NULL) {
+        s->defer = agi_arena_calloc(&s->arena, sizeof(agi_defer_t));
+        if (s->defer == NULL)
+            return -1;
+    }
 
-    if (result_n == 1)
-        /* remove parentheses around variable value */
-        (void)memcpy(buf, data + 1, strlen(data + 1) - 1);
+    s->defer->db = 1;
 
-    return result_n;
+    return 0;
 }
 
+/*
+ * Send the deferred writes, in order. On failure, those not sent are
+ * dropped: some of them may have been set already.
+ */
 int
-agi_command_streamfile(int fd, const char *filename,
-    const char *escapedigits, off_t sample_offset)
+agi_setvariable_flush(agi_session_t *s)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    int              rv;
+    char            *buf;
+    size_t           off, prev, len;
+    agi_result_t     r;
+    agi_defer_t     *d = s->defer;
+
+    if (d == NULL || d->npairs == 0)
+        return 0;
+
+    buf = agi_command_scratch(s);
+    if (buf == NULL) {
+        log(LOG_ERR, "agi deferred writes failed");
+        agi_setvariable_drop(s, d, -1);
+        return -1;
+    }
+
+    rv = 0;
+    off = 0;
+    prev = 0;
+
+    while (rv == 0 && (len = agi_setvariable_next(d, &off, buf)) != 0) {
+        if (len == (size_t)-1
+            || agi_exchange_command(s, buf, len, &r) == -1
+            || r.code < 0)
+        {
+            log(LOG_ERR, "agi deferred writes failed");
+            rv = -1;
+        }
 
-    (void)snprintf(command, sizeof command,
-                   "stream file %s %s" LF, filename, escapedigits);
+        /* some of them may have been set all the same */
+        agi_database_publish(d->pairs + prev, d->pairs + off, rv == 0);
 
-    (void)agi_send_command(fd, command, result, data);
+        d->ncommands++;
+        prev = off;
+    }
 
-    result_n = atoi(result);
+    agi_setvariable_drop(s, d, rv);
 
-    return result_n;
+    return rv;
 }
 
+/*
+ * agi_setvariable_flush() for agi_session_command(), which cannot wait: the
+ * deferred writes are queued ahead of its command of len bytes, moved along
+ * when formatted in place at s->out + s->out_len, and their replies only
+ * looked at for failures. AGI_BUSY when the pipeline cannot take them all,
+ * the rest being left for the next command.
+ */
 int
-agi_command_answer(int fd)
+agi_setvariable_queue(agi_session_t *s, int inplace, size_t len)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
+    int              rv;
+    char            *buf, *p;
+    size_t           off, prev, n, db;
+    unsigned         npairs, ndb;
+    agi_defer_t     *d = s->defer;
+
+    buf = agi_command_scratch(s);
+    if (buf == NULL) {
+        log(LOG_ERR, "agi deferred writes failed");
+        agi_setvariable_drop(s, d, -1);
+        return AGI_ERROR;
+    }
+
+    /* the commands below are queued as if nothing was deferred */
+    s->defer = NULL;
+
+    rv = AGI_OK;
+    off = 0;
+
+    for ( ;; ) {
+        /* the command itself needs a slot */
+        if (s->npending >= AGI_SESSION_PIPELINE - 1) {
+            rv = AGI_BUSY;
+            break;
+        }
+
+        prev = off;
+        npairs = d->npairs;
+        ndb = d->ndb;
+
+        n = agi_setvariable_next(d, &off, buf);
+
+        if (n == 0)
+            break;
+
+        if (n == (size_t)-1) {
+            rv = AGI_ERROR;
+            break;
+        }
+
+        /* the kernel is reading out, it may not move until done */
+        if (s->sending && s->out_len + n + len > s->out_size) {
+            off = prev;
+            d->npairs = npairs;
+            d->ndb = ndb;
+            rv = AGI_BUSY;
+            break;
+        }
+
+        p = agi_session_reserve(s, n + len);
+        if (p == NULL) {
+            rv = AGI_ERROR;
+            break;
+        }
+
+        if (inplace)
+            (void)memmove(p + n, p, len);
+
+        (void)memcpy(p, buf, n);
+
+        /* the puts it carries, for the reply to publish */
+        db = agi_database_sent(s, d, d->pairs + prev, d->pairs + off);
+
+        rv = agi_session_command(s, p, n, agi_setvariable_reply,
+                                 (void *)(uintptr_t)db);
+        if (rv != AGI_OK) {
+            d->sent_len -= db;
+            off = prev;
+            d->npairs = npairs;
+            d->ndb = ndb;
+            break;
+        }
+
+        d->ncommands++;
+    }
 
-    (void)agi_send_command(fd, "answer" LF, result, data);
+    s->defer = d;
 
-    result_n = atoi(result);
+    if (rv == AGI_ERROR) {
+        log(LOG_ERR, "agi deferred writes failed");
+        agi_setvariable_drop(s, d, -1);
+        return rv;
+    }
+
+    /* those queued are done with */
+    (void)memmove(d->pairs, d->pairs + off, d->len - off);
+    d->len -= off;
 
-    return result_n;
+    return rv;
 }
 
-int
-agi_command_noop(int fd)
+/*
+ * The session goes with writes still deferred: they are lost, which is
+ * worth a word. Puts queued without a reply may or may not be done, and
+ * their keys are forgotten.
+ */
+void
+agi_setvariable_abandon(agi_session_t *s)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
+    agi_defer_t     *d = s->defer;
+
+    if (d == NULL)
+        return;
 
-    (void)agi_send_command(fd, "noop" LF, result, data);
+    if (d->npairs)
+        log(LOG_ERR, "agi session closed with %u deferred writes not sent",
+            d->npairs);
 
-    result_n = atoi(result);
+    agi_database_publish(d->sent, d->sent + d->sent_len, 0);
 
-    return result_n;
+    d->sent_len = 0;
+
+    agi_setvariable_drop(s, d, 0);
 }
 
-int
-agi_command_hangup(int fd, const char *channelname)
+/*
+ * The next command sending the deferred writes from d->pairs + *off, with
+ * its LF, into buf of AGI_SCRATCH_LEN bytes: "exec MSet" for as many pairs
+ * as it can carry, up to AGI_MSET_PAIRS, or "set variable" for one it
+ * cannot. The pairs are gathered past the first AGI_BUF_LEN bytes, before
+ * being quoted into the command. *off is moved past the pairs taken.
+ * Returns the length, 0 when none is left, or -1 cast to size_t for a pair
+ * that cannot be sent at all, taken all the same.
+ */
+static size_t
+agi_setvariable_next(agi_defer_t *d, size_t *off, char *buf)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[CMD_HANGUP_LEN + 1];
-
-    if (channelname) {
-        (void)snprintf(command, sizeof command, "hangup %s" LF, channelname);
-        (void)agi_send_command(fd, command, result, data);
+    char                       *pairs, *a, *p, *end;
+    const char                 *q, *last, *name, *value, *next, *single;
+    size_t                      len, wire, total;
+    unsigned                    n;
+    const agi_command_desc_t   *c;
+
+    pairs = buf + AGI_BUF_LEN;
+    a = pairs;
+    total = 0;
+    n = 0;
+    single = NULL;
+
+    q = d->pairs + *off;
+    last = d->pairs + d->len;
+
+    while (q < last && n < AGI_MSET_PAIRS) {
+        name = q;
+        value = name + strlen(name) + 1;
+        next = value + strlen(value) + 1;
+
+        len = agi_mset_len(name, value, &wire);
+
+        if (len == 0 || wire > AGI_MSET_LEN) {
+            /* one that MSet cannot carry goes on its own */
+            if (a == pairs) {
+                single = name;
+                q = next;
+                d->npairs--;
+                d->ndb -= agi_database_pair(name);
+            }
+
+            break;
+        }
+
+        if (total + (a != pairs) + wire > AGI_MSET_LEN)
+            break;
+
+        if (a != pairs) {
+            *a++ = ',';
+            total++;
+        }
+
+        a = agi_mset_put(a, name, value);
+        total += wire;
+        n++;
+
+        q = next;
+        d->npairs--;
+        d->ndb -= agi_database_pair(name);
     }
-    else
-        (void)agi_send_command(fd, "hangup" LF, result, data);
 
-    result_n = atoi(result);
+    *off = (size_t)(q - d->pairs);
 
-    return result_n;
-}
+    if (a == pairs && single == NULL)
+        return 0;
 
-int
-agi_command_asyncagibreak(int fd)
-{
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
+    c = &agi_commands[single ? AGI_CMD_setvariable : AGI_CMD_exec];
 
-    (void)agi_send_command(fd, "asyncagi break" LF, result, data);
+    p = (char *)memcpy(buf, c->verb, c->verb_len) + c->verb_len;
+    end = buf + c->len - 1;
 
-    result_n = atoi(result);
+    if (single) {
+        p = agi_put_str(p, end, single);
+        p = agi_put_qstr(p, end, single + strlen(single) + 1);
+    }
+    else {
+        *a = '\0';
 
-    return result_n;
-}
+        p = agi_put_str(p, end, "MSet");
+        p = agi_put_qstr(p, end, pairs);
+    }
 
-int
-agi_command_channelstatus(int fd, const char *channelname)
-{
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[CMD_CHANNEL_STATUS_LEN + 1];
-
-    if (channelname) {
-        (void)snprintf(command, sizeof command,
-                       "channel status %s" LF, channelname);
-        
-        (void)agi_send_command(fd, command, result, data);
+    if (p == NULL) {
+        log(LOG_ERR, "agi command \"%s\" too long or holding a LF", c->verb);
+        return (size_t)-1;
     }
-    else
-        (void)agi_send_command(fd, "channel status" LF, result, data);
 
-    result_n = atoi(result);
+    *p++ = AGI_LF;
 
-    return result_n;
+    return (size_t)(p - buf);
 }
 
-int
-agi_command_databasedel(int fd)
+/*
+ * "exec MSet" is -2 when the application does not exist. Replies come in
+ * order: the puts of this one lead agi_defer_t.sent, ctx bytes of them.
+ */
+static void
+agi_setvariable_reply(agi_session_t *s, void *ctx, int rc, agi_result_t *r)
 {
-    return -1;
-}
+    int              ok;
+    size_t           n;
+    agi_defer_t     *d = s->defer;
 
-int
-agi_command_databasedeltree(int fd)
-{
-    return -1;
-}
+    ok = rc == AGI_OK && r->code >= 0;
+    n = (size_t)(uintptr_t)ctx;
 
-int
-agi_command_databaseget(int fd)
-{
-    return -1;
+    if (n) {
+        agi_database_publish(d->sent, d->sent + n, ok);
+
+        (void)memmove(d->sent, d->sent + n, d->sent_len - n);
+        d->sent_len -= n;
+    }
+
+    if (ok)
+        return;
+
+    log(LOG_ERR, "agi deferred writes failed");
+
+    agi_setvariable_drop(s, d, -1);
 }
 
-int
-agi_command_databaseput(int fd)
+/*
+ * Done with the deferred writes. The variable cache was written through with
+ * them: after a failure, what it holds may not have been set. The database
+ * cache only ever got what was.
+ */
+static void
+agi_setvariable_drop(agi_session_t *s, agi_defer_t *d, int rv)
 {
-    return -1;
+    d->len = 0;
+    d->npairs = 0;
+    d->ndb = 0;
+
+    if (rv == -1)
+        agi_varcache_flush(s);
 }
 
-int
-agi_command_getoption(int fd)
+/*
+ * AGI_SCRATCH_LEN bytes of the session arena, kept for the session, where
+ * text too long for the stack is formatted before it is sent
+ */
+static char *
+agi_command_scratch(agi_session_t *s)
 {
-    return -1;
+    if (s->scratch == NULL)
+        s->scratch = agi_session_alloc(s, AGI_SCRATCH_LEN);
+
+    return s->scratch;
 }
 
-int
-agi_command_getvariable(int fd, char *buf, const char *variablename)
+/*
+ * Reserve the worst case length of the command and write its verb. end is
+ * left one byte short of the reservation for the terminating LF.
+ */
+static char *
+agi_command_start(agi_session_t *s, const agi_command_desc_t *d, char **end)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
-
-    (void)snprintf(command, sizeof command, "get variable %s" LF, variablename);
+    char   *p;
 
-    (void)agi_send_command(fd, command, result, data);
+    p = agi_session_reserve(s, d->len);
+    if (p == NULL) {
+        *end = NULL;
+        return NULL;
+    }
 
-    result_n = atoi(result);
+    *end = p + d->len - 1;
 
-    if (result_n == 1)
-        /* remove parentheses around variable value */
-        (void)memcpy(buf, data + 1, strlen(data + 1) - 1);
+    (void)memcpy(p, d->verb, d->verb_len);
 
-    return result_n;
+    return p + d->verb_len;
 }
 
-int
-agi_command_receivechar(int fd, unsigned long timeout)
+static int
+agi_command_send(agi_session_t *s, const agi_command_desc_t *d, char *p,
+    agi_result_t *r)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    char   *command;
 
-    (void)snprintf(command, sizeof command, "receive char %lu" LF, timeout);
+    if (p == NULL) {
+        log(LOG_ERR, "agi command \"%s\" too long or holding a LF", d->verb);
+        return -1;
+    }
 
-    (void)agi_send_command(fd, command, result, data);
+    *p++ = AGI_LF;
 
-    result_n = atoi(result);
+    command = s->out + s->out_len;
 
-    return result_n;
+    return agi_exchange_command(s, command, (size_t)(p - command), r);
 }
 
-int
-agi_command_receivetext(int fd)
+static int
+agi_command_value(char *buf, size_t size, agi_result_t *r)
 {
-    return -1;
-}
+    if (r->code != 1)
+        return 0;
 
-int
-agi_command_recordfile(int fd)
-{
-    return -1;
-}
+    if (r->value.len >= size) {
+        log(LOG_ERR, "agi value of %zu bytes does not fit in %zu",
+            r->value.len, size);
+        return -1;
+    }
 
-int
-agi_command_sayalpha(int fd)
-{
-    return -1;
+    /* the value without the parentheses around it */
+    (void)memcpy(buf, r->value.data, r->value.len);
+    buf[r->value.len] = '\0';
+
+    return 0;
 }
 
-int
-agi_command_saydigits(int fd, const char *number,
-    const char *escape_digits)
+static int
+agi_setvariable_add(agi_session_t *s, const char *name, const char *value)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    size_t           n;
+    agi_defer_t     *d = s->defer;
 
-    (void)snprintf(command, sizeof command,
-                   "say digits %s %s" LF, number, escape_digits);
+    n = strlen(name) + strlen(value) + 2;
 
-    (void)agi_send_command(fd, command, result, data);
+    if (agi_defer_grow(s, &d->pairs, &d->size, d->len + n) == -1)
+        return -1;
 
-    result_n = atoi(result);
+    n = strlen(name) + 1;
+    (void)memcpy(d->pairs + d->len, name, n);
+    d->len += n;
 
-    return result_n;
-}
+    n = strlen(value) + 1;
+    (void)memcpy(d->pairs + d->len, value, n);
+    d->len += n;
 
-int
-agi_command_saynumber(int fd)
-{
-    return -1;
-}
+    d->npairs++;
+    d->ndb += agi_database_pair(name);
+    d->nsets++;
 
-int
-agi_command_sayphonetic(int fd)
-{
-    return -1;
+    return 1;
 }
 
-int
-agi_command_saydate(int fd, unsigned long date, const char *escape_digits)
+/* a buffer of the session arena, grown to hold need bytes */
+static int
+agi_defer_grow(agi_session_t *s, char **buf, size_t *size, size_t need)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    char    *p;
+    size_t   n;
+
+    if (need <= *size)
+        return 0;
 
-    (void)snprintf(command, sizeof command,
-                   "say data %lu %s" LF, date, escape_digits);
+    n = *size ? *size : 256;
 
-    (void)agi_send_command(fd, command, result, data);
+    while (n < need)
+        n *= 2;
 
-    result_n = atoi(result);
+    p = agi_arena_realloc(&s->arena, *buf, *size, n);
+    if (p == NULL)
+        return -1;
 
-    return result_n;
+    *buf = p;
+    *size = n;
+
+    return 0;
 }
 
-int
-agi_command_saytime(int fd, unsigned long time, const char *escapedigits)
+/*
+ * Queue the put as "DB(family/key)" when deferring, and empty the variable
+ * cache, ${DB()} being a variable too. The database cache waits for the put
+ * to be done. AGI_AGAIN when it has to be sent.
+ */
+static int
+agi_database_put(agi_session_t *s, const char *family, const char *key,
+    const char *value)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
-
-    (void)snprintf(command, sizeof command,
-                   "say time %lu %s" LF, time, escapedigits);
+    int      rv;
+    char     name[AGI_ASTDB_KEY_LEN + sizeof "DB()"];
+
+    if (s->defer == NULL || !s->defer->db)
+        return AGI_AGAIN;
+
+    /* what the function argument could not hold, or the cache key */
+    if (family[strcspn(family, "(),/")] != '\0'
+        || key[strcspn(key, "(),")] != '\0'
+        || agi_database_name(name, family, key) == NULL)
+    {
+        return AGI_AGAIN;
+    }
 
-    (void)agi_send_command(fd, command, result, data);
+    rv = agi_setvariable_add(s, name, value);
+    if (rv != 1)
+        return rv;
 
-    result_n = atoi(result);
+    agi_varcache_flush(s);
 
-    return result_n;
+    return rv;
 }
 
-int
-agi_command_saydatetime(int fd)
+/* 1 for a "DB(family/key)" variable, else 0 */
+static unsigned
+agi_database_pair(const char *name)
 {
-    return -1;
+    return strncmp(name, "DB(", 3) == 0;
 }
 
-int
-agi_command_sendimage(int fd)
+/*
+ * Append the DB() pairs between p and end to agi_defer_t.sent, and return
+ * their length. Failing that, their keys are forgotten at once: whether the
+ * puts are done is never to be known.
+ */
+static size_t
+agi_database_sent(agi_session_t *s, agi_defer_t *d, const char *p,
+    const char *end)
 {
-    return -1;
-}
+    size_t       n, len;
+    const char  *next;
 
-int
-agi_command_sendtext(int fd)
-{
-    return -1;
-}
+    len = 0;
 
-int
-agi_command_setautohangup(int fd, unsigned long time)
-{
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    for ( ; p < end; p = next) {
+        next = p + strlen(p) + 1;
+        next += strlen(next) + 1;
+
+        if (!agi_database_pair(p))
+            continue;
 
-    (void)snprintf(command, sizeof command, "set autohangup %lu" LF, time);
+        n = (size_t)(next - p);
 
-    (void)agi_send_command(fd, command, result, data);
+        if (agi_defer_grow(s, &d->sent, &d->sent_size, d->sent_len + n) == -1)
+        {
+            agi_database_publish(p, next, 0);
+            continue;
+        }
 
-    result_n = atoi(result);
+        (void)memcpy(d->sent + d->sent_len, p, n);
+        d->sent_len += n;
+        len += n;
+    }
 
-    return result_n;
+    return len;
 }
 
-int
-agi_command_setcallerid(int fd, const char *number)
+/*
+ * The DB() pairs between p and end into the database cache once set, or out
+ * of it when they may or may not have been
+ */
+static void
+agi_database_publish(const char *p, const char *end, int ok)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    char         family[AGI_ASTDB_KEY_LEN], *key;
+    size_t       len;
+    const char  *value;
 
-    (void)snprintf(command, sizeof command, "set callerid %s" LF, number);
+    for ( ; p < end; p = value + strlen(value) + 1) {
+        value = p + strlen(p) + 1;
 
-    (void)agi_send_command(fd, command, result, data);
+        if (!agi_database_pair(p))
+            continue;
 
-    result_n = atoi(result);
+        /* "DB(family/key)", split as func_db.c does, at the first '/' */
+        len = strlen(p + 3);
 
-    return result_n;
-}
+        if (len == 0 || len > sizeof family || p[3 + len - 1] != ')')
+            continue;
 
-int
-agi_command_setcontext(int fd, const char *context)
-{
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[CMD_SET_CONTEXT_LEN + 1];
-
-    (void)snprintf(command, sizeof command, "set context %s" LF, context);
+        (void)memcpy(family, p + 3, len - 1);
+        family[len - 1] = '\0';
 
-    (void)agi_send_command(fd, command, result, data);
+        key = strchr(family, '/');
+        if (key == NULL)
+            continue;
 
-    result_n = atoi(result);
+        *key++ = '\0';
 
-    return result_n;
+        if (ok)
+            agi_astdb_cache_put(family, key, 1, value, strlen(value));
+        else
+            agi_astdb_cache_forget(family, key);
+    }
 }
 
-int
-agi_command_setextension(int fd, const char *extension)
+/* "DB(family/key)" into buf, NULL when too long */
+static char *
+agi_database_name(char *buf, const char *family, const char *key)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[CMD_SET_EXTENSION_LEN + 1];
+    size_t  flen, klen;
 
-    (void)snprintf(command, sizeof command, "set extension %s" LF, extension);
+    flen = strlen(family);
+    klen = strlen(key);
 
-    (void)agi_send_command(fd, command, result, data);
+    if (flen + 1 + klen >= AGI_ASTDB_KEY_LEN)
+        return NULL;
 
-    result_n = atoi(result);
+    (void)memcpy(buf, "DB(", 3);
+    (void)memcpy(buf + 3, family, flen);
+    buf[3 + flen] = '/';
+    (void)memcpy(buf + 4 + flen, key, klen);
+    (void)memcpy(buf + 4 + flen + klen, ")", 2);
 
-    return result_n;
+    return buf;
 }
 
-int
-agi_command_setmusic(int fd)
+/*
+ * MSet splits its argument at ',' outside of parentheses, and unescapes and
+ * unquotes it: ',' and parentheses are escaped in values, and the rest of
+ * what it would alter is left to "set variable". Returns the length of
+ * "name=value" with its escapes, or 0, and in wire that once escaped again
+ * by agi_put_qstr().
+ */
+static size_t
+agi_mset_len(const char *name, const char *value, size_t *wire)
 {
-    return -1;
-}
+    size_t          len, vlen;
+    unsigned        escapes;
+    const char     *v;
 
-int
-agi_command_setpriority(int fd, const char *priority)
-{
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    len = strcspn(name, "=,\"\\");
+
+    if (len == 0 || name[len] != '\0')
+        return 0;
 
-    (void)snprintf(command, sizeof command, "set priority %s" LF, priority);
+    vlen = strlen(value);
 
-    (void)agi_send_command(fd, command, result, data);
+    if (vlen && (value[0] == ' ' || value[vlen - 1] == ' '))
+        return 0;
 
-    result_n = atoi(result);
+    escapes = 0;
 
-    return result_n;
+    for (v = value; *v; v++) {
+        if (*v == '"' || *v == '\\')
+            return 0;
+
+        if (*v == ',' || *v == '(' || *v == ')')
+            escapes++;
+    }
+
+    len += 1 + vlen + escapes;
+    *wire = len + escapes;
+
+    return len;
 }
 
-int
-agi_command_setvariable(int fd, const char *name, const char *value)
+static char *
+agi_mset_put(char *p, const char *name, const char *value)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    size_t  len;
+
+    len = strlen(name);
+    p = (char *)memcpy(p, name, len) + len;
 
-    (void)snprintf(command, sizeof command,
-                   "set variable %s %s" LF, name, value);
+    *p++ = '=';
 
-    (void)agi_send_command(fd, command, result, data);
+    for ( ; *value; value++) {
+        if (*value == ',' || *value == '(' || *value == ')')
+            *p++ = '\\';
 
-    result_n = atoi(result);
+        *p++ = *value;
+    }
 
-    return result_n;
+    return p;
 }
 
-int
-agi_command_controlstreamfile(int fd)
+/* in place when dst is src: four characters read for three bytes written */
+static size_t
+agi_base64_decode(char *dst, const char *src, size_t len)
 {
-    return -1;
+    int             c;
+    size_t          i, n;
+    unsigned        bits, nbits;
+
+    bits = 0;
+    nbits = 0;
+    n = 0;
+
+    for (i = 0; i < len; i++) {
+        c = (unsigned char)src[i];
+
+        if (c >= 'A' && c <= 'Z') {
+            c -= 'A';
+        }
+        else if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 26;
+        }
+        else if (c >= '0' && c <= '9') {
+            c -= '0' - 52;
+        }
+        else if (c == '+') {
+            c = 62;
+        }
+        else if (c == '/') {
+            c = 63;
+        }
+        else {
+            /* '=' padding */
+            break;
+        }
+
+        bits = bits << 6 | (unsigned)c;
+        nbits += 6;
+
+        if (nbits >= 8) {
+            nbits -= 8;
+            dst[n++] = (char)(bits >> nbits);
+        }
+    }
+
+    return n;
 }
 
-int
-agi_command_tddmode(int fd, int boolean)
-{
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
+/*
+ * The agi_put_*() functions append one argument, preceded by a space, and
+ * return where the next one goes, or NULL if it does not fit before end.
+ * They pass a NULL p through so that arguments can be chained unchecked.
+ */
 
-    if (boolean)
-        (void)agi_send_command(fd, "tdd mode on" LF, result, data);
-    else
-        (void)agi_send_command(fd, "tdd mode off" LF, result, data);
+static char *
+agi_put(char *p, char *end, const char *v, size_t len)
+{
+    if (p == NULL || (size_t)(end - p) < len + 1)
+        return NULL;
 
-    result_n = atoi(result);
+    *p++ = ' ';
+    (void)memcpy(p, v, len);
 
-    return result_n;
+    return p + len;
 }
 
-int
-agi_command_verbose(int fd, const char *message, int level)
+/* a LF would end the command early, and let the rest through as another */
+static char *
+agi_put_str(char *p, char *end, const char *v)
 {
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    if (*v == '\0')
+        return agi_put(p, end, "\"\"", 2);
 
-    (void)snprintf(command, sizeof command, "verbose %s %d" LF, message, level);
+    if (p == NULL || p == end)
+        return NULL;
 
-    (void)agi_send_command(fd, command, result, data);
+    *p++ = ' ';
 
-    result_n = atoi(result);
+    for ( ; *v; v++) {
+        if (p == end || *v == AGI_LF)
+            return NULL;
 
-    return result_n;
-}
+        *p++ = *v;
+    }
 
-int
-agi_command_waitfordigit(int fd)
-{
-    return -1;
+    return p;
 }
 
-int
-agi_command_speechcreate(int fd)
+static char *
+agi_put_qstr(char *p, char *end, const char *v)
 {
-    return -1;
-}
+    if (p == NULL || end - p < 3)
+        return NULL;
 
-int
-agi_command_speechset(int fd, const char *name, const char *value)
-{
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
-    char    command[AGI_BUF_LEN];
+    *p++ = ' ';
+    *p++ = '"';
 
-    (void)snprintf(command, sizeof command, "speech set %s %s" LF, name, value);
+    for ( ; *v; v++) {
+        if (*v == AGI_LF)
+            return NULL;
 
-    (void)agi_send_command(fd, command, result, data);
+        if (*v == '"' || *v == '\\') {
+            if (p == end)
+                return NULL;
 
-    result_n = atoi(result);
+            *p++ = '\\';
+        }
 
-    return result_n;
-}
+        if (p == end)
+            return NULL;
 
-int
-agi_command_speechdestroy(int fd)
-{
-    int     result_n;
-    char    result[BUFSIZ];
-    char    data[BUFSIZ];
+        *p++ = *v;
+    }
 
-    (void)agi_send_command(fd, "speech destroy" LF, result, data);
+    if (p == end)
+        return NULL;
 
-    result_n = atoi(result);
+    *p++ = '"';
 
-    return result_n;
+    return p;
 }
 
-int
-agi_command_speechloadgrammar(int fd)
+static char *
+agi_put_ostr(char *p, char *end, const char *v)
 {
-    return -1;
-}
+    if (v == NULL)
+        return p;
 
-int
-agi_command_speechunloadgrammar(int fd)
-{
-    return -1;
+    return agi_put_str(p, end, v);
 }
 
-int
-agi_command_speechactivategrammar(int fd)
+static char *
+agi_put_long(char *p, char *end, long v)
 {
-    return -1;
-}
+    char            tmp[INT64_LEN], *t;
+    unsigned long   n;
 
-int
-agi_command_speechdeactivategrammar(int fd)
-{
-    return -1;
+    n = v < 0 ? 0UL - (unsigned long)v : (unsigned long)v;
+    t = tmp + sizeof tmp;
+
+    do {
+        *--t = (char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+
+    if (v < 0)
+        *--t = '-';
+
+    return agi_put(p, end, t, (size_t)(tmp + sizeof tmp - t));
 }
 
-int
-agi_command_speechrecognize(int fd)
+static char *
+agi_put_ulong(char *p, char *end, unsigned long v)
 {
-    return -1;
+    char    tmp[INT64_LEN], *t;
+
+    t = tmp + sizeof tmp;
+
+    do {
+        *--t = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    return agi_put(p, end, t, (size_t)(tmp + sizeof tmp - t));
 }
 
-int
-agi_command_gosub(int fd)
+static char *
+agi_put_bool(char *p, char *end, int v)
 {
-    return -1;
+    if (v)
+        return agi_put(p, end, "on", sizeof "on" - 1);
+
+    return agi_put(p, end, "off", sizeof "off" - 1);
 }
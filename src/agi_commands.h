@@ -0,0 +1,373 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * AGI command descriptor table
+ *
+ * Every AGI command is described once, below; the descriptors, the
+ * prototypes and the agi_command_*() functions are all expanded from it.
+ */
+
+#ifndef AGI_COMMANDS_H
+#define AGI_COMMANDS_H
+
+#include <stddef.h>
+
+#include <sys/types.h>      /* off_t */
+
+#include "agi_core.h"
+#include "utils.h"          /* INT32_LEN, INT64_LEN */
+
+/*
+ * Reference the line "#define AGI_BUF_LEN 2048" in res/res_agi.c in the
+ * Asterisk project
+ */
+#define AGI_BUF_LEN 2048
+
+/*
+ * X(name, verb, result shape, variable cache, deferred writes)
+ *
+ *  CODE    the function returns result=<n>
+ *  VALUE   as CODE, and copies the text inside the parentheses into the
+ *          caller's buffer of size bytes when <n> is 1, or returns -1 when
+ *          it does not fit there with its null byte
+ *  CUSTOM  the function is written by hand out of the same descriptor
+ *
+ *  KEEP    leaves channel variables alone
+ *  FLUSH   may change them: the cache is emptied
+ *  GET     reads one, from the cache when it holds it
+ *  SET     writes one, and the cache with it
+ *
+ * and for the Asterisk database, cached process-wide by agi_astdb.c:
+ *
+ *  DBGET   reads a key, from the cache when it holds it
+ *  DBPUT   writes one, and the cache with it
+ *  DBDEL   deletes one, and its entry with it
+ *  DBDELTREE   deletes a tree, and all the entries
+ *
+ * See agi_varcache.c. Whether a command changes variables and whether it
+ * observes them differ: "say digits" changes none, yet its prompt may read
+ * one, or the dialplan running on hangup. As to the writes held back by
+ * agi_setvariable_defer() and agi_database_defer():
+ *
+ *  SYNC    they are sent before the command, which may observe them
+ *  NONE    the command observes neither variables nor the database
+ */
+#define AGI_COMMANDS(X)                                                       \
+    X(answer,                  "answer",                                      \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(asyncagibreak,           "asyncagi break",                              \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(channelstatus,           "channel status",                              \
+                               CODE,   KEEP,      NONE)                       \
+    X(controlstreamfile,       "control stream file",                         \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(databasedel,             "database del",                                \
+                               CODE,   DBDEL,     SYNC)                       \
+    X(databasedeltree,         "database deltree",                            \
+                               CODE,   DBDELTREE, SYNC)                       \
+    X(databaseget,             "database get",                                \
+                               VALUE,  DBGET,     SYNC)                       \
+    X(databaseput,             "database put",                                \
+                               CODE,   DBPUT,     SYNC)                       \
+    X(exec,                    "exec",                                        \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(getdata,                 "get data",                                    \
+                               CUSTOM, KEEP,      SYNC)                       \
+    X(getfullvariable,         "get full variable",                           \
+                               VALUE,  GET,       SYNC)                       \
+    X(getoption,               "get option",                                  \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(getvariable,             "get variable",                                \
+                               VALUE,  GET,       SYNC)                       \
+    X(gosub,                   "gosub",                                       \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(hangup,                  "hangup",                                      \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(noop,                    "noop",                                        \
+                               CODE,   KEEP,      NONE)                       \
+    X(receivechar,             "receive char",                                \
+                               CODE,   KEEP,      SYNC)                       \
+    X(receivetext,             "receive text",                                \
+                               VALUE,  KEEP,      SYNC)                       \
+    X(recordfile,              "record file",                                 \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(sayalpha,                "say alpha",                                   \
+                               CODE,   KEEP,      SYNC)                       \
+    X(saydigits,               "say digits",                                  \
+                               CODE,   KEEP,      SYNC)                       \
+    X(saynumber,               "say number",                                  \
+                               CODE,   KEEP,      SYNC)                       \
+    X(sayphonetic,             "say phonetic",                                \
+                               CODE,   KEEP,      SYNC)                       \
+    X(saydate,                 "say date",                                    \
+                               CODE,   KEEP,      SYNC)                       \
+    X(saytime,                 "say time",                                    \
+                               CODE,   KEEP,      SYNC)                       \
+    X(saydatetime,             "say datetime",                                \
+                               CODE,   KEEP,      SYNC)                       \
+    X(sendimage,               "send image",                                  \
+                               CODE,   KEEP,      SYNC)                       \
+    X(sendtext,                "send text",                                   \
+                               CODE,   KEEP,      SYNC)                       \
+    X(setautohangup,           "set autohangup",                              \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(setcallerid,             "set callerid",                                \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(setcontext,              "set context",                                 \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(setextension,            "set extension",                               \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(setmusic,                "set music",                                   \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(setpriority,             "set priority",                                \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(setvariable,             "set variable",                                \
+                               CODE,   SET,       SYNC)                       \
+    X(speechactivategrammar,   "speech activate grammar",                     \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(speechcreate,            "speech create",                               \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(speechdeactivategrammar, "speech deactivate grammar",                   \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(speechdestroy,           "speech destroy",                              \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(speechloadgrammar,       "speech load grammar",                         \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(speechrecognize,         "speech recognize",                            \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(speechset,               "speech set",                                  \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(speechunloadgrammar,     "speech unload grammar",                       \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(streamfile,              "stream file",                                 \
+                               CODE,   FLUSH,     SYNC)                       \
+    X(tddmode,                 "tdd mode",                                    \
+                               CODE,   KEEP,      SYNC)                       \
+    X(verbose,                 "verbose",                                     \
+                               CODE,   KEEP,      NONE)                       \
+    X(waitfordigit,            "wait for digit",                              \
+                               CODE,   KEEP,      SYNC)
+/*
+ * Arguments of each command, in the order they are sent and passed
+ *
+ *  STR     a single word, sent as is
+ *  QSTR    free text, sent quoted and escaped
+ *  OSTR    an optional word, left out when NULL
+ *  INT     int
+ *  LONG    long
+ *  ULONG   unsigned long
+ *  OFF     off_t
+ *  BOOL    int sent as "on" or "off"
+ *  OUT     char * receiving the VALUE of the reply, not sent
+ *  SIZE    size_t, the size of the OUT buffer, not sent
+ */
+#define AGI_ARGS_answer(A)
+#define AGI_ARGS_asyncagibreak(A)
+#define AGI_ARGS_channelstatus(A)                                             \
+    A(OSTR, channelname)
+#define AGI_ARGS_controlstreamfile(A)                                         \
+    A(STR, filename) A(QSTR, escape_digits) A(OSTR, options)
+#define AGI_ARGS_databasedel(A)                                               \
+    A(STR, family) A(STR, key)
+#define AGI_ARGS_databasedeltree(A)                                           \
+    A(STR, family) A(OSTR, keytree)
+#define AGI_ARGS_databaseget(A)                                               \
+    A(OUT, buf) A(SIZE, size) A(STR, family) A(STR, key)
+#define AGI_ARGS_databaseput(A)                                               \
+    A(STR, family) A(STR, key) A(QSTR, value)
+#define AGI_ARGS_exec(A)                                                      \
+    A(STR, application) A(QSTR, options)
+#define AGI_ARGS_getdata(A)                                                   \
+    A(STR, prompt) A(INT, timeout) A(INT, maxlen)
+#define AGI_ARGS_getfullvariable(A)                                           \
+    A(OUT, buf) A(SIZE, size) A(QSTR, name) A(OSTR, chan)
+#define AGI_ARGS_getoption(A)                                                 \
+    A(STR, filename) A(QSTR, escape_digits) A(INT, timeout)
+#define AGI_ARGS_getvariable(A)                                               \
+    A(OUT, buf) A(SIZE, size) A(STR, variablename)
+#define AGI_ARGS_gosub(A)                                                     \
+    A(STR, context) A(STR, extension) A(STR, priority) A(OSTR, arguments)
+#define AGI_ARGS_hangup(A)                                                    \
+    A(OSTR, channelname)
+#define AGI_ARGS_noop(A)
+#define AGI_ARGS_receivechar(A)                                               \
+    A(ULONG, timeout)
+#define AGI_ARGS_receivetext(A)                                               \
+    A(OUT, buf) A(SIZE, size) A(ULONG, timeout)
+#define AGI_ARGS_recordfile(A)                                                \
+    A(STR, filename) A(STR, format) A(QSTR, escape_digits) A(INT, timeout)    \
+    A(OFF, sample_offset) A(OSTR, options)
+#define AGI_ARGS_sayalpha(A)                                                  \
+    A(STR, number) A(QSTR, escape_digits)
+#define AGI_ARGS_saydigits(A)                                                 \
+    A(STR, number) A(QSTR, escape_digits)
+#define AGI_ARGS_saynumber(A)                                                 \
+    A(LONG, number) A(QSTR, escape_digits) A(OSTR, gender)
+#define AGI_ARGS_sayphonetic(A)                                               \
+    A(STR, string) A(QSTR, escape_digits)
+#define AGI_ARGS_saydate(A)                                                   \
+    A(ULONG, date) A(QSTR, escape_digits)
+#define AGI_ARGS_saytime(A)                                                   \
+    A(ULONG, time) A(QSTR, escape_digits)
+#define AGI_ARGS_saydatetime(A)                                               \
+    A(ULONG, time) A(QSTR, escape_digits) A(OSTR, format) A(OSTR, zone)
+#define AGI_ARGS_sendimage(A)                                                 \
+    A(STR, image)
+#define AGI_ARGS_sendtext(A)                                                  \
+    A(QSTR, text)
+#define AGI_ARGS_setautohangup(A)                                             \
+    A(ULONG, time)
+#define AGI_ARGS_setcallerid(A)                                               \
+    A(QSTR, number)
+#define AGI_ARGS_setcontext(A)                                                \
+    A(STR, context)
+#define AGI_ARGS_setextension(A)                                              \
+    A(STR, extension)
+#define AGI_ARGS_setmusic(A)                                                  \
+    A(BOOL, on) A(OSTR, music_class)
+#define AGI_ARGS_setpriority(A)                                               \
+    A(STR, priority)
+#define AGI_ARGS_setvariable(A)                                               \
+    A(STR, name) A(QSTR, value)
+#define AGI_ARGS_speechactivategrammar(A)                                     \
+    A(STR, grammar)
+#define AGI_ARGS_speechcreate(A)                                              \
+    A(STR, engine)
+#define AGI_ARGS_speechdeactivategrammar(A)                                   \
+    A(STR, grammar)
+#define AGI_ARGS_speechdestroy(A)
+#define AGI_ARGS_speechloadgrammar(A)                                         \
+    A(STR, grammar) A(STR, path)
+#define AGI_ARGS_speechrecognize(A)                                           \
+    A(STR, prompt) A(INT, timeout) A(OSTR, offset)
+#define AGI_ARGS_speechset(A)                                                 \
+    A(STR, name) A(QSTR, value)
+#define AGI_ARGS_speechunloadgrammar(A)                                       \
+    A(STR, grammar)
+#define AGI_ARGS_streamfile(A)                                                \
+    A(STR, filename) A(QSTR, escape_digits) A(OFF, sample_offset)
+#define AGI_ARGS_tddmode(A)                                                   \
+    A(BOOL, on)
+#define AGI_ARGS_verbose(A)                                                   \
+    A(QSTR, message) A(INT, level)
+#define AGI_ARGS_waitfordigit(A)                                              \
+    A(INT, timeout)
+
+#define AGI_ARG_TYPE_STR    const char *
+#define AGI_ARG_TYPE_QSTR   const char *
+#define AGI_ARG_TYPE_OSTR   const char *
+#define AGI_ARG_TYPE_INT    int
+#define AGI_ARG_TYPE_LONG   long
+#define AGI_ARG_TYPE_ULONG  unsigned long
+#define AGI_ARG_TYPE_OFF    off_t
+#define AGI_ARG_TYPE_BOOL   int
+#define AGI_ARG_TYPE_OUT    char *
+#define AGI_ARG_TYPE_SIZE   size_t
+
+/* worst case length of an argument, separating space included */
+#define AGI_ARG_LEN_STR     AGI_BUF_LEN
+#define AGI_ARG_LEN_QSTR    AGI_BUF_LEN
+#define AGI_ARG_LEN_OSTR    AGI_BUF_LEN
+#define AGI_ARG_LEN_INT     (1 + INT32_LEN)
+#define AGI_ARG_LEN_LONG    (1 + INT64_LEN)
+#define AGI_ARG_LEN_ULONG   (1 + INT64_LEN)
+#define AGI_ARG_LEN_OFF     (1 + INT64_LEN)
+#define AGI_ARG_LEN_BOOL    (sizeof " off" - 1)
+#define AGI_ARG_LEN_OUT     0
+#define AGI_ARG_LEN_SIZE    0
+
+#define AGI_ARG_DECL(type, name)    , AGI_ARG_TYPE_##type name
+#define AGI_ARG_LEN(type, name)     + AGI_ARG_LEN_##type
+
+/* verb, arguments and LF, capped to what Asterisk reads in one go */
+#define AGI_COMMAND_LEN(name, verb)                                           \
+    ((sizeof verb - 1 AGI_ARGS_##name(AGI_ARG_LEN) + 1) < AGI_BUF_LEN         \
+     ? (sizeof verb - 1 AGI_ARGS_##name(AGI_ARG_LEN) + 1) : AGI_BUF_LEN)
+
+enum {
+    AGI_RESULT_CODE = 0,
+    AGI_RESULT_VALUE,
+    AGI_RESULT_CUSTOM
+};
+
+#define AGI_COMMAND_ENUM(name, verb, shape, cache, defer)  AGI_CMD_##name,
+
+enum {
+    AGI_COMMANDS(AGI_COMMAND_ENUM)
+    AGI_CMD_MAX
+};
+
+typedef struct {
+    const char     *verb;       /* sent as is, ahead of the arguments */
+    size_t          verb_len;
+    size_t          len;        /* worst case command length */
+    unsigned        shape;
+} agi_command_desc_t;
+
+extern const agi_command_desc_t agi_commands[AGI_CMD_MAX];
+
+/*
+ * "set variable" commands held back by agi_setvariable_defer(), and
+ * "database put" by agi_database_defer() as DB(family/key) variables; name
+ * and value each NUL-terminated, one pair after the other
+ */
+struct agi_defer_s {
+    char                   *pairs;
+    size_t                  len;
+    size_t                  size;
+    unsigned                npairs;
+    unsigned                ndb;        /* DB() pairs among them */
+
+    /* DB() pairs queued by agi_setvariable_queue(), awaiting their reply */
+    char                   *sent;
+    size_t                  sent_len;
+    size_t                  sent_size;
+
+    unsigned long           nsets;      /* writes deferred */
+    unsigned long           ncommands;  /* and the commands they took */
+
+    unsigned                vars:1;     /* agi_setvariable_defer() */
+    unsigned                db:1;       /* agi_database_defer() */
+};
+
+/*
+ * room for the quoted pairs of "exec MSet \"...\"", Asterisk reading lines
+ * of up to AGI_BUF_LEN - 1 bytes, LF included
+ */
+#define AGI_MSET_LEN                                                          \
+    (AGI_BUF_LEN - 2 - (sizeof "exec MSet \"\"" - 1))
+
+/*
+ * and for no more pairs than MSet parses: 99, or 24 in older Asterisk
+ * releases, the rest being folded into the value of the last one
+ */
+#define AGI_MSET_PAIRS  24
+
+/* a command line, and the MSet pairs it is formatted from */
+#define AGI_SCRATCH_LEN     (AGI_BUF_LEN + AGI_MSET_LEN + 1)
+
+#define AGI_COMMAND_PROTO_CODE(name)                                          \
+    int agi_command_##name(agi_session_t *s AGI_ARGS_##name(AGI_ARG_DECL));
+#define AGI_COMMAND_PROTO_VALUE(name)   AGI_COMMAND_PROTO_CODE(name)
+#define AGI_COMMAND_PROTO_CUSTOM(name)
+
+#define AGI_COMMAND_PROTO(name, verb, shape, cache, defer)                    \
+    AGI_COMMAND_PROTO_##shape(name)
+
+AGI_COMMANDS(AGI_COMMAND_PROTO)
+
+int agi_command_getdata(agi_session_t *s, const char *prompt, char *digits,
+    int maxlen, int timeout);
+int agi_command_getvariables(agi_session_t *s, char *buf, size_t size,
+    const char **names, unsigned n, agi_str_t *values);
+
+int agi_setvariable_defer(agi_session_t *s);
+int agi_database_defer(agi_session_t *s);
+int agi_setvariable_flush(agi_session_t *s);
+int agi_setvariable_queue(agi_session_t *s, int inplace, size_t len);
+void agi_setvariable_abandon(agi_session_t *s);
+
+/* deferred variables and database writes are one queue */
+#define agi_database_flush(s)   agi_setvariable_flush(s)
+
+#endif /* AGI_COMMANDS_H */
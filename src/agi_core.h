@@ -0,0 +1,45 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Definitions shared by the AGI event, session and transport code
+ */
+
+#ifndef AGI_CORE_H
+#define AGI_CORE_H
+
+#include <stddef.h>         /* size_t */
+#include <string.h>         /* memcmp */
+
+#define AGI_OK          0
+#define AGI_ERROR      -1
+#define AGI_AGAIN      -2
+#define AGI_BUSY       -3
+#define AGI_DONE       -4
+
+#define AGI_LF          '\n'
+
+/* a string that is not null-terminated, usually a view into a buffer */
+typedef struct {
+    const char             *data;
+    size_t                  len;
+} agi_str_t;
+
+#define agi_string(lit)     { lit, sizeof lit - 1 }
+
+#define agi_str_eq(s, lit)                                                    \
+    ((s)->len == sizeof lit - 1 && memcmp((s)->data, lit, sizeof lit - 1) == 0)
+
+typedef struct agi_event_s          agi_event_t;
+typedef struct agi_event_loop_s     agi_event_loop_t;
+typedef struct agi_listener_s       agi_listener_t;
+typedef struct agi_session_s        agi_session_t;
+typedef struct agi_pool_s           agi_pool_t;
+typedef struct agi_sched_s          agi_sched_t;
+typedef struct agi_uring_s          agi_uring_t;
+typedef struct agi_transport_s      agi_transport_t;
+typedef struct agi_env_s            agi_env_t;
+typedef struct agi_env_extra_s      agi_env_extra_t;
+typedef struct agi_module_gen_s     agi_module_gen_t;
+typedef struct agi_defer_s          agi_defer_t;
+
+#endif /* AGI_CORE_H */
@@ -0,0 +1,178 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Coroutines running blocking-style AGI scripts on the event loop
+ *
+ * A script spawned on a session runs on a small stack of its own and calls
+ * the agi_command_*() functions as it would over a blocking socket. When
+ * send() or recv() would block, agi_coro_wait() switches back to the event
+ * loop, which switches to the script again on the next event of the session
+ * so that it retries. One thread thus holds as many dialogs as it has stacks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <ucontext.h>
+
+#include <sys/mman.h>
+
+#include "agi_commands.h"
+#include "agi_coro.h"
+#include "agi_session.h"
+#include "log.h"
+
+static void agi_coro_main(void);
+static void agi_coro_switch(agi_coro_t *co);
+
+/* the coroutine running on this thread, if any */
+static __thread agi_coro_t     *agi_coro_current;
+
+/*
+ * Run handler on a coroutine of s, up to its first wait. The session is
+ * closed once handler returns. s must be driven by an event loop.
+ */
+int
+agi_coro_spawn(agi_session_t *s, agi_coro_handler_pt handler,
+    size_t stack_size)
+{
+    char        *mem;
+    size_t       page, size;
+    agi_coro_t  *co;
+
+    if (s->loop == NULL || s->coro) {
+        log(LOG_ERR, "no coroutine for session %d", s->ev.fd);
+        return -1;
+    }
+
+    if (stack_size == 0)
+        stack_size = AGI_CORO_STACK_SIZE;
+
+    page = (size_t)sysconf(_SC_PAGESIZE);
+
+    /* a guard page, the stack, and the coroutine at the top */
+    size = page + stack_size + sizeof(agi_coro_t);
+    size = (size + page - 1) & ~(page - 1);
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        log(LOG_ERR, "mmap() failed");
+        return -1;
+    }
+
+    /* an overflow faults rather than corrupting the next mapping */
+    if (mprotect(mem, page, PROT_NONE) == -1)
+        log(LOG_ERR, "mprotect() failed, coroutine stack has no guard");
+
+    co = (agi_coro_t *)(mem + size - sizeof(agi_coro_t));
+
+    (void)memset(co, 0, sizeof *co);
+
+    co->session = s;
+    co->handler = handler;
+    co->mem = mem;
+    co->mem_size = size;
+
+    if (getcontext(&co->ctx) == -1) {
+        log(LOG_ERR, "getcontext() failed");
+        (void)munmap(mem, size);
+        return -1;
+    }
+
+    co->ctx.uc_stack.ss_sp = mem + page;
+    co->ctx.uc_stack.ss_size = (size_t)((char *)co - (mem + page));
+    co->ctx.uc_link = &co->caller;
+
+    makecontext(&co->ctx, agi_coro_main, 0);
+
+    s->coro = co;
+
+    agi_coro_switch(co);
+
+    return 0;
+}
+
+/* called by the event loop on any event of the session */
+void
+agi_coro_resume(agi_coro_t *co)
+{
+    if (!co->waiting)
+        return;
+
+    co->waiting = 0;
+
+    agi_coro_switch(co);
+}
+
+/*
+ * Called by the blocking I/O functions on EAGAIN. Returns 0 once the socket
+ * had an event, or -1 when not on a coroutine of s, the caller then failing
+ * as it would have without coroutines.
+ */
+int
+agi_coro_wait(agi_session_t *s)
+{
+    agi_coro_t  *co = s->coro;
+
+    if (co == NULL || co != agi_coro_current)
+        return -1;
+
+    co->waiting = 1;
+
+    if (swapcontext(&co->ctx, &co->caller) == -1) {
+        log(LOG_ERR, "swapcontext() failed");
+        co->waiting = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Called when the session is freed. A coroutine still waiting is dropped
+ * along with its stack: whatever its script allocated on the heap leaks.
+ */
+void
+agi_coro_free(agi_coro_t *co)
+{
+    if (!co->done)
+        log(LOG_ERR, "session %d freed with its script waiting",
+            co->session->ev.fd);
+
+    (void)munmap(co->mem, co->mem_size);
+}
+
+static void
+agi_coro_main(void)
+{
+    agi_coro_t  *co = agi_coro_current;
+
+    co->handler(co->session);
+
+    /* Asterisk goes on with the dialplan once the script is done */
+    if (!co->session->closing)
+        (void)agi_setvariable_flush(co->session);
+
+    co->done = 1;
+
+    /* returns to co->caller through uc_link */
+}
+
+static void
+agi_coro_switch(agi_coro_t *co)
+{
+    agi_coro_t  *prev;
+
+    prev = agi_coro_current;
+    agi_coro_current = co;
+
+    if (swapcontext(&co->caller, &co->ctx) == -1)
+        log(LOG_ERR, "swapcontext() failed");
+
+    agi_coro_current = prev;
+
+    if (co->done)
+        agi_session_close(co->session);
+}
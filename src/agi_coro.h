@@ -0,0 +1,40 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Coroutines running blocking-style AGI scripts on the event loop
+ */
+
+#ifndef AGI_CORO_H
+#define AGI_CORO_H
+
+#include <stddef.h>
+
+#include <ucontext.h>
+
+#include "agi_core.h"
+
+#define AGI_CORO_STACK_SIZE     (64 * 1024)
+
+typedef void (*agi_coro_handler_pt)(agi_session_t *s);
+
+typedef struct {
+    ucontext_t              ctx;
+    ucontext_t              caller;     /* the event loop, while running */
+
+    agi_session_t          *session;
+    agi_coro_handler_pt     handler;
+
+    void                   *mem;        /* guard page, stack and this */
+    size_t                  mem_size;
+
+    unsigned                waiting:1;  /* for the socket, in agi_coro_wait() */
+    unsigned                done:1;
+} agi_coro_t;
+
+int agi_coro_spawn(agi_session_t *s, agi_coro_handler_pt handler,
+    size_t stack_size);
+void agi_coro_resume(agi_coro_t *co);
+int agi_coro_wait(agi_session_t *s);
+void agi_coro_free(agi_coro_t *co);
+
+#endif /* AGI_CORO_H */
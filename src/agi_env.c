@@ -0,0 +1,417 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Compact AGI environment, made of offsets into the text it was parsed from
+ */
+
+#include <stdlib.h>         /* atoi, strtol, realloc */
+#include <string.h>         /* memcmp, memset */
+
+#include "agi_env.h"
+#include "log.h"
+
+static int agi_env_argument(const char *name, size_t len);
+static int agi_env_set_arg(agi_env_t *env, agi_arena_t *arena, unsigned n,
+    agi_env_str_t *value);
+static int agi_env_extra_add(agi_env_t *env, agi_arena_t *arena,
+    unsigned hash, agi_env_str_t *name, agi_env_str_t *value);
+static size_t agi_env_put(char *out, size_t size, size_t n,
+    const char *name, size_t name_len, const char *value, size_t value_len);
+
+/*
+ * Perfect hash of the known variable names, generated by
+ * misc/agi_env_hash.py. A name lands in slot
+ *
+ *     ((hash >> AGI_ENV_HASH_SHIFT) + agi_env_disp[hash & mask]) % NFIELDS
+ *
+ * and no two known names share a slot, so a single comparison tells whether
+ * the variable is known.
+ */
+
+/* generated by misc/agi_env_hash.py: begin */
+
+#define AGI_ENV_NBUCKETS    16
+
+static const unsigned char agi_env_disp[AGI_ENV_NBUCKETS] = {
+     0,  6,  0,  9,  1,  0,  2,  0,
+     3,  0,  6,  0, 18,  0,  4,  0,
+};
+
+static const agi_env_field_t agi_env_fields[AGI_ENV_NFIELDS] = {
+    { agi_string("language"), AGI_ENV_LANGUAGE },
+    { agi_string("calleridname"), AGI_ENV_CALLERIDNAME },
+    { agi_string("channel"), AGI_ENV_CHANNEL },
+    { agi_string("type"), AGI_ENV_TYPE },
+    { agi_string("priority"), AGI_ENV_PRIORITY },
+    { agi_string("callingpres"), AGI_ENV_CALLINGPRES },
+    { agi_string("uniqueid"), AGI_ENV_UNIQUEID },
+    { agi_string("dnid"), AGI_ENV_DNID },
+    { agi_string("threadid"), AGI_ENV_THREADID },
+    { agi_string("network_script"), AGI_ENV_NETWORK_SCRIPT },
+    { agi_string("callingani2"), AGI_ENV_CALLINGANI2 },
+    { agi_string("version"), AGI_ENV_VERSION },
+    { agi_string("network"), AGI_ENV_NETWORK },
+    { agi_string("callingtns"), AGI_ENV_CALLINGTNS },
+    { agi_string("callington"), AGI_ENV_CALLINGTON },
+    { agi_string("callerid"), AGI_ENV_CALLERID },
+    { agi_string("request"), AGI_ENV_REQUEST },
+    { agi_string("context"), AGI_ENV_CONTEXT },
+    { agi_string("rdnis"), AGI_ENV_RDNIS },
+    { agi_string("enhanced"), AGI_ENV_ENHANCED },
+    { agi_string("extension"), AGI_ENV_EXTENSION },
+    { agi_string("accountcode"), AGI_ENV_ACCOUNTCODE },
+};
+
+/* generated by misc/agi_env_hash.py: end */
+
+void
+agi_env_init(agi_env_t *env)
+{
+    (void)memset(env, 0, sizeof *env);
+}
+
+void
+agi_env_free(agi_env_t *env)
+{
+    free(env->argv);
+    free(env->extra);
+
+    agi_env_init(env);
+}
+
+const agi_env_field_t *
+agi_env_field(unsigned hash, const char *name, size_t len)
+{
+    const agi_env_field_t  *f;
+
+    f = &agi_env_fields[((hash >> AGI_ENV_HASH_SHIFT)
+                         + agi_env_disp[hash & (AGI_ENV_NBUCKETS - 1)])
+                        % AGI_ENV_NFIELDS];
+
+    if (f->name.len != len || memcmp(f->name.data, name, len) != 0)
+        return NULL;
+
+    return f;
+}
+
+/*
+ * Store the variable the parser has just returned, whose value must have
+ * been null-terminated in buf. Variables that are neither known nor
+ * agi_arg_<n> go to the extra table. buf must stay under AGI_ENV_MAX_LEN.
+ * Both argv and the extra table come from arena, or the heap when NULL.
+ *
+ * Returns 0, -1 when out of memory, or AGI_BUSY when the extra table is
+ * full: the variable is left out and env->overflow set.
+ */
+int
+agi_env_set(agi_env_t *env, agi_arena_t *arena, const agi_env_parser_t *ep,
+    const char *buf)
+{
+    unsigned                n;
+    const char             *name, *value;
+    agi_env_str_t           s, v;
+    const agi_env_field_t  *f;
+
+    s.off = (uint16_t)ep->variable_start;
+    s.len = (uint16_t)(ep->variable_end - ep->variable_start);
+
+    v.off = (uint16_t)ep->value_start;
+    v.len = (uint16_t)(ep->value_end - ep->value_start);
+
+    name = buf + s.off;
+    value = buf + v.off;
+
+    f = agi_env_field(ep->hash, name, s.len);
+
+    if (f) {
+        env->str[f->field] = v;
+
+        switch (f->field) {
+        case AGI_ENV_NETWORK:
+            env->network_n = v.len == 3 && memcmp(value, "yes", 3) == 0;
+            break;
+
+        case AGI_ENV_PRIORITY:
+            env->priority_n = atoi(value);
+            break;
+
+        case AGI_ENV_THREADID:
+            env->threadid_n = strtol(value, (char **)NULL, 10);
+            break;
+
+        case AGI_ENV_ENHANCED:
+            env->enhanced_n = v.len == 3 && memcmp(value, "1.0", 3) == 0;
+            break;
+
+        default:
+            break;
+        }
+
+        return 0;
+    }
+
+    n = (unsigned)agi_env_argument(name, s.len);
+
+    if (n)
+        return agi_env_set_arg(env, arena, n, &v);
+
+    return agi_env_extra_add(env, arena, ep->hash, &s, &v);
+}
+
+/* value of a field, or NULL if Asterisk did not send it */
+const char *
+agi_env_get(const agi_env_t *env, const char *buf, unsigned field)
+{
+    if (env->str[field].off == 0)
+        return NULL;
+
+    return buf + env->str[field].off;
+}
+
+/* value of agi_arg_<n>, or NULL */
+const char *
+agi_env_arg(const agi_env_t *env, const char *buf, unsigned n)
+{
+    if (n == 0 || n > env->argc || env->argv[n - 1].off == 0)
+        return NULL;
+
+    return buf + env->argv[n - 1].off;
+}
+
+/* value of a variable without a field, looked up by its name sans "agi_" */
+const char *
+agi_env_extra_get(const agi_env_t *env, const char *buf, const char *name)
+{
+    unsigned                i, n, hash;
+    size_t                  len;
+    const agi_env_var_t    *v;
+
+    if (env->extra == NULL)
+        return NULL;
+
+    hash = 0;
+
+    for (len = 0; name[len]; len++)
+        hash = agi_env_hash(hash, name[len]);
+
+    i = hash & (AGI_ENV_EXTRA - 1);
+
+    for (n = 0; n < AGI_ENV_EXTRA; n++) {
+        v = &env->extra->vars[i];
+
+        if (v->name.len == 0)
+            return NULL;
+
+        if (v->hash == (uint16_t)hash && v->name.len == len
+            && memcmp(buf + v->name.off, name, len) == 0)
+        {
+            return buf + v->value.off;
+        }
+
+        i = (i + 1) & (AGI_ENV_EXTRA - 1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Format env back into AGI environment text, one "agi_<name>: <value>" line
+ * per variable and the blank line, as long as it fits in size bytes.
+ * Returns the length of the whole text, as snprintf() does. The variables
+ * come in another order than Asterisk sent them, and the lines that did
+ * not parse are lost.
+ */
+size_t
+agi_env_format(const agi_env_t *env, const char *buf, char *out, size_t size)
+{
+    char                    name[sizeof "arg_127"];
+    size_t                  n, len;
+    unsigned                i, a;
+    const agi_env_var_t    *v;
+    const agi_env_str_t    *s;
+    const agi_env_field_t  *f;
+
+    n = 0;
+
+    for (i = 0; i < AGI_ENV_NFIELDS; i++) {
+        f = &agi_env_fields[i];
+        s = &env->str[f->field];
+
+        if (s->off)
+            n = agi_env_put(out, size, n, f->name.data, f->name.len,
+                            buf + s->off, s->len);
+    }
+
+    for (i = 0; i < env->argc; i++) {
+        s = &env->argv[i];
+
+        if (s->off == 0)
+            continue;
+
+        /* "arg_<n>" */
+        (void)memcpy(name, "arg_", 4);
+
+        len = 4;
+        a = i + 1;
+
+        if (a >= 100)
+            name[len++] = (char)('0' + a / 100);
+        if (a >= 10)
+            name[len++] = (char)('0' + a / 10 % 10);
+
+        name[len++] = (char)('0' + a % 10);
+
+        n = agi_env_put(out, size, n, name, len, buf + s->off, s->len);
+    }
+
+    for (i = 0; env->extra && i < AGI_ENV_EXTRA; i++) {
+        v = &env->extra->vars[i];
+
+        if (v->name.len)
+            n = agi_env_put(out, size, n, buf + v->name.off, v->name.len,
+                            buf + v->value.off, v->value.len);
+    }
+
+    if (n < size)
+        out[n] = AGI_LF;
+
+    return n + 1;
+}
+
+/* one line at out + n, if it fits; returns the length up to its end */
+static size_t
+agi_env_put(char *out, size_t size, size_t n, const char *name,
+    size_t name_len, const char *value, size_t value_len)
+{
+    size_t  len;
+
+    len = sizeof "agi_: \n" - 1 + name_len + value_len;
+
+    if (n + len <= size) {
+        out += n;
+
+        (void)memcpy(out, "agi_", 4);
+        (void)memcpy(out + 4, name, name_len);
+
+        out += 4 + name_len;
+
+        *out++ = ':';
+        *out++ = ' ';
+
+        (void)memcpy(out, value, value_len);
+
+        out[value_len] = AGI_LF;
+    }
+
+    return n + len;
+}
+
+/* n of agi_arg_<n>, or 0 */
+static int
+agi_env_argument(const char *name, size_t len)
+{
+    int     n;
+    size_t  i;
+
+    if (len < sizeof "arg_1" - 1 || len > sizeof "arg_127" - 1
+        || memcmp(name, "arg_", 4) != 0 || name[4] == '0')
+    {
+        return 0;
+    }
+
+    n = 0;
+
+    for (i = 4; i < len; i++) {
+        if (name[i] < '0' || name[i] > '9')
+            return 0;
+
+        n = n * 10 + name[i] - '0';
+    }
+
+    return n <= AGI_ENV_ARGS ? n : 0;
+}
+
+/*
+ * Arguments come in order, so argv grows to the number actually sent rather
+ * than to AGI_ENV_ARGS
+ */
+static int
+agi_env_set_arg(agi_env_t *env, agi_arena_t *arena, unsigned n,
+    agi_env_str_t *value)
+{
+    unsigned        nalloc;
+    agi_env_str_t  *argv;
+
+    if (n > env->nalloc) {
+        nalloc = env->nalloc ? env->nalloc : 4;
+
+        while (nalloc < n)
+            nalloc *= 2;
+
+        if (arena)
+            argv = agi_arena_realloc(arena, env->argv,
+                                     env->nalloc * sizeof *argv,
+                                     nalloc * sizeof *argv);
+        else
+            argv = realloc(env->argv, nalloc * sizeof *argv);
+
+        if (argv == NULL) {
+            log(LOG_ERR, "realloc() failed");
+            return -1;
+        }
+
+        (void)memset(argv + env->nalloc, 0,
+                     (nalloc - env->nalloc) * sizeof *argv);
+
+        env->argv = argv;
+        env->nalloc = (uint16_t)nalloc;
+    }
+
+    env->argv[n - 1] = *value;
+
+    if (n > env->argc)
+        env->argc = (uint16_t)n;
+
+    return 0;
+}
+
+static int
+agi_env_extra_add(agi_env_t *env, agi_arena_t *arena, unsigned hash,
+    agi_env_str_t *name, agi_env_str_t *value)
+{
+    unsigned            i;
+    agi_env_var_t      *v;
+    agi_env_extra_t    *x;
+
+    x = env->extra;
+
+    if (x == NULL) {
+        x = arena ? agi_arena_calloc(arena, sizeof *x) : calloc(1, sizeof *x);
+        if (x == NULL) {
+            log(LOG_ERR, "calloc() failed");
+            return -1;
+        }
+
+        env->extra = x;
+    }
+
+    if (x->nvars == AGI_ENV_EXTRA) {
+        log(LOG_ERR, "more than %d unknown agi variables", AGI_ENV_EXTRA);
+        env->overflow = 1;
+        return AGI_BUSY;
+    }
+
+    i = hash & (AGI_ENV_EXTRA - 1);
+
+    while (x->vars[i].name.len)
+        i = (i + 1) & (AGI_ENV_EXTRA - 1);
+
+    v = &x->vars[i];
+    v->hash = (uint16_t)hash;
+    v->name = *name;
+    v->value = *value;
+
+    x->nvars++;
+
+    return 0;
+}
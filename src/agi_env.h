@@ -0,0 +1,126 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Compact AGI environment, made of offsets into the text it was parsed from
+ */
+
+#ifndef AGI_ENV_H
+#define AGI_ENV_H
+
+#include <assert.h>          /* static_assert */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "agi_core.h"
+#include "agi_parse.h"      /* agi_env_parser_t */
+#include "agi_pool.h"       /* agi_arena_t */
+
+/*
+ * Hash of a variable name without its "agi_" prefix, computed by the
+ * environment parser as the name goes by. misc/agi_env_hash.py depends on
+ * it: regenerate the table in agi_env.c after changing it.
+ */
+#define agi_env_hash(key, c)    ((unsigned)(key) * 31 + (unsigned char)(c))
+
+#define AGI_ENV_HASH_SHIFT      8
+
+/* offsets are 16 bits wide */
+#define AGI_ENV_MAX_LEN         65536
+
+#define AGI_ENV_ARGS            127     /* agi_arg_1 .. agi_arg_127 */
+
+/* variables without a field of their own, kept for agi_env_extra_get() */
+#define AGI_ENV_EXTRA           16      /* must be a power of 2 */
+
+enum {
+    AGI_ENV_TYPE = 0,
+    AGI_ENV_DNID,
+    AGI_ENV_RDNIS,
+    AGI_ENV_NETWORK,
+    AGI_ENV_REQUEST,
+    AGI_ENV_CHANNEL,
+    AGI_ENV_VERSION,
+    AGI_ENV_CONTEXT,
+    AGI_ENV_UNIQUEID,
+    AGI_ENV_CALLERID,
+    AGI_ENV_THREADID,
+    AGI_ENV_LANGUAGE,
+    AGI_ENV_PRIORITY,
+    AGI_ENV_ENHANCED,
+    AGI_ENV_EXTENSION,
+    AGI_ENV_CALLINGTON,
+    AGI_ENV_CALLINGTNS,
+    AGI_ENV_CALLINGPRES,
+    AGI_ENV_CALLINGANI2,
+    AGI_ENV_ACCOUNTCODE,
+    AGI_ENV_CALLERIDNAME,
+    AGI_ENV_NETWORK_SCRIPT,
+    AGI_ENV_NFIELDS
+};
+
+typedef struct {
+    agi_str_t       name;
+    unsigned        field;
+} agi_env_field_t;
+
+/*
+ * A null-terminated string in the environment buffer. No value starts at
+ * offset 0, where "agi_" is, so off is 0 only for a variable never sent.
+ */
+typedef struct {
+    uint16_t        off;
+    uint16_t        len;
+} agi_env_str_t;
+
+typedef struct {
+    uint16_t        hash;       /* low bits of agi_env_hash() */
+    agi_env_str_t   name;       /* name.len is 0 for an empty slot */
+    agi_env_str_t   value;
+} agi_env_var_t;
+
+struct agi_env_extra_s {
+    agi_env_var_t   vars[AGI_ENV_EXTRA];
+    unsigned        nvars;
+};
+
+struct agi_env_s {
+    /* the fields that are parsed into integers, read by most handlers */
+    long                threadid_n;
+    int                 priority_n;
+    unsigned            network_n:1;
+    unsigned            enhanced_n:1;
+
+    /* variables were left out, the extra table being full */
+    unsigned            overflow:1;
+
+    uint16_t            argc;
+    uint16_t            nalloc;     /* entries allocated in argv */
+
+    agi_env_str_t      *argv;       /* agi_arg_1 is argv[0] */
+    agi_env_extra_t    *extra;      /* allocated for the first one */
+
+    agi_env_str_t       str[AGI_ENV_NFIELDS];
+};
+
+/* two cache lines, where the char * it replaced took well over 1 KB */
+static_assert(sizeof(agi_env_t) <= 128, "agi_env_t outgrew two cache lines");
+
+/* agi_env_free() is only needed when no arena was given to agi_env_set() */
+void agi_env_init(agi_env_t *env);
+void agi_env_free(agi_env_t *env);
+
+const agi_env_field_t *agi_env_field(unsigned hash, const char *name,
+    size_t len);
+int agi_env_set(agi_env_t *env, agi_arena_t *arena,
+    const agi_env_parser_t *ep, const char *buf);
+
+const char *agi_env_get(const agi_env_t *env, const char *buf,
+    unsigned field);
+const char *agi_env_arg(const agi_env_t *env, const char *buf, unsigned n);
+const char *agi_env_extra_get(const agi_env_t *env, const char *buf,
+    const char *name);
+
+size_t agi_env_format(const agi_env_t *env, const char *buf, char *out,
+    size_t size);
+
+#endif /* AGI_ENV_H */
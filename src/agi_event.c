@@ -0,0 +1,505 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Edge-triggered epoll reactor driving FastAGI sessions
+ *
+ * One reactor owns a set of listening sockets and every session accepted on
+ * them. Listeners are level-triggered so a transient accept4() failure (such
+ * as EMFILE) is retried on the next iteration; sessions are edge-triggered
+ * and are always drained until EAGAIN.
+ *
+ * Created with AGI_EVENT_LOOP_URING, the loop waits with io_uring instead,
+ * see agi_uring.c: the kernel then does the accepting and the receiving,
+ * and hands sessions the bytes it received.
+ */
+
+#define _GNU_SOURCE         /* accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+#include <netdb.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "agi_event.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+#include "agi_uring.h"
+#include "log.h"
+
+static void agi_event_accept(agi_event_t *ev, uint32_t events);
+static void agi_event_flush_posted(agi_event_loop_t *loop);
+static void agi_event_free_closed(agi_event_loop_t *loop);
+static void agi_event_free_listeners(agi_event_loop_t *loop);
+static int agi_event_add_listener(agi_event_loop_t *loop, int fd,
+    const agi_transport_t *t);
+
+agi_event_loop_t *
+agi_event_loop_create(int nevents, agi_session_handler_pt handler, void *data,
+    unsigned flags)
+{
+    agi_event_loop_t   *loop;
+
+    if (nevents <= 0)
+        nevents = AGI_EVENT_DEFAULT_NEVENTS;
+
+    loop = calloc(1, sizeof *loop);
+    if (loop == NULL) {
+        log(LOG_ERR, "calloc() failed");
+        return NULL;
+    }
+
+    loop->events = calloc((size_t)nevents, sizeof(struct epoll_event));
+    if (loop->events == NULL) {
+        log(LOG_ERR, "calloc() failed");
+        free(loop);
+        return NULL;
+    }
+
+    loop->epfd = -1;
+    loop->raw_env = (flags & AGI_EVENT_LOOP_RAW_ENV) != 0;
+
+    if (flags & AGI_EVENT_LOOP_URING) {
+        loop->uring = agi_uring_create(loop, 0);
+
+        if (loop->uring == NULL)
+            log(LOG_ERR, "io_uring unavailable, falling back to epoll");
+    }
+
+    if (loop->uring == NULL)
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (loop->uring == NULL && loop->epfd == -1) {
+        log(LOG_ERR, "epoll_create1() failed");
+        free(loop->events);
+        free(loop);
+        return NULL;
+    }
+
+    loop->nevents = nevents;
+    loop->handler = handler;
+    loop->data = data;
+
+    return loop;
+}
+
+void
+agi_event_loop_destroy(agi_event_loop_t *loop)
+{
+    agi_event_close_listeners(loop);
+    agi_event_free_closed(loop);
+
+    if (loop->nsessions)
+        log(LOG_ERR, "event loop destroyed with %zu live sessions",
+            loop->nsessions);
+
+    if (loop->uring) {
+        agi_uring_destroy(loop->uring);
+
+        /* kept for the completions of their accepts, see above */
+        agi_event_free_listeners(loop);
+    }
+    else {
+        (void)close(loop->epfd);
+    }
+
+    free(loop->events);
+    free(loop);
+}
+
+int
+agi_event_listen(agi_event_loop_t *loop, const char *host, const char *port,
+    int backlog, unsigned flags)
+{
+    int                 fd, rv;
+    int                 on = 1;
+    struct addrinfo     hints, *res, *ai;
+
+    if (backlog <= 0)
+        backlog = AGI_EVENT_DEFAULT_BACKLOG;
+
+    (void)memset(&hints, 0, sizeof hints);
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    rv = getaddrinfo(host, port, &hints, &res);
+    if (rv != 0) {
+        log(LOG_ERR, "getaddrinfo() failed: %s", gai_strerror(rv));
+        return -1;
+    }
+
+    fd = -1;
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+
+        if (fd == -1)
+            continue;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == -1)
+            log(LOG_ERR, "setsockopt(SO_REUSEADDR) failed");
+
+        /*
+         * every worker binds a socket of its own to the same address, and
+         * the kernel spreads the connections among them
+         */
+        if ((flags & AGI_EVENT_REUSEPORT)
+            && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) == -1)
+        {
+            log(LOG_ERR, "setsockopt(SO_REUSEPORT) failed");
+            (void)close(fd);
+            fd = -1;
+            continue;
+        }
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0
+            && listen(fd, backlog) == 0)
+        {
+            break;
+        }
+
+        (void)close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        log(LOG_ERR, "unable to listen on %s:%s", host ? host : "*", port);
+        return -1;
+    }
+
+    return agi_event_add_listener(loop, fd, &agi_transport_tcp);
+}
+
+/*
+ * FastAGI over a Unix domain socket, for an Asterisk on the same host: no
+ * TCP stack on the way. A socket file left at path is replaced.
+ */
+int
+agi_event_listen_unix(agi_event_loop_t *loop, const char *path, int backlog)
+{
+    int                 fd;
+    struct sockaddr_un  sun;
+
+    if (backlog <= 0)
+        backlog = AGI_EVENT_DEFAULT_BACKLOG;
+
+    (void)memset(&sun, 0, sizeof sun);
+
+    sun.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof sun.sun_path) {
+        log(LOG_ERR, "unix socket path too long: %s", path);
+        return -1;
+    }
+
+    (void)strcpy(sun.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log(LOG_ERR, "socket(AF_UNIX) failed");
+        return -1;
+    }
+
+    if (unlink(path) == -1 && errno != ENOENT)
+        log(LOG_ERR, "unlink(%s) failed", path);
+
+    if (bind(fd, (struct sockaddr *)&sun, sizeof sun) == -1
+        || listen(fd, backlog) == -1)
+    {
+        log(LOG_ERR, "unable to listen on %s", path);
+        (void)close(fd);
+        return -1;
+    }
+
+    return agi_event_add_listener(loop, fd, &agi_transport_unix);
+}
+
+/* stop accepting, the sessions already accepted are left alone */
+void
+agi_event_close_listeners(agi_event_loop_t *loop)
+{
+    agi_listener_t *ls;
+
+    if (loop->uring == NULL) {
+        agi_event_free_listeners(loop);
+        return;
+    }
+
+    /*
+     * the accepts may still complete: the listeners are freed along with
+     * the ring, and the connections they bring in are closed
+     */
+    for (ls = loop->listeners; ls; ls = ls->next) {
+        if (ls->ev.fd == -1)
+            continue;
+
+        if (agi_uring_cancel(loop->uring, &ls->ev) == -1)
+            log(LOG_ERR, "unable to cancel the accept on %d", ls->ev.fd);
+
+        (void)close(ls->ev.fd);
+        ls->ev.fd = -1;
+    }
+}
+
+/* A connection accepted on ls, by accept4() or io_uring */
+void
+agi_event_accepted(agi_listener_t *ls, int fd)
+{
+    int     on = 1;
+
+    /* every AGI command is a small write waiting for a small reply */
+    if (ls->transport == &agi_transport_tcp
+        && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on) == -1)
+    {
+        log(LOG_ERR, "setsockopt(TCP_NODELAY) failed");
+    }
+
+    if (agi_session_open(ls->loop, ls->transport, fd, fd) == NULL)
+        (void)close(fd);
+}
+
+/*
+ * With io_uring, ev gets a multishot recv instead of a poll if ev->input is
+ * set, events being ignored.
+ */
+int
+agi_event_add(agi_event_loop_t *loop, agi_event_t *ev, uint32_t events)
+{
+    struct epoll_event  ee;
+
+    if (loop->uring) {
+        if (ev->input)
+            return agi_uring_recv(loop->uring, ev);
+
+        return agi_uring_poll(loop->uring, ev, events);
+    }
+
+    ee.events = events;
+    ee.data.ptr = ev;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ev->fd, &ee) == -1) {
+        log(LOG_ERR, "epoll_ctl(EPOLL_CTL_ADD, %d) failed", ev->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+agi_event_del(agi_event_loop_t *loop, agi_event_t *ev)
+{
+    if (loop->uring)
+        return agi_uring_cancel(loop->uring, ev);
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ev->fd, NULL) == -1) {
+        log(LOG_ERR, "epoll_ctl(EPOLL_CTL_DEL, %d) failed", ev->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+agi_event_loop_process(agi_event_loop_t *loop, int timeout)
+{
+    int             i, n;
+    agi_event_t    *ev;
+
+    /* what was done between two iterations, such as by agi_sched_complete() */
+    agi_event_flush_posted(loop);
+    agi_event_free_closed(loop);
+
+    if (loop->uring) {
+        /* submits the sends just flushed, and dispatches the completions */
+        n = agi_uring_process(loop->uring, timeout);
+        if (n == -1)
+            return -1;
+    }
+    else {
+        n = epoll_wait(loop->epfd, loop->events, loop->nevents, timeout);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                return 0;
+
+            log(LOG_ERR, "epoll_wait() failed");
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            ev = loop->events[i].data.ptr;
+            ev->handler(ev, loop->events[i].events);
+        }
+    }
+
+    agi_event_flush_posted(loop);
+    agi_event_free_closed(loop);
+
+    return n;
+}
+
+int
+agi_event_loop_run(agi_event_loop_t *loop)
+{
+    loop->stop = 0;
+
+    while (!loop->stop) {
+        if (agi_event_loop_process(loop, -1) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+void
+agi_event_loop_stop(agi_event_loop_t *loop)
+{
+    loop->stop = 1;
+}
+
+static void
+agi_event_accept(agi_event_t *ev, uint32_t events)
+{
+    int                 fd;
+    agi_listener_t     *ls = (agi_listener_t *)ev;
+
+    (void)events;
+
+    for (;;) {
+        fd = accept4(ev->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            /* EMFILE, ENFILE, ENOBUFS: retried on the next iteration */
+            log(LOG_ERR, "accept4() failed");
+            return;
+        }
+
+        agi_event_accepted(ls, fd);
+    }
+}
+
+static int
+agi_event_add_listener(agi_event_loop_t *loop, int fd,
+    const agi_transport_t *t)
+{
+    int                 rv;
+    agi_listener_t     *ls;
+
+    ls = calloc(1, sizeof *ls);
+    if (ls == NULL) {
+        log(LOG_ERR, "calloc() failed");
+        (void)close(fd);
+        return -1;
+    }
+
+    ls->ev.fd = fd;
+    ls->ev.handler = agi_event_accept;
+    ls->loop = loop;
+    ls->transport = t;
+
+    /* level-triggered, see the comment at the top of the file */
+    rv = loop->uring ? agi_uring_accept(loop->uring, &ls->ev)
+                     : agi_event_add(loop, &ls->ev, EPOLLIN);
+
+    if (rv == -1) {
+        (void)close(fd);
+        free(ls);
+        return -1;
+    }
+
+    ls->next = loop->listeners;
+    loop->listeners = ls;
+
+    return 0;
+}
+
+/* One send() for all the commands a session queued during this iteration */
+static void
+agi_event_flush_posted(agi_event_loop_t *loop)
+{
+    agi_session_t  *s;
+
+    while (loop->posted) {
+        s = loop->posted;
+        loop->posted = s->posted_next;
+
+        s->posted = 0;
+
+        if (!s->closing && agi_session_flush(s) == AGI_ERROR)
+            agi_session_fail(s);
+    }
+}
+
+static void
+agi_event_free_closed(agi_event_loop_t *loop)
+{
+    agi_session_t  *s, *busy;
+
+    busy = NULL;
+
+    while (loop->closed) {
+        s = loop->closed;
+        loop->closed = s->next;
+
+        /*
+         * a task or a request to the kernel still refers to it, try again
+         * on the next iteration
+         */
+        if (s->ntasks || s->ev.inflight) {
+            if (s->ev.inflight && !s->ev.cancelled
+                && agi_uring_cancel(loop->uring, &s->ev) == -1)
+            {
+                log(LOG_ERR, "unable to cancel the requests of session %d",
+                    s->ev.fd);
+            }
+
+            s->next = busy;
+            busy = s;
+            continue;
+        }
+
+        agi_session_free(s);
+    }
+
+    loop->closed = busy;
+}
+
+static void
+agi_event_free_listeners(agi_event_loop_t *loop)
+{
+    agi_listener_t *ls, *next;
+
+    for (ls = loop->listeners; ls; ls = next) {
+        next = ls->next;
+
+        if (ls->ev.fd != -1)
+            (void)close(ls->ev.fd);
+
+        free(ls);
+    }
+
+    loop->listeners = NULL;
+}
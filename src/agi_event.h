@@ -0,0 +1,119 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Edge-triggered epoll reactor driving FastAGI sessions
+ */
+
+#ifndef AGI_EVENT_H
+#define AGI_EVENT_H
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include <sys/epoll.h>
+
+#include "agi_core.h"
+
+#define AGI_EVENT_DEFAULT_NEVENTS   512
+#define AGI_EVENT_DEFAULT_BACKLOG   511
+
+/* agi_event_listen() flags */
+#define AGI_EVENT_REUSEPORT         0x01    /* one socket per worker */
+
+/* agi_event_loop_create() flags */
+#define AGI_EVENT_LOOP_URING        0x01    /* io_uring, or epoll if missing */
+#define AGI_EVENT_LOOP_RAW_ENV      0x02    /* agi_session_t.env_raw kept */
+
+typedef void (*agi_event_handler_pt)(agi_event_t *ev, uint32_t events);
+
+/*
+ * With io_uring, the bytes the kernel received on ev: n > 0 bytes at buf,
+ * which is only valid during the call, 0 at end of file, or -1 on failure
+ * with errno set
+ */
+typedef void (*agi_event_input_pt)(agi_event_t *ev, const char *buf,
+    ssize_t n);
+
+/* with io_uring, the completion of agi_uring_send(): n bytes sent, or -1 */
+typedef void (*agi_event_sent_pt)(agi_event_t *ev, ssize_t n);
+
+/* called once the AGI environment of a new session has been read */
+typedef void (*agi_session_handler_pt)(agi_session_t *s);
+
+/*
+ * Every object registered with epoll starts with an agi_event_t so that the
+ * reactor can dispatch on epoll_event.data.ptr without knowing its type
+ */
+struct agi_event_s {
+    int                     fd;
+    agi_event_handler_pt    handler;
+
+    /* sessions only, the others are polled, see agi_uring.c */
+    agi_event_input_pt      input;
+    agi_event_sent_pt       sent;
+
+    /* io_uring requests the kernel has not completed yet */
+    unsigned                inflight;
+    uint32_t                events;     /* those polled */
+    unsigned                cancelled:1;
+};
+
+struct agi_listener_s {
+    agi_event_t             ev;         /* must be first */
+    agi_event_loop_t       *loop;
+    const agi_transport_t  *transport;  /* of the sessions accepted */
+    agi_listener_t         *next;
+};
+
+struct agi_event_loop_s {
+    int                     epfd;       /* -1 with io_uring */
+    agi_uring_t            *uring;
+    int                     nevents;
+    struct epoll_event     *events;
+
+    agi_listener_t         *listeners;
+
+    /* sessions with queued commands, flushed at the end of the iteration */
+    agi_session_t          *posted;
+
+    /* sessions closed while dispatching, freed at the end of the iteration */
+    agi_session_t          *closed;
+
+    agi_session_handler_pt  handler;
+    void                   *data;
+
+    /*
+     * slots for the sessions of this loop, see agi_session_pool_create();
+     * sessions come from the heap without it or once it is exhausted
+     */
+    agi_pool_t             *pool;
+
+    /* the share of this loop in the work-stealing scheduler, or NULL */
+    agi_sched_t            *sched;
+
+    size_t                  nsessions;
+
+    unsigned                stop:1;
+    unsigned                raw_env:1;  /* AGI_EVENT_LOOP_RAW_ENV */
+};
+
+agi_event_loop_t *agi_event_loop_create(int nevents,
+    agi_session_handler_pt handler, void *data, unsigned flags);
+void agi_event_loop_destroy(agi_event_loop_t *loop);
+
+int agi_event_listen(agi_event_loop_t *loop, const char *host,
+    const char *port, int backlog, unsigned flags);
+int agi_event_listen_unix(agi_event_loop_t *loop, const char *path,
+    int backlog);
+void agi_event_close_listeners(agi_event_loop_t *loop);
+void agi_event_accepted(agi_listener_t *ls, int fd);
+
+int agi_event_add(agi_event_loop_t *loop, agi_event_t *ev, uint32_t events);
+int agi_event_del(agi_event_loop_t *loop, agi_event_t *ev);
+
+int agi_event_loop_run(agi_event_loop_t *loop);
+int agi_event_loop_process(agi_event_loop_t *loop, int timeout);
+void agi_event_loop_stop(agi_event_loop_t *loop);
+
+#endif /* AGI_EVENT_H */
@@ -0,0 +1,212 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Classic AGI calls handed over to a resident daemon by agi_shim
+ *
+ * For AGI(script) Asterisk forks and execs a program per call, which then
+ * pays for dynamic linking and for its initialization before it can read
+ * the environment. Pointing the dialplan at agi_shim instead moves the
+ * program into a daemon, started once: the shim sends its descriptors over
+ * a Unix datagram socket, SCM_RIGHTS, and the daemon runs the call on an
+ * event loop with everything it has cached, exactly as a FastAGI session
+ * but over agi_transport_stdio.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "agi_handoff.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+#include "log.h"
+
+static void agi_handoff_handler(agi_event_t *ev, uint32_t events);
+static int agi_handoff_recv(agi_event_loop_t *loop, int fd);
+static void agi_handoff_close(int *fds, size_t n);
+
+/*
+ * Receive the calls handed over on a datagram socket at path, which is
+ * replaced if it exists. The socket is one of the listeners of the loop.
+ *
+ * SIGPIPE is ignored from then on, process-wide: the calls are written to
+ * over pipes, and one caller hanging up during a write must not kill the
+ * daemon with every other call it runs.
+ */
+int
+agi_handoff_listen(agi_event_loop_t *loop, const char *path)
+{
+    int                 fd;
+    agi_listener_t     *ls;
+    struct sockaddr_un  sun;
+
+    (void)memset(&sun, 0, sizeof sun);
+
+    sun.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof sun.sun_path) {
+        log(LOG_ERR, "unix socket path too long: %s", path);
+        return -1;
+    }
+
+    (void)strcpy(sun.sun_path, path);
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        log(LOG_ERR, "signal(SIGPIPE) failed");
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log(LOG_ERR, "socket(AF_UNIX) failed");
+        return -1;
+    }
+
+    if (unlink(path) == -1 && errno != ENOENT)
+        log(LOG_ERR, "unlink(%s) failed", path);
+
+    if (bind(fd, (struct sockaddr *)&sun, sizeof sun) == -1) {
+        log(LOG_ERR, "bind(%s) failed", path);
+        (void)close(fd);
+        return -1;
+    }
+
+    ls = calloc(1, sizeof *ls);
+    if (ls == NULL) {
+        log(LOG_ERR, "calloc() failed");
+        (void)close(fd);
+        return -1;
+    }
+
+    ls->ev.fd = fd;
+    ls->ev.handler = agi_handoff_handler;
+    ls->loop = loop;
+    ls->transport = &agi_transport_stdio;
+
+    if (agi_event_add(loop, &ls->ev, EPOLLIN | EPOLLET) == -1) {
+        (void)close(fd);
+        free(ls);
+        return -1;
+    }
+
+    ls->next = loop->listeners;
+    loop->listeners = ls;
+
+    return 0;
+}
+
+static void
+agi_handoff_handler(agi_event_t *ev, uint32_t events)
+{
+    agi_listener_t     *ls = (agi_listener_t *)ev;
+
+    (void)events;
+
+    /* edge-triggered, drained until EAGAIN */
+    while (agi_handoff_recv(ls->loop, ev->fd) != AGI_AGAIN) {
+        /* void */
+    }
+}
+
+static int
+agi_handoff_recv(agi_event_loop_t *loop, int fd)
+{
+    int                 fds[AGI_HANDOFF_MAX_FDS];
+    size_t              nfds, want;
+    ssize_t             n;
+    struct iovec        iov;
+    struct msghdr       msg;
+    struct cmsghdr     *cmsg;
+    agi_session_t      *s;
+    agi_handoff_msg_t   hm;
+
+    union {
+        struct cmsghdr  align;
+        char            buf[CMSG_SPACE(sizeof fds)];
+    } control;
+
+    iov.iov_base = &hm;
+    iov.iov_len = sizeof hm;
+
+    (void)memset(&msg, 0, sizeof msg);
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+    if (n == (ssize_t)-1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return AGI_AGAIN;
+
+        if (errno == EINTR)
+            return AGI_OK;
+
+        log(LOG_ERR, "recvmsg() failed");
+        return AGI_AGAIN;
+    }
+
+    nfds = 0;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+        && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        (void)memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+
+    want = (n == (ssize_t)sizeof hm && (hm.flags & AGI_HANDOFF_EAGI)) ? 4 : 3;
+
+    if (n != (ssize_t)sizeof hm || hm.version != AGI_HANDOFF_VERSION
+        || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || nfds != want)
+    {
+        log(LOG_ERR, "invalid agi handoff, %zd bytes, %zu descriptors",
+            n, nfds);
+        agi_handoff_close(fds, nfds);
+        return AGI_OK;
+    }
+
+    /* the output is left blocking, see agi_session_open() */
+    if (fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK) == -1) {
+        log(LOG_ERR, "fcntl(O_NONBLOCK) failed");
+        agi_handoff_close(fds, nfds);
+        return AGI_OK;
+    }
+
+    s = agi_session_open(loop, &agi_transport_stdio, fds[0], fds[1]);
+    if (s == NULL) {
+        agi_handoff_close(fds, nfds);
+        return AGI_OK;
+    }
+
+    /* closing it with the session lets the shim exit */
+    s->shim_fd = fds[2];
+
+    if (nfds == 4)
+        s->audio_fd = fds[3];
+
+    log_debug1("agi handoff: session %d", s->ev.fd);
+
+    return AGI_OK;
+}
+
+static void
+agi_handoff_close(int *fds, size_t n)
+{
+    size_t  i;
+
+    for (i = 0; i < n; i++)
+        (void)close(fds[i]);
+}
@@ -0,0 +1,38 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Classic AGI calls handed over to a resident daemon by agi_shim
+ */
+
+#ifndef AGI_HANDOFF_H
+#define AGI_HANDOFF_H
+
+#include <stdint.h>
+
+#include "agi_core.h"
+#include "agi_event.h"
+
+#define AGI_HANDOFF_PATH        "/var/run/agi/handoff.sock"
+
+/* the variable agi_shim reads the path from, if set */
+#define AGI_HANDOFF_PATH_ENV    "AGI_HANDOFF_PATH"
+
+#define AGI_HANDOFF_VERSION     1
+
+#define AGI_HANDOFF_EAGI        0x01    /* the audio descriptor follows */
+
+/*
+ * The datagram agi_shim sends, along with its stdin, its stdout, the end of
+ * a socket pair it waits on, and the EAGI audio descriptor if any. The
+ * daemon closes the socket pair end once the call is over.
+ */
+typedef struct {
+    uint8_t                 version;
+    uint8_t                 flags;
+} agi_handoff_msg_t;
+
+#define AGI_HANDOFF_MAX_FDS     4
+
+int agi_handoff_listen(agi_event_loop_t *loop, const char *path);
+
+#endif /* AGI_HANDOFF_H */
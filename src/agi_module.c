@@ -0,0 +1,323 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Handler modules loaded with dlopen() and reloaded without dropping calls
+ *
+ * Each agi_module_reload() loads the shared object at path as a new
+ * generation and makes it current: sessions accepted from then on run its
+ * handler, those already running keep the generation they started with, and
+ * an old generation is unloaded as its last session is freed.
+ *
+ * dlopen() hands back the object already loaded under the same name, even
+ * when the file was replaced since, so every generation is loaded from a
+ * private copy, unlinked as soon as it is mapped. Deploying is replacing the
+ * file at path, with rename() so that a reload never reads half of it, and
+ * calling agi_module_reload().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "agi_module.h"
+#include "agi_route.h"
+#include "agi_session.h"
+#include "log.h"
+
+#define AGI_MODULE_COPY_LEN     65536
+
+static agi_module_gen_t *agi_module_load(agi_module_t *m);
+static int agi_module_copy(const char *from, const char *to);
+
+int
+agi_module_init(agi_module_t *m, const char *path)
+{
+    m->path = path;
+    m->gens = NULL;
+    m->generation = 0;
+
+    atomic_init(&m->current, NULL);
+
+    if (pthread_mutex_init(&m->lock, NULL) != 0) {
+        log(LOG_ERR, "pthread_mutex_init() failed");
+        return -1;
+    }
+
+    if (agi_module_reload(m) == -1) {
+        (void)pthread_mutex_destroy(&m->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Load the module as a new generation and make it current. Any thread may
+ * call it; when the load fails, the current generation stays.
+ */
+int
+agi_module_reload(agi_module_t *m)
+{
+    agi_module_gen_t   *gen, *old;
+
+    (void)pthread_mutex_lock(&m->lock);
+
+    gen = agi_module_load(m);
+
+    if (gen == NULL) {
+        (void)pthread_mutex_unlock(&m->lock);
+        return -1;
+    }
+
+    gen->next = m->gens;
+    m->gens = gen;
+
+    old = atomic_exchange_explicit(&m->current, gen, memory_order_acq_rel);
+
+    (void)pthread_mutex_unlock(&m->lock);
+
+    log_debug2("agi module %s: generation %u", m->path, gen->generation);
+
+    /* the reference the module held as current */
+    if (old)
+        agi_module_release(old);
+
+    return 0;
+}
+
+/* Once no session runs any generation */
+void
+agi_module_destroy(agi_module_t *m)
+{
+    agi_module_gen_t   *gen, *next;
+
+    gen = atomic_exchange(&m->current, NULL);
+    if (gen)
+        agi_module_release(gen);
+
+    for (gen = m->gens; gen; gen = next) {
+        next = gen->next;
+
+        if (gen->handle)
+            log(LOG_ERR, "agi module %s: generation %u still has %u sessions",
+                m->path, gen->generation, atomic_load(&gen->refs));
+        else
+            free(gen);
+    }
+
+    m->gens = NULL;
+
+    (void)pthread_mutex_destroy(&m->lock);
+}
+
+/*
+ * A reference to the current generation. The structure of a generation is
+ * kept until agi_module_destroy(), only its code goes: a generation that a
+ * reload retired in the meantime has no reference left and is passed over.
+ */
+agi_module_gen_t *
+agi_module_acquire(agi_module_t *m)
+{
+    unsigned            refs;
+    agi_module_gen_t   *gen;
+
+    for (;;) {
+        gen = atomic_load_explicit(&m->current, memory_order_acquire);
+        if (gen == NULL)
+            return NULL;
+
+        refs = atomic_load_explicit(&gen->refs, memory_order_relaxed);
+
+        while (refs) {
+            if (atomic_compare_exchange_weak_explicit(&gen->refs, &refs,
+                                                      refs + 1,
+                                                      memory_order_acquire,
+                                                      memory_order_relaxed))
+            {
+                return gen;
+            }
+        }
+    }
+}
+
+void
+agi_module_release(agi_module_gen_t *gen)
+{
+    if (atomic_fetch_sub_explicit(&gen->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    if (gen->exit)
+        gen->exit();
+
+    if (dlclose(gen->handle) != 0)
+        log(LOG_ERR, "dlclose() failed: %s", dlerror());
+
+    log_debug1("agi module generation %u unloaded", gen->generation);
+
+    gen->handle = NULL;
+}
+
+/*
+ * The session handler of the event loops running a module, with the
+ * agi_module_t as agi_event_loop_t.data, or as the data of the route when
+ * dispatched by agi_router_handler()
+ */
+void
+agi_module_handler(agi_session_t *s)
+{
+    agi_module_t       *m;
+    agi_module_gen_t   *gen;
+
+    m = s->route ? s->route->data : s->loop->data;
+
+    gen = agi_module_acquire(m);
+    if (gen == NULL) {
+        log(LOG_ERR, "agi module %s is not loaded", m->path);
+        agi_session_close(s);
+        return;
+    }
+
+    /* released by agi_session_free() */
+    s->module = gen;
+
+    gen->handler(s);
+}
+
+static agi_module_gen_t *
+agi_module_load(agi_module_t *m)
+{
+    int                     rv;
+    char                    copy[4096];
+    agi_module_gen_t       *gen;
+    agi_module_init_pt      init;
+
+    gen = calloc(1, sizeof *gen);
+    if (gen == NULL) {
+        log(LOG_ERR, "calloc() failed");
+        return NULL;
+    }
+
+    gen->generation = m->generation + 1;
+
+    rv = snprintf(copy, sizeof copy, "%s.%ld.%u", m->path, (long)getpid(),
+                  gen->generation);
+
+    if (rv < 0 || (size_t)rv >= sizeof copy) {
+        log(LOG_ERR, "agi module path %s is too long", m->path);
+        goto failed;
+    }
+
+    if (agi_module_copy(m->path, copy) == -1)
+        goto failed;
+
+    gen->handle = dlopen(copy, RTLD_NOW | RTLD_LOCAL);
+
+    /* mapped or not, the copy has served */
+    (void)unlink(copy);
+
+    if (gen->handle == NULL) {
+        log(LOG_ERR, "dlopen(%s) failed: %s", m->path, dlerror());
+        goto failed;
+    }
+
+    *(void **)&gen->handler = dlsym(gen->handle, AGI_MODULE_HANDLER);
+    *(void **)&init = dlsym(gen->handle, AGI_MODULE_INIT);
+    *(void **)&gen->exit = dlsym(gen->handle, AGI_MODULE_EXIT);
+
+    if (gen->handler == NULL) {
+        log(LOG_ERR, "agi module %s has no " AGI_MODULE_HANDLER, m->path);
+        goto failed;
+    }
+
+    if (init && init() == -1) {
+        log(LOG_ERR, "agi module %s refused to load", m->path);
+        goto failed;
+    }
+
+    atomic_init(&gen->refs, 1);
+
+    m->generation = gen->generation;
+
+    return gen;
+
+failed:
+
+    if (gen->handle)
+        (void)dlclose(gen->handle);
+
+    free(gen);
+
+    return NULL;
+}
+
+static int
+agi_module_copy(const char *from, const char *to)
+{
+    int         in, out;
+    char        buf[AGI_MODULE_COPY_LEN];
+    ssize_t     n, w, off;
+
+    in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        log(LOG_ERR, "open(%s) failed", from);
+        return -1;
+    }
+
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0700);
+    if (out == -1) {
+        log(LOG_ERR, "open(%s) failed", to);
+        (void)close(in);
+        return -1;
+    }
+
+    for (;;) {
+        n = read(in, buf, sizeof buf);
+
+        if (n == 0)
+            break;
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+
+            log(LOG_ERR, "read(%s) failed", from);
+            goto failed;
+        }
+
+        for (off = 0; off < n; off += w) {
+            w = write(out, buf + off, (size_t)(n - off));
+
+            if (w == -1) {
+                if (errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+
+                log(LOG_ERR, "write(%s) failed", to);
+                goto failed;
+            }
+        }
+    }
+
+    (void)close(in);
+
+    if (close(out) == -1) {
+        log(LOG_ERR, "close(%s) failed", to);
+        (void)unlink(to);
+        return -1;
+    }
+
+    return 0;
+
+failed:
+
+    (void)close(in);
+    (void)close(out);
+    (void)unlink(to);
+
+    return -1;
+}
@@ -0,0 +1,72 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Handler modules loaded with dlopen() and reloaded without dropping calls
+ */
+
+#ifndef AGI_MODULE_H
+#define AGI_MODULE_H
+
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "agi_core.h"
+#include "agi_event.h"
+
+/*
+ * What a module exports: the handler is required, init() and exit() are
+ * called, when present, right after loading and right before unloading.
+ *
+ *     void agi_plugin_handler(agi_session_t *s);
+ *     int  agi_plugin_init(void);      0, or -1 to refuse the load
+ *     void agi_plugin_exit(void);
+ *
+ * dlsym() also searches the libraries the module depends on: none of these
+ * names may be taken by the library itself, or a module without one of
+ * them would get the library's function in its place.
+ */
+#define AGI_MODULE_HANDLER      "agi_plugin_handler"
+#define AGI_MODULE_INIT         "agi_plugin_init"
+#define AGI_MODULE_EXIT         "agi_plugin_exit"
+
+typedef int (*agi_module_init_pt)(void);
+typedef void (*agi_module_exit_pt)(void);
+
+/*
+ * A load of the module. It is referenced by the module while current and by
+ * every session bound to it, and unloaded once the last of them is gone.
+ */
+struct agi_module_gen_s {
+    void                   *handle;     /* NULL once unloaded */
+    agi_session_handler_pt  handler;
+    agi_module_exit_pt      exit;
+
+    unsigned                generation;
+    atomic_uint             refs;
+
+    agi_module_gen_t       *next;       /* agi_module_t.gens */
+};
+
+typedef struct {
+    const char             *path;
+
+    _Atomic(agi_module_gen_t *) current;
+
+    /* every generation ever loaded, freed by agi_module_destroy() */
+    agi_module_gen_t       *gens;
+    unsigned                generation;
+
+    pthread_mutex_t         lock;       /* serializes reloads */
+} agi_module_t;
+
+int agi_module_init(agi_module_t *m, const char *path);
+int agi_module_reload(agi_module_t *m);
+void agi_module_destroy(agi_module_t *m);
+
+agi_module_gen_t *agi_module_acquire(agi_module_t *m);
+void agi_module_release(agi_module_gen_t *gen);
+
+void agi_module_handler(agi_session_t *s);
+
+#endif /* AGI_MODULE_H */
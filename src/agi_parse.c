@@ -2,208 +2,147 @@
  * Author: Romario Maxwell
  */
 
-#include "utils.h"
-#include "agi.h"        /* agi_environment_t */
-#include "string.h"
+#include <limits.h>     /* INT_MAX, LONG_MAX */
+#include <string.h>     /* memcmp */
+
+#include "agi_env.h"    /* agi_env_hash */
+#include "agi_parse.h"
+#include "agi_scan.h"
 
 #define LF '\n'
+#define CR '\r'
 
-int
-agi_parse_environment_variable_line(agi_environment_t *e,
-    const char *buf)
+void
+agi_env_parser_init(agi_env_parser_t *ep)
 {
-    unsigned char c, ch;
-    const char *p;
-    enum {
-        sw_start = 0,
-        sw_agi_a,
-        sw_agi_ag,
-        sw_agi_agi,
-        sw_underscore_before_variable,
-        sw_variable,
-        sw_space_before_value,
-        sw_value,
-        sw_space_after_value
-    } state;
-
-    /* the last '\0' is not needed because string is zero terminated */
-    static unsigned char lowcase[] =
-        "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
-        "\0\0\0\0\0\0\0\0\0\0\0\0\0-\0\0" "0123456789\0\0\0\0\0\0"
-        "\0abcdefghijklmnopqrstuvwxyz\0\0\0\0\0"
-        "\0abcdefghijklmnopqrstuvwxyz\0\0\0\0\0"
-        "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
-        "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
-        "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
-        "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
-
-    state = sw_start;
-
-    for (p = buf; p; p++) {
-        ch = *p;
-
-        switch (state) {
-            /* first char */
-            case sw_start:
-                switch (ch) {
-                    case 'a':
-                        state = sw_agi_a;
-                        break;
-
-                    /* TODO: remove magic number and handle properly */
-                    case LF:
-                        return 3;
-
-                    default:
-                        return -1;
-                }
-                break;
-
-            case sw_agi_a:
-                switch (ch) {
-                    case 'g':
-                        state = sw_agi_ag;
-                        break;
-
-                    default:
-                        return -1;
-                }
-                break;
-
-            case sw_agi_ag:
-                switch (ch) {
-                    case 'i':
-                        state = sw_agi_agi;
-                        break;
-
-                    default:
-                        return -1;
-                }
-                break;
-
-            case sw_agi_agi:
-                switch (ch) {
-                    case '_':
-                        state = sw_underscore_before_variable;
-                        break;
-
-                    default:
-                        return -1;
-                }
-                break;
-
-            /* TODO */
-            case sw_underscore_before_variable:
-                switch (ch) {
-                    case LF:    /* fall through */
-                    case '\0':
-                        return -1;
-
-                    default:
-                        e->variable_start = (char *)p;
-                        state = sw_variable;
-                        break;
-                }
+    ep->pos = 0;
+    ep->scanned = 0;
+    ep->colon = 0;
+    ep->variable_start = 0;
+    ep->variable_end = 0;
+    ep->value_start = 0;
+    ep->value_end = 0;
+    ep->hash = 0;
+    ep->nul = 0;
+}
 
-                break;
+/*
+ * Parse one "agi_variable: value" line out of buf[ep->pos .. len). The
+ * parser may be called again with more bytes appended to buf and resumes
+ * where it stopped.
+ *
+ * Returns AGI_OK with the variable and value offsets set, AGI_AGAIN once all
+ * of buf has been consumed without completing a line, AGI_DONE with ep->pos
+ * just past the blank line ending the environment, or AGI_ERROR with ep->pos
+ * past a malformed line.
+ *
+ * The line is delimited by agi_scan_line(), which also locates the colon, so
+ * only the "agi_" prefix is checked and the name hashed byte by byte here.
+ */
+int
+agi_parse_environment_variable_line(agi_env_parser_t *ep,
+    const char *buf, size_t len)
+{
+    size_t      start, lf, colon, end, pos;
+    unsigned    hash, nul;
 
-            case sw_variable:
-                c = lowcase[ch];
+    lf = ep->scanned + agi_scan_line(buf + ep->scanned, len - ep->scanned,
+                                     &colon, &nul);
 
-                if (c)
-                    break;
+    /* the colon and null byte of a line received in several parts */
+    if (ep->colon == 0 && ep->scanned + colon < lf)
+        ep->colon = ep->scanned + colon;
 
-                if (ch == ':') {
-                    e->variable_end = (char *)p;
-                    state = sw_space_before_value;
-                    break;
-                }
+    if (nul)
+        ep->nul = 1;
 
-                if (ch == LF) {
-                    e->variable_end = (char *)p;
-                    e->value_start = (char *)p;
-                    e->value_end = (char *)p;
-                    goto done;
-                }
+    if (lf == len) {
+        ep->scanned = len;
+        return AGI_AGAIN;
+    }
 
-                if (ch == '\0')
-                    return -1;
+    start = ep->pos;
+    colon = ep->colon;
+    nul = ep->nul;
 
-                break;
+    ep->pos = lf + 1;
+    ep->scanned = ep->pos;
+    ep->colon = 0;
+    ep->nul = 0;
 
-            case sw_space_before_value:
-                switch (ch) {
-                    case ' ':
-                        break;
+    /* blank line: end of the AGI environment */
+    if (lf == start)
+        return AGI_DONE;
 
-                    case LF:
-                        e->value_start = (char *)p;
-                        e->value_end = (char *)p;
-                        goto done;
+    if (nul || lf - start < sizeof "agi_x" - 1
+        || memcmp(buf + start, "agi_", sizeof "agi_" - 1) != 0
+        || colon == start + sizeof "agi_" - 1)
+    {
+        return AGI_ERROR;
+    }
 
-                    case '\0':
-                        return -1;
+    ep->variable_start = start + sizeof "agi_" - 1;
 
-                    default:
-                        e->value_start = (char *)p;
-                        state = sw_value;
-                        break;
-                }
-                break;
+    if (colon == 0) {
+        /* a variable without a value */
+        ep->variable_end = lf;
+        ep->value_start = lf;
+        ep->value_end = lf;
 
-            case sw_value:
-                switch (ch) {
-                    case ' ':
-                        e->value_end = (char *)p;
-                        state = sw_space_after_value;
-                        break;
+    } else {
+        ep->variable_end = colon;
 
-                    case LF:
-                        e->value_end = (char *)p;
-                        goto done;
+        for (pos = colon + 1; pos < lf && buf[pos] == ' '; pos++) {
+            /* void */
+        }
 
-                    case '\0':
-                        return -1;
-                }
-                break;
+        for (end = lf; end > pos && buf[end - 1] == ' '; end--) {
+            /* void */
+        }
 
-            /* space before end of header line */
-            case sw_space_after_value:
-                switch (ch) {
-                    case ' ':
-                        break;
+        ep->value_start = pos;
+        ep->value_end = end;
+    }
 
-                    case LF:
-                        goto done;
+    hash = 0;
 
-                    case '\0':
-                        return -1;
-                    
-                    default:
-                        state = sw_value;
-                        break;
-                }
-                break;
-        }
-    }
+    for (pos = ep->variable_start; pos < ep->variable_end; pos++)
+        hash = agi_env_hash(hash, buf[pos]);
 
-done:
+    ep->hash = hash;
 
-    return 0;
+    return AGI_OK;
 }
 
+static void agi_parse_result_data(agi_result_t *r);
+
+/*
+ * Parse one reply line, buf[0 .. len) with the LF included, without copying
+ * or modifying it: r holds the status and result as integers, and views into
+ * buf for everything else.
+ *
+ *     200 result=<n> [data]
+ *     510 Invalid or unknown command
+ *     511 Command Not Permitted on a dead channel or intercept routine
+ *     520-Invalid command syntax.  Proper usage follows:
+ *
+ * Returns AGI_OK, AGI_AGAIN for the first line of a multi-line "520-" reply,
+ * whose remaining lines up to the one starting with "520 " belong to the same
+ * reply, or AGI_ERROR. A result past INT_MAX is clamped to it, r->result
+ * keeps the digits as sent.
+ */
 int
-agi_parse_command_response_line(char *buf, char *result, char *data)
+agi_parse_command_response_line(const char *buf, size_t len,
+    agi_result_t *r)
 {
-    char            *p;
-    char            *res_start, *res_end, *data_start, *data_end;
-    size_t          len;
+    const char     *p, *last;
+    const char     *res_start, *text_start;
+    int             n, sign;
     unsigned char   c, ch;
     enum {
         sw_start = 0,
-        sw_code_2,
-        sw_code_20,
-        sw_code_200,
+        sw_status,
+        sw_after_status,
         sw_space_before_result,
         sw_result_r,
         sw_result_re,
@@ -214,7 +153,8 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
         sw_equal_sign_after_result,
         sw_return_value,
         sw_space_before_data,
-        sw_data
+        sw_almost_done,
+        sw_text
     } state;
 
     /* the last '\0' is not needed because string is zero terminated */
@@ -228,54 +168,62 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
         "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
         "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
 
+    r->status = 0;
+    r->code = -1;
+    r->result.data = buf;
+    r->result.len = 0;
+    r->data.data = buf;
+    r->data.len = 0;
+    r->value.data = buf;
+    r->value.len = 0;
+    r->endpos = -1;
+    r->timeout = 0;
+
     state = sw_start;
 
-    for (p = buf; p; p++) {
+    res_start = NULL;
+    text_start = NULL;
+    n = 0;
+    sign = 1;
+
+    last = buf + len;
+
+    for (p = buf; p < last; p++) {
         ch = *p;
 
         switch (state) {
             /* first char */
             case sw_start:
-                switch (ch) {
-                    case '2':
-                        state = sw_code_2;
-                        break;
+            case sw_status:
+                if (ch < '0' || ch > '9')
+                    return AGI_ERROR;
 
-                    default:
-                        return -1;
-                }
-                break;
-
-            case sw_code_2:
-                switch (ch) {
-                    case '0':
-                        state = sw_code_20;
-                        break;
+                r->status = r->status * 10 + (ch - '0');
 
-                    default:
-                        return -1;
-                }
-                break;
-
-            case sw_code_20:
-                switch (ch) {
-                    case '0':
-                        state = sw_code_200;
-                        break;
+                if (p - buf == 2)
+                    state = sw_after_status;
+                else
+                    state = sw_status;
 
-                    default:
-                        return -1;
-                }
                 break;
 
-            case sw_code_200:
+            case sw_after_status:
                 switch (ch) {
                     case ' ':
-                        state = sw_space_before_result;
+                        if (r->status == 200) {
+                            state = sw_space_before_result;
+                            break;
+                        }
+
+                        text_start = p + 1;
+                        state = sw_text;
                         break;
 
+                    case '-':
+                        return r->status == 520 ? AGI_AGAIN : AGI_ERROR;
+
                     default:
-                        return -1;
+                        return AGI_ERROR;
                 }
                 break;
 
@@ -286,7 +234,7 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
                         break;
 
                     default:
-                        return -1;
+                        return AGI_ERROR;
                 }
                 break;
 
@@ -297,7 +245,7 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
                         break;
 
                     default:
-                        return -1;
+                        return AGI_ERROR;
                 }
                 break;
 
@@ -308,7 +256,7 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
                         break;
 
                     default:
-                        return -1;
+                        return AGI_ERROR;
                 }
                 break;
 
@@ -319,7 +267,7 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
                         break;
 
                     default:
-                        return -1;
+                        return AGI_ERROR;
                 }
                 break;
 
@@ -330,7 +278,7 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
                         break;
 
                     default:
-                        return -1;
+                        return AGI_ERROR;
                 }
                 break;
 
@@ -341,7 +289,7 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
                         break;
 
                     default:
-                        return -1;
+                        return AGI_ERROR;
                 }
                 break;
 
@@ -352,50 +300,66 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
                         break;
 
                     default:
-                        return -1;
+                        return AGI_ERROR;
                 }
                 break;
 
             case sw_equal_sign_after_result:
                 c = digit[ch];
 
-                if (c) {
-                    res_start = p;
-                    state = sw_return_value;
-                    break;
-                }
+                if (c == 0)
+                    return AGI_ERROR;
+
+                res_start = p;
+
+                if (c == '-')
+                    sign = -1;
                 else
-                    return -1;
+                    n = c - '0';
 
+                state = sw_return_value;
                 break;
 
             case sw_return_value:
                 c = digit[ch];
 
-                if (c)
+                if (c && c != '-') {
+                    if (n > (INT_MAX - (c - '0')) / 10)
+                        n = INT_MAX;
+                    else
+                        n = n * 10 + (c - '0');
+
                     break;
+                }
 
                 switch (ch) {
                     case LF:
+                    case CR:
+                    case ' ':
                         /*
                          * 200 result=-
                          * negative value with no digit
                          */
                         if (*(p - 1) == '-')
-                            return -1;
+                            return AGI_ERROR;
 
-                        res_end = p;
-                        data_start = p;
-                        data_end = p;
-                        goto done;
+                        r->result.data = res_start;
+                        r->result.len = (size_t)(p - res_start);
+                        r->code = sign * n;
+
+                        if (ch == LF)
+                            goto done;
+
+                        if (ch == CR) {
+                            state = sw_almost_done;
+                            break;
+                        }
 
-                    case ' ':
-                        res_end = p;
                         state = sw_space_before_data;
                         break;
 
                     default:
-                        return -1;
+                        return AGI_ERROR;
                 }
                 break;
 
@@ -404,41 +368,113 @@ agi_parse_command_response_line(char *buf, char *result, char *data)
                     case ' ':
                         break;
 
-                    case '\0':
-                        return -1;
+                    case LF:
+                        goto done;
+
+                    case CR:
+                        state = sw_almost_done;
+                        break;
 
                     default:
-                        data_start = p;
-                        state = sw_data;
+                        text_start = p;
+                        state = sw_text;
                         break;
                 }
                 break;
 
-            case sw_data:
-                switch (ch) {
-                    case LF:
-                        data_end = p;
-                        goto done;
+            /* CR from peers that send CRLF, see below for the data */
+            case sw_almost_done:
+                if (ch == LF)
+                    goto done;
 
-                    case '\0':
-                        return -1;
+                return AGI_ERROR;
 
-                    default:
-                        break;
+            /* data of a 200 reply, or the message of any other status */
+            case sw_text:
+                if (ch == LF) {
+                    r->data.data = text_start;
+                    r->data.len = (size_t)(p - text_start);
+                    goto done;
                 }
+
                 break;
         }
     }
 
+    /* no LF */
+    return AGI_ERROR;
+
 done:
 
-    len = res_end - res_start;
-    res_start[len] = '\0';
-    (void)strlcpy(result, res_start, BUFSIZ);
+    /* trailing blanks, and CR from peers that send CRLF */
+    while (r->data.len
+           && (r->data.data[r->data.len - 1] == ' '
+               || r->data.data[r->data.len - 1] == '\r'))
+    {
+        r->data.len--;
+    }
 
-    len = data_end - data_start;
-    data_start[len] = '\0';
-    (void)strlcpy(data, data_start, BUFSIZ);
+    if (r->status == 200)
+        agi_parse_result_data(r);
 
-    return 0;
+    return AGI_OK;
+}
+
+/*
+ * Split the data of a 200 reply into its parenthesized value, as in
+ * "(timeout)" or the "(value)" of get variable, and "endpos=<n>"
+ */
+static void
+agi_parse_result_data(agi_result_t *r)
+{
+    long        n;
+    const char *p, *last, *start;
+
+    p = r->data.data;
+    last = p + r->data.len;
+
+    if (p == last)
+        return;
+
+    /* "endpos=<n>" is always the last field */
+    for (start = last; start > p && start[-1] != ' ' && start[-1] != ')';
+         start--)
+    {
+        /* void */
+    }
+
+    if (last - start > (ptrdiff_t)(sizeof "endpos=" - 1)
+        && memcmp(start, "endpos=", sizeof "endpos=" - 1) == 0)
+    {
+        n = 0;
+
+        for (p = start + sizeof "endpos=" - 1; p < last; p++) {
+            if (*p < '0' || *p > '9')
+                break;
+
+            if (n > (LONG_MAX - (*p - '0')) / 10)
+                n = LONG_MAX;
+            else
+                n = n * 10 + (*p - '0');
+        }
+
+        if (p == last) {
+            r->endpos = n;
+            last = start;
+
+            while (last > r->data.data && last[-1] == ' ')
+                last--;
+        }
+    }
+
+    p = r->data.data;
+
+    if (last - p >= 2 && *p == '(' && last[-1] == ')') {
+        r->value.data = p + 1;
+        r->value.len = (size_t)(last - p) - 2;
+
+        r->timeout = r->value.len == sizeof "timeout" - 1
+                     && memcmp(r->value.data, "timeout",
+                               sizeof "timeout" - 1) == 0;
+    }
 }
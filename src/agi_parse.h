@@ -0,0 +1,69 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * AGI environment and command reply parsers
+ */
+
+#ifndef AGI_PARSE_H
+#define AGI_PARSE_H
+
+#include <stddef.h>
+#include <string.h>         /* memcmp */
+
+#include "agi_core.h"
+#include "agi_pool.h"       /* agi_arena_t */
+
+/*
+ * State of the environment parser, kept across partial reads. Positions are
+ * offsets into the caller's buffer so that it may be reallocated between two
+ * calls as long as the bytes already fed are preserved.
+ */
+typedef struct {
+    size_t      pos;            /* start of the current line */
+    size_t      scanned;        /* bytes before it hold no LF */
+    size_t      colon;          /* first ':' of the current line, or 0 */
+    size_t      variable_start;
+    size_t      variable_end;
+    size_t      value_start;
+    size_t      value_end;
+    unsigned    hash;           /* agi_env_hash() of the variable name */
+    unsigned    nul:1;          /* the current line holds a null byte */
+} agi_env_parser_t;
+
+/*
+ * A parsed command reply. The views point into the session read buffer and
+ * remain valid until the next command is sent on the session.
+ */
+typedef struct {
+    int         status;         /* 200, 510, 511 or 520 */
+    int         code;           /* result=<n>, -1 unless status is 200 */
+    agi_str_t   result;         /* <n> as sent, leading zeros included */
+    agi_str_t   data;           /* whatever follows result=<n> */
+    agi_str_t   value;          /* data inside the leading parentheses */
+    long        endpos;         /* endpos=<n>, -1 when absent */
+    unsigned    timeout:1;      /* value is "timeout" */
+} agi_result_t;
+
+/*
+ * Written by Asterisk on its own, between two replies, when the channel hangs
+ * up and AGISIGHUP is "no"
+ */
+#define AGI_HANGUP              "HANGUP\n"
+
+/* buf[0 .. len) is a line as agi_buf_line() returns it, LF included */
+#define agi_parse_hangup(buf, len)                                            \
+    ((len) == sizeof AGI_HANGUP - 1                                           \
+     && memcmp(buf, AGI_HANGUP, sizeof AGI_HANGUP - 1) == 0)
+
+void agi_env_parser_init(agi_env_parser_t *ep);
+
+int agi_parse_environment_variable_line(agi_env_parser_t *ep,
+    const char *buf, size_t len);
+int agi_parse_command_response_line(const char *buf, size_t len,
+    agi_result_t *r);
+
+int agi_getenvironment(int fd, agi_env_t *env, char *buf, size_t bufsz);
+int agi_process_environment(agi_env_parser_t *ep, agi_env_t *env,
+    agi_arena_t *arena, char *buf, size_t len);
+
+#endif /* AGI_PARSE_H */
@@ -0,0 +1,284 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Preallocated session slots, each with a bump arena
+ */
+
+#include <stdlib.h>
+#include <string.h>         /* memcpy, memset */
+
+#include <sys/mman.h>
+
+#include "agi_pool.h"
+#include "log.h"
+
+#define agi_align(n, a)     (((n) + ((a) - 1)) & ~((size_t)(a) - 1))
+
+#define AGI_POOL_ALIGN      64                  /* a cache line */
+#define AGI_POOL_HUGE_SIZE  (2 * 1024 * 1024)
+
+struct agi_arena_large_s {
+    agi_arena_large_t      *next;
+    size_t                  size;
+    /* AGI_ARENA_ALIGN aligned data follows */
+};
+
+#define AGI_ARENA_LARGE_SIZE                                                  \
+    agi_align(sizeof(agi_arena_large_t), AGI_ARENA_ALIGN)
+
+#define agi_arena_large_data(l)     ((char *)(l) + AGI_ARENA_LARGE_SIZE)
+#define agi_arena_large(p)                                                    \
+    ((agi_arena_large_t *)((char *)(p) - AGI_ARENA_LARGE_SIZE))
+
+static void *agi_arena_alloc_large(agi_arena_t *a, size_t size);
+static void *agi_arena_realloc_large(agi_arena_t *a, void *p, size_t size);
+
+void
+agi_arena_init(agi_arena_t *a, void *mem, size_t size)
+{
+    a->start = mem;
+    a->pos = mem;
+    a->end = (char *)mem + size;
+    a->last = NULL;
+    a->large = NULL;
+}
+
+void *
+agi_arena_alloc(agi_arena_t *a, size_t size)
+{
+    char   *p;
+
+    if (size <= (size_t)(a->end - a->pos)) {
+        p = a->pos;
+
+        a->pos = p + agi_align(size, AGI_ARENA_ALIGN);
+        if (a->pos > a->end)
+            a->pos = a->end;
+
+        a->last = p;
+
+        return p;
+    }
+
+    return agi_arena_alloc_large(a, size);
+}
+
+void *
+agi_arena_calloc(agi_arena_t *a, size_t size)
+{
+    void   *p;
+
+    p = agi_arena_alloc(a, size);
+
+    if (p)
+        (void)memset(p, 0, size);
+
+    return p;
+}
+
+/*
+ * The latest bump allocation grows or shrinks in place. Any other bump
+ * allocation is copied, its old space being lost until the reset.
+ */
+void *
+agi_arena_realloc(agi_arena_t *a, void *p, size_t old, size_t size)
+{
+    void   *n;
+
+    if (p == NULL)
+        return agi_arena_alloc(a, size);
+
+    if ((char *)p < a->start || (char *)p >= a->end)
+        return agi_arena_realloc_large(a, p, size);
+
+    if (p == a->last && size <= (size_t)(a->end - (char *)p)) {
+        a->pos = (char *)p + agi_align(size, AGI_ARENA_ALIGN);
+        if (a->pos > a->end)
+            a->pos = a->end;
+
+        return p;
+    }
+
+    if (size <= old)
+        return p;
+
+    n = agi_arena_alloc(a, size);
+    if (n == NULL)
+        return NULL;
+
+    (void)memcpy(n, p, old);
+
+    return n;
+}
+
+/* constant time unless allocations went to the heap */
+void
+agi_arena_reset(agi_arena_t *a)
+{
+    agi_arena_large_t  *l, *next;
+
+    for (l = a->large; l; l = next) {
+        next = l->next;
+        free(l);
+    }
+
+    a->pos = a->start;
+    a->last = NULL;
+    a->large = NULL;
+}
+
+static void *
+agi_arena_alloc_large(agi_arena_t *a, size_t size)
+{
+    agi_arena_large_t  *l;
+
+    l = malloc(AGI_ARENA_LARGE_SIZE + size);
+    if (l == NULL) {
+        log(LOG_ERR, "malloc() failed");
+        return NULL;
+    }
+
+    l->size = size;
+    l->next = a->large;
+    a->large = l;
+
+    return agi_arena_large_data(l);
+}
+
+static void *
+agi_arena_realloc_large(agi_arena_t *a, void *p, size_t size)
+{
+    agi_arena_large_t  *l, *n, **prev;
+
+    l = agi_arena_large(p);
+
+    for (prev = &a->large; *prev != l; prev = &(*prev)->next) {
+        /* void */
+    }
+
+    n = realloc(l, AGI_ARENA_LARGE_SIZE + size);
+    if (n == NULL) {
+        log(LOG_ERR, "realloc() failed");
+        return NULL;
+    }
+
+    n->size = size;
+    *prev = n;
+
+    return agi_arena_large_data(n);
+}
+
+/*
+ * Slots are handed out from the start of the mapping the first time and
+ * from the free list afterwards, so pages are only touched once used.
+ */
+agi_pool_t *
+agi_pool_create(size_t n, size_t object_size, size_t arena_size,
+    unsigned flags)
+{
+    int          mflags;
+    void        *mem;
+    size_t       size, mem_size;
+    agi_pool_t  *pool;
+
+    object_size = agi_align(object_size, AGI_POOL_ALIGN);
+    size = object_size + agi_align(arena_size, AGI_POOL_ALIGN);
+    mem_size = size * n;
+
+    mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+    mem = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (flags & AGI_POOL_HUGE) {
+        mem_size = agi_align(mem_size, AGI_POOL_HUGE_SIZE);
+        mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
+                   mflags | MAP_HUGETLB, -1, 0);
+
+        if (mem == MAP_FAILED)
+            log(LOG_ERR, "mmap(MAP_HUGETLB) failed, using regular pages");
+    }
+#endif
+
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, mflags, -1, 0);
+        if (mem == MAP_FAILED) {
+            log(LOG_ERR, "mmap() failed");
+            return NULL;
+        }
+
+#ifdef MADV_HUGEPAGE
+        /* transparent huge pages, when enabled for madvise() */
+        if (flags & AGI_POOL_HUGE)
+            (void)madvise(mem, mem_size, MADV_HUGEPAGE);
+#endif
+    }
+
+    pool = calloc(1, sizeof *pool);
+    if (pool == NULL) {
+        log(LOG_ERR, "calloc() failed");
+        (void)munmap(mem, mem_size);
+        return NULL;
+    }
+
+    pool->mem = mem;
+    pool->mem_size = mem_size;
+    pool->object_size = object_size;
+    pool->size = size;
+    pool->stats.nslots = n;
+
+    return pool;
+}
+
+void
+agi_pool_destroy(agi_pool_t *pool)
+{
+    (void)munmap(pool->mem, pool->mem_size);
+    free(pool);
+}
+
+/*
+ * A zeroed object, or NULL when all slots are in use, which the caller may
+ * answer with a heap allocation
+ */
+void *
+agi_pool_get(agi_pool_t *pool)
+{
+    char   *p;
+
+    if (pool->free) {
+        p = pool->free;
+        pool->free = *(void **)p;
+
+    } else if (pool->stats.nused < pool->stats.nslots) {
+        /* no slot was ever released: the first unused one is next */
+        p = pool->mem + pool->stats.nused * pool->size;
+
+    } else {
+        pool->stats.nexhausted++;
+        return NULL;
+    }
+
+    if (++pool->stats.nused > pool->stats.peak)
+        pool->stats.peak = pool->stats.nused;
+
+    (void)memset(p, 0, pool->object_size);
+
+    return p;
+}
+
+/* set arena to the part of the slot that follows the object */
+void
+agi_pool_arena(agi_pool_t *pool, void *object, agi_arena_t *arena)
+{
+    agi_arena_init(arena, (char *)object + pool->object_size,
+                   pool->size - pool->object_size);
+}
+
+void
+agi_pool_put(agi_pool_t *pool, void *object)
+{
+    *(void **)object = pool->free;
+    pool->free = object;
+
+    pool->stats.nused--;
+}
@@ -0,0 +1,69 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Preallocated session slots, each with a bump arena
+ */
+
+#ifndef AGI_POOL_H
+#define AGI_POOL_H
+
+#include <stddef.h>
+
+#include "agi_core.h"
+
+#define AGI_ARENA_ALIGN     16
+
+#define AGI_POOL_HUGE       0x01    /* back the slots with huge pages */
+
+typedef struct agi_arena_large_s    agi_arena_large_t;
+
+/*
+ * Allocations are bumped out of [start, end) and released all at once by
+ * agi_arena_reset(). What does not fit is taken from the heap and freed by
+ * the reset as well; an arena without memory of its own only does that.
+ */
+typedef struct {
+    char                   *start;
+    char                   *pos;
+    char                   *end;
+    char                   *last;       /* latest bump allocation */
+    agi_arena_large_t      *large;
+} agi_arena_t;
+
+typedef struct {
+    size_t                  nslots;
+    size_t                  nused;
+    size_t                  peak;
+    unsigned long           nexhausted; /* gets refused for lack of slots */
+} agi_pool_stats_t;
+
+/*
+ * n slots of size bytes, the first object_size of which hold the object and
+ * the rest its arena. A pool belongs to one thread: it is not locked.
+ */
+struct agi_pool_s {
+    char                   *mem;
+    size_t                  mem_size;
+    size_t                  object_size;
+    size_t                  size;
+
+    void                   *free;       /* next free slot */
+
+    agi_pool_stats_t        stats;
+};
+
+void agi_arena_init(agi_arena_t *a, void *mem, size_t size);
+void *agi_arena_alloc(agi_arena_t *a, size_t size);
+void *agi_arena_calloc(agi_arena_t *a, size_t size);
+void *agi_arena_realloc(agi_arena_t *a, void *p, size_t old, size_t size);
+void agi_arena_reset(agi_arena_t *a);
+
+agi_pool_t *agi_pool_create(size_t n, size_t object_size, size_t arena_size,
+    unsigned flags);
+void agi_pool_destroy(agi_pool_t *pool);
+
+void *agi_pool_get(agi_pool_t *pool);
+void agi_pool_arena(agi_pool_t *pool, void *object, agi_arena_t *arena);
+void agi_pool_put(agi_pool_t *pool, void *object);
+
+#endif /* AGI_POOL_H */
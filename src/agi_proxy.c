@@ -0,0 +1,483 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * FastAGI reverse proxy relaying sessions to backend pools with splice()
+ *
+ * The proxy reads and parses the AGI environment of a session as any other
+ * handler does, picks the pool whose prefix is the longest match of
+ * agi_network_script and, in that pool, the backend relaying the fewest
+ * sessions. It connects to it, replays the environment byte for byte as it
+ * was received, unknown variables included, and from then on
+ * only moves bytes between the two sockets: splice() through a pipe per
+ * direction, so that the kernel hands pages over and nothing is copied to
+ * user space.
+ *
+ * The relay relies on readiness, which io_uring sessions do not report: it
+ * needs an epoll event loop, created with AGI_EVENT_LOOP_RAW_ENV.
+ */
+
+#define _GNU_SOURCE         /* splice, pipe2, F_SETPIPE_SZ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netdb.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "agi_proxy.h"
+#include "agi_env.h"
+#include "agi_session.h"
+#include "log.h"
+
+typedef struct {
+    int                     fd[2];
+    size_t                  len;        /* bytes in the pipe */
+    unsigned                eof:1;      /* from the source */
+    unsigned                shut:1;     /* the destination, once drained */
+} agi_proxy_pipe_t;
+
+typedef struct {
+    agi_event_t             ev;         /* the backend, must be first */
+    agi_session_t          *session;    /* the client */
+    agi_proxy_backend_t    *backend;
+
+    /* the environment replayed, and what the client sent right after it */
+    char                   *head;
+    size_t                  head_len;
+    size_t                  head_sent;
+
+    agi_proxy_pipe_t        up;         /* client to backend */
+    agi_proxy_pipe_t        down;       /* backend to client */
+
+    unsigned                connected:1;
+} agi_proxy_conn_t;
+
+static agi_proxy_backend_t *agi_proxy_backend(agi_proxy_t *p,
+    const char *script);
+static int agi_proxy_connect(agi_proxy_conn_t *c);
+static int agi_proxy_head(agi_proxy_conn_t *c);
+static void agi_proxy_client_handler(agi_event_t *ev, uint32_t events);
+static void agi_proxy_backend_handler(agi_event_t *ev, uint32_t events);
+static void agi_proxy_run(agi_proxy_conn_t *c, uint32_t events);
+static int agi_proxy_relay(agi_proxy_pipe_t *p, int src, int dst,
+    int writable);
+static int agi_proxy_pipe(agi_proxy_pipe_t *p);
+static void agi_proxy_close(agi_session_t *s);
+
+/* Resolve the address of every backend */
+int
+agi_proxy_init(agi_proxy_t *p)
+{
+    int                     rv;
+    unsigned                i, j;
+    struct addrinfo         hints, *res;
+    agi_proxy_backend_t    *b;
+
+    (void)memset(&hints, 0, sizeof hints);
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    for (i = 0; i < p->npools; i++) {
+        for (j = 0; j < p->pools[i].nbackends; j++) {
+            b = &p->pools[i].backends[j];
+
+            rv = getaddrinfo(b->host, b->port, &hints, &res);
+            if (rv != 0) {
+                log(LOG_ERR, "getaddrinfo(%s) failed: %s", b->host,
+                    gai_strerror(rv));
+                return -1;
+            }
+
+            (void)memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+            b->addrlen = res->ai_addrlen;
+
+            atomic_init(&b->nsessions, 0);
+
+            freeaddrinfo(res);
+        }
+    }
+
+    return 0;
+}
+
+void
+agi_proxy_handler(agi_session_t *s)
+{
+    size_t              len, rest;
+    const char         *script;
+    agi_proxy_t        *p = s->loop->data;
+    agi_proxy_conn_t   *c;
+
+    if (s->pushed) {
+        log(LOG_ERR, "agi proxy needs an epoll event loop");
+        agi_session_close(s);
+        return;
+    }
+
+    if (s->env_raw == NULL) {
+        log(LOG_ERR, "agi proxy needs AGI_EVENT_LOOP_RAW_ENV");
+        agi_session_close(s);
+        return;
+    }
+
+    script = agi_session_env(s, AGI_ENV_NETWORK_SCRIPT);
+
+    c = agi_session_alloc(s, sizeof *c);
+    if (c == NULL) {
+        agi_session_close(s);
+        return;
+    }
+
+    (void)memset(c, 0, sizeof *c);
+
+    c->ev.fd = -1;
+    c->up.fd[0] = c->up.fd[1] = -1;
+    c->down.fd[0] = c->down.fd[1] = -1;
+    c->session = s;
+
+    c->backend = agi_proxy_backend(p, script ? script : "");
+    if (c->backend == NULL) {
+        log(LOG_ERR, "no agi backend for \"%s\"", script ? script : "");
+        agi_session_close(s);
+        return;
+    }
+
+    atomic_fetch_add_explicit(&c->backend->nsessions, 1,
+                              memory_order_relaxed);
+
+    s->data = c;
+    s->close_handler = agi_proxy_close;
+
+    /* the environment as received, and what the client sent right after */
+    len = s->env_len;
+    rest = agi_buf_len(&s->in);
+
+    c->head = agi_session_alloc(s, len + rest);
+    if (c->head == NULL) {
+        agi_session_close(s);
+        return;
+    }
+
+    (void)memcpy(c->head, s->env_raw, len);
+    (void)memcpy(c->head + len, s->in.pos, rest);
+
+    s->in.pos = s->in.last;
+
+    c->head_len = len + rest;
+
+    if (agi_proxy_pipe(&c->up) == -1 || agi_proxy_pipe(&c->down) == -1
+        || agi_proxy_connect(c) == -1)
+    {
+        agi_session_close(s);
+        return;
+    }
+
+    /* the socket is ours: the session does no more I/O on it */
+    s->detached = 1;
+    s->ev.handler = agi_proxy_client_handler;
+
+    /* what the client sent since the environment raised no event */
+    agi_proxy_run(c, 0);
+}
+
+/* Least outstanding sessions in the pool of the longest matching prefix */
+static agi_proxy_backend_t *
+agi_proxy_backend(agi_proxy_t *p, const char *script)
+{
+    size_t                  len, best_len;
+    unsigned                i, n, min;
+    agi_proxy_pool_t       *pool, *best;
+    agi_proxy_backend_t    *b;
+
+    best = NULL;
+    best_len = 0;
+
+    for (i = 0; i < p->npools; i++) {
+        pool = &p->pools[i];
+        len = strlen(pool->prefix);
+
+        if ((best == NULL || len > best_len) && pool->nbackends
+            && strncmp(script, pool->prefix, len) == 0)
+        {
+            best = pool;
+            best_len = len;
+        }
+    }
+
+    if (best == NULL)
+        return NULL;
+
+    b = &best->backends[0];
+    min = atomic_load_explicit(&b->nsessions, memory_order_relaxed);
+
+    for (i = 1; i < best->nbackends && min; i++) {
+        n = atomic_load_explicit(&best->backends[i].nsessions,
+                                 memory_order_relaxed);
+
+        if (n < min) {
+            b = &best->backends[i];
+            min = n;
+        }
+    }
+
+    return b;
+}
+
+static int
+agi_proxy_connect(agi_proxy_conn_t *c)
+{
+    int                     fd;
+    int                     on = 1;
+    agi_proxy_backend_t    *b = c->backend;
+
+    fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                0);
+    if (fd == -1) {
+        log(LOG_ERR, "socket() failed");
+        return -1;
+    }
+
+    if (b->addr.ss_family != AF_UNIX
+        && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on) == -1)
+    {
+        log(LOG_ERR, "setsockopt(TCP_NODELAY) failed");
+    }
+
+    if (connect(fd, (struct sockaddr *)&b->addr, b->addrlen) == -1
+        && errno != EINPROGRESS)
+    {
+        log(LOG_ERR, "connect() to %s:%s failed", b->host, b->port);
+        (void)close(fd);
+        return -1;
+    }
+
+    c->ev.fd = fd;
+    c->ev.handler = agi_proxy_backend_handler;
+
+    /* EPOLLOUT tells when connected */
+    if (agi_event_add(c->session->loop, &c->ev,
+                      EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == -1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+agi_proxy_client_handler(agi_event_t *ev, uint32_t events)
+{
+    agi_session_t  *s = (agi_session_t *)ev;
+
+    if (s->closing)
+        return;
+
+    agi_proxy_run(s->data, events);
+}
+
+static void
+agi_proxy_backend_handler(agi_event_t *ev, uint32_t events)
+{
+    int                 err;
+    socklen_t           len;
+    agi_proxy_conn_t   *c = (agi_proxy_conn_t *)ev;
+
+    if (c->session->closing)
+        return;
+
+    if (!c->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        err = 0;
+        len = sizeof err;
+
+        (void)getsockopt(ev->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+        if (err) {
+            errno = err;
+            log(LOG_ERR, "connect() to %s:%s failed", c->backend->host,
+                c->backend->port);
+            agi_session_close(c->session);
+            return;
+        }
+
+        c->connected = 1;
+    }
+
+    agi_proxy_run(c, events);
+}
+
+static void
+agi_proxy_run(agi_proxy_conn_t *c, uint32_t events)
+{
+    int             rv;
+    agi_session_t  *s = c->session;
+
+    if (events & EPOLLERR)
+        goto failed;
+
+    rv = agi_proxy_head(c);
+    if (rv == AGI_ERROR)
+        goto failed;
+
+    if (agi_proxy_relay(&c->up, s->ev.fd, c->ev.fd, rv == AGI_OK)
+        == AGI_ERROR)
+    {
+        goto failed;
+    }
+
+    if (c->connected
+        && agi_proxy_relay(&c->down, c->ev.fd, s->ev.fd, 1) == AGI_ERROR)
+    {
+        goto failed;
+    }
+
+    if (c->up.shut && c->down.shut)
+        agi_session_close(s);
+
+    return;
+
+failed:
+
+    agi_session_close(s);
+}
+
+/* The head goes first. Returns AGI_OK once sent, AGI_AGAIN until then. */
+static int
+agi_proxy_head(agi_proxy_conn_t *c)
+{
+    ssize_t     n;
+
+    if (!c->connected)
+        return AGI_AGAIN;
+
+    while (c->head_sent < c->head_len) {
+        n = send(c->ev.fd, c->head + c->head_sent, c->head_len - c->head_sent,
+                 MSG_NOSIGNAL);
+
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return AGI_AGAIN;
+
+            if (errno == EINTR)
+                continue;
+
+            log(LOG_ERR, "send() to the agi backend failed");
+            return AGI_ERROR;
+        }
+
+        c->head_sent += (size_t)n;
+    }
+
+    return AGI_OK;
+}
+
+/*
+ * Move what src has to dst through the pipe until either blocks; with
+ * edge-triggered events, the next one comes once they no longer would. The
+ * pipe is only filled while dst is not writable, the source being left to
+ * apply back pressure once it is full.
+ */
+static int
+agi_proxy_relay(agi_proxy_pipe_t *p, int src, int dst, int writable)
+{
+    ssize_t     n;
+    unsigned    moved;
+
+    do {
+        moved = 0;
+
+        if (p->len && writable) {
+            n = splice(p->fd[0], NULL, dst, NULL, p->len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (n > 0) {
+                p->len -= (size_t)n;
+                moved = 1;
+            }
+            else if (n == 0) {
+                /* nothing taken: tried again with the next event */
+                writable = 0;
+            }
+            else if (errno == EAGAIN) {
+                writable = 0;
+            }
+            else if (errno != EINTR) {
+                log(LOG_ERR, "splice() to %d failed", dst);
+                return AGI_ERROR;
+            }
+        }
+
+        if (!p->eof && p->len < AGI_PROXY_SPLICE_LEN) {
+            n = splice(src, NULL, p->fd[1], NULL,
+                       AGI_PROXY_SPLICE_LEN - p->len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (n > 0) {
+                p->len += (size_t)n;
+                moved = 1;
+            }
+            else if (n == 0) {
+                p->eof = 1;
+            }
+            else if (errno != EAGAIN && errno != EINTR) {
+                log(LOG_ERR, "splice() from %d failed", src);
+                return AGI_ERROR;
+            }
+        }
+
+    } while (moved);
+
+    /* pass the end of the stream on, once everything before it is */
+    if (p->eof && p->len == 0 && writable && !p->shut) {
+        (void)shutdown(dst, SHUT_WR);
+        p->shut = 1;
+    }
+
+    return AGI_OK;
+}
+
+static int
+agi_proxy_pipe(agi_proxy_pipe_t *p)
+{
+    if (pipe2(p->fd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        log(LOG_ERR, "pipe2() failed");
+        return -1;
+    }
+
+    /* room for a whole splice() while the destination is blocked */
+    (void)fcntl(p->fd[1], F_SETPIPE_SZ, AGI_PROXY_SPLICE_LEN);
+
+    return 0;
+}
+
+/* the close handler of the session, the connection lives in its arena */
+static void
+agi_proxy_close(agi_session_t *s)
+{
+    agi_proxy_conn_t   *c = s->data;
+
+    atomic_fetch_sub_explicit(&c->backend->nsessions, 1,
+                              memory_order_relaxed);
+
+    if (c->ev.fd != -1)
+        (void)close(c->ev.fd);
+
+    if (c->up.fd[0] != -1) {
+        (void)close(c->up.fd[0]);
+        (void)close(c->up.fd[1]);
+    }
+
+    if (c->down.fd[0] != -1) {
+        (void)close(c->down.fd[0]);
+        (void)close(c->down.fd[1]);
+    }
+}
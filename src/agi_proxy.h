@@ -0,0 +1,52 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * FastAGI reverse proxy relaying sessions to backend pools with splice()
+ */
+
+#ifndef AGI_PROXY_H
+#define AGI_PROXY_H
+
+#include <stdatomic.h>
+
+#include <sys/socket.h>
+
+#include "agi_core.h"
+
+/* bytes moved by one splice(), and the capacity asked of the pipes */
+#define AGI_PROXY_SPLICE_LEN    (64 * 1024)
+
+typedef struct {
+    const char             *host;
+    const char             *port;
+
+    struct sockaddr_storage addr;       /* resolved by agi_proxy_init() */
+    socklen_t               addrlen;
+
+    /* sessions relayed to it right now, by all the workers */
+    atomic_uint             nsessions;
+} agi_proxy_backend_t;
+
+typedef struct {
+    /* the start of agi_network_script, "" for any */
+    const char             *prefix;
+
+    agi_proxy_backend_t    *backends;
+    unsigned                nbackends;
+} agi_proxy_pool_t;
+
+/*
+ * The session handler of the event loops of a proxy, with the agi_proxy_t
+ * as agi_event_loop_t.data, or agi_workers_conf_t.data. The loops keep the
+ * environment as received: AGI_EVENT_LOOP_RAW_ENV, or
+ * agi_workers_conf_t.raw_env.
+ */
+typedef struct {
+    agi_proxy_pool_t       *pools;
+    unsigned                npools;
+} agi_proxy_t;
+
+int agi_proxy_init(agi_proxy_t *p);
+void agi_proxy_handler(agi_session_t *s);
+
+#endif /* AGI_PROXY_H */
@@ -0,0 +1,715 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Dispatch of FastAGI sessions to handlers by agi_network_script
+ *
+ * Routes are patterns over the script path of agi://host/<path>?<query>:
+ *
+ *     ivr/billing             the path itself
+ *     ivr/:account/menu       :account captures one segment
+ *     *file                   *file captures the rest, and ends a pattern
+ *
+ * agi_router_compile() turns them into a radix trie laid out in one array,
+ * the static children of a node next to each other and sorted by their first
+ * byte. A lookup walks the path once, preferring a static edge to a
+ * parameter and a parameter to a wildcard, and only goes back when the
+ * preferred branch dead-ends. It allocates nothing: parameters are views
+ * into the path. The compiled router is only read, by all the workers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "agi_route.h"
+#include "agi_pool.h"
+#include "agi_session.h"
+#include "log.h"
+
+#define AGI_ROUTE_NONE      -1
+
+typedef struct {
+    char                   *pattern;    /* a copy, labels view into it */
+    agi_session_handler_pt  handler;
+    void                   *data;
+} agi_route_entry_t;
+
+/* the trie as it is built, released once laid out */
+typedef struct agi_route_tree_s     agi_route_tree_t;
+
+struct agi_route_tree_s {
+    const char             *label;
+    size_t                  len;
+
+    agi_route_tree_t       *child;      /* static, sorted by first byte */
+    agi_route_tree_t       *next;
+    agi_route_tree_t       *param;
+    agi_route_tree_t       *wildcard;
+
+    int                     route;
+};
+
+/* label is the static edge leading to the node, or the parameter name */
+typedef struct {
+    const char             *label;
+    uint32_t                len;
+
+    uint32_t                children;
+    uint32_t                nchildren;
+
+    int32_t                 param;
+    int32_t                 wildcard;
+    int32_t                 route;
+} agi_route_node_t;
+
+struct agi_router_s {
+    agi_route_entry_t      *routes;
+    unsigned                nroutes;
+    unsigned                size;
+
+    agi_route_node_t       *nodes;      /* NULL until compiled */
+    unsigned                nnodes;
+};
+
+static int agi_router_insert(agi_arena_t *a, agi_route_tree_t *root,
+    const char *pattern, int route, unsigned *n);
+static agi_route_tree_t *agi_router_static(agi_arena_t *a,
+    agi_route_tree_t *node, const char *s, size_t len, unsigned *n);
+static agi_route_tree_t *agi_route_tree_create(agi_arena_t *a,
+    const char *label, size_t len, unsigned *n);
+static int agi_router_find(const agi_router_t *r,
+    const agi_route_node_t *node, const char *p, size_t len,
+    agi_route_match_t *m);
+static const char *agi_router_path(agi_session_t *s);
+static int agi_route_parse_args(agi_session_t *s, agi_route_t *route,
+    const char *query, size_t len);
+static size_t agi_route_decode(char *dst, const char *src, size_t len);
+static const agi_str_t *agi_route_lookup(const agi_route_arg_t *args,
+    unsigned n, const char *name);
+
+agi_router_t *
+agi_router_create(void)
+{
+    agi_router_t   *r;
+
+    r = calloc(1, sizeof *r);
+    if (r == NULL)
+        log(LOG_ERR, "calloc() failed");
+
+    return r;
+}
+
+void
+agi_router_destroy(agi_router_t *r)
+{
+    unsigned    i;
+
+    for (i = 0; i < r->nroutes; i++)
+        free(r->routes[i].pattern);
+
+    free(r->routes);
+    free(r->nodes);
+    free(r);
+}
+
+/* Takes effect with the next agi_router_compile() */
+int
+agi_router_add(agi_router_t *r, const char *pattern,
+    agi_session_handler_pt handler, void *data)
+{
+    unsigned            size;
+    agi_route_entry_t  *routes;
+
+    if (r->nroutes == r->size) {
+        size = r->size ? r->size * 2 : 16;
+
+        routes = realloc(r->routes, size * sizeof *routes);
+        if (routes == NULL) {
+            log(LOG_ERR, "realloc() failed");
+            return -1;
+        }
+
+        r->routes = routes;
+        r->size = size;
+    }
+
+    while (*pattern == '/')
+        pattern++;
+
+    r->routes[r->nroutes].pattern = strdup(pattern);
+    if (r->routes[r->nroutes].pattern == NULL) {
+        log(LOG_ERR, "strdup() failed");
+        return -1;
+    }
+
+    r->routes[r->nroutes].handler = handler;
+    r->routes[r->nroutes].data = data;
+    r->nroutes++;
+
+    return 0;
+}
+
+/*
+ * Build the trie of every route added so far. Fails on a malformed pattern
+ * or on two patterns matching the same paths.
+ */
+int
+agi_router_compile(agi_router_t *r)
+{
+    int                     rv;
+    unsigned                i, n, nnodes;
+    agi_arena_t             a;
+    agi_route_tree_t       *root, *t, *c, **order;
+    agi_route_node_t       *nodes, *node;
+
+    rv = -1;
+    order = NULL;
+    nodes = NULL;
+    nnodes = 0;
+
+    /* the tree nodes all come from the heap and go at once */
+    agi_arena_init(&a, NULL, 0);
+
+    root = agi_route_tree_create(&a, "", 0, &nnodes);
+    if (root == NULL)
+        goto done;
+
+    for (i = 0; i < r->nroutes; i++) {
+        if (agi_router_insert(&a, root, r->routes[i].pattern, (int)i, &nnodes)
+            == -1)
+        {
+            goto done;
+        }
+    }
+
+    order = malloc(nnodes * sizeof *order);
+    nodes = malloc(nnodes * sizeof *nodes);
+
+    if (order == NULL || nodes == NULL) {
+        log(LOG_ERR, "malloc() failed");
+        goto done;
+    }
+
+    /* breadth first, so that the static children of a node are contiguous */
+    order[0] = root;
+    n = 1;
+
+    for (i = 0; i < n; i++) {
+        t = order[i];
+        node = &nodes[i];
+
+        node->label = t->label;
+        node->len = (uint32_t)t->len;
+        node->route = t->route;
+        node->children = n;
+        node->nchildren = 0;
+
+        for (c = t->child; c; c = c->next) {
+            order[n++] = c;
+            node->nchildren++;
+        }
+
+        node->param = AGI_ROUTE_NONE;
+        node->wildcard = AGI_ROUTE_NONE;
+
+        if (t->param) {
+            node->param = (int32_t)n;
+            order[n++] = t->param;
+        }
+
+        if (t->wildcard) {
+            node->wildcard = (int32_t)n;
+            order[n++] = t->wildcard;
+        }
+    }
+
+    free(r->nodes);
+
+    r->nodes = nodes;
+    r->nnodes = nnodes;
+
+    nodes = NULL;
+    rv = 0;
+
+done:
+
+    free(nodes);
+    free(order);
+    agi_arena_reset(&a);
+
+    return rv;
+}
+
+/*
+ * Match a path, without its leading '/' and its query, against the compiled
+ * routes. Returns 0 and fills m, or -1 when no route matches.
+ */
+int
+agi_router_match(const agi_router_t *r, const char *path, size_t len,
+    agi_route_match_t *m)
+{
+    if (r->nodes == NULL)
+        return -1;
+
+    m->nparams = 0;
+
+    return agi_router_find(r, r->nodes, path, len, m) ? 0 : -1;
+}
+
+/*
+ * The session handler of the event loops of a router, with the agi_router_t
+ * as agi_event_loop_t.data: it sets agi_session_t.route and calls the
+ * handler of the route.
+ */
+void
+agi_router_handler(agi_session_t *s)
+{
+    size_t              len, plen;
+    const char         *path, *query;
+    agi_route_t        *route;
+    agi_router_t       *r = s->loop->data;
+    agi_route_match_t   m;
+
+    path = agi_router_path(s);
+    if (path == NULL) {
+        log(LOG_ERR, "session %d has no agi_network_script", s->ev.fd);
+        agi_session_close(s);
+        return;
+    }
+
+    len = strlen(path);
+
+    query = memchr(path, '?', len);
+    plen = query ? (size_t)(query - path) : len;
+
+    if (agi_router_match(r, path, plen, &m) == -1) {
+        log(LOG_ERR, "no agi route for \"%.*s\"", (int)plen, path);
+        agi_session_close(s);
+        return;
+    }
+
+    route = agi_session_alloc(s, sizeof *route
+                                 + m.nparams * sizeof(agi_route_arg_t));
+    if (route == NULL) {
+        agi_session_close(s);
+        return;
+    }
+
+    route->pattern = r->routes[m.route].pattern;
+    route->data = r->routes[m.route].data;
+    route->params = (agi_route_arg_t *)(route + 1);
+    route->nparams = m.nparams;
+    route->args = NULL;
+    route->nargs = 0;
+
+    (void)memcpy(route->params, m.params, m.nparams * sizeof *m.params);
+
+    if (query
+        && agi_route_parse_args(s, route, query + 1, len - plen - 1) == -1)
+    {
+        agi_session_close(s);
+        return;
+    }
+
+    s->route = route;
+
+    r->routes[m.route].handler(s);
+}
+
+/* value of the path parameter name of the route, or NULL */
+const agi_str_t *
+agi_route_param(agi_session_t *s, const char *name)
+{
+    if (s->route == NULL)
+        return NULL;
+
+    return agi_route_lookup(s->route->params, s->route->nparams, name);
+}
+
+/* decoded value of the query argument name, or NULL */
+const agi_str_t *
+agi_route_arg(agi_session_t *s, const char *name)
+{
+    if (s->route == NULL)
+        return NULL;
+
+    return agi_route_lookup(s->route->args, s->route->nargs, name);
+}
+
+static int
+agi_router_insert(agi_arena_t *a, agi_route_tree_t *root,
+    const char *pattern, int route, unsigned *n)
+{
+    char                kind;
+    unsigned            nparams;
+    const char         *p, *q, *name;
+    agi_route_tree_t   *node, **slot;
+
+    node = root;
+    nparams = 0;
+
+    /* ':' and '*' only mean a parameter at the start of a segment */
+#define agi_route_special(p)                                                  \
+    ((*(p) == ':' || *(p) == '*') && ((p) == pattern || (p)[-1] == '/'))
+
+    for (p = pattern; *p; /* void */) {
+
+        if (!agi_route_special(p)) {
+            for (q = p + 1; *q && !agi_route_special(q); q++) {
+                /* void */
+            }
+
+            node = agi_router_static(a, node, p, (size_t)(q - p), n);
+            if (node == NULL)
+                return -1;
+
+            p = q;
+            continue;
+        }
+
+        kind = *p++;
+        name = p;
+
+        while (*p && *p != '/')
+            p++;
+
+        if (p == name) {
+            log(LOG_ERR, "agi route \"%s\": unnamed parameter", pattern);
+            return -1;
+        }
+
+        if (kind == '*' && *p) {
+            log(LOG_ERR, "agi route \"%s\": *%.*s is not last", pattern,
+                (int)(p - name), name);
+            return -1;
+        }
+
+        if (++nparams > AGI_ROUTE_PARAMS) {
+            log(LOG_ERR, "agi route \"%s\": more than %d parameters",
+                pattern, AGI_ROUTE_PARAMS);
+            return -1;
+        }
+
+        slot = (kind == '*') ? &node->wildcard : &node->param;
+
+        if (*slot == NULL) {
+            *slot = agi_route_tree_create(a, name, (size_t)(p - name), n);
+            if (*slot == NULL)
+                return -1;
+        }
+        else if ((*slot)->len != (size_t)(p - name)
+                 || memcmp((*slot)->label, name, (*slot)->len) != 0)
+        {
+            log(LOG_ERR, "agi route \"%s\": %c%.*s conflicts with %c%.*s",
+                pattern, kind, (int)(p - name), name, kind,
+                (int)(*slot)->len, (*slot)->label);
+            return -1;
+        }
+
+        node = *slot;
+    }
+
+#undef agi_route_special
+
+    if (node->route != AGI_ROUTE_NONE) {
+        log(LOG_ERR, "agi route \"%s\" is already routed", pattern);
+        return -1;
+    }
+
+    node->route = route;
+
+    return 0;
+}
+
+/* Insert a static run below node, splitting an edge sharing a prefix */
+static agi_route_tree_t *
+agi_router_static(agi_arena_t *a, agi_route_tree_t *node, const char *s,
+    size_t len, unsigned *n)
+{
+    size_t              i;
+    agi_route_tree_t   *c, *m, **prev;
+
+    while (len) {
+        prev = &node->child;
+
+        for (c = *prev; c; c = c->next) {
+            if ((unsigned char)c->label[0] >= (unsigned char)s[0])
+                break;
+
+            prev = &c->next;
+        }
+
+        if (c == NULL || c->label[0] != s[0]) {
+            m = agi_route_tree_create(a, s, len, n);
+            if (m == NULL)
+                return NULL;
+
+            m->next = c;
+            *prev = m;
+
+            return m;
+        }
+
+        for (i = 1; i < c->len && i < len && c->label[i] == s[i]; i++) {
+            /* void */
+        }
+
+        if (i < c->len) {
+            m = agi_route_tree_create(a, c->label, i, n);
+            if (m == NULL)
+                return NULL;
+
+            m->next = c->next;
+            m->child = c;
+            *prev = m;
+
+            c->next = NULL;
+            c->label += i;
+            c->len -= i;
+
+            c = m;
+        }
+
+        node = c;
+        s += i;
+        len -= i;
+    }
+
+    return node;
+}
+
+static agi_route_tree_t *
+agi_route_tree_create(agi_arena_t *a, const char *label, size_t len,
+    unsigned *n)
+{
+    agi_route_tree_t   *t;
+
+    t = agi_arena_calloc(a, sizeof *t);
+    if (t == NULL) {
+        log(LOG_ERR, "agi_arena_calloc() failed");
+        return NULL;
+    }
+
+    t->label = label;
+    t->len = len;
+    t->route = AGI_ROUTE_NONE;
+
+    (*n)++;
+
+    return t;
+}
+
+/* node has been matched, p is what is left of the path */
+static int
+agi_router_find(const agi_router_t *r, const agi_route_node_t *node,
+    const char *p, size_t len, agi_route_match_t *m)
+{
+    size_t                      lo, hi, mid, seg;
+    const char                 *end;
+    agi_route_arg_t            *arg;
+    const agi_route_node_t     *c;
+
+    if (len == 0 && node->route != AGI_ROUTE_NONE) {
+        m->route = (unsigned)node->route;
+        return 1;
+    }
+
+    if (len && node->nchildren) {
+        lo = node->children;
+        hi = lo + node->nchildren;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            c = &r->nodes[mid];
+
+            if ((unsigned char)c->label[0] < (unsigned char)p[0]) {
+                lo = mid + 1;
+                continue;
+            }
+
+            if ((unsigned char)c->label[0] > (unsigned char)p[0]) {
+                hi = mid;
+                continue;
+            }
+
+            if (c->len <= len && memcmp(c->label, p, c->len) == 0
+                && agi_router_find(r, c, p + c->len, len - c->len, m))
+            {
+                return 1;
+            }
+
+            break;
+        }
+    }
+
+    /* no more parameters than AGI_ROUTE_PARAMS down any branch */
+
+    if (node->param != AGI_ROUTE_NONE && len && *p != '/') {
+        c = &r->nodes[node->param];
+
+        end = memchr(p, '/', len);
+        seg = end ? (size_t)(end - p) : len;
+
+        arg = &m->params[m->nparams++];
+        arg->name.data = c->label;
+        arg->name.len = c->len;
+        arg->value.data = p;
+        arg->value.len = seg;
+
+        if (agi_router_find(r, c, p + seg, len - seg, m))
+            return 1;
+
+        m->nparams--;
+    }
+
+    if (node->wildcard != AGI_ROUTE_NONE) {
+        c = &r->nodes[node->wildcard];
+
+        arg = &m->params[m->nparams++];
+        arg->name.data = c->label;
+        arg->name.len = c->len;
+        arg->value.data = p;
+        arg->value.len = len;
+
+        m->route = (unsigned)c->route;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* agi_network_script, or the path of agi_request without the leading '/' */
+static const char *
+agi_router_path(agi_session_t *s)
+{
+    const char  *path;
+
+    path = agi_session_env(s, AGI_ENV_NETWORK_SCRIPT);
+
+    if (path == NULL) {
+        path = agi_session_env(s, AGI_ENV_REQUEST);
+        if (path == NULL || strncmp(path, "agi://", 6) != 0)
+            return NULL;
+
+        path = strchr(path + 6, '/');
+        if (path == NULL)
+            return NULL;
+    }
+
+    while (*path == '/')
+        path++;
+
+    return path;
+}
+
+/* name=value pairs separated by '&', decoded into the session arena */
+static int
+agi_route_parse_args(agi_session_t *s, agi_route_t *route,
+    const char *query, size_t len)
+{
+    char                *buf;
+    size_t               i, n;
+    const char          *p, *end, *amp, *eq;
+    agi_route_arg_t     *arg;
+
+    if (len == 0)
+        return 0;
+
+    n = 1;
+
+    for (i = 0; i < len; i++) {
+        if (query[i] == '&')
+            n++;
+    }
+
+    route->args = agi_session_alloc(s, n * sizeof *route->args);
+    buf = agi_session_alloc(s, len);
+
+    if (route->args == NULL || buf == NULL)
+        return -1;
+
+    end = query + len;
+
+    for (p = query; p < end; p = amp + 1) {
+        amp = memchr(p, '&', (size_t)(end - p));
+        if (amp == NULL)
+            amp = end;
+
+        if (amp == p)
+            continue;
+
+        eq = memchr(p, '=', (size_t)(amp - p));
+        if (eq == NULL)
+            eq = amp;
+
+        arg = &route->args[route->nargs++];
+
+        arg->name.data = buf;
+        arg->name.len = agi_route_decode(buf, p, (size_t)(eq - p));
+        buf += arg->name.len;
+
+        arg->value.data = buf;
+        arg->value.len = (eq < amp)
+                         ? agi_route_decode(buf, eq + 1, (size_t)(amp - eq - 1))
+                         : 0;
+        buf += arg->value.len;
+    }
+
+    return 0;
+}
+
+/* Percent-decoding with '+' for a space; a malformed escape is kept as is */
+static size_t
+agi_route_decode(char *dst, const char *src, size_t len)
+{
+    int         hi, lo;
+    size_t      i, n;
+
+#define agi_hex(c)                                                            \
+    (((c) >= '0' && (c) <= '9') ? (c) - '0'                                   \
+     : (((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'f') ? ((c) | 0x20) - 'a' + 10 \
+     : -1)
+
+    for (i = 0, n = 0; i < len; i++, n++) {
+        if (src[i] == '+') {
+            dst[n] = ' ';
+            continue;
+        }
+
+        if (src[i] == '%' && i + 2 < len) {
+            hi = agi_hex(src[i + 1]);
+            lo = agi_hex(src[i + 2]);
+
+            if (hi != -1 && lo != -1) {
+                dst[n] = (char)(hi << 4 | lo);
+                i += 2;
+                continue;
+            }
+        }
+
+        dst[n] = src[i];
+    }
+
+#undef agi_hex
+
+    return n;
+}
+
+static const agi_str_t *
+agi_route_lookup(const agi_route_arg_t *args, unsigned n, const char *name)
+{
+    size_t      len;
+    unsigned    i;
+
+    len = strlen(name);
+
+    for (i = 0; i < n; i++) {
+        if (args[i].name.len == len
+            && memcmp(args[i].name.data, name, len) == 0)
+        {
+            return &args[i].value;
+        }
+    }
+
+    return NULL;
+}
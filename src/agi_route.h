@@ -0,0 +1,64 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Dispatch of FastAGI sessions to handlers by agi_network_script
+ */
+
+#ifndef AGI_ROUTE_H
+#define AGI_ROUTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "agi_core.h"
+#include "agi_event.h"
+
+/* path parameters a route can capture */
+#define AGI_ROUTE_PARAMS        8
+
+typedef struct agi_router_s     agi_router_t;
+
+/* a path parameter or a query argument, viewing the session memory */
+typedef struct {
+    agi_str_t               name;
+    agi_str_t               value;
+} agi_route_arg_t;
+
+/*
+ * The route a session was dispatched to, as agi_session_t.route. It lives in
+ * the session arena: query arguments are decoded there, path parameters are
+ * views into the environment.
+ */
+typedef struct {
+    const char             *pattern;
+    void                   *data;       /* given to agi_router_add() */
+
+    agi_route_arg_t        *params;
+    unsigned                nparams;
+
+    agi_route_arg_t        *args;
+    unsigned                nargs;
+} agi_route_t;
+
+/* what agi_router_match() found, without allocating */
+typedef struct {
+    unsigned                route;
+    unsigned                nparams;
+    agi_route_arg_t         params[AGI_ROUTE_PARAMS];
+} agi_route_match_t;
+
+agi_router_t *agi_router_create(void);
+void agi_router_destroy(agi_router_t *r);
+
+int agi_router_add(agi_router_t *r, const char *pattern,
+    agi_session_handler_pt handler, void *data);
+int agi_router_compile(agi_router_t *r);
+int agi_router_match(const agi_router_t *r, const char *path, size_t len,
+    agi_route_match_t *m);
+
+void agi_router_handler(agi_session_t *s);
+
+const agi_str_t *agi_route_param(agi_session_t *s, const char *name);
+const agi_str_t *agi_route_arg(agi_session_t *s, const char *name);
+
+#endif /* AGI_ROUTE_H */
@@ -0,0 +1,195 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Vectorized line scanner for the AGI environment
+ *
+ * LF, ':' and '\0' are looked for together: every block yields one bit mask
+ * per byte value, and the lowest LF bit bounds the two others. The AVX2 or
+ * SSE2 version is picked on the first call; other CPUs use the scalar one.
+ */
+
+#include <stddef.h>
+
+#if (defined __x86_64__ || defined __i386__) && defined __GNUC__
+#define AGI_SCAN_X86    1
+#include <immintrin.h>
+#endif
+
+#include "agi_core.h"
+#include "agi_scan.h"
+
+typedef size_t (*agi_scan_line_pt)(const char *p, size_t len, size_t *colon,
+    unsigned *nul);
+
+static size_t agi_scan_line_init(const char *p, size_t len, size_t *colon,
+    unsigned *nul);
+static size_t agi_scan_line_scalar(const char *p, size_t len, size_t *colon,
+    unsigned *nul);
+static size_t agi_scan_tail(const char *p, size_t i, size_t len,
+    size_t *colon, unsigned *nul);
+
+#if (AGI_SCAN_X86)
+static size_t agi_scan_line_sse2(const char *p, size_t len, size_t *colon,
+    unsigned *nul);
+static size_t agi_scan_line_avx2(const char *p, size_t len, size_t *colon,
+    unsigned *nul);
+#endif
+
+static agi_scan_line_pt agi_scan_line_handler = agi_scan_line_init;
+
+size_t
+agi_scan_line(const char *p, size_t len, size_t *colon, unsigned *nul)
+{
+    agi_scan_line_pt    handler;
+
+    /* workers race on the first call, see below */
+    handler = __atomic_load_n(&agi_scan_line_handler, __ATOMIC_RELAXED);
+
+    return handler(p, len, colon, nul);
+}
+
+/* every thread that races here stores the same pointer */
+static size_t
+agi_scan_line_init(const char *p, size_t len, size_t *colon, unsigned *nul)
+{
+    agi_scan_line_pt    handler;
+
+    handler = agi_scan_line_scalar;
+
+#if (AGI_SCAN_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        handler = agi_scan_line_avx2;
+
+    else if (__builtin_cpu_supports("sse2"))
+        handler = agi_scan_line_sse2;
+#endif
+
+    __atomic_store_n(&agi_scan_line_handler, handler, __ATOMIC_RELAXED);
+
+    return handler(p, len, colon, nul);
+}
+
+static size_t
+agi_scan_line_scalar(const char *p, size_t len, size_t *colon, unsigned *nul)
+{
+    *colon = len;
+    *nul = 0;
+
+    return agi_scan_tail(p, 0, len, colon, nul);
+}
+
+/* the bytes left over after the last full block */
+static size_t
+agi_scan_tail(const char *p, size_t i, size_t len, size_t *colon,
+    unsigned *nul)
+{
+    for ( ; i < len; i++) {
+        switch (p[i]) {
+        case AGI_LF:
+            return i;
+
+        case ':':
+            if (*colon == len)
+                *colon = i;
+            break;
+
+        case '\0':
+            *nul = 1;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return len;
+}
+
+#if (AGI_SCAN_X86)
+
+__attribute__((target("sse2")))
+static size_t
+agi_scan_line_sse2(const char *p, size_t len, size_t *colon, unsigned *nul)
+{
+    size_t      i;
+    unsigned    lf, cl, z;
+    __m128i     v, vlf, vcl, vz;
+
+    *colon = len;
+    *nul = 0;
+
+    vlf = _mm_set1_epi8(AGI_LF);
+    vcl = _mm_set1_epi8(':');
+    vz = _mm_setzero_si128();
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+
+        lf = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vlf));
+        cl = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vcl));
+        z = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vz));
+
+        if (lf) {
+            /* only what comes before the first LF counts */
+            lf &= -lf;
+            cl &= lf - 1;
+            z &= lf - 1;
+        }
+
+        if (cl && *colon == len)
+            *colon = i + (size_t)__builtin_ctz(cl);
+
+        if (z)
+            *nul = 1;
+
+        if (lf)
+            return i + (size_t)__builtin_ctz(lf);
+    }
+
+    return agi_scan_tail(p, i, len, colon, nul);
+}
+
+__attribute__((target("avx2")))
+static size_t
+agi_scan_line_avx2(const char *p, size_t len, size_t *colon, unsigned *nul)
+{
+    size_t      i;
+    unsigned    lf, cl, z;
+    __m256i     v, vlf, vcl, vz;
+
+    *colon = len;
+    *nul = 0;
+
+    vlf = _mm256_set1_epi8(AGI_LF);
+    vcl = _mm256_set1_epi8(':');
+    vz = _mm256_setzero_si256();
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(p + i));
+
+        lf = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vlf));
+        cl = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vcl));
+        z = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vz));
+
+        if (lf) {
+            lf &= -lf;
+            cl &= lf - 1;
+            z &= lf - 1;
+        }
+
+        if (cl && *colon == len)
+            *colon = i + (size_t)__builtin_ctz(cl);
+
+        if (z)
+            *nul = 1;
+
+        if (lf)
+            return i + (size_t)__builtin_ctz(lf);
+    }
+
+    return agi_scan_tail(p, i, len, colon, nul);
+}
+
+#endif
@@ -0,0 +1,20 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Vectorized line scanner for the AGI environment
+ */
+
+#ifndef AGI_SCAN_H
+#define AGI_SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Scan p[0 .. len) up to its first LF, 16 or 32 bytes at a time depending on
+ * what the CPU supports. Returns the offset of the LF, or len when there is
+ * none. *colon is set to the offset of the first ':' before the LF, or to len
+ * when there is none, and *nul to whether a null byte comes before it.
+ */
+size_t agi_scan_line(const char *p, size_t len, size_t *colon, unsigned *nul);
+
+#endif /* AGI_SCAN_H */
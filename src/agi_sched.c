@@ -0,0 +1,372 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Work-stealing scheduler for handler computations
+ *
+ * A task posted by a session goes to the deque of the worker that owns the
+ * session. Workers run their own tasks between two epoll_wait() calls, and
+ * steal from the others before going to sleep. A task stolen is handed back
+ * to its owner once computed, so that the session keeps doing its I/O on a
+ * single thread: only the computation moves.
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "agi_sched.h"
+#include "agi_session.h"
+#include "log.h"
+
+#define AGI_SCHED_MASK      (AGI_SCHED_DEQUE_SIZE - 1)
+
+static int agi_sched_push(agi_sched_deque_t *q, agi_task_t *t);
+static agi_task_t *agi_sched_pop(agi_sched_deque_t *q);
+static agi_task_t *agi_sched_steal(agi_sched_deque_t *q);
+static int agi_sched_empty(agi_sched_deque_t *q);
+static agi_task_t *agi_sched_next(agi_sched_t *sc);
+static void agi_sched_finish(agi_task_t *t);
+static void agi_sched_notify(agi_sched_t *sc);
+static void agi_sched_event_handler(agi_event_t *ev, uint32_t events);
+
+int
+agi_sched_init(agi_sched_t *sc, agi_event_loop_t *loop, agi_sched_t *peers,
+    unsigned npeers, unsigned id)
+{
+    atomic_init(&sc->deque.top, 0);
+    atomic_init(&sc->deque.bottom, 0);
+    atomic_init(&sc->done, NULL);
+    atomic_init(&sc->sleeping, 0);
+
+    sc->loop = loop;
+    sc->peers = peers;
+    sc->npeers = npeers;
+    sc->id = id;
+    sc->seed = id * 2654435761u + 1;
+
+    sc->ev.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sc->ev.fd == -1) {
+        log(LOG_ERR, "eventfd() failed");
+        return -1;
+    }
+
+    sc->ev.handler = agi_sched_event_handler;
+
+    if (agi_event_add(loop, &sc->ev, EPOLLIN) == -1)
+        return -1;
+
+    loop->sched = sc;
+
+    return 0;
+}
+
+/* only once no peer may wake sc up anymore */
+void
+agi_sched_free(agi_sched_t *sc)
+{
+    if (sc->ev.fd != -1)
+        (void)close(sc->ev.fd);
+
+    sc->ev.fd = -1;
+}
+
+/*
+ * Queue t for the handler of s. Without a scheduler, or when the deque is
+ * full, the task is run right away.
+ */
+int
+agi_sched_post(agi_session_t *s, agi_task_t *t)
+{
+    unsigned        i, n;
+    agi_sched_t    *sc, *peer;
+
+    sc = s->loop ? s->loop->sched : NULL;
+
+    t->session = s;
+    t->owner = sc;
+
+    s->ntasks++;
+
+    if (sc == NULL || agi_sched_push(&sc->deque, t) == -1) {
+        t->handler(t);
+        agi_sched_finish(t);
+
+        return AGI_DONE;
+    }
+
+    /* a sleeping worker would rather steal it than wait for us */
+    n = sc->npeers;
+
+    for (i = 1; i < n; i++) {
+        peer = &sc->peers[(sc->id + i) % n];
+
+        if (atomic_load_explicit(&peer->sleeping, memory_order_relaxed)) {
+            agi_sched_notify(peer);
+            break;
+        }
+    }
+
+    return AGI_OK;
+}
+
+/* Run up to max tasks, own ones first. Returns the number of tasks run. */
+unsigned
+agi_sched_run(agi_sched_t *sc, unsigned max)
+{
+    unsigned        n;
+    agi_task_t     *t, *head;
+    agi_sched_t    *owner;
+
+    for (n = 0; n < max; n++) {
+        t = agi_sched_next(sc);
+        if (t == NULL)
+            break;
+
+        t->handler(t);
+
+        sc->nrun++;
+
+        owner = t->owner;
+
+        if (owner == sc) {
+            agi_sched_finish(t);
+            continue;
+        }
+
+        sc->nstolen++;
+
+        head = atomic_load_explicit(&owner->done, memory_order_relaxed);
+
+        do {
+            t->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&owner->done, &head,
+                     t, memory_order_seq_cst, memory_order_relaxed));
+
+        agi_sched_notify(owner);
+    }
+
+    return n;
+}
+
+/* the done handlers of the tasks other workers ran for us */
+void
+agi_sched_complete(agi_sched_t *sc)
+{
+    agi_task_t     *t, *next, *list;
+
+    t = atomic_exchange_explicit(&sc->done, NULL, memory_order_acquire);
+
+    /* the list is LIFO, reverse it */
+    for (list = NULL; t; t = next) {
+        next = t->next;
+        t->next = list;
+        list = t;
+    }
+
+    for (t = list; t; t = next) {
+        next = t->next;
+        agi_sched_finish(t);
+    }
+}
+
+/*
+ * Called before blocking in epoll_wait(). Returns -1 when there turns out to
+ * be work, in which case the worker must not block.
+ */
+int
+agi_sched_sleep(agi_sched_t *sc)
+{
+    unsigned    i;
+
+    atomic_store(&sc->sleeping, 1);
+
+    /* whatever was queued before the store is seen below, the rest wakes us */
+    if (atomic_load(&sc->done) != NULL)
+        goto busy;
+
+    for (i = 0; i < sc->npeers; i++) {
+        if (!agi_sched_empty(&sc->peers[i].deque))
+            goto busy;
+    }
+
+    return 0;
+
+busy:
+
+    atomic_store(&sc->sleeping, 0);
+
+    return -1;
+}
+
+void
+agi_sched_awake(agi_sched_t *sc)
+{
+    atomic_store_explicit(&sc->sleeping, 0, memory_order_relaxed);
+}
+
+static agi_task_t *
+agi_sched_next(agi_sched_t *sc)
+{
+    unsigned        i, n, victim;
+    agi_task_t     *t;
+
+    t = agi_sched_pop(&sc->deque);
+    if (t)
+        return t;
+
+    n = sc->npeers;
+
+    if (n < 2)
+        return NULL;
+
+    /* xorshift, so that thieves do not all line up behind the same victim */
+    sc->seed ^= sc->seed << 13;
+    sc->seed ^= sc->seed >> 17;
+    sc->seed ^= sc->seed << 5;
+
+    victim = sc->seed % n;
+
+    for (i = 0; i < n; i++, victim = (victim + 1) % n) {
+        if (victim == sc->id)
+            continue;
+
+        t = agi_sched_steal(&sc->peers[victim].deque);
+        if (t)
+            return t;
+    }
+
+    return NULL;
+}
+
+static void
+agi_sched_finish(agi_task_t *t)
+{
+    agi_session_t  *s = t->session;
+
+    if (t->done)
+        t->done(t);
+
+    /* the session may be freed from now on, see agi_event_free_closed() */
+    s->ntasks--;
+}
+
+static void
+agi_sched_notify(agi_sched_t *sc)
+{
+    unsigned    one = 1;
+    uint64_t    n = 1;
+
+    if (!atomic_compare_exchange_strong(&sc->sleeping, &one, 0))
+        return;
+
+    if (write(sc->ev.fd, &n, sizeof n) == -1)
+        log(LOG_ERR, "write() to worker %u failed", sc->id);
+}
+
+static void
+agi_sched_event_handler(agi_event_t *ev, uint32_t events)
+{
+    uint64_t    n;
+
+    (void)events;
+
+    /* the tasks are run by the worker once the events are dispatched */
+    (void)read(ev->fd, &n, sizeof n);
+}
+
+/*
+ * The deque follows "Correct and Efficient Work-Stealing for Weak Memory
+ * Models" (Le et al., 2013), with a fixed size array, and a release store
+ * of bottom rather than a fence in push.
+ */
+
+static int
+agi_sched_push(agi_sched_deque_t *q, agi_task_t *t)
+{
+    long    b, top;
+
+    b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    top = atomic_load_explicit(&q->top, memory_order_acquire);
+
+    if (b - top >= AGI_SCHED_DEQUE_SIZE)
+        return -1;
+
+    atomic_store_explicit(&q->tasks[b & AGI_SCHED_MASK], t,
+                          memory_order_relaxed);
+
+    /* publishes the task to the thieves that acquire bottom */
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_release);
+
+    return 0;
+}
+
+static agi_task_t *
+agi_sched_pop(agi_sched_deque_t *q)
+{
+    long            b, top;
+    agi_task_t     *t;
+
+    b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    top = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+    if (top > b) {
+        /* empty */
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    t = atomic_load_explicit(&q->tasks[b & AGI_SCHED_MASK],
+                             memory_order_relaxed);
+
+    if (top == b) {
+        /* the last one: race the thieves for it */
+        if (!atomic_compare_exchange_strong_explicit(&q->top, &top, top + 1,
+                 memory_order_seq_cst, memory_order_relaxed))
+        {
+            t = NULL;
+        }
+
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    }
+
+    return t;
+}
+
+static agi_task_t *
+agi_sched_steal(agi_sched_deque_t *q)
+{
+    long            b, top;
+    agi_task_t     *t;
+
+    top = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+
+    if (top >= b)
+        return NULL;
+
+    t = atomic_load_explicit(&q->tasks[top & AGI_SCHED_MASK],
+                             memory_order_relaxed);
+
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &top, top + 1,
+             memory_order_seq_cst, memory_order_relaxed))
+    {
+        /* lost to the owner or to another thief */
+        return NULL;
+    }
+
+    return t;
+}
+
+static int
+agi_sched_empty(agi_sched_deque_t *q)
+{
+    return atomic_load(&q->top) >= atomic_load(&q->bottom);
+}
@@ -0,0 +1,84 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Work-stealing scheduler for handler computations
+ */
+
+#ifndef AGI_SCHED_H
+#define AGI_SCHED_H
+
+#include <stdatomic.h>
+
+#include "agi_core.h"
+#include "agi_event.h"
+
+#define AGI_SCHED_DEQUE_SIZE    1024    /* must be a power of 2 */
+
+/* tasks run in a row before the worker looks at its sockets again */
+#define AGI_SCHED_BATCH         16
+
+typedef struct agi_task_s       agi_task_t;
+
+typedef void (*agi_task_handler_pt)(agi_task_t *t);
+
+/*
+ * handler may run on any worker and must not touch the session beyond
+ * reading its environment: no command, no arena allocation. done is then
+ * called on the worker that owns the session, where commands may be sent
+ * again. The session is not freed before done has returned, even if it was
+ * closed in between.
+ */
+struct agi_task_s {
+    agi_task_handler_pt     handler;
+    agi_task_handler_pt     done;
+    void                   *data;
+
+    agi_session_t          *session;    /* set by agi_sched_post() */
+    agi_sched_t            *owner;
+    agi_task_t             *next;       /* agi_sched_t.done */
+};
+
+/*
+ * Chase-Lev deque: the owner pushes and pops at the bottom, the others steal
+ * from the top. The indices are kept on cache lines of their own.
+ */
+typedef struct {
+    _Alignas(64) atomic_long        top;
+    _Alignas(64) atomic_long        bottom;
+    _Atomic(agi_task_t *)           tasks[AGI_SCHED_DEQUE_SIZE];
+} agi_sched_deque_t;
+
+/* one per worker; an array of them makes up the scheduler */
+struct agi_sched_s {
+    agi_event_t             ev;         /* eventfd, must be first */
+    agi_event_loop_t       *loop;
+
+    agi_sched_deque_t       deque;
+
+    /* tasks that other workers ran for the sessions of this one */
+    _Atomic(agi_task_t *)   done;
+
+    /* set while blocked in epoll_wait(), cleared by whoever wakes it up */
+    atomic_uint             sleeping;
+
+    agi_sched_t            *peers;
+    unsigned                npeers;
+    unsigned                id;
+    unsigned                seed;       /* victim selection */
+
+    unsigned long           nrun;
+    unsigned long           nstolen;
+};
+
+int agi_sched_init(agi_sched_t *sc, agi_event_loop_t *loop, agi_sched_t *peers,
+    unsigned npeers, unsigned id);
+void agi_sched_free(agi_sched_t *sc);
+
+int agi_sched_post(agi_session_t *s, agi_task_t *t);
+
+unsigned agi_sched_run(agi_sched_t *sc, unsigned max);
+void agi_sched_complete(agi_sched_t *sc);
+int agi_sched_sleep(agi_sched_t *sc);
+void agi_sched_awake(agi_sched_t *sc);
+
+#endif /* AGI_SCHED_H */
@@ -0,0 +1,838 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Non-blocking FastAGI session I/O driven by the event loop
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "agi_parse.h"
+#include "agi_buf.h"
+#include "agi_commands.h"
+#include "agi_session.h"
+#include "agi_module.h"
+#include "agi_uring.h"
+#include "agi_varcache.h"
+#include "log.h"
+
+static void agi_session_event_handler(agi_event_t *ev, uint32_t events);
+static void agi_session_input(agi_event_t *ev, const char *buf, ssize_t n);
+static void agi_session_sent(agi_event_t *ev, ssize_t n);
+static int agi_session_read_environment(agi_session_t *s);
+static int agi_session_push_environment(agi_session_t *s, const char *buf,
+    size_t n, size_t *used);
+static int agi_session_keep_environment(agi_session_t *s, size_t from);
+static int agi_session_finish_environment(agi_session_t *s);
+static int agi_session_read_replies(agi_session_t *s);
+static int agi_session_process_replies(agi_session_t *s);
+static int agi_session_grow(agi_session_t *s, char **buf, size_t *size,
+    size_t need, size_t max);
+
+/*
+ * Create a session for an accepted connection. With loop set the descriptor
+ * must be non-blocking and the session is driven by the event loop; without
+ * it the session is used through the blocking agi_send_command() and the
+ * agi_command_*() functions.
+ */
+agi_session_t *
+agi_session_create(agi_event_loop_t *loop, int fd)
+{
+    return agi_session_open(loop, &agi_transport_tcp, fd, fd);
+}
+
+/*
+ * Create a session reading from in and writing to out over transport t,
+ * such as agi_transport_stdio on STDIN_FILENO and STDOUT_FILENO for a
+ * classic AGI script. The session owns, and closes, both descriptors. With
+ * loop set, in must be non-blocking; out is only waited for when it is a
+ * socket, a pipe had better be left blocking.
+ */
+agi_session_t *
+agi_session_open(agi_event_loop_t *loop, const agi_transport_t *t, int in,
+    int out)
+{
+    agi_session_t  *s;
+
+    s = NULL;
+
+    if (loop && loop->pool) {
+        s = agi_pool_get(loop->pool);
+
+        if (s) {
+            s->pool = loop->pool;
+            agi_pool_arena(s->pool, s, &s->arena);
+        }
+    }
+
+    if (s == NULL) {
+        s = calloc(1, sizeof *s);
+        if (s == NULL) {
+            log(LOG_ERR, "calloc() failed");
+            return NULL;
+        }
+
+        /* every allocation goes to the heap, and is freed by the reset */
+        agi_arena_init(&s->arena, NULL, 0);
+    }
+
+    s->ev.fd = in;
+    s->ev.handler = agi_session_event_handler;
+    s->transport = t;
+    s->out_fd = out;
+    s->audio_fd = t->audio ? AGI_EAGI_AUDIO_FD : -1;
+    s->shim_fd = -1;
+    s->loop = loop;
+    s->state = AGI_SESSION_READY;
+
+    if (agi_buf_init(&s->in, &s->arena, AGI_BUF_SIZE) == -1)
+        goto failed;
+
+    if (loop == NULL)
+        return s;
+
+    s->env_buf = agi_arena_alloc(&s->arena, AGI_SESSION_ENV_LEN);
+    if (s->env_buf == NULL)
+        goto failed;
+
+    s->env_size = AGI_SESSION_ENV_LEN;
+    s->state = AGI_SESSION_ENVIRONMENT;
+
+    agi_env_parser_init(&s->env_parser);
+
+    /* agi_event_add() then arms a recv rather than a poll */
+    if (loop->uring && t->socket) {
+        s->ev.input = agi_session_input;
+        s->ev.sent = agi_session_sent;
+        s->pushed = 1;
+    }
+
+    if (agi_event_add(loop, &s->ev,
+                      EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == -1)
+    {
+        goto failed;
+    }
+
+    loop->nsessions++;
+
+    return s;
+
+failed:
+
+    agi_arena_reset(&s->arena);
+
+    if (s->pool)
+        agi_pool_put(s->pool, s);
+    else
+        free(s);
+
+    return NULL;
+}
+
+void
+agi_session_free(agi_session_t *s)
+{
+    if (s->close_handler)
+        s->close_handler(s);
+
+    agi_setvariable_abandon(s);
+
+    /* closing the descriptor also removes it from the epoll set */
+    (void)close(s->ev.fd);
+
+    if (s->out_fd != s->ev.fd)
+        (void)close(s->out_fd);
+
+    if (s->audio_fd != -1)
+        (void)close(s->audio_fd);
+
+    if (s->shim_fd != -1)
+        (void)close(s->shim_fd);
+
+    if (s->loop)
+        s->loop->nsessions--;
+
+    if (s->coro)
+        agi_coro_free(s->coro);
+
+    /* nothing of the handler runs past this point: its code can go */
+    if (s->module)
+        agi_module_release(s->module);
+
+    /* the environment and all the buffers live in the arena */
+    agi_arena_reset(&s->arena);
+
+    if (s->pool)
+        agi_pool_put(s->pool, s);
+    else
+        free(s);
+}
+
+/*
+ * Slots for n sessions, each with an AGI_SESSION_ARENA_SIZE arena, to be set
+ * as agi_event_loop_t.pool. flags may hold AGI_POOL_HUGE.
+ */
+agi_pool_t *
+agi_session_pool_create(size_t n, unsigned flags)
+{
+    return agi_pool_create(n, sizeof(agi_session_t), AGI_SESSION_ARENA_SIZE,
+                           flags);
+}
+
+/*
+ * Queue an AGI command (terminated with LF) and call handler with its reply.
+ * Commands queued while handling one event go out in a single send() at the
+ * end of the event loop iteration, and up to AGI_SESSION_PIPELINE of them
+ * may wait for their reply; replies are matched in order. Deferred writes,
+ * see agi_setvariable_defer(), are queued ahead of the command.
+ */
+int
+agi_session_command(agi_session_t *s, const char *command, size_t len,
+    agi_reply_handler_pt handler, void *ctx)
+{
+    int             rv, inplace;
+    agi_reply_t    *r;
+
+    if (s->closing || s->loop == NULL)
+        return AGI_ERROR;
+
+    if (s->state != AGI_SESSION_READY || s->npending == AGI_SESSION_PIPELINE)
+        return AGI_BUSY;
+
+    /* whatever the command does, it sees the variables set before it */
+    if (s->defer && s->defer->npairs) {
+        inplace = command == s->out + s->out_len;
+
+        rv = agi_setvariable_queue(s, inplace, len);
+        if (rv != AGI_OK)
+            return rv;
+
+        if (inplace)
+            command = s->out + s->out_len;
+    }
+
+    /* the kernel is reading out, it may not move until done */
+    if (s->sending && s->out_len + len > s->out_size
+        && command != s->out + s->out_len)
+    {
+        return AGI_BUSY;
+    }
+
+    if (agi_session_grow(s, &s->out, &s->out_size, s->out_len + len,
+                         (size_t)-1) == -1)
+    {
+        return AGI_ERROR;
+    }
+
+    /* formatted in place after agi_session_reserve() */
+    if (command != s->out + s->out_len)
+        (void)memcpy(s->out + s->out_len, command, len);
+
+    s->out_len += len;
+
+    agi_varcache_flush(s);
+
+    r = &s->pending[(s->pending_head + s->npending) % AGI_SESSION_PIPELINE];
+    r->handler = handler;
+    r->ctx = ctx;
+
+    s->npending++;
+
+    if (!s->posted) {
+        s->posted = 1;
+        s->posted_next = s->loop->posted;
+        s->loop->posted = s;
+    }
+
+    return AGI_OK;
+}
+
+/*
+ * Room for a command of up to n bytes right after those already queued, so
+ * that it can be formatted in place. Nothing is queued until the command is
+ * passed to agi_session_command() or agi_send_command().
+ */
+char *
+agi_session_reserve(agi_session_t *s, size_t n)
+{
+    if (s->sending && s->out_len + n > s->out_size)
+        return NULL;
+
+    if (agi_session_grow(s, &s->out, &s->out_size, s->out_len + n,
+                         (size_t)-1) == -1)
+    {
+        return NULL;
+    }
+
+    return s->out + s->out_len;
+}
+
+/*
+ * The session is freed by the event loop once the current iteration is over,
+ * so it remains valid for the rest of the calling handler. A session without
+ * an event loop is freed right away.
+ */
+void
+agi_session_close(agi_session_t *s)
+{
+    if (s->closing)
+        return;
+
+    s->closing = 1;
+
+    if (s->loop == NULL) {
+        agi_session_free(s);
+        return;
+    }
+
+    s->next = s->loop->closed;
+    s->loop->closed = s;
+}
+
+static void
+agi_session_event_handler(agi_event_t *ev, uint32_t events)
+{
+    int             rv;
+    agi_session_t  *s = (agi_session_t *)ev;
+
+    if (s->closing)
+        return;
+
+    /* a script does its own I/O: it retries whatever it was waiting for */
+    if (s->coro) {
+        agi_coro_resume(s->coro);
+        return;
+    }
+
+    if (events & EPOLLERR) {
+        log(LOG_ERR, "socket error on session %d", ev->fd);
+        agi_session_fail(s);
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        if (agi_session_flush(s) == AGI_ERROR) {
+            agi_session_fail(s);
+            return;
+        }
+    }
+
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+        return;
+
+    if (s->state == AGI_SESSION_ENVIRONMENT) {
+        rv = agi_session_read_environment(s);
+
+        if (rv == AGI_AGAIN)
+            return;
+
+        if (rv == AGI_ERROR) {
+            agi_session_fail(s);
+            return;
+        }
+
+        s->state = AGI_SESSION_READY;
+
+        if (s->loop->handler)
+            s->loop->handler(s);
+
+        if (s->closing || s->coro || s->detached)
+            return;
+    }
+
+    if (agi_session_read_replies(s) == AGI_ERROR)
+        agi_session_fail(s);
+}
+
+/* Read and parse the AGI environment as it arrives */
+static int
+agi_session_read_environment(agi_session_t *s)
+{
+    int         rv;
+    ssize_t     bytes;
+
+    for (;;) {
+        /* leave room for the terminating null-character */
+        if (s->env_len + 1 == s->env_size) {
+            /* env holds offsets: the buffer may move */
+            if (agi_session_grow(s, &s->env_buf, &s->env_size,
+                                 s->env_size + 1, AGI_SESSION_ENV_MAX_LEN)
+                == -1)
+            {
+                log(LOG_ERR, "agi environment too large");
+                return AGI_ERROR;
+            }
+        }
+
+        bytes = s->transport->recv(s, s->env_buf + s->env_len,
+                                   s->env_size - s->env_len - 1);
+
+        if (bytes == (ssize_t)-1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return AGI_AGAIN;
+
+            if (errno == EINTR)
+                continue;
+
+            log(LOG_ERR, "recv() failed");
+            return AGI_ERROR;
+        }
+
+        if (bytes == (ssize_t)0) {
+            log(LOG_ERR, "remote side closed their endpoint");
+            return AGI_ERROR;
+        }
+
+        s->env_len += (size_t)bytes;
+
+        if (agi_session_keep_environment(s, s->env_len - (size_t)bytes)
+            == -1)
+        {
+            return AGI_ERROR;
+        }
+
+        rv = agi_process_environment(&s->env_parser, &s->env, &s->arena,
+                                     s->env_buf, s->env_len);
+
+        if (rv == AGI_DONE)
+            break;
+
+        if (rv == AGI_ERROR)
+            return AGI_ERROR;
+    }
+
+    return agi_session_finish_environment(s);
+}
+
+/*
+ * With io_uring, append the n bytes the kernel received to the environment
+ * and parse it. *used is set to the number of bytes which belong to it.
+ */
+static int
+agi_session_push_environment(agi_session_t *s, const char *buf, size_t n,
+    size_t *used)
+{
+    int         rv;
+    size_t      len;
+
+    *used = 0;
+
+    while (*used < n) {
+        if (s->env_len + 1 == s->env_size) {
+            if (agi_session_grow(s, &s->env_buf, &s->env_size,
+                                 s->env_size + 1, AGI_SESSION_ENV_MAX_LEN)
+                == -1)
+            {
+                log(LOG_ERR, "agi environment too large");
+                return AGI_ERROR;
+            }
+        }
+
+        len = s->env_size - s->env_len - 1;
+
+        if (len > n - *used)
+            len = n - *used;
+
+        (void)memcpy(s->env_buf + s->env_len, buf + *used, len);
+
+        s->env_len += len;
+        *used += len;
+
+        if (agi_session_keep_environment(s, s->env_len - len) == -1)
+            return AGI_ERROR;
+
+        rv = agi_process_environment(&s->env_parser, &s->env, &s->arena,
+                                     s->env_buf, s->env_len);
+
+        if (rv == AGI_DONE)
+            return agi_session_finish_environment(s);
+
+        if (rv == AGI_ERROR)
+            return AGI_ERROR;
+    }
+
+    return AGI_AGAIN;
+}
+
+/*
+ * With AGI_EVENT_LOOP_RAW_ENV, copy the bytes received from env_buf[from]
+ * on to env_raw, before the parser modifies them
+ */
+static int
+agi_session_keep_environment(agi_session_t *s, size_t from)
+{
+    if (!s->loop->raw_env)
+        return 0;
+
+    if (agi_session_grow(s, &s->env_raw, &s->env_raw_size, s->env_len,
+                         AGI_SESSION_ENV_MAX_LEN)
+        == -1)
+    {
+        log(LOG_ERR, "agi environment too large");
+        return -1;
+    }
+
+    (void)memcpy(s->env_raw + from, s->env_buf + from, s->env_len - from);
+
+    return 0;
+}
+
+/*
+ * Bytes received after the blank line ending the environment belong to
+ * command replies and are moved to the reply buffer
+ */
+static int
+agi_session_finish_environment(agi_session_t *s)
+{
+    char       *p;
+    size_t      surplus;
+
+    surplus = s->env_len - s->env_parser.pos;
+
+    if (surplus) {
+        if (agi_buf_append(&s->in, s->env_buf + s->env_parser.pos, surplus)
+            == -1)
+        {
+            return AGI_ERROR;
+        }
+    }
+
+    s->env_len = s->env_parser.pos;
+    s->env_buf[s->env_len] = '\0';
+
+    /*
+     * the environment is kept for the whole session: give back the slack,
+     * which the arena can reuse as long as nothing was allocated after it
+     */
+    p = agi_arena_realloc(&s->arena, s->env_buf, s->env_size, s->env_len + 1);
+    if (p) {
+        s->env_buf = p;
+        s->env_size = s->env_len + 1;
+    }
+
+    return AGI_OK;
+}
+
+/*
+ * With io_uring, the bytes received on the session, see agi_event_input_pt.
+ * They are handled as agi_session_event_handler() handles those it receives
+ * itself.
+ */
+static void
+agi_session_input(agi_event_t *ev, const char *buf, ssize_t n)
+{
+    int             rv;
+    size_t          used;
+    agi_session_t  *s = (agi_session_t *)ev;
+
+    /* once detached, the bytes are for whoever took the socket over */
+    if (s->closing || s->detached)
+        return;
+
+    if (n <= 0) {
+        if (n == 0)
+            log_debug1("session %d: Asterisk closed its endpoint", ev->fd);
+        else
+            log(LOG_ERR, "recv() failed");
+
+        goto failed;
+    }
+
+    if (s->state == AGI_SESSION_ENVIRONMENT) {
+        rv = agi_session_push_environment(s, buf, (size_t)n, &used);
+
+        if (rv == AGI_AGAIN)
+            return;
+
+        if (rv == AGI_ERROR)
+            goto failed;
+
+        /* the first replies, sent right after the environment */
+        if (agi_buf_append(&s->in, buf + used, (size_t)n - used) == -1)
+            goto failed;
+
+        s->state = AGI_SESSION_READY;
+
+        if (s->loop->handler)
+            s->loop->handler(s);
+
+        if (s->closing || s->coro || s->detached)
+            return;
+    }
+    else if (agi_buf_append(&s->in, buf, (size_t)n) == -1) {
+        goto failed;
+    }
+
+    /* the script is waiting for a reply in agi_read_replies() */
+    if (s->coro) {
+        agi_coro_resume(s->coro);
+        return;
+    }
+
+    if (agi_session_process_replies(s) == AGI_ERROR)
+        agi_session_fail(s);
+
+    return;
+
+failed:
+
+    agi_session_fail(s);
+
+    /* to find its session closed */
+    if (s->coro)
+        agi_coro_resume(s->coro);
+}
+
+/* With io_uring, the completion of the send of out by agi_session_flush() */
+static void
+agi_session_sent(agi_event_t *ev, ssize_t n)
+{
+    agi_session_t  *s = (agi_session_t *)ev;
+
+    s->sending = 0;
+
+    if (s->closing)
+        return;
+
+    if (n == (ssize_t)-1) {
+        log(LOG_ERR, "send() failed");
+        goto failed;
+    }
+
+    s->out_sent += (size_t)n;
+
+    /* the rest, and whatever was queued meanwhile */
+    if (agi_session_flush(s) == AGI_ERROR)
+        goto failed;
+
+    /* the script is waiting for its command to go in agi_send_command() */
+    if (s->coro && !s->sending)
+        agi_coro_resume(s->coro);
+
+    return;
+
+failed:
+
+    agi_session_fail(s);
+
+    if (s->coro)
+        agi_coro_resume(s->coro);
+}
+
+static int
+agi_session_read_replies(agi_session_t *s)
+{
+    ssize_t     bytes;
+
+    for (;;) {
+        bytes = agi_buf_recv(&s->in, s);
+
+        if (bytes == (ssize_t)-1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            if (errno == EINTR)
+                continue;
+
+            log(LOG_ERR, "recv() failed");
+            return AGI_ERROR;
+        }
+
+        if (bytes == (ssize_t)0) {
+            log_debug1("session %d: Asterisk closed its endpoint", s->ev.fd);
+            return AGI_ERROR;
+        }
+    }
+
+    return agi_session_process_replies(s);
+}
+
+/*
+ * Hand every complete reply to the handler of the oldest command. HANGUP,
+ * whenever it comes, fails the commands pending and queued and closes the
+ * session, rather than holding it until the next reply times out.
+ */
+static int
+agi_session_process_replies(agi_session_t *s)
+{
+    int             rv;
+    char           *line;
+    size_t          len;
+    agi_reply_t     h;
+    agi_result_t    r;
+
+    while (!s->closing) {
+        line = agi_buf_line(&s->in, &len);
+        if (line == NULL)
+            return AGI_OK;
+
+        if (!s->usage && agi_parse_hangup(line, len)) {
+            log_debug1("session %d: Asterisk sent HANGUP", s->ev.fd);
+
+            s->hangup = 1;
+            agi_session_fail(s);
+
+            return AGI_OK;
+        }
+
+        if (s->npending == 0) {
+            log(LOG_ERR, "unexpected agi line on session %d: %.*s",
+                s->ev.fd, (int)len, line);
+            continue;
+        }
+
+        if (s->usage) {
+            /* "520 End of proper usage." completes the reply */
+            if (len < 4 || memcmp(line, "520 ", 4) != 0)
+                continue;
+
+            s->usage = 0;
+
+            (void)agi_parse_command_response_line(line, len, &r);
+            rv = AGI_OK;
+        }
+        else {
+            rv = agi_parse_command_response_line(line, len, &r);
+
+            if (rv == AGI_AGAIN) {
+                s->usage = 1;
+                continue;
+            }
+
+            if (rv == AGI_ERROR)
+                log(LOG_ERR, "invalid agi command reply: %.*s",
+                    (int)len, line);
+        }
+
+        h = s->pending[s->pending_head];
+
+        s->pending_head = (s->pending_head + 1) % AGI_SESSION_PIPELINE;
+        s->npending--;
+
+        if (h.handler)
+            h.handler(s, h.ctx, rv, &r);
+    }
+
+    return AGI_OK;
+}
+
+/*
+ * Send the commands queued. With io_uring the send is only submitted, and
+ * AGI_AGAIN returned until agi_session_sent() is called.
+ */
+int
+agi_session_flush(agi_session_t *s)
+{
+    ssize_t     bytes;
+
+    if (s->pushed && s->out_sent < s->out_len) {
+        if (s->sending)
+            return AGI_AGAIN;
+
+        if (agi_uring_send(s->loop->uring, &s->ev, s->out + s->out_sent,
+                           s->out_len - s->out_sent) == -1)
+        {
+            return AGI_ERROR;
+        }
+
+        s->sending = 1;
+
+        return AGI_AGAIN;
+    }
+
+    while (s->out_sent < s->out_len) {
+        bytes = s->transport->send(s, s->out + s->out_sent,
+                                   s->out_len - s->out_sent);
+
+        if (bytes == (ssize_t)-1) {
+            /* EPOLLOUT resumes the flush */
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return AGI_AGAIN;
+
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EPIPE)
+                log(LOG_ERR,
+                        "send() failed: Asterisk closed"
+                        " its endpoint and may have died");
+            else
+                log(LOG_ERR, "send() failed");
+
+            return AGI_ERROR;
+        }
+
+        s->out_sent += (size_t)bytes;
+    }
+
+    s->out_len = 0;
+    s->out_sent = 0;
+
+    return AGI_OK;
+}
+
+/* The connection is unusable: fail the outstanding commands and close */
+void
+agi_session_fail(agi_session_t *s)
+{
+    agi_reply_t     h;
+    agi_result_t    r;
+
+    (void)memset(&r, 0, sizeof r);
+
+    r.code = -1;
+    r.endpos = -1;
+
+    while (s->npending) {
+        h = s->pending[s->pending_head];
+
+        s->pending_head = (s->pending_head + 1) % AGI_SESSION_PIPELINE;
+        s->npending--;
+
+        if (h.handler)
+            h.handler(s, h.ctx, AGI_ERROR, &r);
+    }
+
+    s->out_len = 0;
+    s->out_sent = 0;
+
+    agi_session_close(s);
+}
+
+static int
+agi_session_grow(agi_session_t *s, char **buf, size_t *size, size_t need,
+    size_t max)
+{
+    char   *p;
+    size_t  n;
+
+    if (need <= *size)
+        return 0;
+
+    if (need > max)
+        return -1;
+
+    n = *size ? *size : AGI_SESSION_OUT_LEN;
+
+    while (n < need)
+        n *= 2;
+
+    if (n > max)
+        n = max;
+
+    p = agi_arena_realloc(&s->arena, *buf, *size, n);
+    if (p == NULL)
+        return -1;
+
+    *buf = p;
+    *size = n;
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * A FastAGI session: one Asterisk channel talking to us over one socket
+ */
+
+#ifndef AGI_SESSION_H
+#define AGI_SESSION_H
+
+#include <stddef.h>
+
+#include "agi_buf.h"
+#include "agi_core.h"
+#include "agi_coro.h"
+#include "agi_env.h"
+#include "agi_event.h"
+#include "agi_parse.h"
+#include "agi_pool.h"
+#include "agi_route.h"
+#include "agi_varcache.h"
+#include "agi_transport.h"
+
+/*
+ * initial size of the environment buffer, doubled on demand and trimmed once
+ * the environment has been read
+ */
+#define AGI_SESSION_ENV_LEN         2048
+#define AGI_SESSION_ENV_MAX_LEN     AGI_ENV_MAX_LEN
+
+/* initial size of the command buffer, doubled on demand */
+#define AGI_SESSION_OUT_LEN         1024
+
+/*
+ * arena of a pooled session: room for the environment, reply and command
+ * buffers at their initial size, and for what handlers allocate
+ */
+#define AGI_SESSION_ARENA_SIZE      8192
+
+/* commands sent and waiting for their reply */
+#define AGI_SESSION_PIPELINE        16
+
+enum {
+    AGI_SESSION_ENVIRONMENT = 0,    /* reading the AGI environment */
+    AGI_SESSION_READY               /* accepting commands */
+};
+
+/*
+ * rc is AGI_OK when r holds the parsed reply, and AGI_ERROR when the reply
+ * was malformed or the connection failed before it arrived. r and the views
+ * in it are only valid during the call.
+ */
+typedef void (*agi_reply_handler_pt)(agi_session_t *s, void *ctx, int rc,
+    agi_result_t *r);
+
+typedef struct {
+    agi_reply_handler_pt    handler;
+    void                   *ctx;
+} agi_reply_t;
+
+/* called right before the session is freed, to release agi_session_t.data */
+typedef void (*agi_close_handler_pt)(agi_session_t *s);
+
+struct agi_session_s {
+    agi_event_t             ev;         /* input, must be first */
+    agi_event_loop_t       *loop;
+
+    const agi_transport_t  *transport;
+    int                     out_fd;     /* ev.fd but for pipes */
+    int                     audio_fd;   /* EAGI, or -1 */
+    int                     shim_fd;    /* see agi_handoff.c, or -1 */
+
+    /* buffers and handler allocations, released at once when freed */
+    agi_arena_t             arena;
+    agi_pool_t             *pool;       /* slot owner, NULL for the heap */
+
+    agi_env_t               env;
+    agi_env_parser_t        env_parser;
+
+    /* environment text; env holds offsets into it */
+    char                   *env_buf;
+    size_t                  env_len;
+    size_t                  env_size;
+
+    /*
+     * the env_len bytes of the environment as received, before the parser
+     * null-terminated its lines, when the loop has AGI_EVENT_LOOP_RAW_ENV
+     */
+    char                   *env_raw;
+    size_t                  env_raw_size;
+
+    /* command reply bytes */
+    agi_buf_t               in;
+
+    /*
+     * commands not yet accepted by the kernel; with io_uring, out must not
+     * move while sending
+     */
+    char                   *out;
+    size_t                  out_len;
+    size_t                  out_sent;
+    size_t                  out_size;
+
+    /* replies expected, in the order their commands were queued */
+    agi_reply_t             pending[AGI_SESSION_PIPELINE];
+    unsigned                pending_head;
+    unsigned                npending;
+
+    /* the script spawned by agi_coro_spawn(), doing its own I/O */
+    agi_coro_t             *coro;
+
+    /* the module generation running the session, see agi_module.c */
+    agi_module_gen_t       *module;
+
+    /* channel variables read, see agi_varcache.c, or NULL */
+    agi_varcache_t         *varcache;
+
+    /* "set variable" held back, see agi_setvariable_defer(), or NULL */
+    agi_defer_t            *defer;
+
+    /* text formatted before it is sent, see agi_command_scratch(), or NULL */
+    char                   *scratch;
+
+    /* the route dispatched to by agi_router_handler(), or NULL */
+    const agi_route_t      *route;
+
+    void                   *data;       /* owned by the session handler */
+    agi_close_handler_pt    close_handler;
+
+    /* agi_task_t posted and not done yet, see agi_sched_post() */
+    unsigned                ntasks;
+
+    agi_session_t          *next;       /* agi_event_loop_t.closed */
+    agi_session_t          *posted_next;    /* agi_event_loop_t.posted */
+
+    unsigned                state:1;
+    unsigned                usage:1;    /* skipping "520-" usage text */
+    unsigned                posted:1;
+    unsigned                closing:1;
+
+    /* io_uring: the kernel receives for us, and out is being sent */
+    unsigned                pushed:1;
+    unsigned                sending:1;
+
+    /* the handler took ev.fd over, as agi_proxy.c does */
+    unsigned                detached:1;
+
+    /* Asterisk sent HANGUP: commands fail without being sent */
+    unsigned                hangup:1;
+};
+
+/* memory released with the session */
+#define agi_session_alloc(s, size)  agi_arena_alloc(&(s)->arena, size)
+
+#define agi_session_env(s, field)                                            \
+    agi_env_get(&(s)->env, (s)->env_buf, field)
+#define agi_session_arg(s, n)                                                 \
+    agi_env_arg(&(s)->env, (s)->env_buf, n)
+
+agi_pool_t *agi_session_pool_create(size_t n, unsigned flags);
+
+agi_session_t *agi_session_create(agi_event_loop_t *loop, int fd);
+agi_session_t *agi_session_open(agi_event_loop_t *loop,
+    const agi_transport_t *t, int in, int out);
+void agi_session_free(agi_session_t *s);
+
+int agi_session_command(agi_session_t *s, const char *command, size_t len,
+    agi_reply_handler_pt handler, void *ctx);
+char *agi_session_reserve(agi_session_t *s, size_t n);
+int agi_session_flush(agi_session_t *s);
+void agi_session_fail(agi_session_t *s);
+void agi_session_close(agi_session_t *s);
+
+int agi_send_command(agi_session_t *s, const char *command, size_t len,
+    agi_result_t *r);
+int agi_exchange_command(agi_session_t *s, const char *command, size_t len,
+    agi_result_t *r);
+int agi_send_pushed(agi_session_t *s, const char *buf, size_t len);
+int agi_read_replies(agi_session_t *s, agi_result_t *r, size_t n);
+size_t agi_buffered_replies(agi_buf_t *b, size_t n);
+
+#endif /* AGI_SESSION_H */
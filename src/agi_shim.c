@@ -0,0 +1,128 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * agi_shim: what the dialplan runs, with AGI(agi_shim) or EAGI(agi_shim),
+ * in place of a classic AGI program. It hands its stdin, its stdout and the
+ * EAGI audio descriptor over to the daemon listening with
+ * agi_handoff_listen(), and waits for the daemon to be done with the call
+ * so that Asterisk sees the script running until then.
+ *
+ * Kept to a handful of syscalls: linked statically, it starts in well under
+ * a millisecond. The daemon socket is AGI_HANDOFF_PATH, or the one set in
+ * the environment as AGI_HANDOFF_PATH_ENV.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "agi_handoff.h"
+#include "agi_transport.h"
+
+int
+main(void)
+{
+    int                 fd, eagi, sp[2], fds[AGI_HANDOFF_MAX_FDS];
+    char                c;
+    size_t              nfds;
+    ssize_t             n;
+    const char         *path;
+    struct iovec        iov;
+    struct msghdr       msg;
+    struct cmsghdr     *cmsg;
+    struct sockaddr_un  sun;
+    agi_handoff_msg_t   hm;
+
+    union {
+        struct cmsghdr  align;
+        char            buf[CMSG_SPACE(sizeof fds)];
+    } control;
+
+    /*
+     * before any descriptor is opened: for AGI() Asterisk leaves fd 3
+     * closed, and the first socket would take it
+     */
+    eagi = fcntl(AGI_EAGI_AUDIO_FD, F_GETFD) != -1;
+
+    path = getenv(AGI_HANDOFF_PATH_ENV);
+    if (path == NULL)
+        path = AGI_HANDOFF_PATH;
+
+    (void)memset(&sun, 0, sizeof sun);
+
+    sun.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof sun.sun_path)
+        return 1;
+
+    (void)strcpy(sun.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return 1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) == -1)
+        return 1;
+
+    hm.version = AGI_HANDOFF_VERSION;
+    hm.flags = 0;
+
+    fds[0] = STDIN_FILENO;
+    fds[1] = STDOUT_FILENO;
+    fds[2] = sp[1];
+    nfds = 3;
+
+    if (eagi) {
+        hm.flags |= AGI_HANDOFF_EAGI;
+        fds[nfds++] = AGI_EAGI_AUDIO_FD;
+    }
+
+    iov.iov_base = &hm;
+    iov.iov_len = sizeof hm;
+
+    (void)memset(&msg, 0, sizeof msg);
+    (void)memset(&control, 0, sizeof control);
+
+    msg.msg_name = &sun;
+    msg.msg_namelen = sizeof sun;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+
+    (void)memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    while (sendmsg(fd, &msg, 0) == -1) {
+        if (errno != EINTR)
+            return 1;
+    }
+
+    /* Asterisk must only see the end of the script from the daemon */
+    (void)close(STDIN_FILENO);
+    (void)close(STDOUT_FILENO);
+
+    if (nfds == 4)
+        (void)close(AGI_EAGI_AUDIO_FD);
+
+    (void)close(sp[1]);
+    (void)close(fd);
+
+    /* until the daemon closes its end */
+    do {
+        n = read(sp[0], &c, 1);
+    } while (n == -1 && errno == EINTR);
+
+    return 0;
+}
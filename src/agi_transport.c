@@ -0,0 +1,135 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Transports a session exchanges AGI text over
+ *
+ * FastAGI runs over a TCP or a Unix domain socket. A classic AGI script has
+ * Asterisk on the other end of a pipe for its stdin and another for its
+ * stdout, on which recv() and send() fail with ENOTSOCK: read() and write()
+ * are used instead, with large reads since a pipe holds up to 64 KB. The
+ * process then has to ignore SIGPIPE, which write() raises once Asterisk
+ * hung up: agi_handoff_listen() does for the daemon, a script run by
+ * Asterisk itself does on its own. All transports feed the same framing and
+ * parsing code.
+ */
+
+#include <string.h>         /* memset */
+#include <errno.h>
+
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "agi_transport.h"
+#include "agi_buf.h"
+#include "agi_session.h"
+
+static ssize_t agi_socket_recv(agi_session_t *s, char *buf, size_t size);
+static ssize_t agi_socket_send(agi_session_t *s, const char *buf, size_t len);
+static ssize_t agi_socket_sendv(agi_session_t *s, const struct iovec *iov,
+    int iovcnt);
+static ssize_t agi_pipe_recv(agi_session_t *s, char *buf, size_t size);
+static ssize_t agi_pipe_send(agi_session_t *s, const char *buf, size_t len);
+static ssize_t agi_pipe_sendv(agi_session_t *s, const struct iovec *iov,
+    int iovcnt);
+
+const agi_transport_t  agi_transport_tcp = {
+    "tcp",
+    agi_socket_recv,
+    agi_socket_send,
+    agi_socket_sendv,
+    AGI_BUF_RECV_SIZE,
+    1,
+    0
+};
+
+const agi_transport_t  agi_transport_unix = {
+    "unix",
+    agi_socket_recv,
+    agi_socket_send,
+    agi_socket_sendv,
+    AGI_BUF_RECV_SIZE,
+    1,
+    0
+};
+
+const agi_transport_t  agi_transport_stdio = {
+    "stdio",
+    agi_pipe_recv,
+    agi_pipe_send,
+    agi_pipe_sendv,
+    AGI_TRANSPORT_PIPE_RECV_SIZE,
+    0,
+    0
+};
+
+const agi_transport_t  agi_transport_eagi = {
+    "eagi",
+    agi_pipe_recv,
+    agi_pipe_send,
+    agi_pipe_sendv,
+    AGI_TRANSPORT_PIPE_RECV_SIZE,
+    0,
+    1
+};
+
+/*
+ * Read the audio of the channel, signed linear at 8 kHz, as read() would.
+ * Fails with EBADF unless the session was opened with agi_transport_eagi.
+ */
+ssize_t
+agi_eagi_read(agi_session_t *s, void *buf, size_t size)
+{
+    if (s->audio_fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return read(s->audio_fd, buf, size);
+}
+
+static ssize_t
+agi_socket_recv(agi_session_t *s, char *buf, size_t size)
+{
+    return recv(s->ev.fd, buf, size, 0);
+}
+
+static ssize_t
+agi_socket_send(agi_session_t *s, const char *buf, size_t len)
+{
+    return send(s->out_fd, buf, len, MSG_NOSIGNAL);
+}
+
+static ssize_t
+agi_socket_sendv(agi_session_t *s, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr   msg;
+
+    (void)memset(&msg, 0, sizeof msg);
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+
+    /* writev() that does not raise SIGPIPE */
+    return sendmsg(s->out_fd, &msg, MSG_NOSIGNAL);
+}
+
+static ssize_t
+agi_pipe_recv(agi_session_t *s, char *buf, size_t size)
+{
+    return read(s->ev.fd, buf, size);
+}
+
+static ssize_t
+agi_pipe_send(agi_session_t *s, const char *buf, size_t len)
+{
+    return write(s->out_fd, buf, len);
+}
+
+static ssize_t
+agi_pipe_sendv(agi_session_t *s, const struct iovec *iov, int iovcnt)
+{
+    return writev(s->out_fd, iov, iovcnt);
+}
@@ -0,0 +1,52 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Transports a session exchanges AGI text over
+ */
+
+#ifndef AGI_TRANSPORT_H
+#define AGI_TRANSPORT_H
+
+#include <stddef.h>
+
+#include <sys/types.h>      /* ssize_t */
+#include <sys/uio.h>        /* struct iovec */
+
+#include "agi_core.h"
+
+/* the audio of the channel, for EAGI scripts */
+#define AGI_EAGI_AUDIO_FD       3
+
+/* free space asked for before every read of a pipe */
+#define AGI_TRANSPORT_PIPE_RECV_SIZE    (64 * 1024)
+
+/*
+ * The functions behave as recv(), send() and writev() on the descriptors of
+ * the session: ev.fd for input and out_fd for output, the same one for
+ * sockets.
+ */
+struct agi_transport_s {
+    const char     *name;
+
+    ssize_t       (*recv)(agi_session_t *s, char *buf, size_t size);
+    ssize_t       (*send)(agi_session_t *s, const char *buf, size_t len);
+    ssize_t       (*sendv)(agi_session_t *s, const struct iovec *iov,
+                           int iovcnt);
+
+    size_t          recv_size;  /* free space asked for before every read */
+
+    unsigned        socket:1;   /* io_uring may recv and send on it */
+    unsigned        audio:1;    /* AGI_EAGI_AUDIO_FD is open */
+};
+
+/* FastAGI */
+extern const agi_transport_t    agi_transport_tcp;
+extern const agi_transport_t    agi_transport_unix;
+
+/* AGI and EAGI, on stdin and stdout */
+extern const agi_transport_t    agi_transport_stdio;
+extern const agi_transport_t    agi_transport_eagi;
+
+ssize_t agi_eagi_read(agi_session_t *s, void *buf, size_t size);
+
+#endif /* AGI_TRANSPORT_H */
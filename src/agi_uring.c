@@ -0,0 +1,704 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * io_uring backend of the event loop
+ *
+ * Listeners get a multishot accept and sessions a multishot recv into the
+ * provided buffer ring, both armed once for the lifetime of the socket, so
+ * that receiving costs no syscall of its own: the completions of a whole
+ * iteration are reaped by the io_uring_enter() that waits for them, along
+ * with the submission of the sends queued during the previous one. Other
+ * descriptors, such as eventfds, get a multishot poll and keep their
+ * agi_event_handler_pt.
+ *
+ * The request is encoded in the user_data of its submission: the address of
+ * its agi_event_t, which is at least 8-byte aligned, and the operation in
+ * the low bits. ev->inflight counts the requests the kernel may still
+ * complete, an agi_event_t must not be freed before it drops to zero.
+ */
+
+#define _GNU_SOURCE         /* syscall */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "agi_uring.h"
+#include "agi_event.h"
+#include "log.h"
+
+#define AGI_URING_POLL      1
+#define AGI_URING_ACCEPT    2
+#define AGI_URING_RECV      3
+#define AGI_URING_SEND      4
+#define AGI_URING_OP_MASK   7
+
+/* the kernel releases the ring entries we acquire and acquires ours */
+#define agi_uring_load(p)                                                     \
+    atomic_load_explicit((_Atomic unsigned *)(p), memory_order_acquire)
+#define agi_uring_store(p, v)                                                 \
+    atomic_store_explicit((_Atomic unsigned *)(p), v, memory_order_release)
+
+static struct io_uring_sqe *agi_uring_sqe(agi_uring_t *u, agi_event_t *ev,
+    int op, int fd);
+static int agi_uring_submit(agi_uring_t *u, unsigned wait,
+    struct timespec *ts);
+static void agi_uring_complete(agi_uring_t *u, struct io_uring_cqe *cqe);
+static void agi_uring_recycle(agi_uring_t *u, unsigned bid);
+static int agi_uring_map(agi_uring_t *u, struct io_uring_params *p);
+static int agi_uring_buffers(agi_uring_t *u);
+static int agi_uring_probe(agi_uring_t *u);
+
+/*
+ * Returns NULL, and the caller falls back to epoll, when the kernel lacks
+ * any of what this file relies on. The features reported only tell that it
+ * is recent enough; provided buffer rings are known once registered, and
+ * multishot recv once a recv is seen to stay armed, see agi_uring_probe().
+ */
+agi_uring_t *
+agi_uring_create(agi_event_loop_t *loop, unsigned entries)
+{
+    int                     fd;
+    unsigned                need;
+    agi_uring_t            *u;
+    struct io_uring_params  p;
+
+    if (entries == 0)
+        entries = AGI_URING_ENTRIES;
+
+    (void)memset(&p, 0, sizeof p);
+
+    /* every session keeps a recv armed: leave room for many completions */
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;
+
+    fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+
+    if (fd == -1 && errno == EINVAL) {
+        p.flags &= ~IORING_SETUP_COOP_TASKRUN;
+        fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+
+    if (fd == -1) {
+        log(LOG_ERR, "io_uring_setup() failed");
+        return NULL;
+    }
+
+    need = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_LINKED_FILE;
+
+    if ((p.features & need) != need) {
+        log(LOG_ERR, "io_uring features 0x%x lack 0x%x", p.features,
+            need & ~p.features);
+        (void)close(fd);
+        return NULL;
+    }
+
+    u = calloc(1, sizeof *u);
+    if (u == NULL) {
+        log(LOG_ERR, "calloc() failed");
+        (void)close(fd);
+        return NULL;
+    }
+
+    u->fd = fd;
+    u->loop = loop;
+
+    if (agi_uring_map(u, &p) == -1 || agi_uring_buffers(u) == -1
+        || agi_uring_probe(u) == -1)
+    {
+        agi_uring_destroy(u);
+        return NULL;
+    }
+
+    return u;
+}
+
+/* closing the ring cancels whatever is still in flight */
+void
+agi_uring_destroy(agi_uring_t *u)
+{
+    (void)close(u->fd);
+
+    if (u->bufs)
+        free(u->bufs);
+
+    if (u->br)
+        (void)munmap(u->br, u->br_size);
+
+    if (u->sqes)
+        (void)munmap(u->sqes, u->sqes_size);
+
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        (void)munmap(u->cq_ring, u->cq_ring_size);
+
+    if (u->sq_ring)
+        (void)munmap(u->sq_ring, u->sq_ring_size);
+
+    free(u);
+}
+
+/* ev->handler is called with the ready events, as epoll would */
+int
+agi_uring_poll(agi_uring_t *u, agi_event_t *ev, uint32_t events)
+{
+    struct io_uring_sqe    *sqe;
+
+    /* poll is level-triggered, multishot makes it behave as edge-triggered */
+    ev->events = events & ~(uint32_t)EPOLLET;
+
+    sqe = agi_uring_sqe(u, ev, AGI_URING_POLL, ev->fd);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = ev->events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+
+    return 0;
+}
+
+/* the connections go to agi_event_accepted() */
+int
+agi_uring_accept(agi_uring_t *u, agi_event_t *ev)
+{
+    struct io_uring_sqe    *sqe;
+
+    sqe = agi_uring_sqe(u, ev, AGI_URING_ACCEPT, ev->fd);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+
+    return 0;
+}
+
+/* the bytes go to ev->input(), see agi_event_input_pt */
+int
+agi_uring_recv(agi_uring_t *u, agi_event_t *ev)
+{
+    struct io_uring_sqe    *sqe;
+
+    sqe = agi_uring_sqe(u, ev, AGI_URING_RECV, ev->fd);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+
+    return 0;
+}
+
+/*
+ * Send len bytes of buf, which must stay where it is until ev->sent() is
+ * called with the number of bytes sent, or with -1 and errno set.
+ */
+int
+agi_uring_send(agi_uring_t *u, agi_event_t *ev, const char *buf, size_t len)
+{
+    struct io_uring_sqe    *sqe;
+
+    sqe = agi_uring_sqe(u, ev, AGI_URING_SEND, ev->fd);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+
+    return 0;
+}
+
+/*
+ * Cancel every request on ev->fd. The cancellation is submitted right away,
+ * ev remains in use until ev->inflight drops to zero.
+ */
+int
+agi_uring_cancel(agi_uring_t *u, agi_event_t *ev)
+{
+    struct io_uring_sqe    *sqe;
+
+    ev->cancelled = 1;
+
+    if (ev->inflight == 0)
+        return 0;
+
+    sqe = agi_uring_sqe(u, NULL, 0, ev->fd);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+
+    return agi_uring_submit(u, 0, NULL);
+}
+
+/*
+ * Submit what was queued, wait up to timeout milliseconds (forever when -1)
+ * for a completion, and dispatch every completion. Returns the number of
+ * completions, or -1 on failure.
+ */
+int
+agi_uring_process(agi_uring_t *u, int timeout)
+{
+    int                 n;
+    unsigned            head, tail, wait;
+    struct timespec     ts, *tp;
+
+    tp = NULL;
+    wait = 0;
+
+    /* nothing to wait for if completions are already there */
+    if (timeout != 0
+        && *u->cq_head == agi_uring_load(u->cq_tail))
+    {
+        wait = 1;
+
+        if (timeout > 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+            tp = &ts;
+        }
+    }
+
+    if ((u->sq_pending || wait) && agi_uring_submit(u, wait, tp) == -1)
+        return -1;
+
+    n = 0;
+
+    head = *u->cq_head;
+    tail = agi_uring_load(u->cq_tail);
+
+    /*
+     * the entries are released one at a time: a handler may submit, and the
+     * submission may reap completions to make room
+     */
+    while (head != tail) {
+        struct io_uring_cqe     cqe;
+
+        cqe = u->cqes[head & u->cq_mask];
+
+        agi_uring_store(u->cq_head, ++head);
+
+        agi_uring_complete(u, &cqe);
+        n++;
+
+        head = *u->cq_head;
+        tail = agi_uring_load(u->cq_tail);
+    }
+
+    return n;
+}
+
+static void
+agi_uring_complete(agi_uring_t *u, struct io_uring_cqe *cqe)
+{
+    int             op, res, more;
+    unsigned        bid;
+    agi_event_t    *ev;
+
+    /* cancellations carry no event */
+    if (cqe->user_data == 0)
+        return;
+
+    ev = (agi_event_t *)(uintptr_t)
+             (cqe->user_data & ~(uint64_t)AGI_URING_OP_MASK);
+    op = (int)(cqe->user_data & AGI_URING_OP_MASK);
+    res = cqe->res;
+    more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (op) {
+
+    case AGI_URING_POLL:
+        if (res >= 0)
+            ev->handler(ev, (uint32_t)res);
+        else if (res != -ECANCELED)
+            ev->handler(ev, EPOLLERR);
+
+        if (!more && res != -ECANCELED && !ev->cancelled
+            && agi_uring_poll(u, ev, ev->events) == -1)
+        {
+            ev->handler(ev, EPOLLERR);
+        }
+
+        break;
+
+    case AGI_URING_ACCEPT:
+        if (res >= 0) {
+            /* the listener was closed while the connection was queued */
+            if (ev->cancelled)
+                (void)close(res);
+            else
+                agi_event_accepted((agi_listener_t *)ev, res);
+        }
+        else if (res != -ECANCELED && res != -ECONNABORTED) {
+            errno = -res;
+            log(LOG_ERR, "accept() failed");
+        }
+
+        /* EMFILE and the like end the multishot accept: try again */
+        if (!more && !ev->cancelled && res != -ECANCELED
+            && agi_uring_accept(u, ev) == -1)
+        {
+            log(LOG_ERR, "listener %d stopped accepting", ev->fd);
+        }
+
+        break;
+
+    case AGI_URING_RECV:
+        if (res > 0) {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            if (!ev->cancelled)
+                ev->input(ev, u->bufs + (size_t)bid * AGI_URING_BUF_SIZE,
+                          res);
+
+            agi_uring_recycle(u, bid);
+        }
+        else if (res == 0) {
+            if (!ev->cancelled)
+                ev->input(ev, NULL, 0);
+        }
+        else if (res != -ENOBUFS && res != -ECANCELED) {
+            errno = -res;
+
+            if (!ev->cancelled)
+                ev->input(ev, NULL, -1);
+        }
+
+        /* out of buffers ends the multishot recv, once they are back */
+        if (!more && (res > 0 || res == -ENOBUFS) && !ev->cancelled
+            && agi_uring_recv(u, ev) == -1)
+        {
+            errno = ENOBUFS;
+            ev->input(ev, NULL, -1);
+        }
+
+        break;
+
+    case AGI_URING_SEND:
+        if (res < 0) {
+            errno = -res;
+            ev->sent(ev, -1);
+        }
+        else {
+            ev->sent(ev, res);
+        }
+
+        break;
+    }
+
+    /* last, ev may be freed once it drops to zero */
+    if (!more)
+        ev->inflight--;
+}
+
+/*
+ * A submission entry for a request of ev on fd, submitting those queued
+ * first when the queue is full
+ */
+static struct io_uring_sqe *
+agi_uring_sqe(agi_uring_t *u, agi_event_t *ev, int op, int fd)
+{
+    unsigned                tail;
+    struct io_uring_sqe    *sqe;
+
+    tail = *u->sq_tail;
+
+    if (tail - agi_uring_load(u->sq_head) == u->sq_entries) {
+        if (agi_uring_submit(u, 0, NULL) == -1)
+            return NULL;
+
+        if (tail - agi_uring_load(u->sq_head) == u->sq_entries) {
+            log(LOG_ERR, "io_uring submission queue full");
+            return NULL;
+        }
+    }
+
+    sqe = &u->sqes[tail & u->sq_mask];
+
+    (void)memset(sqe, 0, sizeof *sqe);
+
+    sqe->fd = fd;
+
+    if (ev) {
+        sqe->user_data = (uintptr_t)ev | (unsigned)op;
+        ev->inflight++;
+    }
+
+    /* submitted with the next io_uring_enter() */
+    agi_uring_store(u->sq_tail, tail + 1);
+    u->sq_pending++;
+
+    return sqe;
+}
+
+static int
+agi_uring_submit(agi_uring_t *u, unsigned wait, struct timespec *ts)
+{
+    int                                 rv;
+    unsigned                            flags;
+    struct io_uring_getevents_arg       arg;
+
+    flags = 0;
+
+    if (wait)
+        flags |= IORING_ENTER_GETEVENTS;
+
+    if (ts) {
+        (void)memset(&arg, 0, sizeof arg);
+        arg.ts = (uintptr_t)ts;
+
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    for (;;) {
+        rv = (int)syscall(__NR_io_uring_enter, u->fd, u->sq_pending, wait,
+                          flags, ts ? (void *)&arg : NULL,
+                          ts ? sizeof arg : 0);
+
+        if (rv >= 0) {
+            u->sq_pending -= (unsigned)rv;
+            return 0;
+        }
+
+        if (errno == EINTR || errno == ETIME) {
+            /* the submissions went in all the same */
+            u->sq_pending = *u->sq_tail - agi_uring_load(u->sq_head);
+            return 0;
+        }
+
+        /* the completion queue is full: the caller reaps it and retries */
+        if (errno == EBUSY || errno == EAGAIN)
+            return 0;
+
+        log(LOG_ERR, "io_uring_enter() failed");
+        return -1;
+    }
+}
+
+/* hand buffer bid back to the kernel */
+static void
+agi_uring_recycle(agi_uring_t *u, unsigned bid)
+{
+    struct io_uring_buf    *buf;
+
+    buf = &u->br->bufs[u->br_tail & (AGI_URING_NBUFS - 1)];
+
+    buf->addr = (uintptr_t)(u->bufs + (size_t)bid * AGI_URING_BUF_SIZE);
+    buf->len = AGI_URING_BUF_SIZE;
+    buf->bid = (uint16_t)bid;
+
+    u->br_tail++;
+
+    atomic_store_explicit((_Atomic uint16_t *)&u->br->tail, u->br_tail,
+                          memory_order_release);
+}
+
+static int
+agi_uring_map(agi_uring_t *u, struct io_uring_params *p)
+{
+    char       *sq, *cq;
+    unsigned    i;
+
+    u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p->cq_off.cqes
+                      + p->cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    sq = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        log(LOG_ERR, "mmap() of the submission queue failed");
+        return -1;
+    }
+
+    u->sq_ring = sq;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    }
+    else {
+        cq = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            log(LOG_ERR, "mmap() of the completion queue failed");
+            return -1;
+        }
+    }
+
+    u->cq_ring = cq;
+
+    u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        log(LOG_ERR, "mmap() of the submission entries failed");
+        u->sqes = NULL;
+        return -1;
+    }
+
+    u->sq_head = (unsigned *)(sq + p->sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    u->sq_array = (unsigned *)(sq + p->sq_off.array);
+    u->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    u->sq_entries = p->sq_entries;
+
+    u->cq_head = (unsigned *)(cq + p->cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+    /* entries are submitted in order, the array never changes */
+    for (i = 0; i < p->sq_entries; i++)
+        u->sq_array[i] = i;
+
+    return 0;
+}
+
+static int
+agi_uring_buffers(agi_uring_t *u)
+{
+    unsigned                    i;
+    struct io_uring_buf_reg     reg;
+
+    u->br_size = AGI_URING_NBUFS * sizeof(struct io_uring_buf);
+
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        log(LOG_ERR, "mmap() of the buffer ring failed");
+        u->br = NULL;
+        return -1;
+    }
+
+    u->bufs = malloc((size_t)AGI_URING_NBUFS * AGI_URING_BUF_SIZE);
+    if (u->bufs == NULL) {
+        log(LOG_ERR, "malloc() failed");
+        return -1;
+    }
+
+    (void)memset(&reg, 0, sizeof reg);
+
+    reg.ring_addr = (uintptr_t)u->br;
+    reg.ring_entries = AGI_URING_NBUFS;
+    reg.bgid = 0;
+
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) == -1)
+    {
+        log(LOG_ERR, "io_uring_register(IORING_REGISTER_PBUF_RING) failed");
+        return -1;
+    }
+
+    for (i = 0; i < AGI_URING_NBUFS; i++)
+        agi_uring_recycle(u, i);
+
+    return 0;
+}
+
+/*
+ * Receive on a socketpair the way sessions do: with multishot recv, the byte
+ * written beforehand completes the recv with IORING_CQE_F_MORE, and the peer
+ * hanging up ends it. Kernels without fail the recv, or complete it once.
+ */
+static int
+agi_uring_probe(agi_uring_t *u)
+{
+    int                     rv, res, armed, sv[2];
+    unsigned                head, flags;
+    struct timespec         ts;
+    struct io_uring_sqe    *sqe;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        log(LOG_ERR, "socketpair() failed");
+        return -1;
+    }
+
+    rv = -1;
+    armed = 0;
+
+    if (write(sv[1], "", 1) != 1) {
+        log(LOG_ERR, "write() to the io_uring probe failed");
+        goto done;
+    }
+
+    sqe = agi_uring_sqe(u, NULL, 0, sv[0]);
+    if (sqe == NULL)
+        goto done;
+
+    /* never dispatched: agi_uring_complete() is not called here */
+    sqe->user_data = AGI_URING_RECV;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+
+    ts.tv_sec = 1;
+    ts.tv_nsec = 0;
+
+    for (;;) {
+        if (agi_uring_submit(u, 1, &ts) == -1)
+            goto done;
+
+        head = *u->cq_head;
+
+        if (head == agi_uring_load(u->cq_tail)) {
+            log(LOG_ERR, "io_uring recv probe timed out");
+            goto done;
+        }
+
+        res = u->cqes[head & u->cq_mask].res;
+        flags = u->cqes[head & u->cq_mask].flags;
+
+        agi_uring_store(u->cq_head, head + 1);
+
+        if (res > 0)
+            agi_uring_recycle(u, flags >> IORING_CQE_BUFFER_SHIFT);
+
+        if (!(flags & IORING_CQE_F_MORE))
+            break;
+
+        armed = 1;
+
+        if (sv[1] != -1) {
+            (void)close(sv[1]);
+            sv[1] = -1;
+        }
+    }
+
+    if (!armed) {
+        log(LOG_ERR, "io_uring multishot recv unsupported: %d", res);
+        goto done;
+    }
+
+    rv = 0;
+
+done:
+
+    (void)close(sv[0]);
+
+    if (sv[1] != -1)
+        (void)close(sv[1]);
+
+    return rv;
+}
@@ -0,0 +1,67 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * io_uring backend of the event loop
+ */
+
+#ifndef AGI_URING_H
+#define AGI_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+#include "agi_core.h"
+
+#define AGI_URING_ENTRIES       256
+
+/* provided buffers the kernel receives into, shared by all sessions */
+#define AGI_URING_NBUFS         256     /* must be a power of 2 */
+#define AGI_URING_BUF_SIZE      4096
+
+struct agi_uring_s {
+    int                         fd;
+    agi_event_loop_t           *loop;
+
+    /* submission queue */
+    unsigned                   *sq_head;
+    unsigned                   *sq_tail;
+    unsigned                   *sq_array;
+    unsigned                    sq_mask;
+    unsigned                    sq_entries;
+    unsigned                    sq_pending;     /* filled, not submitted */
+    struct io_uring_sqe        *sqes;
+
+    /* completion queue */
+    unsigned                   *cq_head;
+    unsigned                   *cq_tail;
+    unsigned                    cq_mask;
+    struct io_uring_cqe        *cqes;
+
+    void                       *sq_ring;
+    size_t                      sq_ring_size;
+    void                       *cq_ring;        /* sq_ring if shared */
+    size_t                      cq_ring_size;
+    size_t                      sqes_size;
+
+    /* provided buffer ring, group 0 */
+    struct io_uring_buf_ring   *br;
+    size_t                      br_size;
+    char                       *bufs;
+    uint16_t                    br_tail;
+};
+
+agi_uring_t *agi_uring_create(agi_event_loop_t *loop, unsigned entries);
+void agi_uring_destroy(agi_uring_t *u);
+
+int agi_uring_poll(agi_uring_t *u, agi_event_t *ev, uint32_t events);
+int agi_uring_accept(agi_uring_t *u, agi_event_t *ev);
+int agi_uring_recv(agi_uring_t *u, agi_event_t *ev);
+int agi_uring_send(agi_uring_t *u, agi_event_t *ev, const char *buf,
+    size_t len);
+int agi_uring_cancel(agi_uring_t *u, agi_event_t *ev);
+
+int agi_uring_process(agi_uring_t *u, int timeout);
+
+#endif /* AGI_URING_H */
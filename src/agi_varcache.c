@@ -0,0 +1,262 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Per-session cache of channel variables read by the agi_command_*() calls
+ *
+ * Once agi_varcache_enable() was called on a session, agi_command_getvariable()
+ * and agi_command_getfullvariable() answer from the cache what they read
+ * before, unset variables included, and agi_command_setvariable() writes
+ * through it. What the "variable cache" column of AGI_COMMANDS() marks as
+ * FLUSH empties it before being sent, as does any command sent otherwise:
+ * agi_send_command(), agi_session_command() and agi_batch_send() do not
+ * know what the text they send does.
+ *
+ * Asterisk may still change variables behind the script's back, from the
+ * manager interface or another channel, and some never read the same twice,
+ * EPOCH or RAND() for instance: the cache is for scripts that know what they
+ * read. agi_command_getfullvariable() on another channel is never cached.
+ *
+ * Entries and their values live in the session arena; a flush only marks
+ * them invalid, for the next read of the same name to reuse.
+ */
+
+#include <string.h>
+
+#include "agi_varcache.h"
+#include "agi_commands.h"
+#include "agi_env.h"        /* agi_env_hash */
+#include "agi_session.h"
+#include "log.h"
+
+static agi_varcache_entry_t *agi_varcache_find(agi_varcache_t *c,
+    unsigned command, const char *name, size_t len, unsigned hash);
+static agi_varcache_entry_t *agi_varcache_add(agi_session_t *s,
+    unsigned command, const char *name);
+static int agi_varcache_store(agi_session_t *s, agi_varcache_entry_t *e,
+    int code, const char *value, size_t len);
+static unsigned agi_varcache_hash(const char *name, size_t *len);
+
+int
+agi_varcache_enable(agi_session_t *s)
+{
+    if (s->varcache)
+        return 0;
+
+    s->varcache = agi_arena_calloc(&s->arena, sizeof(agi_varcache_t));
+
+    return s->varcache ? 0 : -1;
+}
+
+void
+agi_varcache_flush(agi_session_t *s)
+{
+    unsigned                i;
+    agi_varcache_entry_t   *e;
+    agi_varcache_t         *c = s->varcache;
+
+    if (c == NULL)
+        return;
+
+    for (i = 0; i < AGI_VARCACHE_BUCKETS; i++) {
+        for (e = c->buckets[i]; e; e = e->next)
+            e->valid = 0;
+    }
+
+    c->flushes++;
+}
+
+/*
+ * The result code of the command from the cache, and the value into buf of
+ * size bytes, as the command would have. AGI_AGAIN when it has to be sent.
+ */
+int
+agi_varcache_get(agi_session_t *s, unsigned command, const char *name,
+    char *buf, size_t size)
+{
+    size_t                  len;
+    unsigned                hash;
+    agi_varcache_entry_t   *e;
+    agi_varcache_t         *c = s->varcache;
+
+    if (c == NULL || name == NULL)
+        return AGI_AGAIN;
+
+    hash = agi_varcache_hash(name, &len);
+
+    e = agi_varcache_find(c, command, name, len, hash);
+
+    if (e == NULL || !e->valid) {
+        c->misses++;
+        return AGI_AGAIN;
+    }
+
+    c->hits++;
+
+    if (e->code == 1) {
+        if (e->value_len >= size) {
+            log(LOG_ERR, "agi value of %zu bytes does not fit in %zu",
+                e->value_len, size);
+            return -1;
+        }
+
+        (void)memcpy(buf, e->value, e->value_len);
+        buf[e->value_len] = '\0';
+    }
+
+    return e->code;
+}
+
+/* What Asterisk replied to the command name was read with */
+void
+agi_varcache_put(agi_session_t *s, unsigned command, const char *name,
+    const agi_result_t *r)
+{
+    agi_varcache_entry_t   *e;
+
+    if (s->varcache == NULL || name == NULL)
+        return;
+
+    if (r->status != 200 || (r->code != 0 && r->code != 1))
+        return;
+
+    e = agi_varcache_add(s, command, name);
+    if (e == NULL)
+        return;
+
+    (void)agi_varcache_store(s, e, r->code, r->value.data, r->value.len);
+}
+
+/*
+ * After "set variable name value" got code back, -1 when it failed. Any
+ * expression read by agi_command_getfullvariable() may have changed.
+ */
+void
+agi_varcache_set(agi_session_t *s, const char *name, const char *value,
+    int code)
+{
+    unsigned                i;
+    agi_varcache_entry_t   *e;
+    agi_varcache_t         *c = s->varcache;
+
+    if (c == NULL)
+        return;
+
+    for (i = 0; i < AGI_VARCACHE_BUCKETS; i++) {
+        for (e = c->buckets[i]; e; e = e->next) {
+            if (e->command == AGI_CMD_getfullvariable)
+                e->valid = 0;
+        }
+    }
+
+    /* "_name" and "__name" set name, inherited by the channels it spawns */
+    while (*name == '_')
+        name++;
+
+    e = agi_varcache_add(s, AGI_CMD_getvariable, name);
+    if (e == NULL)
+        return;
+
+    if (code != 1) {
+        e->valid = 0;
+        return;
+    }
+
+    /* Asterisk reports a variable set to "" as not set */
+    if (agi_varcache_store(s, e, *value ? 1 : 0, value, strlen(value)) == -1)
+        e->valid = 0;
+}
+
+static agi_varcache_entry_t *
+agi_varcache_find(agi_varcache_t *c, unsigned command, const char *name,
+    size_t len, unsigned hash)
+{
+    agi_varcache_entry_t   *e;
+
+    for (e = c->buckets[hash & (AGI_VARCACHE_BUCKETS - 1)]; e; e = e->next) {
+        if (e->hash == hash && e->command == command && e->name_len == len
+            && memcmp(e->name, name, len) == 0)
+        {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/* The entry of name, invalid when new */
+static agi_varcache_entry_t *
+agi_varcache_add(agi_session_t *s, unsigned command, const char *name)
+{
+    size_t                  len;
+    unsigned                hash;
+    agi_varcache_entry_t   *e, **bucket;
+    agi_varcache_t         *c = s->varcache;
+
+    hash = agi_varcache_hash(name, &len);
+
+    e = agi_varcache_find(c, command, name, len, hash);
+    if (e)
+        return e;
+
+    e = agi_arena_calloc(&s->arena, sizeof *e);
+    if (e == NULL)
+        return NULL;
+
+    e->name = agi_session_alloc(s, len);
+    if (e->name == NULL)
+        return NULL;
+
+    (void)memcpy(e->name, name, len);
+
+    e->command = command;
+    e->hash = hash;
+    e->name_len = len;
+
+    bucket = &c->buckets[hash & (AGI_VARCACHE_BUCKETS - 1)];
+
+    e->next = *bucket;
+    *bucket = e;
+
+    return e;
+}
+
+static int
+agi_varcache_store(agi_session_t *s, agi_varcache_entry_t *e, int code,
+    const char *value, size_t len)
+{
+    if (code == 1 && len > e->value_size) {
+        e->value = agi_session_alloc(s, len);
+        if (e->value == NULL) {
+            e->value_size = 0;
+            e->valid = 0;
+            return -1;
+        }
+
+        e->value_size = len;
+    }
+
+    if (code == 1)
+        (void)memcpy(e->value, value, len);
+
+    e->code = code;
+    e->value_len = code == 1 ? len : 0;
+    e->valid = 1;
+
+    return 0;
+}
+
+static unsigned
+agi_varcache_hash(const char *name, size_t *len)
+{
+    size_t      n;
+    unsigned    hash;
+
+    hash = 0;
+
+    for (n = 0; name[n]; n++)
+        hash = agi_env_hash(hash, name[n]);
+
+    *len = n;
+
+    return hash;
+}
@@ -0,0 +1,54 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Per-session cache of channel variables read by the agi_command_*() calls
+ */
+
+#ifndef AGI_VARCACHE_H
+#define AGI_VARCACHE_H
+
+#include <stddef.h>
+
+#include "agi_core.h"
+#include "agi_parse.h"
+
+#define AGI_VARCACHE_BUCKETS    16      /* must be a power of 2 */
+
+typedef struct agi_varcache_entry_s     agi_varcache_entry_t;
+
+struct agi_varcache_entry_s {
+    agi_varcache_entry_t   *next;
+
+    unsigned                command;    /* AGI_CMD_get[full]variable */
+    unsigned                hash;
+    char                   *name;
+    size_t                  name_len;
+
+    /* result=1 and the value, or result=0 for an unset variable */
+    int                     code;
+    char                   *value;
+    size_t                  value_len;
+    size_t                  value_size;
+
+    unsigned                valid:1;
+};
+
+typedef struct {
+    agi_varcache_entry_t   *buckets[AGI_VARCACHE_BUCKETS];
+
+    unsigned long           hits;       /* round trips saved */
+    unsigned long           misses;
+    unsigned long           flushes;
+} agi_varcache_t;
+
+int agi_varcache_enable(agi_session_t *s);
+void agi_varcache_flush(agi_session_t *s);
+
+int agi_varcache_get(agi_session_t *s, unsigned command, const char *name,
+    char *buf, size_t size);
+void agi_varcache_put(agi_session_t *s, unsigned command, const char *name,
+    const agi_result_t *r);
+void agi_varcache_set(agi_session_t *s, const char *name, const char *value,
+    int code);
+
+#endif /* AGI_VARCACHE_H */
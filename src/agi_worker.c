@@ -0,0 +1,368 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Worker threads, each running an event loop of its own
+ *
+ * Every worker listens on a socket of its own bound with SO_REUSEPORT, so the
+ * kernel balances connections between workers and a session is accepted,
+ * parsed and handled by a single thread: no lock is taken on the way.
+ */
+
+#define _GNU_SOURCE         /* CPU_SET, pthread_setaffinity_np */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+#include "agi_worker.h"
+#include "agi_pool.h"
+#include "agi_sched.h"
+#include "agi_session.h"
+#include "log.h"
+
+static void *agi_worker_cycle(void *data);
+static int agi_worker_init(agi_worker_t *worker);
+static void agi_worker_done(agi_worker_t *worker);
+static void agi_worker_pin(agi_worker_t *worker);
+static void agi_worker_notify_handler(agi_event_t *ev, uint32_t events);
+static int agi_workers_cpus(cpu_set_t *set, int *cpu, unsigned n);
+
+/*
+ * Returns once every worker listens, or NULL when any of them could not: the
+ * others are then stopped and joined
+ */
+agi_workers_t *
+agi_workers_start(const agi_workers_conf_t *conf)
+{
+    int             rv, cpu[AGI_WORKER_MAX];
+    unsigned        i, n, started;
+    cpu_set_t       set;
+    agi_worker_t   *worker;
+    agi_workers_t  *w;
+
+    if (sched_getaffinity(0, sizeof set, &set) == -1) {
+        log(LOG_ERR, "sched_getaffinity() failed");
+        CPU_ZERO(&set);
+    }
+
+    n = conf->nworkers;
+
+    if (n == 0)
+        n = CPU_COUNT(&set) ? (unsigned)CPU_COUNT(&set) : 1;
+
+    if (n > AGI_WORKER_MAX)
+        n = AGI_WORKER_MAX;
+
+    /* the CPUs this process may run on, taskset and cgroups permitting */
+    if (agi_workers_cpus(&set, cpu, n) == -1 && conf->pin)
+        log(LOG_ERR, "no cpu affinity, workers are not pinned");
+
+    w = calloc(1, sizeof *w + n * sizeof(agi_worker_t));
+    if (w == NULL) {
+        log(LOG_ERR, "calloc() failed");
+        return NULL;
+    }
+
+    w->conf = conf;
+    w->nworkers = n;
+
+    if (conf->sched) {
+        /* the deque indices are cache line aligned */
+        rv = posix_memalign((void **)&w->sched, 64, n * sizeof(agi_sched_t));
+        if (rv != 0) {
+            log(LOG_ERR, "posix_memalign() failed: %s", strerror(rv));
+            free(w);
+            return NULL;
+        }
+
+        (void)memset(w->sched, 0, n * sizeof(agi_sched_t));
+
+        for (i = 0; i < n; i++)
+            w->sched[i].ev.fd = -1;
+    }
+
+    (void)pthread_mutex_init(&w->lock, NULL);
+    (void)pthread_cond_init(&w->cond, NULL);
+
+    for (started = 0; started < n; started++) {
+        worker = &w->worker[started];
+
+        worker->notify.fd = -1;
+        worker->id = started;
+        worker->cpu = conf->pin ? cpu[started] : -1;
+        worker->workers = w;
+
+        rv = pthread_create(&worker->tid, NULL, agi_worker_cycle, worker);
+        if (rv != 0) {
+            log(LOG_ERR, "pthread_create() failed: %s", strerror(rv));
+            break;
+        }
+    }
+
+    (void)pthread_mutex_lock(&w->lock);
+
+    while (w->nready < started)
+        (void)pthread_cond_wait(&w->cond, &w->lock);
+
+    (void)pthread_mutex_unlock(&w->lock);
+
+    for (i = 0; i < started; i++) {
+        if (w->worker[i].status == -1)
+            break;
+    }
+
+    if (started < n || i < started) {
+        w->nworkers = started;
+
+        agi_workers_stop(w);
+        (void)agi_workers_wait(w);
+
+        return NULL;
+    }
+
+    return w;
+}
+
+/* may be called from any thread, but not from a signal handler */
+void
+agi_workers_stop(agi_workers_t *w)
+{
+    unsigned        i;
+    uint64_t        one = 1;
+    agi_worker_t   *worker;
+
+    for (i = 0; i < w->nworkers; i++) {
+        worker = &w->worker[i];
+
+        if (worker->notify.fd == -1)
+            continue;
+
+        if (write(worker->notify.fd, &one, sizeof one) == -1)
+            log(LOG_ERR, "write() to worker %u failed", worker->id);
+    }
+}
+
+/* join the workers and free w; returns -1 when any of them failed */
+int
+agi_workers_wait(agi_workers_t *w)
+{
+    int         rv;
+    unsigned    i;
+
+    rv = 0;
+
+    for (i = 0; i < w->nworkers; i++) {
+        (void)pthread_join(w->worker[i].tid, NULL);
+
+        if (w->worker[i].status == -1)
+            rv = -1;
+
+        if (w->worker[i].notify.fd != -1)
+            (void)close(w->worker[i].notify.fd);
+    }
+
+    /* now that no worker is left to wake another one up */
+    if (w->sched) {
+        for (i = 0; i < w->nworkers; i++)
+            agi_sched_free(&w->sched[i]);
+
+        free(w->sched);
+    }
+
+    (void)pthread_cond_destroy(&w->cond);
+    (void)pthread_mutex_destroy(&w->lock);
+    free(w);
+
+    return rv;
+}
+
+static void *
+agi_worker_cycle(void *data)
+{
+    int                 timeout;
+    agi_worker_t       *worker = data;
+    agi_workers_t      *w = worker->workers;
+    agi_sched_t        *sc;
+    agi_event_loop_t   *loop;
+
+    if (worker->cpu != -1)
+        agi_worker_pin(worker);
+
+    worker->status = agi_worker_init(worker);
+
+    (void)pthread_mutex_lock(&w->lock);
+
+    w->nready++;
+    (void)pthread_cond_signal(&w->cond);
+
+    (void)pthread_mutex_unlock(&w->lock);
+
+    loop = worker->loop;
+    sc = worker->sched;
+
+    if (worker->status == -1) {
+        agi_worker_done(worker);
+        return NULL;
+    }
+
+    /* once stopped, the listeners are closed: let the calls in progress end */
+    while (!loop->stop || loop->nsessions) {
+        timeout = -1;
+
+        if (sc) {
+            agi_sched_complete(sc);
+
+            if (agi_sched_run(sc, AGI_SCHED_BATCH)
+                || agi_sched_sleep(sc) == -1)
+            {
+                timeout = 0;
+            }
+        }
+
+        if (agi_event_loop_process(loop, timeout) == -1) {
+            worker->status = -1;
+            break;
+        }
+
+        if (sc)
+            agi_sched_awake(sc);
+    }
+
+    agi_worker_done(worker);
+
+    return NULL;
+}
+
+static int
+agi_worker_init(agi_worker_t *worker)
+{
+    unsigned                    flags;
+    const agi_workers_conf_t   *conf = worker->workers->conf;
+
+    flags = 0;
+
+    if (conf->uring)
+        flags |= AGI_EVENT_LOOP_URING;
+
+    if (conf->raw_env)
+        flags |= AGI_EVENT_LOOP_RAW_ENV;
+
+    worker->loop = agi_event_loop_create(conf->nevents, conf->handler,
+                                         conf->data, flags);
+    if (worker->loop == NULL)
+        return -1;
+
+    if (conf->pool_size) {
+        worker->pool = agi_session_pool_create(conf->pool_size,
+                                               conf->pool_flags);
+        if (worker->pool == NULL)
+            return -1;
+
+        worker->loop->pool = worker->pool;
+    }
+
+    worker->notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->notify.fd == -1) {
+        log(LOG_ERR, "eventfd() failed");
+        return -1;
+    }
+
+    worker->notify.handler = agi_worker_notify_handler;
+
+    if (agi_event_add(worker->loop, &worker->notify, EPOLLIN) == -1)
+        return -1;
+
+    if (worker->workers->sched) {
+        worker->sched = &worker->workers->sched[worker->id];
+
+        if (agi_sched_init(worker->sched, worker->loop,
+                           worker->workers->sched, worker->workers->nworkers,
+                           worker->id) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return agi_event_listen(worker->loop, conf->host, conf->port,
+                            conf->backlog, AGI_EVENT_REUSEPORT);
+}
+
+static void
+agi_worker_done(agi_worker_t *worker)
+{
+    if (worker->loop)
+        agi_event_loop_destroy(worker->loop);
+
+    /* after the loop, which frees the sessions closed last */
+    if (worker->pool)
+        agi_pool_destroy(worker->pool);
+
+    /* notify.fd is closed by agi_workers_wait(), agi_workers_stop() uses it */
+}
+
+/*
+ * Pinning comes first so that the loop, the pool and the socket buffers are
+ * first touched, hence allocated, on the node the worker runs on
+ */
+static void
+agi_worker_pin(agi_worker_t *worker)
+{
+    int         rv;
+    cpu_set_t   set;
+
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+
+    rv = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (rv != 0) {
+        log(LOG_ERR, "pthread_setaffinity_np(%d) failed: %s", worker->cpu,
+            strerror(rv));
+        worker->cpu = -1;
+    }
+}
+
+static void
+agi_worker_notify_handler(agi_event_t *ev, uint32_t events)
+{
+    uint64_t        n;
+    agi_worker_t   *worker = (agi_worker_t *)ev;
+
+    (void)events;
+    (void)read(ev->fd, &n, sizeof n);
+
+    agi_event_close_listeners(worker->loop);
+    agi_event_loop_stop(worker->loop);
+}
+
+/* the nth worker gets the nth allowed CPU, wrapping around when short */
+static int
+agi_workers_cpus(cpu_set_t *set, int *cpu, unsigned n)
+{
+    int         c;
+    unsigned    i;
+
+    if (CPU_COUNT(set) == 0) {
+        for (i = 0; i < n; i++)
+            cpu[i] = -1;
+
+        return -1;
+    }
+
+    c = -1;
+
+    for (i = 0; i < n; i++) {
+        do {
+            c = (c + 1) % CPU_SETSIZE;
+        } while (!CPU_ISSET(c, set));
+
+        cpu[i] = c;
+    }
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Worker threads, each running an event loop of its own
+ */
+
+#ifndef AGI_WORKER_H
+#define AGI_WORKER_H
+
+#include <stddef.h>
+
+#include <pthread.h>
+
+#include "agi_core.h"
+#include "agi_event.h"
+
+#define AGI_WORKER_MAX      256
+
+typedef struct agi_workers_s    agi_workers_t;
+
+typedef struct {
+    unsigned                nworkers;   /* 0 for one per online CPU */
+
+    const char             *host;
+    const char             *port;
+    int                     backlog;
+    int                     nevents;
+
+    size_t                  pool_size;  /* pooled sessions per worker, or 0 */
+    unsigned                pool_flags; /* AGI_POOL_HUGE */
+
+    unsigned                pin:1;      /* worker n runs on the nth CPU */
+    unsigned                sched:1;    /* steal tasks, see agi_sched.h */
+    unsigned                uring:1;    /* io_uring, see agi_uring.c */
+    unsigned                raw_env:1;  /* AGI_EVENT_LOOP_RAW_ENV */
+
+    agi_session_handler_pt  handler;
+    void                   *data;
+} agi_workers_conf_t;
+
+/*
+ * Everything a worker touches is allocated by its own thread, after it was
+ * pinned, so that the memory comes from the NUMA node of its CPU. Sessions
+ * never leave the worker that accepted them and nothing is shared between
+ * workers but the configuration.
+ */
+typedef struct {
+    agi_event_t             notify;     /* eventfd, must be first */
+
+    pthread_t               tid;
+    unsigned                id;
+    int                     cpu;        /* -1 when not pinned */
+
+    agi_event_loop_t       *loop;
+    agi_pool_t             *pool;
+    agi_sched_t            *sched;
+
+    agi_workers_t          *workers;
+
+    int                     status;     /* 0 once listening, -1 on failure */
+} agi_worker_t;
+
+struct agi_workers_s {
+    const agi_workers_conf_t   *conf;
+
+    /* workers done with agi_worker_init(), successfully or not */
+    pthread_mutex_t             lock;
+    pthread_cond_t              cond;
+    unsigned                    nready;
+
+    agi_sched_t                *sched;      /* one per worker, or NULL */
+
+    unsigned                    nworkers;
+    agi_worker_t                worker[];
+};
+
+agi_workers_t *agi_workers_start(const agi_workers_conf_t *conf);
+void agi_workers_stop(agi_workers_t *w);
+int agi_workers_wait(agi_workers_t *w);
+
+#endif /* AGI_WORKER_H */
@@ -0,0 +1,17 @@
+/*
+ * Author: Romario Maxwell
+ */
+
+#include <stdarg.h>
+
+#include "log.h"
+
+void
+agi_log(int level, const char *fmt, ...)
+{
+    va_list     ap;
+
+    va_start(ap, fmt);
+    vsyslog(level, fmt, ap);
+    va_end(ap);
+}
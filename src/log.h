@@ -0,0 +1,35 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Logging, to syslog: the program calls openlog() as it sees fit
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <syslog.h>         /* LOG_ERR, LOG_DEBUG */
+
+void agi_log(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define log(level, ...)     agi_log(level, __VA_ARGS__)
+
+/* compiled in with -DAGI_DEBUG only */
+#ifdef AGI_DEBUG
+
+#define log_debug0(fmt)                                                       \
+    agi_log(LOG_DEBUG, fmt)
+#define log_debug1(fmt, a1)                                                   \
+    agi_log(LOG_DEBUG, fmt, a1)
+#define log_debug2(fmt, a1, a2)                                               \
+    agi_log(LOG_DEBUG, fmt, a1, a2)
+
+#else
+
+#define log_debug0(fmt)
+#define log_debug1(fmt, a1)
+#define log_debug2(fmt, a1, a2)
+
+#endif
+
+#endif /* LOG_H */
@@ -0,0 +1,12 @@
+/*
+ * Author: Romario Maxwell
+ */
+
+#ifndef UTILS_H
+#define UTILS_H
+
+/* the longest decimal integers, sign included */
+#define INT32_LEN   (sizeof "-2147483648" - 1)
+#define INT64_LEN   (sizeof "-9223372036854775808" - 1)
+
+#endif /* UTILS_H */
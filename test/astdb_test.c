@@ -0,0 +1,201 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * agi_astdb cache: hits, misses, entries forgotten or dropped by a deltree,
+ * and readers racing a writer that keeps resizing the value they read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "agi_astdb.h"
+
+#define check(c)                                                              \
+    do {                                                                      \
+        if (!(c)) {                                                           \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c);           \
+            nfailed++;                                                        \
+        }                                                                     \
+    } while (0)
+
+#define AGI_TEST_READS      1000000
+#define AGI_TEST_READERS    3
+
+/* around the buffer of the readers, which must never be written */
+#define AGI_TEST_CANARY     0x5a
+
+static int              nfailed;
+
+static atomic_int       done;
+static char             long_value[AGI_ASTDB_VALUE_LEN];
+
+typedef struct {
+    size_t              size;       /* of the buffer given to the cache */
+    long                nhits;
+    long                nbad;
+} reader_t;
+
+static void
+test_cache(void)
+{
+    char    buf[AGI_ASTDB_VALUE_LEN];
+
+    check(agi_astdb_cache_get("cid", "15551234567", buf, sizeof buf)
+          == AGI_AGAIN);
+
+    agi_astdb_cache_put("cid", "15551234567", 1, "ACME Sales", 10);
+
+    check(agi_astdb_cache_get("cid", "15551234567", buf, sizeof buf) == 1
+          && strcmp(buf, "ACME Sales") == 0);
+
+    /* too long for the caller's buffer: as if it were not cached */
+    check(agi_astdb_cache_get("cid", "15551234567", buf, 10) == AGI_AGAIN);
+    check(agi_astdb_cache_get("cid", "15551234567", buf, 11) == 1);
+
+    /* a key Asterisk does not have */
+    agi_astdb_cache_put("cid", "15550000000", 0, NULL, 0);
+
+    check(agi_astdb_cache_get("cid", "15550000000", buf, sizeof buf) == 0);
+
+    agi_astdb_cache_forget("cid", "15551234567");
+
+    check(agi_astdb_cache_get("cid", "15551234567", buf, sizeof buf)
+          == AGI_AGAIN);
+
+    agi_astdb_cache_put("cid", "15551234567", 1, "ACME Sales", 10);
+    agi_astdb_cache_deltree("cid");
+
+    check(agi_astdb_cache_get("cid", "15551234567", buf, sizeof buf)
+          == AGI_AGAIN);
+    check(agi_astdb_cache_get("cid", "15550000000", buf, sizeof buf)
+          == AGI_AGAIN);
+
+    /* values that do not fit a slot are not cached */
+    agi_astdb_cache_put("cid", "long", 1, long_value, sizeof long_value);
+
+    check(agi_astdb_cache_get("cid", "long", buf, sizeof buf) == AGI_AGAIN);
+}
+
+static void *
+writer(void *arg)
+{
+    unsigned    i;
+
+    (void)arg;
+
+    for (i = 0; !atomic_load(&done); i++) {
+        switch (i % 3) {
+        case 0:
+            agi_astdb_cache_put("race", "key", 1, "x", 1);
+            break;
+        case 1:
+            agi_astdb_cache_put("race", "key", 1, long_value,
+                                sizeof long_value - 1);
+            break;
+        default:
+            agi_astdb_cache_put("race", "key", 0, NULL, 0);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void *
+reader(void *arg)
+{
+    int         rc;
+    long        i;
+    size_t      j;
+    char        mem[AGI_ASTDB_VALUE_LEN + 64], *buf;
+    reader_t   *r = arg;
+
+    (void)memset(mem, AGI_TEST_CANARY, sizeof mem);
+    buf = mem + 32;
+
+    for (i = 0; i < AGI_TEST_READS; i++) {
+        rc = agi_astdb_cache_get("race", "key", buf, r->size);
+
+        if (rc == 1) {
+            r->nhits++;
+
+            /* one of the values written, whole */
+            if (strcmp(buf, "x") != 0 && strcmp(buf, long_value) != 0)
+                r->nbad++;
+
+        } else if (rc != 0 && rc != AGI_AGAIN) {
+            r->nbad++;
+        }
+
+        for (j = 0; j < 32; j++) {
+            if (mem[j] != AGI_TEST_CANARY
+                || buf[r->size + j] != AGI_TEST_CANARY)
+            {
+                r->nbad++;
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void
+test_race(void)
+{
+    int         i;
+    pthread_t   w, t[AGI_TEST_READERS];
+    reader_t    r[AGI_TEST_READERS];
+
+    (void)memset(r, 0, sizeof r);
+
+    /* one buffer that fits both values, two that only fit the short one */
+    r[0].size = AGI_ASTDB_VALUE_LEN;
+    r[1].size = 2;
+    r[2].size = 8;
+
+    atomic_store(&done, 0);
+
+    /* so that the readers have something to find from the start */
+    agi_astdb_cache_put("race", "key", 1, "x", 1);
+
+    check(pthread_create(&w, NULL, writer, NULL) == 0);
+
+    for (i = 0; i < AGI_TEST_READERS; i++)
+        check(pthread_create(&t[i], NULL, reader, &r[i]) == 0);
+
+    for (i = 0; i < AGI_TEST_READERS; i++)
+        (void)pthread_join(t[i], NULL);
+
+    atomic_store(&done, 1);
+    (void)pthread_join(w, NULL);
+
+    for (i = 0; i < AGI_TEST_READERS; i++)
+        check(r[i].nbad == 0);
+
+    check(r[0].nhits > 0);
+}
+
+int
+main(void)
+{
+    (void)memset(long_value, 'y', sizeof long_value - 1);
+    long_value[sizeof long_value - 1] = '\0';
+
+    if (agi_astdb_cache_init(60) == -1)
+        return 1;
+
+    test_cache();
+    test_race();
+
+    if (nfailed) {
+        fprintf(stderr, "astdb_test: %d checks failed\n", nfailed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * agi_buf_t: replies framed on LF however the reads split or merge them,
+ * compaction and growth of the buffer in between, and the replies counted by
+ * agi_buffered_replies(), usage blocks and HANGUP included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "agi_buf.h"
+#include "agi_session.h"
+
+#define check(c)                                                              \
+    do {                                                                      \
+        if (!(c)) {                                                           \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c);           \
+            nfailed++;                                                        \
+        }                                                                     \
+    } while (0)
+
+#define AGI_TEST_LONG_LEN   5000
+
+static int              nfailed;
+
+static void
+append(agi_buf_t *b, const char *text)
+{
+    if (agi_buf_append(b, text, strlen(text)) == -1)
+        exit(1);
+}
+
+/* the next line is text, LF included */
+static int
+line_is(agi_buf_t *b, const char *text)
+{
+    char    *line;
+    size_t   len;
+
+    line = agi_buf_line(b, &len);
+
+    return line != NULL && len == strlen(text)
+           && memcmp(line, text, len) == 0;
+}
+
+static void
+test_split(void)
+{
+    size_t      len;
+    agi_buf_t   b;
+
+    check(agi_buf_init(&b, NULL, 16) == 0);
+
+    /* a reply over three reads */
+    append(&b, "200 res");
+    check(agi_buf_line(&b, &len) == NULL);
+
+    append(&b, "ult=1 (hel");
+    check(agi_buf_line(&b, &len) == NULL);
+
+    append(&b, "lo)\n");
+    check(line_is(&b, "200 result=1 (hello)\n"));
+    check(agi_buf_line(&b, &len) == NULL);
+
+    /* two replies and the start of a third in one read */
+    append(&b, "200 result=2\n200 result=3\n2");
+    check(line_is(&b, "200 result=2\n"));
+    check(line_is(&b, "200 result=3\n"));
+    check(agi_buf_line(&b, &len) == NULL);
+
+    /* the tail is moved to the start of the buffer, which it fits */
+    check(agi_buf_reserve(&b, (size_t)(b.end - b.start) - 1) == 0);
+    check(b.pos == b.start && agi_buf_len(&b) == 1);
+
+    append(&b, "00 result=4\n");
+    check(line_is(&b, "200 result=4\n"));
+
+    check(agi_buf_len(&b) == 0);
+
+    agi_buf_free(&b);
+}
+
+/* a line longer than the buffer, received a few bytes at a time */
+static void
+test_grow(void)
+{
+    char       *text;
+    size_t      i, n, len;
+    agi_buf_t   b;
+
+    text = malloc(AGI_TEST_LONG_LEN + 1);
+    if (text == NULL)
+        exit(1);
+
+    (void)memcpy(text, "200 result=1 (", 14);
+    (void)memset(text + 14, 'x', AGI_TEST_LONG_LEN - 16);
+    (void)memcpy(text + AGI_TEST_LONG_LEN - 2, ")\n", 3);
+
+    check(agi_buf_init(&b, NULL, 16) == 0);
+
+    append(&b, "200 result=0\n");
+
+    for (i = 0; i < AGI_TEST_LONG_LEN; i += n) {
+        n = AGI_TEST_LONG_LEN - i < 7 ? AGI_TEST_LONG_LEN - i : 7;
+
+        check(agi_buf_append(&b, text + i, n) == 0);
+
+        if (i == 0)
+            check(line_is(&b, "200 result=0\n"));
+        else if (i + n < AGI_TEST_LONG_LEN)
+            check(agi_buf_line(&b, &len) == NULL);
+    }
+
+    check(line_is(&b, text));
+    check((size_t)(b.end - b.start) >= AGI_TEST_LONG_LEN);
+
+    /* never past AGI_BUF_MAX_SIZE */
+    check(agi_buf_reserve(&b, AGI_BUF_MAX_SIZE + 1) == -1);
+
+    agi_buf_free(&b);
+    free(text);
+}
+
+static void
+test_replies(void)
+{
+    size_t      len;
+    agi_buf_t   b;
+
+    check(agi_buf_init(&b, NULL, 0) == 0);
+
+    check(agi_buffered_replies(&b, 3) == 0);
+
+    append(&b, "200 result=1\n520-Invalid command syntax.  "
+               "Proper usage follows:\n"
+               "Usage: GET DATA <file to be streamed> [timeout] "
+               "[max digits]\n");
+
+    /* the usage block is one reply, not complete yet */
+    check(agi_buffered_replies(&b, 3) == 1);
+
+    append(&b, "520 End of proper usage.\n200 res");
+    check(agi_buffered_replies(&b, 3) == 2);
+    check(agi_buffered_replies(&b, 1) == 1);
+
+    append(&b, "ult=0\n");
+    check(agi_buffered_replies(&b, 3) == 3);
+
+    /* counted from the first line not consumed */
+    check(line_is(&b, "200 result=1\n"));
+    check(agi_buffered_replies(&b, 3) == 2);
+
+    while (agi_buf_line(&b, &len) != NULL) {
+        /* void */
+    }
+
+    /* HANGUP ends the wait for the replies still expected */
+    append(&b, "200 result=1\nHANGUP\n");
+    check(agi_buffered_replies(&b, 5) == 5);
+
+    /* but is only text inside a usage block */
+    while (agi_buf_line(&b, &len) != NULL) {
+        /* void */
+    }
+
+    append(&b, "520-Invalid command syntax.  Proper usage follows:\n"
+               "HANGUP\n");
+    check(agi_buffered_replies(&b, 2) == 0);
+
+    agi_buf_free(&b);
+}
+
+int
+main(void)
+{
+    test_split();
+    test_grow();
+    test_replies();
+
+    if (nfailed) {
+        fprintf(stderr, "buf_test: %d checks failed\n", nfailed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * Commands on a blocking session, the peer playing Asterisk: the values of
+ * agi_command_getvariables() decoded out of base64, the deferred writes sent
+ * as "exec MSet" and those it cannot carry as "set variable", and HANGUP in
+ * place of a reply, on its own or in a batch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "agi_batch.h"
+#include "agi_commands.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+
+#define check(c)                                                              \
+    do {                                                                      \
+        if (!(c)) {                                                           \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c);           \
+            nfailed++;                                                        \
+        }                                                                     \
+    } while (0)
+
+#define AGI_TEST_VARS       30
+
+static int              nfailed;
+
+/* the end played by Asterisk */
+static int              peer;
+
+static agi_session_t *
+session(void)
+{
+    int             sv[2];
+    agi_session_t  *s;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        exit(1);
+
+    s = agi_session_open(NULL, &agi_transport_unix, sv[0], sv[0]);
+    if (s == NULL)
+        exit(1);
+
+    peer = sv[1];
+
+    return s;
+}
+
+static void
+session_close(agi_session_t *s)
+{
+    agi_session_free(s);
+    (void)close(peer);
+}
+
+/* the replies are there before the commands they answer are sent */
+static void
+reply(const char *text)
+{
+    if (write(peer, text, strlen(text)) != (ssize_t)strlen(text))
+        exit(1);
+}
+
+/* what the session sent since the last call, into buf */
+static char *
+sent(char *buf, size_t size)
+{
+    ssize_t     n;
+
+    n = recv(peer, buf, size - 1, MSG_DONTWAIT);
+
+    buf[n > 0 ? n : 0] = '\0';
+
+    return buf;
+}
+
+static int
+value_is(agi_str_t *v, const char *s)
+{
+    return v->len == strlen(s) && memcmp(v->data, s, v->len) == 0;
+}
+
+static void
+test_getvariables(void)
+{
+    char            buf[256], out[1024];
+    agi_str_t       values[4];
+    agi_session_t  *s;
+
+    static const char  *names[] = { "A", "EMPTY", "COMMA", "BINARY" };
+    static const char  *bad[] = { "A}B" };
+
+    s = session();
+
+    /* "hello", "", "a,b" and "\0\1\2\3" once encoded */
+    reply("200 result=1 (aGVsbG8=,,YSxi,AAECAw==)\n");
+
+    check(agi_command_getvariables(s, buf, sizeof buf, names, 4, values)
+          == 0);
+    check(strcmp(sent(out, sizeof out),
+                 "get full variable \"${BASE64_ENCODE(${A})},"
+                 "${BASE64_ENCODE(${EMPTY})},${BASE64_ENCODE(${COMMA})},"
+                 "${BASE64_ENCODE(${BINARY})}\"\n") == 0);
+
+    check(value_is(&values[0], "hello"));
+    check(values[1].len == 0);
+    check(value_is(&values[2], "a,b"));
+    check(values[3].len == 4 && memcmp(values[3].data, "\0\1\2\3", 4) == 0);
+
+    /* padding of one and two characters, and none */
+    reply("200 result=1 (YQ==,YWI=,YWJj)\n");
+
+    check(agi_command_getvariables(s, buf, sizeof buf, names, 3, values)
+          == 0);
+    check(value_is(&values[0], "a") && value_is(&values[1], "ab")
+          && value_is(&values[2], "abc"));
+
+    /* none of them set */
+    reply("200 result=0\n");
+
+    check(agi_command_getvariables(s, buf, sizeof buf, names, 2, values)
+          == 0);
+    check(values[0].len == 0 && values[1].len == 0);
+
+    (void)sent(out, sizeof out);
+
+    /* a '}' would end the reference: nothing is sent */
+    check(agi_command_getvariables(s, buf, sizeof buf, bad, 1, values)
+          == -1);
+    check(sent(out, sizeof out)[0] == '\0');
+
+    session_close(s);
+}
+
+static void
+test_mset(void)
+{
+    char            name[16], value[16], out[4096], *p;
+    unsigned        i, n;
+    agi_session_t  *s;
+
+    s = session();
+
+    check(agi_setvariable_defer(s) == 0);
+
+    /* recorded, and answered as Asterisk would */
+    check(agi_command_setvariable(s, "A", "1") == 1);
+    check(agi_command_setvariable(s, "B", "x,y(z)") == 1);
+    check(agi_command_setvariable(s, "C", "say \"hi\"") == 1);
+    check(agi_command_setvariable(s, "D", " pad") == 1);
+    check(agi_command_setvariable(s, "E", "pad ") == 1);
+    check(agi_command_setvariable(s, "F", "back\\slash") == 1);
+    check(agi_command_setvariable(s, "G", "") == 1);
+
+    check(sent(out, sizeof out)[0] == '\0');
+
+    reply("200 result=0\n200 result=1\n200 result=1\n200 result=1\n"
+          "200 result=1\n200 result=0\n");
+
+    check(agi_setvariable_flush(s) == 0);
+
+    /*
+     * MSet unescapes and unquotes, and strips the blanks around values:
+     * quotes, backslashes and edge spaces go as "set variable"
+     */
+    check(strcmp(sent(out, sizeof out),
+                 "exec MSet \"A=1,B=x\\\\,y\\\\(z\\\\)\"\n"
+                 "set variable C \"say \\\"hi\\\"\"\n"
+                 "set variable D \" pad\"\n"
+                 "set variable E \"pad \"\n"
+                 "set variable F \"back\\\\slash\"\n"
+                 "exec MSet \"G=\"\n") == 0);
+
+    /* no more than AGI_MSET_PAIRS in one MSet */
+    for (i = 0; i < AGI_TEST_VARS; i++) {
+        (void)snprintf(name, sizeof name, "V%u", i);
+        (void)snprintf(value, sizeof value, "%u", i);
+
+        check(agi_command_setvariable(s, name, value) == 1);
+    }
+
+    reply("200 result=0\n200 result=0\n");
+
+    check(agi_setvariable_flush(s) == 0);
+
+    (void)sent(out, sizeof out);
+
+    p = out;
+
+    check(strncmp(p, "exec MSet \"V0=0,V1=1,", 21) == 0);
+
+    for (n = 0; *p != '\n'; p++)
+        n += *p == '=';
+
+    check(n == AGI_MSET_PAIRS);
+
+    p++;
+
+    check(strcmp(p, "exec MSet \"V24=24,V25=25,V26=26,V27=27,V28=28,"
+                    "V29=29\"\n") == 0);
+
+    session_close(s);
+}
+
+static void
+test_hangup(void)
+{
+    char            out[256];
+    agi_batch_t     b;
+    agi_result_t    r[3];
+    agi_session_t  *s;
+
+    s = session();
+
+    reply("200 result=1\nHANGUP\n");
+
+    check(agi_command_answer(s) == 1);
+    check(agi_command_answer(s) == -1);
+    check(s->hangup);
+
+    (void)sent(out, sizeof out);
+
+    /* the channel is gone: no command goes anymore */
+    check(agi_command_answer(s) == -1);
+    check(sent(out, sizeof out)[0] == '\0');
+
+    session_close(s);
+
+    /* in place of the second reply of a batch */
+    s = session();
+
+    agi_batch_init(&b);
+
+    check(agi_batch_add(&b, "noop\n", 5) == AGI_OK);
+    check(agi_batch_add(&b, "answer\n", 7) == AGI_OK);
+    check(agi_batch_add(&b, "noop\n", 5) == AGI_OK);
+
+    reply("200 result=0\nHANGUP\n");
+
+    check(agi_batch_send(s, &b, r) == -1);
+    check(strcmp(sent(out, sizeof out), "noop\nanswer\nnoop\n") == 0);
+
+    check(r[0].status == 200 && r[0].code == 0);
+    check(r[1].code == -1 && r[2].code == -1);
+    check(s->hangup);
+
+    session_close(s);
+}
+
+int
+main(void)
+{
+    /* the failures of the commands are expected */
+    openlog("commands_test", 0, LOG_USER);
+
+    test_getvariables();
+    test_mset();
+    test_hangup();
+
+    if (nfailed) {
+        fprintf(stderr, "commands_test: %d checks failed\n", nfailed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,275 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * agi_parse_command_response_line(): status lines, "520-" usage blocks,
+ * "(timeout)" and "endpos=" in the data, CRLF, and results out of range. The
+ * environment parser, fed all at once or one byte at a time.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <syslog.h>
+
+#include "agi_env.h"
+#include "agi_parse.h"
+
+#define check(c)                                                              \
+    do {                                                                      \
+        if (!(c)) {                                                           \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c);           \
+            nfailed++;                                                        \
+        }                                                                     \
+    } while (0)
+
+static int              nfailed;
+
+static const char       environment[] =
+    "agi_network: yes\n"
+    "agi_network_script: ivr/menu\n"
+    "agi_request: agi://10.0.0.1/ivr/menu\n"
+    "agi_channel: SIP/1000-00000001\n"
+    "agi_language: en\n"
+    "agi_type: SIP\n"
+    "agi_uniqueid: 1700000000.1\n"
+    "agi_callerid: 15551234567\n"
+    "agi_calleridname: ACME Sales  \n"
+    "agi_dnid:\n"
+    "agi_context: default\n"
+    "agi_extension: 1000\n"
+    "agi_priority: 1\n"
+    "agi_enhanced: 0.0\n"
+    "agi_accountcode: \n"
+    "agi_threadid: 140000000000000\n"
+    "agi_arg_1: first\n"
+    "agi_arg_2: a: b\n"
+    "not an agi variable\n"
+    "agi_custom: extra\n"
+    "\n";
+
+static int
+parse(const char *line, agi_result_t *r)
+{
+    return agi_parse_command_response_line(line, strlen(line), r);
+}
+
+static int
+str_is(agi_str_t *str, const char *s)
+{
+    return str->len == strlen(s) && memcmp(str->data, s, str->len) == 0;
+}
+
+static void
+test_status(void)
+{
+    agi_result_t    r;
+
+    check(parse("200 result=1\n", &r) == AGI_OK);
+    check(r.status == 200 && r.code == 1);
+    check(str_is(&r.result, "1") && r.data.len == 0 && r.value.len == 0);
+    check(r.endpos == -1 && !r.timeout);
+
+    check(parse("200 result=-1\n", &r) == AGI_OK);
+    check(r.code == -1 && str_is(&r.result, "-1"));
+
+    /* leading zeros are kept in the text */
+    check(parse("200 result=0049\n", &r) == AGI_OK);
+    check(r.code == 49 && str_is(&r.result, "0049"));
+
+    check(parse("200 result=1 (ACME Sales)\n", &r) == AGI_OK);
+    check(str_is(&r.data, "(ACME Sales)") && str_is(&r.value, "ACME Sales"));
+
+    check(parse("510 Invalid or unknown command\n", &r) == AGI_OK);
+    check(r.status == 510 && r.code == -1);
+    check(str_is(&r.data, "Invalid or unknown command"));
+
+    check(parse("511 Command Not Permitted on a dead channel or intercept "
+                "routine\n", &r) == AGI_OK);
+    check(r.status == 511 && r.code == -1);
+
+    check(parse("200 result=\n", &r) == AGI_ERROR);
+    check(parse("200 result=-\n", &r) == AGI_ERROR);
+    check(parse("200 result=1x\n", &r) == AGI_ERROR);
+    check(parse("200 reslut=1\n", &r) == AGI_ERROR);
+    check(parse("20 result=1\n", &r) == AGI_ERROR);
+    check(parse("200 result=1", &r) == AGI_ERROR);
+    check(parse("HANGUP\n", &r) == AGI_ERROR);
+}
+
+/* agi_session_t feeds the first and the last line, skipping the usage */
+static void
+test_usage(void)
+{
+    agi_result_t    r;
+
+    check(parse("520-Invalid command syntax.  Proper usage follows:\n", &r)
+          == AGI_AGAIN);
+    check(parse("520 End of proper usage.\n", &r) == AGI_OK);
+    check(r.status == 520 && r.code == -1);
+    check(str_is(&r.data, "End of proper usage."));
+
+    /* only 520 comes in several lines */
+    check(parse("510-Invalid or unknown command\n", &r) == AGI_ERROR);
+}
+
+static void
+test_data(void)
+{
+    agi_result_t    r;
+
+    check(parse("200 result=0 (timeout)\n", &r) == AGI_OK);
+    check(r.code == 0 && r.timeout && str_is(&r.value, "timeout"));
+
+    check(parse("200 result=1 (timeouts)\n", &r) == AGI_OK);
+    check(!r.timeout);
+
+    check(parse("200 result=0 endpos=12345\n", &r) == AGI_OK);
+    check(r.endpos == 12345 && r.value.len == 0);
+
+    check(parse("200 result=49 (dtmf) endpos=8000\n", &r) == AGI_OK);
+    check(r.code == 49 && r.endpos == 8000 && str_is(&r.value, "dtmf"));
+
+    check(parse("200 result=0 (timeout) endpos=0\n", &r) == AGI_OK);
+    check(r.timeout && r.endpos == 0);
+
+    /* not a number: part of the data */
+    check(parse("200 result=1 endpos=12x\n", &r) == AGI_OK);
+    check(r.endpos == -1 && str_is(&r.data, "endpos=12x"));
+
+    check(parse("200 result=1 endpos=\n", &r) == AGI_OK);
+    check(r.endpos == -1);
+}
+
+static void
+test_crlf(void)
+{
+    agi_result_t    r;
+
+    check(parse("200 result=1\r\n", &r) == AGI_OK);
+    check(r.code == 1 && str_is(&r.result, "1") && r.data.len == 0);
+
+    check(parse("200 result=-1 \r\n", &r) == AGI_OK);
+    check(r.code == -1 && r.data.len == 0);
+
+    check(parse("200 result=0 (timeout)\r\n", &r) == AGI_OK);
+    check(r.timeout && str_is(&r.data, "(timeout)"));
+
+    check(parse("200 result=49 (dtmf) endpos=8000\r\n", &r) == AGI_OK);
+    check(r.endpos == 8000 && str_is(&r.value, "dtmf"));
+
+    check(parse("520 End of proper usage.\r\n", &r) == AGI_OK);
+    check(str_is(&r.data, "End of proper usage."));
+
+    check(parse("200 result=1\r\r\n", &r) == AGI_ERROR);
+    check(parse("200 result=1\rx\n", &r) == AGI_ERROR);
+    check(parse("200 result=-\r\n", &r) == AGI_ERROR);
+}
+
+static void
+test_overflow(void)
+{
+    agi_result_t    r;
+
+    check(parse("200 result=2147483647\n", &r) == AGI_OK);
+    check(r.code == INT_MAX);
+
+    check(parse("200 result=2147483648\n", &r) == AGI_OK);
+    check(r.code == INT_MAX && str_is(&r.result, "2147483648"));
+
+    check(parse("200 result=-99999999999999999999\n", &r) == AGI_OK);
+    check(r.code == -INT_MAX);
+    check(str_is(&r.result, "-99999999999999999999"));
+
+    check(parse("200 result=0 endpos=99999999999999999999999\n", &r)
+          == AGI_OK);
+    check(r.endpos == LONG_MAX);
+}
+
+/* the environment received in parts of step bytes, parsed into env */
+static int
+environment_parse(agi_env_t *env, char *buf, size_t step)
+{
+    int                 rv;
+    size_t              len, n;
+    agi_env_parser_t    ep;
+
+    agi_env_init(env);
+    agi_env_parser_init(&ep);
+
+    rv = AGI_AGAIN;
+
+    for (len = 0; rv == AGI_AGAIN && len < sizeof environment - 1; len += n) {
+        n = sizeof environment - 1 - len < step
+            ? sizeof environment - 1 - len : step;
+
+        (void)memcpy(buf + len, environment + len, n);
+
+        rv = agi_process_environment(&ep, env, NULL, buf, len + n);
+    }
+
+    return rv == AGI_DONE && ep.pos == sizeof environment - 1 ? 0 : -1;
+}
+
+static int
+env_is(const char *v, const char *expected)
+{
+    return v != NULL && strcmp(v, expected) == 0;
+}
+
+static void
+test_environment(void)
+{
+    char        all[sizeof environment], bytes[sizeof environment];
+    unsigned    i;
+    agi_env_t   a, b;
+
+    check(environment_parse(&a, all, sizeof environment) == 0);
+    check(environment_parse(&b, bytes, 1) == 0);
+
+    check(env_is(agi_env_get(&b, bytes, AGI_ENV_CHANNEL),
+                 "SIP/1000-00000001"));
+    check(env_is(agi_env_get(&b, bytes, AGI_ENV_NETWORK_SCRIPT),
+                 "ivr/menu"));
+    check(env_is(agi_env_get(&b, bytes, AGI_ENV_CALLERIDNAME), "ACME Sales"));
+    check(env_is(agi_env_get(&b, bytes, AGI_ENV_DNID), ""));
+    check(env_is(agi_env_get(&b, bytes, AGI_ENV_ACCOUNTCODE), ""));
+    check(agi_env_get(&b, bytes, AGI_ENV_RDNIS) == NULL);
+    check(env_is(agi_env_arg(&b, bytes, 1), "first"));
+    check(env_is(agi_env_arg(&b, bytes, 2), "a: b"));
+    check(agi_env_arg(&b, bytes, 3) == NULL);
+    check(env_is(agi_env_extra_get(&b, bytes, "custom"), "extra"));
+
+    check(b.network_n && b.priority_n == 1 && b.threadid_n == 140000000000000);
+
+    /* the same as received at once */
+    for (i = 0; i < AGI_ENV_NFIELDS; i++) {
+        check(a.str[i].off == b.str[i].off && a.str[i].len == b.str[i].len);
+    }
+
+    check(memcmp(all, bytes, sizeof environment - 1) == 0);
+
+    agi_env_free(&a);
+    agi_env_free(&b);
+}
+
+int
+main(void)
+{
+    /* the line that is not a variable is logged */
+    openlog("parse_test", 0, LOG_USER);
+
+    test_status();
+    test_usage();
+    test_data();
+    test_crlf();
+    test_overflow();
+    test_environment();
+
+    if (nfailed) {
+        fprintf(stderr, "parse_test: %d checks failed\n", nfailed);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,420 @@
+/*
+ * Author: Romario Maxwell
+ *
+ * agi_router: precedence of static segments, :parameters and *wildcards,
+ * backtracking out of dead ends, the patterns agi_router_compile() refuses,
+ * thousands of generated routes, and the dispatch of sessions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "agi_event.h"
+#include "agi_route.h"
+#include "agi_session.h"
+#include "agi_transport.h"
+
+#define check(c)                                                              \
+    do {                                                                      \
+        if (!(c)) {                                                           \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c);           \
+            nfailed++;                                                        \
+        }                                                                     \
+    } while (0)
+
+#define AGI_TEST_SERVICES   2000
+
+static int              nfailed;
+
+static void
+nop(agi_session_t *s)
+{
+    (void)s;
+}
+
+/* the route path matches, or -1 */
+static int
+match(agi_router_t *r, const char *path, agi_route_match_t *m)
+{
+    if (agi_router_match(r, path, strlen(path), m) == -1)
+        return -1;
+
+    return (int)m->route;
+}
+
+static int
+param_is(agi_route_match_t *m, unsigned i, const char *name,
+    const char *value)
+{
+    return i < m->nparams
+           && m->params[i].name.len == strlen(name)
+           && memcmp(m->params[i].name.data, name, strlen(name)) == 0
+           && m->params[i].value.len == strlen(value)
+           && memcmp(m->params[i].value.data, value, strlen(value)) == 0;
+}
+
+static int
+str_is(const agi_str_t *s, const char *value)
+{
+    return s && s->len == strlen(value)
+           && memcmp(s->data, value, s->len) == 0;
+}
+
+static void
+test_precedence(void)
+{
+    agi_router_t       *r;
+    agi_route_match_t   m;
+
+    /* in the order added */
+    enum { REST, ACCOUNT, BILLING, MENU, BILLING_MENU, USER_CALL, QUEUE };
+
+    r = agi_router_create();
+
+    /* added in an order other than that of precedence */
+    check(agi_router_add(r, "ivr/*rest", nop, NULL) == 0);
+    check(agi_router_add(r, "ivr/:account", nop, NULL) == 0);
+    check(agi_router_add(r, "ivr/billing", nop, NULL) == 0);
+    check(agi_router_add(r, "ivr/:account/menu", nop, NULL) == 0);
+    check(agi_router_add(r, "ivr/billing/menu", nop, NULL) == 0);
+    check(agi_router_add(r, "user/:id/calls/:call", nop, NULL) == 0);
+    check(agi_router_add(r, "/queue/:name", nop, NULL) == 0);
+
+    /* not compiled yet */
+    check(match(r, "ivr/billing", &m) == -1);
+
+    check(agi_router_compile(r) == 0);
+
+    /* static first */
+    check(match(r, "ivr/billing", &m) == BILLING);
+    check(m.nparams == 0);
+
+    check(match(r, "ivr/billing/menu", &m) == BILLING_MENU);
+    check(m.nparams == 0);
+
+    /* then a parameter */
+    check(match(r, "ivr/acme", &m) == ACCOUNT);
+    check(m.nparams == 1 && param_is(&m, 0, "account", "acme"));
+
+    check(match(r, "ivr/acme/menu", &m) == MENU);
+    check(m.nparams == 1 && param_is(&m, 0, "account", "acme"));
+
+    /* a static edge taken part of the way, then given up */
+    check(match(r, "ivr/bill", &m) == ACCOUNT);
+    check(param_is(&m, 0, "account", "bill"));
+
+    check(match(r, "ivr/billingx", &m) == ACCOUNT);
+    check(param_is(&m, 0, "account", "billingx"));
+
+    /* both "billing" and :account dead-end: the wildcard, params undone */
+    check(match(r, "ivr/billing/other", &m) == REST);
+    check(m.nparams == 1 && param_is(&m, 0, "rest", "billing/other"));
+
+    check(match(r, "ivr/acme/menu/1", &m) == REST);
+    check(m.nparams == 1 && param_is(&m, 0, "rest", "acme/menu/1"));
+
+    /* a parameter matches no empty segment, a wildcard matches nothing */
+    check(match(r, "ivr/", &m) == REST);
+    check(param_is(&m, 0, "rest", ""));
+
+    check(match(r, "ivr//menu", &m) == REST);
+
+    check(match(r, "user/42/calls/7", &m) == USER_CALL);
+    check(m.nparams == 2 && param_is(&m, 0, "id", "42")
+          && param_is(&m, 1, "call", "7"));
+
+    check(match(r, "user/42/calls", &m) == -1);
+    check(match(r, "user/42/calls/", &m) == -1);
+    check(match(r, "user/42/calls/7/8", &m) == -1);
+
+    /* leading slashes are not part of a pattern */
+    check(match(r, "queue/sales", &m) == QUEUE);
+    check(param_is(&m, 0, "name", "sales"));
+
+    check(match(r, "ivr", &m) == -1);
+    check(match(r, "iv", &m) == -1);
+    check(match(r, "", &m) == -1);
+    check(match(r, "other", &m) == -1);
+
+    /* only the length given is looked at */
+    check(agi_router_match(r, "ivr/billing?x=1", 11, &m) == REST
+          && m.route == BILLING);
+
+    agi_router_destroy(r);
+}
+
+/* whether patterns, added in that order, compile */
+static int
+compiles(const char **patterns, unsigned n)
+{
+    int             rv;
+    unsigned        i;
+    agi_router_t   *r;
+
+    r = agi_router_create();
+
+    for (i = 0; i < n; i++) {
+        if (agi_router_add(r, patterns[i], nop, NULL) == -1) {
+            agi_router_destroy(r);
+            return 0;
+        }
+    }
+
+    rv = agi_router_compile(r);
+
+    agi_router_destroy(r);
+
+    return rv == 0;
+}
+
+#define compiles(...)                                                         \
+    compiles((const char *[]) { __VA_ARGS__ },                                \
+             sizeof (const char *[]) { __VA_ARGS__ } / sizeof(const char *))
+
+static void
+test_conflicts(void)
+{
+    agi_router_t       *r;
+    agi_route_match_t   m;
+
+    /* one name per parameter, or wildcard, in a given position */
+    check(!compiles("a/:x", "a/:y"));
+    check(!compiles("a/:x/b", "a/:y/c"));
+    check(!compiles("a/*x", "a/*y"));
+
+    /* the same paths twice */
+    check(!compiles("a/b", "a/b"));
+    check(!compiles("a/:x", "/a/:x"));
+    check(!compiles("a/*x", "a/*x"));
+
+    /* malformed */
+    check(!compiles("a/:"));
+    check(!compiles("a/:/b"));
+    check(!compiles("*"));
+    check(!compiles("a/*x/b"));
+    check(!compiles(":a/:b/:c/:d/:e/:f/:g/:h/:i"));
+
+    check(compiles(":a/:b/:c/:d/:e/:f/:g/*h"));
+    check(compiles("a/:x", "a/*y", "a/b", "a/:x/b", "a/b/:x"));
+    check(compiles("a/:x/b", "a/:x/c"));
+
+    /* ':' and '*' within a segment are plain bytes */
+    r = agi_router_create();
+
+    check(agi_router_add(r, "a/b:c", nop, NULL) == 0);
+    check(agi_router_add(r, "a/b*c", nop, NULL) == 0);
+    check(agi_router_add(r, "a/:x", nop, NULL) == 0);
+    check(agi_router_compile(r) == 0);
+
+    check(match(r, "a/b:c", &m) == 0 && m.nparams == 0);
+    check(match(r, "a/b*c", &m) == 1 && m.nparams == 0);
+    check(match(r, "a/bxc", &m) == 2 && param_is(&m, 0, "x", "bxc"));
+
+    /* a failed compile leaves the previous trie in place */
+    check(agi_router_add(r, "a/:y", nop, NULL) == 0);
+    check(agi_router_compile(r) == -1);
+    check(match(r, "a/b:c", &m) == 0);
+
+    agi_router_destroy(r);
+}
+
+/*
+ * For every service, four routes sharing long prefixes with those of the
+ * other services: svc1, svc10, svc100... The routes are added in a
+ * scrambled order, and route[][] remembers which index each one got.
+ */
+static void
+test_generated(void)
+{
+    char                path[64], value[32];
+    unsigned            i, k, n, x, route[AGI_TEST_SERVICES][4];
+    agi_router_t       *r;
+    agi_route_match_t   m;
+
+    static const char  *patterns[] = {
+        "svc%u",
+        "svc%u/menu",
+        "svc%u/:account/menu",
+        "svc%u/*path",
+    };
+
+    r = agi_router_create();
+
+    n = AGI_TEST_SERVICES * 4;
+
+    /* 7919 is prime to n: x walks every route once */
+    for (k = 0, x = 0; k < n; k++, x = (x + 7919) % n) {
+        i = x / 4;
+
+        (void)snprintf(path, sizeof path, patterns[x % 4], i);
+
+        check(agi_router_add(r, path, nop, NULL) == 0);
+        route[i][x % 4] = k;
+    }
+
+    check(agi_router_compile(r) == 0);
+
+    for (i = 0; i < AGI_TEST_SERVICES; i++) {
+        (void)snprintf(path, sizeof path, "svc%u", i);
+        check(match(r, path, &m) == (int)route[i][0] && m.nparams == 0);
+
+        (void)snprintf(path, sizeof path, "svc%u/menu", i);
+        check(match(r, path, &m) == (int)route[i][1] && m.nparams == 0);
+
+        (void)snprintf(value, sizeof value, "acct%u", i * 7);
+        (void)snprintf(path, sizeof path, "svc%u/%s/menu", i, value);
+        check(match(r, path, &m) == (int)route[i][2]
+              && m.nparams == 1 && param_is(&m, 0, "account", value));
+
+        /* "menu" and :account both dead-end */
+        (void)snprintf(path, sizeof path, "svc%u/menu/extra", i);
+        check(match(r, path, &m) == (int)route[i][3]
+              && m.nparams == 1 && param_is(&m, 0, "path", "menu/extra"));
+
+        (void)snprintf(path, sizeof path, "svc%u/a/b/c", i);
+        check(match(r, path, &m) == (int)route[i][3]
+              && param_is(&m, 0, "path", "a/b/c"));
+
+        (void)snprintf(path, sizeof path, "svc%ux/menu", i);
+        check(match(r, path, &m) == -1);
+
+        (void)snprintf(path, sizeof path, "svc%u", i + AGI_TEST_SERVICES);
+        check(match(r, path, &m) == -1);
+    }
+
+    agi_router_destroy(r);
+}
+
+/* what the route handlers saw, copied out of the session arena */
+static agi_route_t          dispatched;
+static int                  ndispatched;
+
+static void
+seen(agi_session_t *s)
+{
+    dispatched = *s->route;
+    dispatched.params = NULL;
+    dispatched.args = NULL;
+
+    ndispatched++;
+}
+
+static void
+account(agi_session_t *s)
+{
+    seen(s);
+
+    check(str_is(agi_route_param(s, "account"), "acme"));
+    check(agi_route_param(s, "lang") == NULL);
+
+    check(str_is(agi_route_arg(s, "lang"), "en"));
+    check(str_is(agi_route_arg(s, "name"), "J\xc3\xb6rg M"));
+    check(str_is(agi_route_arg(s, "flag"), ""));
+    check(str_is(agi_route_arg(s, "bad"), "%zz%4"));
+    check(agi_route_arg(s, "account") == NULL);
+
+    agi_session_close(s);
+}
+
+static void
+billing(agi_session_t *s)
+{
+    seen(s);
+
+    check(s->route->nparams == 0 && s->route->nargs == 0);
+
+    agi_session_close(s);
+}
+
+/* the route a session with env gets, NULL for none */
+static const agi_route_t *
+dispatch(agi_router_t *r, const char *env)
+{
+    int                 sv[2], i;
+    agi_event_loop_t   *loop;
+
+    ndispatched = 0;
+
+    loop = agi_event_loop_create(0, agi_router_handler, r, 0);
+
+    if (loop == NULL
+        || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == -1
+        || agi_session_open(loop, &agi_transport_unix, sv[0], sv[0]) == NULL
+        || write(sv[1], env, strlen(env)) != (ssize_t)strlen(env))
+    {
+        exit(1);
+    }
+
+    for (i = 0; i < 10 && loop->nsessions; i++)
+        (void)agi_event_loop_process(loop, 100);
+
+    (void)close(sv[1]);
+
+    agi_event_loop_destroy(loop);
+
+    return ndispatched ? &dispatched : NULL;
+}
+
+static void
+test_dispatch(void)
+{
+    int                 data;
+    const agi_route_t  *route;
+    agi_router_t       *r;
+
+    r = agi_router_create();
+
+    check(agi_router_add(r, "ivr/:account/menu", account, &data) == 0);
+    check(agi_router_add(r, "ivr/billing", billing, NULL) == 0);
+    check(agi_router_compile(r) == 0);
+
+    route = dispatch(r, "agi_network: yes\n"
+                        "agi_network_script: ivr/acme/menu"
+                        "?lang=en&name=J%C3%B6rg+M&&flag&bad=%zz%4\n"
+                        "\n");
+
+    check(route && route->data == &data
+          && strcmp(route->pattern, "ivr/:account/menu") == 0
+          && route->nparams == 1 && route->nargs == 4);
+
+    /* agi_request, when there is no agi_network_script */
+    route = dispatch(r, "agi_network: yes\n"
+                        "agi_request: agi://10.0.0.1:4573/ivr/billing\n"
+                        "\n");
+
+    check(route && strcmp(route->pattern, "ivr/billing") == 0);
+
+    /* sessions no route matches are closed */
+    route = dispatch(r, "agi_network: yes\n"
+                        "agi_network_script: ivr/acme\n"
+                        "\n");
+
+    check(route == NULL);
+
+    agi_router_destroy(r);
+}
+
+int
+main(void)
+{
+    /* the failures of agi_router_compile() are expected */
+    openlog("route_test", 0, LOG_USER);
+
+    test_precedence();
+    test_conflicts();
+    test_generated();
+    test_dispatch();
+
+    if (nfailed) {
+        fprintf(stderr, "route_test: %d checks failed\n", nfailed);
+        return 1;
+    }
+
+    return 0;
+}